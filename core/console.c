@@ -36,6 +36,7 @@ static struct {
 
 	fb_render_func_t	fb_render_cb;
 	void			*fb_arg;
+	unsigned long		fb_seq;
 
 	kbd_event_func_t	kbd_event_cb;
 	void			*kbd_arg;
@@ -82,6 +83,18 @@ console_refresh(void)
 		(*console.fb_render_cb)(console.gc, console.fb_arg);
 }
 
+void
+console_fb_dirty(void)
+{
+	__atomic_add_fetch(&console.fb_seq, 1, __ATOMIC_RELEASE);
+}
+
+unsigned long
+console_fb_seq(void)
+{
+	return __atomic_load_n(&console.fb_seq, __ATOMIC_ACQUIRE);
+}
+
 void
 console_kbd_register(kbd_event_func_t event_cb, void *arg, int pri)
 {
@@ -0,0 +1,676 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * DM live handover, see handover.h for the overall flow.
+ *
+ * Wire format on the handover socket (running DM -> new DM):
+ *
+ *   struct handover_hdr		sent with SCM_RIGHTS carrying all fds
+ *   { struct handover_sec, data }	repeated, hdr.len bytes in total
+ *
+ * The new DM acknowledges with a single byte once everything has been
+ * received. Until then the running DM keeps its ioreq client and can
+ * resume the VM if anything goes wrong; once acked it gives the client
+ * up and exits. The new DM waits for that before it creates its own.
+ * Backends which are fds (tap, backing files) are not opened again by
+ * the new DM, so their locks and state carry over.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "dm.h"
+#include "vmm.h"
+#include "vmmapi.h"
+#include "mevent.h"
+#include "handover.h"
+
+#define HANDOVER_MAGIC		0x7265766f646e6168UL	/* "handover" */
+#define HANDOVER_VERSION	1
+#define HANDOVER_PATH_FMT	"/run/acrn/%s-handover.socket"
+
+struct handover_hdr {
+	uint64_t	magic;
+	uint32_t	version;
+	int32_t		status;		/* 0, or -errno if refused */
+	int32_t		vmid;
+	int32_t		ncpus;
+	uint64_t	lowmem;
+	uint64_t	highmem;
+	uint32_t	nfds;
+	uint64_t	len;		/* length of the section stream */
+};
+
+struct handover_sec {
+	char		name[HANDOVER_NAME_LEN];
+	uint64_t	len;
+};
+
+struct handover_section {
+	char			name[HANDOVER_NAME_LEN];
+	handover_save_t		save;
+	handover_restore_t	restore;
+	void			*arg;
+	LIST_ENTRY(handover_section) list;
+};
+
+static LIST_HEAD(handover_sec_head, handover_section) sec_head;
+
+static struct sockaddr_un handover_addr;
+static int handover_fd = -1;
+static int handover_peer = -1;
+static struct mevent *handover_mev;
+static bool incoming;
+
+/* state received by the new DM, consumed by handover_restore() */
+static struct handover_buf in_buf;
+static int in_fds[HANDOVER_MAX_FDS];
+static int in_nfds;
+
+static struct handover_section *
+handover_find(const char *name)
+{
+	struct handover_section *sec;
+
+	LIST_FOREACH(sec, &sec_head, list)
+		if (!strncmp(sec->name, name, HANDOVER_NAME_LEN))
+			return sec;
+	return NULL;
+}
+
+int
+handover_register(const char *name, handover_save_t save,
+		  handover_restore_t restore, void *arg)
+{
+	struct handover_section *sec;
+
+	if (strnlen(name, HANDOVER_NAME_LEN) >= HANDOVER_NAME_LEN)
+		return -1;
+
+	if (handover_find(name) != NULL) {
+		fprintf(stderr, "handover: section %s already exists\n", name);
+		return -1;
+	}
+
+	sec = calloc(1, sizeof(struct handover_section));
+	if (!sec)
+		return -1;
+
+	strncpy(sec->name, name, HANDOVER_NAME_LEN - 1);
+	sec->save = save;
+	sec->restore = restore;
+	sec->arg = arg;
+	LIST_INSERT_HEAD(&sec_head, sec, list);
+
+	return 0;
+}
+
+void
+handover_unregister(const char *name)
+{
+	struct handover_section *sec;
+
+	sec = handover_find(name);
+	if (sec) {
+		LIST_REMOVE(sec, list);
+		free(sec);
+	}
+}
+
+static int
+handover_reserve(struct handover_buf *hb, size_t len)
+{
+	uint8_t *data;
+	size_t size;
+
+	if (hb->len + len <= hb->size)
+		return 0;
+
+	size = hb->size ? hb->size : 4096;
+	while (size < hb->len + len)
+		size *= 2;
+
+	data = realloc(hb->data, size);
+	if (!data)
+		return -1;
+
+	hb->data = data;
+	hb->size = size;
+	return 0;
+}
+
+int
+handover_put(struct handover_buf *hb, const void *data, size_t len)
+{
+	if (handover_reserve(hb, len) < 0)
+		return -1;
+
+	memcpy(hb->data + hb->len, data, len);
+	hb->len += len;
+	return 0;
+}
+
+/*
+ * Queue an fd for passing to the new DM. Only the index into the fd
+ * table goes into the section, the fd itself travels with SCM_RIGHTS.
+ */
+int
+handover_put_fd(struct handover_buf *hb, int fd)
+{
+	int32_t idx;
+
+	if (*hb->nfds >= HANDOVER_MAX_FDS)
+		return -1;
+
+	idx = (*hb->nfds)++;
+	hb->fds[idx] = fd;
+	return handover_put(hb, &idx, sizeof(idx));
+}
+
+int
+handover_get(struct handover_buf *hb, void *data, size_t len)
+{
+	if (hb->pos + len > hb->len)
+		return -1;
+
+	memcpy(data, hb->data + hb->pos, len);
+	hb->pos += len;
+	return 0;
+}
+
+/* The caller owns the returned fd */
+int
+handover_get_fd(struct handover_buf *hb)
+{
+	int32_t idx;
+	int fd;
+
+	if (handover_get(hb, &idx, sizeof(idx)) < 0)
+		return -1;
+
+	if (idx < 0 || idx >= *hb->nfds)
+		return -1;
+
+	fd = hb->fds[idx];
+	hb->fds[idx] = -1;
+	return fd;
+}
+
+static int
+handover_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int
+handover_read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int
+handover_send_hdr(int fd, struct handover_hdr *hdr, int *fds, int nfds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(*hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	return sendmsg(fd, &msg, 0) == sizeof(*hdr) ? 0 : -1;
+}
+
+static int
+handover_recv_hdr(int fd, struct handover_hdr *hdr, int *fds, int *nfds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(*hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do {
+		ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret != sizeof(*hdr))
+		return -1;
+
+	*nfds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+				cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+	}
+
+	if (msg.msg_flags & MSG_CTRUNC) {
+		fprintf(stderr, "handover: fd table truncated\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Refuse the handover if any registered component cannot be saved */
+static int
+handover_check(void)
+{
+	struct handover_section *sec;
+	int ret = 0;
+
+	LIST_FOREACH(sec, &sec_head, list) {
+		if (sec->save == NULL) {
+			fprintf(stderr, "handover: %s does not support "
+					"handover\n", sec->name);
+			ret = -EOPNOTSUPP;
+		}
+	}
+	return ret;
+}
+
+static void
+handover_accept(int fd, enum ev_type t, void *arg)
+{
+	struct vmctx *ctx = arg;
+	struct handover_hdr hdr;
+	int peer;
+
+	peer = accept(fd, NULL, NULL);
+	if (peer < 0)
+		return;
+
+	if (handover_peer >= 0) {
+		close(peer);
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HANDOVER_MAGIC;
+	hdr.version = HANDOVER_VERSION;
+	hdr.status = handover_check();
+	if (hdr.status) {
+		handover_send_hdr(peer, &hdr, NULL, 0);
+		close(peer);
+		return;
+	}
+
+	printf("handover: pausing %s for handover\n", vmname);
+	handover_peer = peer;
+	vm_suspend(ctx, VM_SUSPEND_HANDOVER);
+}
+
+int
+handover_init(struct vmctx *ctx)
+{
+	char path[sizeof(handover_addr.sun_path)];
+
+	if (mkdir("/run/acrn", 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	snprintf(path, sizeof(path), HANDOVER_PATH_FMT, vmname);
+	unlink(path);
+
+	handover_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (handover_fd < 0)
+		return -1;
+
+	memset(&handover_addr, 0, sizeof(handover_addr));
+	handover_addr.sun_family = AF_UNIX;
+	snprintf(handover_addr.sun_path, sizeof(handover_addr.sun_path),
+			"%s", path);
+	if (bind(handover_fd, (struct sockaddr *)&handover_addr,
+			sizeof(handover_addr)) < 0)
+		goto err;
+
+	if (listen(handover_fd, 1) < 0)
+		goto err;
+
+	handover_mev = mevent_add(handover_fd, EVF_READ, handover_accept, ctx);
+	if (!handover_mev)
+		goto err;
+
+	return 0;
+
+err:
+	fprintf(stderr, "handover: failed to listen on %s\n", path);
+	unlink(path);
+	close(handover_fd);
+	handover_fd = -1;
+	return -1;
+}
+
+void
+handover_deinit(void)
+{
+	if (handover_fd < 0)
+		return;
+
+	mevent_delete(handover_mev);
+	close(handover_fd);
+	handover_fd = -1;
+	unlink(handover_addr.sun_path);
+
+	if (handover_peer >= 0) {
+		close(handover_peer);
+		handover_peer = -1;
+	}
+}
+
+/*
+ * Called by the running DM once the VM is paused. On success the caller
+ * must give up its ioreq client and exit without destroying the VM; on
+ * failure the peer is dropped and the VM can be resumed.
+ */
+int
+handover_send(struct vmctx *ctx)
+{
+	struct handover_section *sec;
+	struct handover_hdr hdr;
+	struct handover_sec sh;
+	struct handover_buf hb;
+	int fds[HANDOVER_MAX_FDS];
+	int nfds = 0;
+	size_t off;
+	char ack;
+	int ret = -1;
+
+	if (handover_peer < 0)
+		return -1;
+
+	memset(&hb, 0, sizeof(hb));
+	hb.fds = fds;
+	hb.nfds = &nfds;
+
+	/* fd 0 is always the VHM device which keeps the VM alive */
+	fds[nfds++] = ctx->fd;
+
+	LIST_FOREACH(sec, &sec_head, list) {
+		memset(&sh, 0, sizeof(sh));
+		memcpy(sh.name, sec->name, sizeof(sh.name));
+		off = hb.len;
+		if (handover_put(&hb, &sh, sizeof(sh)) < 0)
+			goto out;
+		if (sec->save(sec->arg, &hb) < 0) {
+			fprintf(stderr, "handover: failed to save %s\n",
+					sec->name);
+			goto out;
+		}
+		sh.len = hb.len - off - sizeof(sh);
+		memcpy(hb.data + off, &sh, sizeof(sh));
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HANDOVER_MAGIC;
+	hdr.version = HANDOVER_VERSION;
+	hdr.vmid = ctx->vmid;
+	hdr.ncpus = guest_ncpus;
+	hdr.lowmem = ctx->lowmem;
+	hdr.highmem = ctx->highmem;
+	hdr.nfds = nfds;
+	hdr.len = hb.len;
+
+	if (handover_send_hdr(handover_peer, &hdr, fds, nfds) < 0 ||
+	    handover_write_all(handover_peer, hb.data, hb.len) < 0) {
+		fprintf(stderr, "handover: failed to send state\n");
+		goto out;
+	}
+
+	if (handover_read_all(handover_peer, &ack, 1) < 0) {
+		fprintf(stderr, "handover: no ack from new DM\n");
+		goto out;
+	}
+
+	printf("handover: %zu bytes and %d fds handed over\n", hb.len, nfds);
+	ret = 0;
+out:
+	free(hb.data);
+	if (ret < 0) {
+		close(handover_peer);
+		handover_peer = -1;
+	}
+	return ret;
+}
+
+void
+handover_set_incoming(void)
+{
+	incoming = true;
+}
+
+bool
+handover_incoming(void)
+{
+	return incoming;
+}
+
+/*
+ * Called by the new DM in place of creating the VM. Connects to the
+ * running DM, takes over the VM and stashes the device state for
+ * handover_restore(). The guest memory size is taken from the old DM.
+ */
+struct vmctx *
+handover_receive(const char *name, size_t *memsize)
+{
+	struct sockaddr_un addr;
+	struct handover_hdr hdr;
+	struct vmctx *ctx = NULL;
+	char ack = 0;
+	int fd, i;
+
+	incoming = false;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), HANDOVER_PATH_FMT,
+			name);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "handover: cannot connect to %s\n",
+				addr.sun_path);
+		goto out;
+	}
+
+	if (handover_recv_hdr(fd, &hdr, in_fds, &in_nfds) < 0 ||
+	    hdr.magic != HANDOVER_MAGIC) {
+		fprintf(stderr, "handover: bad handover header\n");
+		goto out;
+	}
+
+	if (hdr.version != HANDOVER_VERSION) {
+		fprintf(stderr, "handover: version %u not supported\n",
+				hdr.version);
+		goto out;
+	}
+
+	if (hdr.status) {
+		fprintf(stderr, "handover: refused by running DM (%d)\n",
+				hdr.status);
+		goto out;
+	}
+
+	if (in_nfds < 1 || in_nfds != hdr.nfds) {
+		fprintf(stderr, "handover: expected %u fds, got %d\n",
+				hdr.nfds, in_nfds);
+		goto out;
+	}
+
+	in_buf.data = malloc(hdr.len ? hdr.len : 1);
+	if (!in_buf.data)
+		goto out;
+	in_buf.len = in_buf.size = hdr.len;
+	in_buf.pos = 0;
+	in_buf.fds = in_fds;
+	in_buf.nfds = &in_nfds;
+	if (handover_read_all(fd, in_buf.data, hdr.len) < 0) {
+		fprintf(stderr, "handover: short read of device state\n");
+		goto out;
+	}
+
+	ctx = vm_adopt(name, in_fds[0], hdr.vmid);
+	if (!ctx)
+		goto out;
+	in_fds[0] = -1;
+
+	guest_ncpus = hdr.ncpus;
+	*memsize = hdr.lowmem + hdr.highmem;
+
+	/* let the old DM go and wait until it is gone */
+	if (handover_write_all(fd, &ack, 1) == 0)
+		while (read(fd, &ack, 1) > 0)
+			;
+
+out:
+	close(fd);
+	if (!ctx) {
+		for (i = 0; i < in_nfds; i++)
+			if (in_fds[i] >= 0)
+				close(in_fds[i]);
+		in_nfds = 0;
+		free(in_buf.data);
+		in_buf.data = NULL;
+	}
+	return ctx;
+}
+
+/*
+ * Feed the received sections to the components registered by the new
+ * DM. Every section has to find its owner, otherwise the two DMs were
+ * not started with the same device configuration.
+ */
+int
+handover_restore(void)
+{
+	struct handover_section *sec;
+	struct handover_buf hb;
+	struct handover_sec sh;
+	int i, ret = 0;
+
+	while (in_buf.pos < in_buf.len) {
+		if (handover_get(&in_buf, &sh, sizeof(sh)) < 0 ||
+		    in_buf.pos + sh.len > in_buf.len) {
+			fprintf(stderr, "handover: corrupted section\n");
+			ret = -1;
+			break;
+		}
+		sh.name[HANDOVER_NAME_LEN - 1] = '\0';
+
+		sec = handover_find(sh.name);
+		if (!sec || !sec->restore) {
+			fprintf(stderr, "handover: no owner for section %s\n",
+					sh.name);
+			ret = -1;
+			break;
+		}
+
+		hb = in_buf;
+		hb.data = in_buf.data + in_buf.pos;
+		hb.len = sh.len;
+		hb.pos = 0;
+		if (sec->restore(sec->arg, &hb) < 0) {
+			fprintf(stderr, "handover: failed to restore %s\n",
+					sh.name);
+			ret = -1;
+			break;
+		}
+		in_buf.pos += sh.len;
+	}
+
+	for (i = 0; i < in_nfds; i++)
+		if (in_fds[i] >= 0)
+			close(in_fds[i]);
+	in_nfds = 0;
+	free(in_buf.data);
+	memset(&in_buf, 0, sizeof(in_buf));
+
+	return ret;
+}
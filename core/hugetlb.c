@@ -42,6 +42,7 @@
 #include "vmm.h"
 #include "vhm_ioctl_defs.h"
 #include "vmmapi.h"
+#include "handover.h"
 
 #define HUGETLB_LV1		0
 #define HUGETLB_LV2		1
@@ -487,6 +488,12 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	}
 	printf("total_size 0x%lx\n\n", total_size);
 
+	/*
+	 * hugetlbfs is mounted privately by each DM, so a new DM would
+	 * not find the guest memory files. Block live handover for now.
+	 */
+	handover_register("hugetlb", NULL, NULL, NULL);
+
 	/* map ept for lowmem*/
 	if (vm_map_memseg_vma(ctx, ctx->lowmem, 0,
 		(uint64_t)ctx->baseaddr, PROT_ALL) < 0)
@@ -517,6 +524,8 @@ void hugetlb_unsetup_memory(struct vmctx *ctx)
 {
 	int level;
 
+	handover_unregister("hugetlb");
+
 	if (total_size > 0) {
 		munmap(ptr, total_size);
 		total_size = 0;
@@ -65,6 +65,11 @@
 #include "sw_load.h"
 #include "monitor.h"
 #include "ioc.h"
+#include "handover.h"
+#include "timeline.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "vnc.h"
 
 #define GUEST_NIO_PORT		0x488	/* guest upcalls via i/o port */
 
@@ -88,6 +93,7 @@ static int strictio;
 static int strictmsr = 1;
 
 static int acpi;
+static int handover_enabled;
 
 static char *progname;
 static const int BSP;
@@ -97,22 +103,27 @@ static cpuset_t cpumask;
 static void vm_loop(struct vmctx *ctx);
 
 static int quit_vm_loop;
+static int vm_run_phase = -1;
+static char *timeline_file;
 
 static char vhm_request_page[4096] __attribute__ ((aligned(4096)));
 
 static struct vhm_request *vhm_req_buf =
 				(struct vhm_request *)&vhm_request_page;
 
-struct dmstats {
-	uint64_t	vmexit_bogus;
-	uint64_t	vmexit_reqidle;
-	uint64_t	vmexit_hlt;
-	uint64_t	vmexit_pause;
-	uint64_t	vmexit_mtrap;
-	uint64_t	cpu_switch_rotate;
-	uint64_t	cpu_switch_direct;
-	uint64_t	vmexit_mmio_emul;
-} stats;
+/* acrn_vmexits_total{reason=...}, registered once for all resets */
+static struct metric *vmexit_metric[VM_EXITCODE_MAX];
+
+static const char * const vmexit_reason[VM_EXITCODE_MAX] = {
+	[VM_EXITCODE_INOUT]	= "inout",
+	[VM_EXITCODE_MMIO_EMUL]	= "mmio",
+	[VM_EXITCODE_PCI_CFG]	= "pci_cfg",
+	[VM_EXITCODE_BOGUS]	= "bogus",
+	[VM_EXITCODE_REQIDLE]	= "reqidle",
+	[VM_EXITCODE_MTRAP]	= "mtrap",
+	[VM_EXITCODE_HLT]	= "hlt",
+	[VM_EXITCODE_PAUSE]	= "pause",
+};
 
 struct mt_vmm_info {
 	pthread_t	mt_thr;
@@ -131,7 +142,9 @@ usage(int code)
 		"Usage: %s [-abehuwxACHPSTWY] [-c vcpus] [-g <gdb port>] [-l <lpc>]\n"
 		"       %*s [-m mem] [-p vcpu:hostcpu] [-s <pci>] [-U uuid] \n"
 		"       %*s [--vsbl vsbl_file_name] [--part_info part_info_name]\n"
-		"	%*s [--enable_trusty] <vm>\n"
+		"	%*s [--enable_trusty] [--enable_handover] [--handover]\n"
+		"       %*s [--timeline timeline_file] [--trace tracepoints]\n"
+		"       %*s [--vnc [host:]port[,fps=N]] <vm>\n"
 		"       -a: local apic is in xAPIC mode (deprecated)\n"
 		"       -A: create ACPI tables\n"
 		"       -c: # cpus (default 1)\n"
@@ -145,7 +158,8 @@ usage(int code)
 		"       -M: do not hide INTx link for MSI&INTx capable ptdev\n"
 		"       -p: pin 'vcpu' to 'hostcpu'\n"
 		"       -P: vmexit from the guest on pause\n"
-		"       -s: <slot,driver,configinfo> PCI slot config\n"
+		"       -s: <slot,driver,configinfo[,flags]> PCI slot config,\n"
+		"           flag 'lazy' defers backend setup until first use\n"
 		"       -S: guest memory cannot be swapped\n"
 		"       -u: RTC keeps UTC time\n"
 		"       -U: uuid\n"
@@ -161,8 +175,16 @@ usage(int code)
 		"       -i: ioc boot parameters\n"
 		"       --vsbl: vsbl file path\n"
 		"       --part_info: guest partition info file path\n"
-		"	--enable_trusty: enable trusty for guest\n",
+		"	--enable_trusty: enable trusty for guest\n"
+		"       --enable_handover: let a later acrn-dm take the VM over\n"
+		"       --handover: take over the VM from a running acrn-dm\n"
+		"       --timeline: write the startup timeline as JSON\n"
+		"       --trace: enable tracepoints, 'all' or names separated\n"
+		"           by ',', drained over the monitor socket\n"
+		"       --vnc: serve the console over VNC, on 127.0.0.1\n"
+		"           unless another loopback address is given\n",
 		progname, (int)strlen(progname), "", (int)strlen(progname), "",
+		(int)strlen(progname), "", (int)strlen(progname), "",
 		(int)strlen(progname), "");
 
 	exit(code);
@@ -274,9 +296,12 @@ fbsdrun_addcpu(struct vmctx *ctx, int guest_ncpus)
 	int error;
 
 	for (i = 0; i < guest_ncpus; i++) {
-		error = vm_create_vcpu(ctx, i);
-		if (error != 0)
-			err(EX_OSERR, "could not create CPU %d", i);
+		/* vcpus of an adopted VM have been created by the old DM */
+		if (!ctx->adopted) {
+			error = vm_create_vcpu(ctx, i);
+			if (error != 0)
+				err(EX_OSERR, "could not create CPU %d", i);
+		}
 
 		CPU_SET_ATOMIC(i, &cpumask);
 
@@ -334,7 +359,6 @@ vmexit_mmio_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
 	int err;
 
-	stats.vmexit_mmio_emul++;
 	err = emulate_mem(ctx, &vhm_req->reqs.mmio_request);
 
 	if (err) {
@@ -391,24 +415,18 @@ vmexit_pci_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_bogus(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_bogus++;
-
 	return VMEXIT_CONTINUE;
 }
 
 static int
 vmexit_reqidle(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_reqidle++;
-
 	return VMEXIT_CONTINUE;
 }
 
 static int
 vmexit_hlt(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_hlt++;
-
 	/*
 	 * Just continue execution with the next instruction. We use
 	 * the HLT VM exit as a way to be friendly with the host
@@ -420,16 +438,12 @@ vmexit_hlt(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 static int
 vmexit_pause(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_pause++;
-
 	return VMEXIT_CONTINUE;
 }
 
 static int
 vmexit_mtrap(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
-	stats.vmexit_mtrap++;
-
 	return VMEXIT_CONTINUE;
 }
 
@@ -444,6 +458,18 @@ static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 	[VM_EXITCODE_PAUSE]  = vmexit_pause,
 };
 
+static void
+vmexit_metrics_init(void)
+{
+	int i;
+
+	for (i = 0; i < VM_EXITCODE_MAX; i++)
+		if (handler[i] && !vmexit_metric[i])
+			vmexit_metric[i] = metric_register(METRIC_COUNTER,
+				"acrn_vmexits_total", "reason=\"%s\"",
+				vmexit_reason[i]);
+}
+
 static void
 handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 {
@@ -457,6 +483,8 @@ handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 		exit(1);
 	}
 
+	metric_inc(vmexit_metric[exitcode]);
+	TRACEPOINT(TP_VMEXIT, exitcode, vcpu);
 	rc = (*handler[exitcode])(ctx, vhm_req, &vcpu);
 	switch (rc) {
 	case VMEXIT_CONTINUE:
@@ -482,6 +510,12 @@ vm_loop(struct vmctx *ctx)
 	error = vm_run(ctx);
 	assert(error == 0);
 
+	timeline_end(vm_run_phase);
+	if (timeline_file) {
+		timeline_write(timeline_file);
+		timeline_file = NULL;
+	}
+
 	while (1) {
 		int vcpu;
 		struct vhm_request *vhm_req;
@@ -541,10 +575,43 @@ sig_handler_term(int signo)
 	mevent_notify();
 }
 
+/* REQ_STOP from acrnctl, power off just like on SIGINT */
+static VMM_MSG_STR(stop_ok, "acrn-dm stopping");
+
+static void
+stop_monitor_handler(struct vmm_msg *msg, struct msg_sender *sender,
+		     void *priv)
+{
+	monitor_send(sender, &stop_ok.vmsg);
+	vm_set_suspend_mode(VM_SUSPEND_POWEROFF);
+	mevent_notify();
+}
+
+static int
+stop_monitor_init(void)
+{
+	struct vmm_msg msg = { .msgid = REQ_STOP };
+	static bool registered;
+
+	if (registered)
+		return 0;
+
+	if (monitor_register_handler(&msg, stop_monitor_handler, NULL))
+		return -1;
+
+	registered = true;
+	return 0;
+}
+
 enum {
 	CMD_OPT_VSBL = 1000,
 	CMD_OPT_PART_INFO,
 	CMD_OPT_TRUSTY_ENABLE,
+	CMD_OPT_HANDOVER_ENABLE,
+	CMD_OPT_HANDOVER,
+	CMD_OPT_TIMELINE,
+	CMD_OPT_TRACE,
+	CMD_OPT_VNC,
 };
 
 static struct option long_options[] = {
@@ -581,20 +648,29 @@ static struct option long_options[] = {
 	{"part_info",		required_argument,	0, CMD_OPT_PART_INFO},
 	{"enable_trusty",	no_argument,		0,
 					CMD_OPT_TRUSTY_ENABLE},
+	{"enable_handover",	no_argument,		0,
+					CMD_OPT_HANDOVER_ENABLE},
+	{"handover",		no_argument,		0, CMD_OPT_HANDOVER},
+	{"timeline",		required_argument,	0, CMD_OPT_TIMELINE},
+	{"trace",		required_argument,	0, CMD_OPT_TRACE},
+	{"vnc",			required_argument,	0, CMD_OPT_VNC},
 	{0,			0,			0,  0  },
 };
 
 int
 main(int argc, char *argv[])
 {
-	int c, error, gdb_port, err;
+	int c, error, gdb_port, err, tl;
 	int max_vcpus, mptgen, memflags;
 	int rtc_localtime;
+	uint32_t trace_mask;
 	struct vmctx *ctx;
 	size_t memsize;
 	char *optstr;
 	int option_idx = 0;
 
+	timeline_init();
+
 	progname = basename(argv[0]);
 	gdb_port = 0;
 	guest_ncpus = 1;
@@ -741,6 +817,24 @@ main(int argc, char *argv[])
 		case CMD_OPT_TRUSTY_ENABLE:
 			trusty_enabled = 1;
 			break;
+		case CMD_OPT_HANDOVER_ENABLE:
+			handover_enabled = 1;
+			break;
+		case CMD_OPT_HANDOVER:
+			handover_set_incoming();
+			break;
+		case CMD_OPT_TIMELINE:
+			timeline_file = optarg;
+			break;
+		case CMD_OPT_TRACE:
+			if (tracepoint_parse(optarg, &trace_mask))
+				errx(EX_USAGE, "invalid tracepoints %s", optarg);
+			tracepoint_enable(trace_mask);
+			break;
+		case CMD_OPT_VNC:
+			if (vnc_parse(optarg))
+				errx(EX_USAGE, "invalid vnc option %s", optarg);
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -756,7 +850,15 @@ main(int argc, char *argv[])
 	vmname = argv[0];
 
 	for (;;) {
-		ctx = do_open(vmname);
+		timeline_reset();
+		tl = timeline_begin("vm_open");
+		if (handover_incoming()) {
+			ctx = handover_receive(vmname, &memsize);
+			if (ctx == NULL)
+				exit(1);
+		} else
+			ctx = do_open(vmname);
+		timeline_end(tl);
 
 		/* set IOReq buffer page */
 		error = vm_set_shared_io_page(ctx, (unsigned long)vhm_req_buf);
@@ -777,19 +879,24 @@ main(int argc, char *argv[])
 		}
 
 		vm_set_memflags(ctx, memflags);
+		tl = timeline_begin("vm_setup_memory");
 		err = vm_setup_memory(ctx, memsize, VM_MMAP_ALL);
 		if (err) {
 			fprintf(stderr, "Unable to setup memory (%d)\n", errno);
 			goto fail;
 		}
+		timeline_end(tl);
 
+		tl = timeline_begin("mevent_init");
 		err = mevent_init();
 		if (err) {
 			fprintf(stderr, "Unable to initialize mevent (%d)\n",
 				errno);
 			goto mevent_fail;
 		}
+		timeline_end(tl);
 
+		tl = timeline_begin("platform_init");
 		init_mem();
 		init_inout();
 		pci_irq_init(ctx);
@@ -801,50 +908,85 @@ main(int argc, char *argv[])
 		sci_init(ctx);
 		init_bvmcons();
 		monitor_init(ctx);
+		timeline_monitor_init();
+		metrics_monitor_init();
+		tracepoint_monitor_init();
+		stop_monitor_init();
+		vmexit_metrics_init();
+		if (handover_enabled && handover_init(ctx) != 0)
+			goto pci_fail;
+		timeline_end(tl);
 
 		/*
 		 * Exit if a device emulation finds an error in its
 		 * initialization
 		 */
+		tl = timeline_begin("init_pci");
 		if (init_pci(ctx) != 0) {
 			goto pci_fail;
 		}
+		timeline_end(tl);
+
+		/* the server outlives guest resets, clients stay connected */
+		if (vnc_init() != 0)
+			goto vm_fail;
 
 		if (gdb_port != 0)
 			fprintf(stderr, "dbgport not supported\n");
 
+		/*
+		 * An adopted VM is running already: pick up the device state
+		 * of the old DM instead of building tables and loading the
+		 * guest image again.
+		 */
+		if (ctx->adopted) {
+			if (handover_restore() != 0)
+				goto vm_fail;
+			goto vm_start;
+		}
+
 		/*
 		 * build the guest tables, MP etc.
 		 */
 		if (mptgen) {
+			tl = timeline_begin("mptable_build");
 			error = mptable_build(ctx, guest_ncpus);
 			if (error) {
 				goto vm_fail;
 			}
+			timeline_end(tl);
 		}
 
+		tl = timeline_begin("smbios_build");
 		error = smbios_build(ctx);
 		if (error)
 			goto vm_fail;
+		timeline_end(tl);
 
 		if (acpi) {
+			tl = timeline_begin("acpi_build");
 			error = acpi_build(ctx, guest_ncpus);
 			if (error)
 				goto vm_fail;
+			timeline_end(tl);
 		}
 
+		tl = timeline_begin("acrn_sw_load");
 		error = acrn_sw_load(ctx);
 		if (error)
 			goto vm_fail;
+		timeline_end(tl);
 
+vm_start:
 		/*
 		 * Change the proc title to include the VM name.
 		 */
 		/*setproctitle("%s", vmname);*/
 
 		/*
-		 * Add CPU 0
+		 * Add CPU 0, vm_loop ends the vm_run phase once the VM runs
 		 */
+		vm_run_phase = timeline_begin("vm_run");
 		fbsdrun_addcpu(ctx, guest_ncpus);
 
 		/* Make a copy for ctx */
@@ -853,9 +995,28 @@ main(int argc, char *argv[])
 		/*
 		 * Head off to the main event dispatch loop
 		 */
-		mevent_dispatch();
+		for (;;) {
+			mevent_dispatch();
+			vm_pause(ctx);
 
-		vm_pause(ctx);
+			if (vm_get_suspend_mode() != VM_SUSPEND_HANDOVER)
+				break;
+
+			/*
+			 * The ioreq client stays ours until the new DM has
+			 * acked, then the VM lives on there and we leave
+			 * without tearing anything down. Otherwise nothing
+			 * is lost, resume the VM and carry on.
+			 */
+			if (handover_send(ctx) == 0) {
+				fbsdrun_deletecpu(ctx, BSP);
+				exit(0);
+			}
+			fprintf(stderr, "handover failed, resuming %s\n",
+				vmname);
+			vm_set_suspend_mode(VM_SUSPEND_NONE);
+			vm_run(ctx);
+		}
 		fbsdrun_deletecpu(ctx, BSP);
 
 		if (vm_get_suspend_mode() != VM_SUSPEND_RESET)
@@ -863,8 +1024,10 @@ main(int argc, char *argv[])
 
 		pci_irq_deinit(ctx);
 		deinit_pci(ctx);
+		handover_deinit();
 		monitor_close();
 		deinit_bvmcons();
+		sci_deinit();
 		vrtc_deinit(ctx);
 		atkbdc_deinit(ctx);
 		vm_unsetup_memory(ctx);
@@ -879,8 +1042,11 @@ vm_fail:
 	pci_irq_deinit(ctx);
 	deinit_pci(ctx);
 pci_fail:
+	vnc_deinit();
+	handover_deinit();
 	monitor_close();
 	deinit_bvmcons();
+	sci_deinit();
 	vrtc_deinit(ctx);
 	atkbdc_deinit(ctx);
 mevent_fail:
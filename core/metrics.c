@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "types.h"
+#include "dm.h"
+#include "monitor.h"
+#include "metrics.h"
+
+#define METRIC_CACHELINE	64
+
+__thread unsigned int metric_tid;
+
+static TAILQ_HEAD(, metric) metrics = TAILQ_HEAD_INITIALIZER(metrics);
+static pthread_mutex_t metrics_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* give the calling thread its shard, threads are spread round robin */
+unsigned int
+metric_tid_init(void)
+{
+	static unsigned int next;
+
+	do {
+		metric_tid = __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+	} while (metric_tid == 0);
+
+	return metric_tid;
+}
+
+struct metric *
+metric_register(enum metric_type type, const char *name,
+		const char *labels_fmt, ...)
+{
+	struct metric *m;
+	va_list args;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		fprintf(stderr, "%s: calloc returns NULL\n", __func__);
+		return NULL;
+	}
+
+	m->type = type;
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	if (labels_fmt) {
+		va_start(args, labels_fmt);
+		vsnprintf(m->labels, sizeof(m->labels), labels_fmt, args);
+		va_end(args);
+	}
+
+	if (type == METRIC_HISTOGRAM)
+		m->stride = roundup2(sizeof(struct metric_shard),
+				     METRIC_CACHELINE);
+	else
+		m->stride = METRIC_CACHELINE;
+	if (posix_memalign(&m->shards, METRIC_CACHELINE,
+			   m->stride * METRIC_SHARDS)) {
+		fprintf(stderr, "%s: no memory for %s\n", __func__, name);
+		free(m);
+		return NULL;
+	}
+	memset(m->shards, 0, m->stride * METRIC_SHARDS);
+
+	pthread_mutex_lock(&metrics_mtx);
+	TAILQ_INSERT_TAIL(&metrics, m, list);
+	pthread_mutex_unlock(&metrics_mtx);
+
+	return m;
+}
+
+void
+metric_unregister(struct metric *m)
+{
+	if (!m)
+		return;
+
+	pthread_mutex_lock(&metrics_mtx);
+	TAILQ_REMOVE(&metrics, m, list);
+	pthread_mutex_unlock(&metrics_mtx);
+
+	free(m->shards);
+	free(m);
+}
+
+/* sum of all shards, a histogram has METRIC_HIST_BUCKETS + 2 values */
+static int
+metric_read(struct metric *m, uint64_t *val)
+{
+	struct metric_shard *s;
+	int i, j, n;
+
+	if (m->type == METRIC_GAUGE) {
+		val[0] = __atomic_load_n(&m->gauge, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	n = (m->type == METRIC_HISTOGRAM) ? METRIC_HIST_BUCKETS + 2 : 1;
+	memset(val, 0, n * sizeof(*val));
+	for (i = 0; i < METRIC_SHARDS; i++) {
+		s = (struct metric_shard *)((char *)m->shards + i * m->stride);
+		val[0] += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+		if (m->type != METRIC_HISTOGRAM)
+			continue;
+		val[1] += __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+		for (j = 0; j < METRIC_HIST_BUCKETS; j++)
+			val[2 + j] += __atomic_load_n(&s->bucket[j],
+						      __ATOMIC_RELAXED);
+	}
+
+	return n;
+}
+
+static const char *metric_type_name[] = {
+	[METRIC_COUNTER] = "counter",
+	[METRIC_GAUGE] = "gauge",
+	[METRIC_HISTOGRAM] = "histogram",
+};
+
+/* metrics_mtx held */
+static void
+metrics_dump_text(FILE *fp)
+{
+	uint64_t val[METRIC_HIST_BUCKETS + 2], cum;
+	struct metric *m, *p;
+	const char *sep;
+	int i;
+
+	TAILQ_FOREACH(m, &metrics, list) {
+		/* one TYPE line per name, where the name shows up first */
+		TAILQ_FOREACH(p, &metrics, list)
+			if (p == m || strcmp(p->name, m->name) == 0)
+				break;
+		if (p == m)
+			fprintf(fp, "# TYPE %s %s\n", m->name,
+				metric_type_name[m->type]);
+
+		metric_read(m, val);
+		sep = m->labels[0] ? "," : "";
+		if (m->type == METRIC_COUNTER) {
+			fprintf(fp, "%s{vm=\"%s\"%s%s} %lu\n", m->name,
+				vmname, sep, m->labels, val[0]);
+			continue;
+		}
+		if (m->type == METRIC_GAUGE) {
+			fprintf(fp, "%s{vm=\"%s\"%s%s} %ld\n", m->name,
+				vmname, sep, m->labels, (int64_t)val[0]);
+			continue;
+		}
+
+		cum = 0;
+		for (i = 0; i < METRIC_HIST_BUCKETS - 1; i++) {
+			cum += val[2 + i];
+			fprintf(fp, "%s_bucket{vm=\"%s\"%s%s,le=\"%lu\"} %lu\n",
+				m->name, vmname, sep, m->labels,
+				(1UL << i) - 1, cum);
+		}
+		fprintf(fp, "%s_bucket{vm=\"%s\"%s%s,le=\"+Inf\"} %lu\n",
+			m->name, vmname, sep, m->labels, val[0]);
+		fprintf(fp, "%s_sum{vm=\"%s\"%s%s} %lu\n", m->name, vmname,
+			sep, m->labels, val[1]);
+		fprintf(fp, "%s_count{vm=\"%s\"%s%s} %lu\n", m->name, vmname,
+			sep, m->labels, val[0]);
+	}
+}
+
+/* metrics_mtx held */
+static void
+metrics_dump_bin(FILE *fp)
+{
+	uint64_t val[METRIC_HIST_BUCKETS + 2];
+	static const char pad[8];
+	struct metrics_bin_record rec;
+	struct metrics_bin_hdr hdr;
+	struct timespec ts;
+	struct metric *m;
+	size_t head;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = METRICS_BIN_MAGIC;
+	hdr.version = METRICS_BIN_VERSION;
+	hdr.nhist_buckets = METRIC_HIST_BUCKETS;
+	TAILQ_FOREACH(m, &metrics, list)
+		hdr.nrecords++;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	hdr.timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	TAILQ_FOREACH(m, &metrics, list) {
+		rec.type = m->type;
+		rec.nvalues = metric_read(m, val);
+		rec.name_len = strlen(m->name);
+		rec.labels_len = strlen(m->labels);
+		head = sizeof(rec) + rec.name_len + rec.labels_len;
+		rec.size = roundup2(head, 8) + rec.nvalues * sizeof(uint64_t);
+
+		fwrite(&rec, sizeof(rec), 1, fp);
+		fwrite(m->name, rec.name_len, 1, fp);
+		fwrite(m->labels, rec.labels_len, 1, fp);
+		fwrite(pad, roundup2(head, 8) - head, 1, fp);
+		fwrite(val, sizeof(uint64_t), rec.nvalues, fp);
+	}
+}
+
+/* REQ_METRICS and REQ_METRICS_BIN, see struct vmm_msg_metrics */
+static void
+metrics_monitor_query(struct vmm_msg *msg, struct msg_sender *sender,
+		      void *priv)
+{
+	char *dump = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	fp = open_memstream(&dump, &len);
+	if (fp == NULL)
+		return;
+	pthread_mutex_lock(&metrics_mtx);
+	if (msg->msgid == REQ_METRICS_BIN)
+		metrics_dump_bin(fp);
+	else
+		metrics_dump_text(fp);
+	pthread_mutex_unlock(&metrics_mtx);
+	fclose(fp);
+
+	if (monitor_send_chunks(sender, msg->msgid, dump, len) < 0)
+		fprintf(stderr, "metrics: reply failed\n");
+	free(dump);
+}
+
+/* handlers outlive monitor_close(), register only once across resets */
+int
+metrics_monitor_init(void)
+{
+	struct vmm_msg text = { .msgid = REQ_METRICS };
+	struct vmm_msg bin = { .msgid = REQ_METRICS_BIN };
+	static bool registered;
+
+	if (registered)
+		return 0;
+
+	if (monitor_register_handler(&text, metrics_monitor_query, NULL) ||
+	    monitor_register_handler(&bin, metrics_monitor_query, NULL))
+		return -1;
+
+	registered = true;
+	return 0;
+}
@@ -48,6 +48,7 @@
 #include <pthread.h>
 
 #include "mevent.h"
+#include "tracepoint.h"
 #include "vmm.h"
 #include "vmmapi.h"
 
@@ -61,6 +62,7 @@
 static int epoll_fd;
 static pthread_t mevent_tid;
 static int mevent_pipefd[2];
+static struct mevent *mevent_pipev;
 static pthread_mutex_t mevent_lmutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct mevent {
@@ -170,6 +172,7 @@ mevent_handle(struct epoll_event *kev, int numev)
 		mevp = kev[i].data.ptr;
 		/* XXX check for EV_ERROR ? */
 
+		TRACEPOINT(TP_MEVENT, mevp->me_fd, mevp->me_type);
 		(*mevp->me_func)(mevp->me_fd, mevp->me_type, mevp->me_param);
 	}
 }
@@ -292,14 +295,13 @@ mevent_deinit(void)
 {
 	mevent_destroy();
 	close(epoll_fd);
+	mevent_pipev = NULL;
 }
 
 void
 mevent_dispatch(void)
 {
 	struct epoll_event eventlist[MEVENT_MAX];
-
-	struct mevent *pipev;
 	int ret;
 
 	mevent_tid = pthread_self();
@@ -308,19 +310,23 @@ mevent_dispatch(void)
 	/*
 	 * Open the pipe that will be used for other threads to force
 	 * the blocking kqueue call to exit by writing to it. Set the
-	 * descriptor to non-blocking.
+	 * descriptor to non-blocking. The loop is entered again after
+	 * a failed handover, the pipe is still there then.
 	 */
-	ret = pipe(mevent_pipefd);
-	if (ret < 0) {
-		perror("pipe");
-		exit(0);
-	}
+	if (mevent_pipev == NULL) {
+		ret = pipe(mevent_pipefd);
+		if (ret < 0) {
+			perror("pipe");
+			exit(0);
+		}
 
-	/*
-	 * Add internal event handler for the pipe write fd
-	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL);
-	assert(pipev != NULL);
+		/*
+		 * Add internal event handler for the pipe write fd
+		 */
+		mevent_pipev = mevent_add(mevent_pipefd[0], EVF_READ,
+					  mevent_pipe_read, NULL);
+		assert(mevent_pipev != NULL);
+	}
 
 	for (;;) {
 		/*
@@ -34,12 +34,16 @@
  * Author: TaoYuhong <yuhong.tao@intel.com>
  */
 
+
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/queue.h>
 #include <errno.h>
 #include <time.h>
@@ -69,8 +73,11 @@ static int monitor_add_handler(struct monitor_msg_handle *handle)
 
 	LIST_FOREACH(hp, &mmh_head, list)
 	    if (hp->msg.msgid == handle->msg.msgid) {
-		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
 		pthread_mutex_unlock(&mmh_mutex);
+		/* built-in handlers are added again after a reset */
+		if (hp == handle)
+			return 0;
+		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
 		return -1;
 	}
 	LIST_INSERT_HEAD(&mmh_head, handle, list);
@@ -79,6 +86,19 @@ static int monitor_add_handler(struct monitor_msg_handle *handle)
 	return 0;
 }
 
+static struct monitor_msg_handle *monitor_find_handler(unsigned int msgid)
+{
+	struct monitor_msg_handle *hp;
+
+	pthread_mutex_lock(&mmh_mutex);
+	LIST_FOREACH(hp, &mmh_head, list)
+		if (hp->msg.msgid == msgid)
+			break;
+	pthread_mutex_unlock(&mmh_mutex);
+
+	return hp;
+}
+
 int monitor_register_handler(struct vmm_msg *msg,
 			    void (*callback) (struct vmm_msg * msg,
 					      struct msg_sender * client,
@@ -107,79 +127,40 @@ int monitor_register_handler(struct vmm_msg *msg,
 	return ret;
 }
 
-/* messages handled by monitor */
-static int write_msg_to(int fd, void *data, unsigned long timeout_usec)
-{
-	struct vmm_msg *msg = data;
-	fd_set wfd;
-	struct timeval timeout;
-	int ret = 0;
-
-	if (msg->len < sizeof(struct vmm_msg)) {
-		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		return -1;
-	}
-
-	if (msg->msgid > MSGID_MAX) {
-		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		return -1;
-	}
-
-	if (msg->magic != VMM_MSG_MAGIC) {
-		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		msg->magic = VMM_MSG_MAGIC;
-	}
-
-	msg->timestamp = time(NULL);
-
-	FD_ZERO(&wfd);
-	FD_SET(fd, &wfd);
-	timeout.tv_sec = 0;
-	timeout.tv_usec = timeout_usec;
-	select(fd + 1, NULL, &wfd, NULL, &timeout);
-
-	if (FD_ISSET(fd, &wfd))
-		ret = write(fd, msg, msg->len);
-
-	return ret;
-}
-
-/* MSG_HANDSHAKE, handshake message handler*/
-#define TIMEOUT_USEC	100000
-static VMM_MSG_STR(handshake_badname, "Error: bad name!");
-static VMM_MSG_STR(handshake_ok, "acrn-dm read you request");
-
-static void handshake_acrn_dm(struct vmm_msg *msg, struct msg_sender *sender,
-			      void *priv)
-{
-	struct vmm_msg_handshake *hsk = (void *)msg;
-	int ret;
-
-	ret = strnlen(hsk->name, CLIENT_NAME_LEN);
-	if (ret >= CLIENT_NAME_LEN) {
-		write_msg_to(sender->fd, &handshake_badname, TIMEOUT_USEC);
-		return;
-	}
-
-	strncpy(sender->name, hsk->name, CLIENT_NAME_LEN);
-	sender->broadcast = hsk->broadcast;
-
-	write_msg_to(sender->fd, &handshake_ok, TIMEOUT_USEC);
-}
-
-static struct monitor_msg_handle handle_handshake = {
-	.msg = {.msgid = MSG_HANDSHAKE},
-	.callback = handshake_acrn_dm,
-};
-
 /* vm manager can comunicate with dm-monitor, use unix socket,
  * the monitor is the server, and there may have many clients,
  * a client send a message, trigger right msg handler. And msg handler
  * should only reply to message sender.
+ *
+ * The monitor thread runs its own epoll loop over the listening socket
+ * and all clients, so nothing it does blocks on a client. Messages to
+ * a client go through a per-client output queue which the loop drains
+ * when the socket is writable. A client that does not keep up loses
+ * messages once its queue is full, it never stalls the sender.
  */
 
+#define MONITOR_MAX_EVENTS	16
+#define MONITOR_OUTQ_LEN	64	/* queued messages per client */
+#define MONITOR_MAX_SUBS	8	/* subscriptions per client */
+#define MONITOR_MIN_INTERVAL	10	/* ms */
+
 static struct sockaddr_un monitor_addr;	/* one monitor */
-static int monitor_fd;
+static int monitor_fd = -1;
+static int monitor_epfd = -1;
+static int monitor_evfd = -1;		/* wakes up the monitor thread */
+
+struct monitor_out {
+	TAILQ_ENTRY(monitor_out) link;
+	size_t len;
+	size_t off;			/* bytes already sent */
+	char data[0];
+};
+
+struct monitor_sub {
+	unsigned int msgid;
+	unsigned int interval_ms;
+	unsigned long long due_ms;
+};
 
 struct vmm_client {
 	/* msg_sender will be seen/modify by msg handler */
@@ -190,8 +171,19 @@ struct vmm_client {
 	int fd;
 	socklen_t addr_len;
 	void *buf;
-	int len;		/* buf len */
-	struct mevent *mev;
+	size_t len;		/* bytes in buf */
+
+	/* protected by client_mutex */
+	TAILQ_HEAD(, monitor_out) outq;
+	int outq_len;
+	unsigned long dropped;
+	int want_write;		/* EPOLLOUT armed */
+	int dead;		/* freed by the monitor thread */
+
+	/* only touched by the monitor thread */
+	struct monitor_sub subs[MONITOR_MAX_SUBS];
+	int nsubs;
+
 	LIST_ENTRY(vmm_client) list;
 };
 
@@ -199,9 +191,30 @@ static LIST_HEAD(client_list_struct, vmm_client) client_head;
 static int num_client = 0;
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static unsigned long long monitor_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void monitor_wakeup(void)
+{
+	uint64_t one = 1;
+
+	if (write(monitor_evfd, &one, sizeof(one)) < 0)
+		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+}
+
 static void vmm_client_free_res(struct vmm_client *client)
 {
-	mevent_delete(client->mev);
+	struct monitor_out *out;
+
+	while ((out = TAILQ_FIRST(&client->outq)) != NULL) {
+		TAILQ_REMOVE(&client->outq, out, link);
+		free(out);
+	}
 	close(client->fd);
 	client->fd = -1;
 	free(client->buf);
@@ -216,186 +229,503 @@ static void vmm_client_free(struct vmm_client *client)
 	num_client--;
 	pthread_mutex_unlock(&client_mutex);
 
+	fprintf(stderr, "Disconnect(%d)!\r\n", client->fd);
+	epoll_ctl(monitor_epfd, EPOLL_CTL_DEL, client->fd, NULL);
 	vmm_client_free_res(client);
 }
 
-static VMM_MSG_STR(unsupported_msgid, "Error: unsupported msgid!");
-
-static int monitor_parse_buf(struct vmm_client *client)
+/* client_mutex held */
+static void vmm_client_set_write(struct vmm_client *client, int on)
 {
-	struct vmm_msg *msg;
-	struct monitor_msg_handle *handle;
-	size_t p = 0;
-	int handled = 0;
+	struct epoll_event ee;
 
-	if (client->len < sizeof(struct vmm_msg))
-		return -1;
-	do {
-		msg = client->buf + p;
+	if (client->want_write == on)
+		return;
 
-		/* do we out-of-bounary? */
-		if (p + msg->len > client->len) {
-			fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-			break;
-		}
+	ee.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	ee.data.ptr = client;
+	if (epoll_ctl(monitor_epfd, EPOLL_CTL_MOD, client->fd, &ee) == 0)
+		client->want_write = on;
+}
 
-		LIST_FOREACH(handle, &mmh_head, list) {
-			if (msg->magic != VMM_MSG_MAGIC)
-				return -1;
-			if (handle->msg.msgid != msg->msgid)
-				continue;
-			client->sender.fd = client->fd;
-			handle->callback(msg, &client->sender, handle->priv);
-			handled = 1;
-			break;
+/* client_mutex held, send what the socket takes, 0 once the queue is empty */
+static int vmm_client_flush(struct vmm_client *client)
+{
+	struct monitor_out *out;
+	ssize_t ret;
+
+	while ((out = TAILQ_FIRST(&client->outq)) != NULL) {
+		ret = send(client->fd, out->data + out->off,
+			   out->len - out->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 1;
+			client->dead = 1;
+			return -1;
 		}
-		p += msg->len;
-	} while (p < client->len);
-
-	if (!handled)
-		write_msg_to(client->fd, &unsupported_msgid, TIMEOUT_USEC);
+		out->off += ret;
+		if (out->off < out->len)
+			return 1;
+		TAILQ_REMOVE(&client->outq, out, link);
+		client->outq_len--;
+		free(out);
+	}
 
 	return 0;
 }
 
-static void mevent_read_func(int fd, enum ev_type type, void *param)
+/* client_mutex held, queue whatever the queue length */
+static int vmm_client_push(struct vmm_client *client, const void *data,
+			   size_t len)
 {
-	struct vmm_client *client = param;
+	struct monitor_out *out;
 
-	client->len = read(fd, client->buf, VMM_MSG_MAX_LEN);
-	if (client->len <= 0) {
-		fprintf(stderr, "Disconnect(%d)!\r\n", client->fd);
-		vmm_client_free(client);
-		return;
-	}
+	if (client->dead)
+		return -1;
 
-	if (client->len == VMM_MSG_MAX_LEN) {
-		fprintf(stderr, "TODO: buf overflow!\r\n");
-		return;
+	out = malloc(sizeof(struct monitor_out) + len);
+	if (!out) {
+		client->dropped++;
+		return -1;
+	}
+	out->len = len;
+	out->off = 0;
+	memcpy(out->data, data, len);
+	TAILQ_INSERT_TAIL(&client->outq, out, link);
+	client->outq_len++;
+
+	/* try right away, the monitor thread sends the rest */
+	switch (vmm_client_flush(client)) {
+	case 1:
+		vmm_client_set_write(client, 1);
+		break;
+	case -1:
+		monitor_wakeup();
+		return -1;
 	}
 
-	monitor_parse_buf(client);
+	return 0;
 }
 
-static struct vmm_client *vmm_client_new(void)
+/* client_mutex held */
+static int vmm_client_queue(struct vmm_client *client, const void *data,
+			    size_t len)
 {
-	struct vmm_client *client;
-
-	client = calloc(1, sizeof(struct vmm_client));
-	if (!client) {
-		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		goto alloc_client;
+	if (client->outq_len >= MONITOR_OUTQ_LEN) {
+		client->dropped++;
+		return -1;
 	}
-	memset(client, 0, sizeof(struct vmm_client));
 
-	client->buf = calloc(1, VMM_MSG_MAX_LEN);
-	if (!client->buf) {
+	return vmm_client_push(client, data, len);
+}
+
+static int monitor_msg_check(struct vmm_msg *msg)
+{
+	if (msg->len < sizeof(struct vmm_msg) || msg->len > VMM_MSG_MAX_LEN) {
 		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		goto alloc_buf;
+		return -1;
 	}
 
-	client->addr_len = sizeof(client->addr);
-	client->fd =
-	    accept(monitor_fd, (struct sockaddr *)&client->addr, &client->addr_len);
-	if (client->fd < 0) {
+	if (msg->msgid > MSGID_MAX) {
 		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		goto accept_con;
+		return -1;
 	}
 
-	client->mev =
-	    mevent_add(client->fd, EVF_READ, mevent_read_func, client);
-	if (!client->mev) {
+	if (msg->magic != VMM_MSG_MAGIC) {
 		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		goto add_mev;
+		msg->magic = VMM_MSG_MAGIC;
 	}
 
+	msg->timestamp = time(NULL);
+	return 0;
+}
+
+int monitor_send(struct msg_sender *sender, struct vmm_msg *msg)
+{
+	struct vmm_client *client = (struct vmm_client *)sender;
+	int ret;
+
+	if (monitor_msg_check(msg))
+		return -1;
+
 	pthread_mutex_lock(&client_mutex);
-	LIST_INSERT_HEAD(&client_head, client, list);
-	num_client++;
+	ret = vmm_client_queue(client, msg, msg->len);
 	pthread_mutex_unlock(&client_mutex);
 
-	return client;
+	return ret;
+}
 
- add_mev:
-	close(client->fd);
-	client->fd = -1;
- accept_con:
-	free(client->buf);
-	client->buf = NULL;
- alloc_buf:
-	free(client);
- alloc_client:
-	return NULL;
+/*
+ * The whole reply is queued at once, so that it is never cut short half
+ * way. If the queue has no room for it, a single chunk marked
+ * VMM_CHUNK_DROPPED goes out instead, so the client still sees a last
+ * chunk.
+ */
+int monitor_send_chunks(struct msg_sender *sender, unsigned int msgid,
+			const char *data, size_t len)
+{
+	const size_t chunk = VMM_MSG_MAX_LEN - sizeof(struct vmm_msg_metrics);
+	struct vmm_client *client = (struct vmm_client *)sender;
+	struct vmm_msg_metrics *reply;
+	size_t off = 0, n, nchunks;
+	unsigned int seq = 0;
+	int ret = 0;
+
+	reply = malloc(VMM_MSG_MAX_LEN);
+	if (!reply)
+		return -1;
+
+	nchunks = len ? (len + chunk - 1) / chunk : 1;
+
+	pthread_mutex_lock(&client_mutex);
+	if (client->outq_len + nchunks > MONITOR_OUTQ_LEN) {
+		client->dropped += nchunks;
+		ret = -1;
+		goto drop;
+	}
+
+	do {
+		n = len - off < chunk ? len - off : chunk;
+		memset(reply, 0, sizeof(*reply));
+		reply->vmsg.magic = VMM_MSG_MAGIC;
+		reply->vmsg.msgid = msgid;
+		reply->vmsg.len = sizeof(*reply) + n;
+		reply->vmsg.timestamp = time(NULL);
+		reply->seq = seq++;
+		reply->last = (off + n == len);
+		memcpy(reply->data, data + off, n);
+		ret = vmm_client_push(client, reply, reply->vmsg.len);
+		if (ret < 0)
+			goto drop;
+		off += n;
+	} while (off < len);
+
+	pthread_mutex_unlock(&client_mutex);
+	free(reply);
+	return 0;
+
+drop:
+	/* the terminating chunk may go over the queue length */
+	memset(reply, 0, sizeof(*reply));
+	reply->vmsg.magic = VMM_MSG_MAGIC;
+	reply->vmsg.msgid = msgid;
+	reply->vmsg.len = sizeof(*reply);
+	reply->vmsg.timestamp = time(NULL);
+	reply->seq = seq;
+	reply->last = VMM_CHUNK_DROPPED;
+	vmm_client_push(client, reply, reply->vmsg.len);
+	pthread_mutex_unlock(&client_mutex);
+	free(reply);
+	return ret;
 }
 
 int monitor_broadcast(struct vmm_msg *msg)
 {
 	struct vmm_client *client;
-	fd_set wfd;
-	int max_fd = 0;
-	struct timeval timeout;
-	int ret = 0;
 
-	if (msg->len < sizeof(struct vmm_msg)) {
-		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+	if (monitor_msg_check(msg))
 		return -1;
+
+	pthread_mutex_lock(&client_mutex);
+	LIST_FOREACH(client, &client_head, list) {
+		if (!client->sender.broadcast)
+			continue;
+		vmm_client_queue(client, msg->payload,
+				 msg->len - sizeof(struct vmm_msg));
 	}
+	pthread_mutex_unlock(&client_mutex);
 
-	if (msg->msgid > MSGID_MAX) {
-		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		return -1;
+	return 0;
+}
+
+/* MSG_HANDSHAKE, handshake message handler*/
+static VMM_MSG_STR(handshake_badname, "Error: bad name!");
+static VMM_MSG_STR(handshake_ok, "acrn-dm read you request");
+
+static void handshake_acrn_dm(struct vmm_msg *msg, struct msg_sender *sender,
+			      void *priv)
+{
+	struct vmm_msg_handshake *hsk = (void *)msg;
+	int ret;
+
+	if (msg->len < sizeof(*hsk)) {
+		monitor_send(sender, &handshake_badname.vmsg);
+		return;
 	}
 
-	if (msg->magic != VMM_MSG_MAGIC) {
-		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
-		msg->magic = VMM_MSG_MAGIC;
+	ret = strnlen(hsk->name, CLIENT_NAME_LEN);
+	if (ret >= CLIENT_NAME_LEN) {
+		monitor_send(sender, &handshake_badname.vmsg);
+		return;
 	}
 
-	msg->timestamp = time(NULL);
+	memcpy(sender->name, hsk->name, ret + 1);
+	sender->broadcast = hsk->broadcast;
+
+	monitor_send(sender, &handshake_ok.vmsg);
+}
+
+static struct monitor_msg_handle handle_handshake = {
+	.msg = {.msgid = MSG_HANDSHAKE},
+	.callback = handshake_acrn_dm,
+};
+
+/* REQ_SUBSCRIBE, replay a request to its sender periodically */
+static VMM_MSG_STR(subscribe_ok, "subscribed");
+static VMM_MSG_STR(subscribe_bad, "Error: bad subscription!");
+
+static void subscribe_acrn_dm(struct vmm_msg *msg, struct msg_sender *sender,
+			      void *priv)
+{
+	struct vmm_msg_subscribe *req = (void *)msg;
+	struct vmm_client *client = (struct vmm_client *)sender;
+	struct monitor_sub *sub;
+	int i;
+
+	if (msg->len < sizeof(*req) || req->msgid == MSG_HANDSHAKE ||
+	    req->msgid == REQ_SUBSCRIBE || !monitor_find_handler(req->msgid))
+		goto bad;
+
+	for (i = 0; i < client->nsubs; i++)
+		if (client->subs[i].msgid == req->msgid)
+			break;
+
+	if (req->interval_ms == 0) {
+		/* cancel */
+		if (i < client->nsubs)
+			client->subs[i] = client->subs[--client->nsubs];
+		monitor_send(sender, &subscribe_ok.vmsg);
+		return;
+	}
+
+	if (i == client->nsubs) {
+		if (client->nsubs == MONITOR_MAX_SUBS)
+			goto bad;
+		client->nsubs++;
+	}
+	sub = &client->subs[i];
+	sub->msgid = req->msgid;
+	sub->interval_ms = req->interval_ms < MONITOR_MIN_INTERVAL ?
+			   MONITOR_MIN_INTERVAL : req->interval_ms;
+	sub->due_ms = monitor_now_ms();	/* first reply right away */
+	monitor_send(sender, &subscribe_ok.vmsg);
+	return;
+
+ bad:
+	monitor_send(sender, &subscribe_bad.vmsg);
+}
+
+static struct monitor_msg_handle handle_subscribe = {
+	.msg = {.msgid = REQ_SUBSCRIBE},
+	.callback = subscribe_acrn_dm,
+};
+
+static VMM_MSG_STR(unsupported_msgid, "Error: unsupported msgid!");
+
+static void monitor_dispatch(struct vmm_client *client, struct vmm_msg *msg)
+{
+	struct monitor_msg_handle *handle;
+
+	client->sender.fd = client->fd;
+	handle = monitor_find_handler(msg->msgid);
+	if (handle)
+		handle->callback(msg, &client->sender, handle->priv);
+	else
+		monitor_send(&client->sender, &unsupported_msgid.vmsg);
+}
+
+/* handle every complete message in the buffer, -1 on a protocol error */
+static int monitor_parse_buf(struct vmm_client *client)
+{
+	struct vmm_msg *msg = client->buf;
+	size_t len;
+
+	while (client->len >= sizeof(struct vmm_msg)) {
+		if (msg->magic != VMM_MSG_MAGIC ||
+		    msg->len < sizeof(struct vmm_msg) ||
+		    msg->len > VMM_MSG_MAX_LEN) {
+			fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+			return -1;
+		}
+
+		/* wait for the rest */
+		if (msg->len > client->len)
+			break;
+
+		len = msg->len;
+		monitor_dispatch(client, msg);
+
+		client->len -= len;
+		memmove(client->buf, client->buf + len, client->len);
+	}
+
+	return 0;
+}
+
+static void monitor_client_read(struct vmm_client *client)
+{
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(client->fd, client->buf + client->len,
+			   VMM_MSG_MAX_LEN - client->len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return;
+		if (ret <= 0) {
+			client->dead = 1;
+			return;
+		}
+
+		client->len += ret;
+		if (monitor_parse_buf(client)) {
+			client->dead = 1;
+			return;
+		}
+	}
+}
 
+static void monitor_client_write(struct vmm_client *client)
+{
 	pthread_mutex_lock(&client_mutex);
+	if (vmm_client_flush(client) == 0)
+		vmm_client_set_write(client, 0);
+	pthread_mutex_unlock(&client_mutex);
+}
 
-	FD_ZERO(&wfd);
-	LIST_FOREACH(client, &client_head, list) {
-		if (!client->sender.broadcast)
+static void monitor_accept(void)
+{
+	struct vmm_client *client;
+	struct epoll_event ee;
+
+	for (;;) {
+		client = calloc(1, sizeof(struct vmm_client));
+		if (!client) {
+			fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+			return;
+		}
+
+		client->buf = calloc(1, VMM_MSG_MAX_LEN);
+		if (!client->buf) {
+			fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+			free(client);
+			return;
+		}
+		TAILQ_INIT(&client->outq);
+
+		client->addr_len = sizeof(client->addr);
+		client->fd = accept4(monitor_fd,
+				     (struct sockaddr *)&client->addr,
+				     &client->addr_len,
+				     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client->fd < 0) {
+			if (errno != EAGAIN)
+				fprintf(stderr, "%s %d\r\n", __FUNCTION__,
+					__LINE__);
+			free(client->buf);
+			free(client);
+			return;
+		}
+		client->sender.fd = client->fd;
+
+		ee.events = EPOLLIN;
+		ee.data.ptr = client;
+		if (epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, client->fd, &ee)) {
+			fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+			vmm_client_free_res(client);
 			continue;
-		FD_SET(client->fd, &wfd);
-		if (client->fd > max_fd)
-			max_fd = client->fd;
+		}
+
+		pthread_mutex_lock(&client_mutex);
+		LIST_INSERT_HEAD(&client_head, client, list);
+		num_client++;
+		pthread_mutex_unlock(&client_mutex);
+
+		fprintf(stderr, "Connected:%d\r\n", client->fd);
 	}
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 10000;
-	select(max_fd + 1, NULL, &wfd, NULL, &timeout);
+}
 
+/*
+ * Replay the due subscriptions, return the ms until the next one is
+ * due or -1 if there is none.
+ */
+static int monitor_run_subs(void)
+{
+	struct vmm_client *client;
+	struct monitor_sub *sub;
+	struct vmm_msg req;
+	unsigned long long now, next = 0;
+	int i;
+
+	now = monitor_now_ms();
 	LIST_FOREACH(client, &client_head, list) {
-		if (!client->sender.broadcast)
-			continue;
-		if (FD_ISSET(client->fd, &wfd)) {
-			ret = write(client->fd, msg->payload,
-				    msg->len - sizeof(struct vmm_msg));
-			if (ret < 0)
-				continue;
+		for (i = 0; i < client->nsubs && !client->dead; i++) {
+			sub = &client->subs[i];
+			if (sub->due_ms <= now) {
+				memset(&req, 0, sizeof(req));
+				req.magic = VMM_MSG_MAGIC;
+				req.msgid = sub->msgid;
+				req.timestamp = time(NULL);
+				req.len = sizeof(req);
+				monitor_dispatch(client, &req);
+				sub->due_ms = now + sub->interval_ms;
+			}
+			if (!next || sub->due_ms < next)
+				next = sub->due_ms;
 		}
 	}
 
-	pthread_mutex_unlock(&client_mutex);
-	return 0;
+	return next ? (int)(next - now) : -1;
 }
 
 /* monitor thread */
-static int monitor_running = 1;
+static volatile int monitor_running;
 static pthread_t monitor_thread;
 
 static void *monitor_server_func(void *arg)
 {
-	struct vmm_client *client;
+	struct epoll_event events[MONITOR_MAX_EVENTS];
+	struct vmm_client *client, *tmp;
+	uint64_t cnt;
+	int i, n, timeout;
+
+	timeout = -1;
 	while (monitor_running) {
-		client = vmm_client_new();
-		if (!client) {
-			usleep(10000);
-			continue;
+		n = epoll_wait(monitor_epfd, events, MONITOR_MAX_EVENTS,
+			       timeout);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+			break;
 		}
-		fprintf(stderr, "Connected:%d\r\n", client->fd);
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &monitor_fd) {
+				monitor_accept();
+				continue;
+			}
+			if (events[i].data.ptr == &monitor_evfd) {
+				if (read(monitor_evfd, &cnt, sizeof(cnt)) < 0)
+					continue;
+				continue;
+			}
+
+			client = events[i].data.ptr;
+			if (client->dead)
+				continue;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				monitor_client_read(client);
+			if (!client->dead && (events[i].events & EPOLLOUT))
+				monitor_client_write(client);
+		}
+
+		/* subscriptions are served from here, see monitor_run_subs() */
+		timeout = monitor_run_subs();
+
+		/* only this thread frees clients, others just mark them */
+		list_foreach_safe(client, &client_head, list, tmp)
+			if (client->dead)
+				vmm_client_free(client);
 	}
 
 	fprintf(stderr, "%s quit!\r\n", __FUNCTION__);
@@ -405,7 +735,8 @@ static void *monitor_server_func(void *arg)
 int monitor_init(struct vmctx *ctx)
 {
 	int ret;
-	char path[128] = { };
+	char *path = monitor_addr.sun_path;
+	struct epoll_event ee;
 
 	ret = system("mkdir -p /run/acrn/");
 	if (ret) {
@@ -413,37 +744,65 @@ int monitor_init(struct vmctx *ctx)
 		goto socket_err;
 	}
 	memset(&monitor_addr, 0, sizeof(monitor_addr));
-	snprintf(path, sizeof(path), "/run/acrn/%s-monitor.socket", vmname);
+	monitor_addr.sun_family = AF_UNIX;
+	snprintf(path, sizeof(monitor_addr.sun_path),
+		 "/run/acrn/%s-monitor.socket", vmname);
 	unlink(path);
-	monitor_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	monitor_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    0);
 	if (monitor_fd < 0) {
 		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
 		goto socket_err;
 	}
 
-	monitor_addr.sun_family = AF_UNIX;
-	strncpy(monitor_addr.sun_path, path, sizeof(monitor_addr.sun_path));
 	ret = bind(monitor_fd, (struct sockaddr *)&monitor_addr, sizeof(monitor_addr));
 	if (ret < 0) {
 		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
 		goto bind_err;
 	}
 
-	listen(monitor_fd, 1);
+	listen(monitor_fd, 16);
+
+	monitor_epfd = epoll_create1(EPOLL_CLOEXEC);
+	monitor_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (monitor_epfd < 0 || monitor_evfd < 0) {
+		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+		goto epoll_err;
+	}
+
+	ee.events = EPOLLIN;
+	ee.data.ptr = &monitor_fd;
+	ret = epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, monitor_fd, &ee);
+	ee.data.ptr = &monitor_evfd;
+	ret |= epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, monitor_evfd, &ee);
+	if (ret) {
+		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
+		goto epoll_err;
+	}
+
+	monitor_running = 1;
 	ret = pthread_create(&monitor_thread, NULL, monitor_server_func, NULL);
 	if (ret) {
 		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
 		goto thread_err;
 	}
+	pthread_setname_np(monitor_thread, "monitor");
 
 	/* Messages handled by monitor */
 	monitor_add_handler(&handle_handshake);
+	monitor_add_handler(&handle_subscribe);
 
 	__sync_fetch_and_add(&can_register_handler, 1);
 	return 0;
 
  thread_err:
 	monitor_thread = 0;
+ epoll_err:
+	if (monitor_evfd >= 0)
+		close(monitor_evfd);
+	if (monitor_epfd >= 0)
+		close(monitor_epfd);
+	monitor_evfd = monitor_epfd = -1;
 	unlink(path);
  bind_err:
 	close(monitor_fd);
@@ -453,20 +812,27 @@ int monitor_init(struct vmctx *ctx)
 
 void monitor_close(void)
 {
-	struct vmm_client *client;
+	struct vmm_client *client, *tmp;
+
 	if (!monitor_thread)
 		return;
-	shutdown(monitor_fd, SHUT_RDWR);
-	close(monitor_fd);
 	monitor_running = 0;
+	monitor_wakeup();
 	pthread_join(monitor_thread, NULL);
+	monitor_thread = 0;
+
+	close(monitor_fd);
 	unlink(monitor_addr.sun_path);
 
-	/* client buf-mem and fd may be still in use by msg-handler */
-	/* which is handled by mevent */
 	pthread_mutex_lock(&client_mutex);
-	LIST_FOREACH(client, &client_head, list) {
+	list_foreach_safe(client, &client_head, list, tmp) {
+		LIST_REMOVE(client, list);
 		vmm_client_free_res(client);
 	}
+	num_client = 0;
 	pthread_mutex_unlock(&client_mutex);
+
+	close(monitor_evfd);
+	close(monitor_epfd);
+	monitor_evfd = monitor_epfd = -1;
 }
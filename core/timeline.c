@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "monitor.h"
+#include "timeline.h"
+
+struct timeline_event {
+	char		name[TIMELINE_NAME_LEN];
+	uint64_t	start;		/* ns since timeline_init */
+	uint64_t	end;		/* 0 while the phase is running */
+};
+
+static struct timeline_event events[TIMELINE_MAX_EVENTS];
+static int nevents;
+static int ndropped;
+static uint64_t t0;
+static pthread_mutex_t timeline_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+timeline_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void
+timeline_init(void)
+{
+	t0 = timeline_now();
+}
+
+/* Forget the phases of the previous boot, the clock keeps running */
+void
+timeline_reset(void)
+{
+	pthread_mutex_lock(&timeline_mtx);
+	nevents = 0;
+	ndropped = 0;
+	pthread_mutex_unlock(&timeline_mtx);
+}
+
+/*
+ * Start a phase, returns the id to pass to timeline_end(). Phases may
+ * nest and may run on any thread. Once the table is full new phases
+ * are only counted.
+ */
+int
+timeline_begin(const char *fmt, ...)
+{
+	struct timeline_event *ev;
+	va_list ap;
+	int id;
+
+	pthread_mutex_lock(&timeline_mtx);
+	if (nevents >= TIMELINE_MAX_EVENTS) {
+		ndropped++;
+		pthread_mutex_unlock(&timeline_mtx);
+		return -1;
+	}
+	id = nevents++;
+	ev = &events[id];
+	va_start(ap, fmt);
+	vsnprintf(ev->name, sizeof(ev->name), fmt, ap);
+	va_end(ap);
+	ev->end = 0;
+	ev->start = timeline_now() - t0;
+	pthread_mutex_unlock(&timeline_mtx);
+
+	return id;
+}
+
+void
+timeline_end(int id)
+{
+	uint64_t now = timeline_now() - t0;
+
+	if (id < 0 || id >= TIMELINE_MAX_EVENTS)
+		return;
+
+	pthread_mutex_lock(&timeline_mtx);
+	events[id].end = now;
+	pthread_mutex_unlock(&timeline_mtx);
+}
+
+/* Write 's' as a quoted JSON string */
+static void
+timeline_put_str(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/* Times are in microseconds, a running phase has no "duration_us" */
+int
+timeline_dump(FILE *fp)
+{
+	struct timeline_event *ev;
+	int i;
+
+	pthread_mutex_lock(&timeline_mtx);
+	fprintf(fp, "{\"vm\":");
+	timeline_put_str(fp, vmname ? vmname : "");
+	fprintf(fp, ",\"dropped\":%d,\"events\":[", ndropped);
+	for (i = 0; i < nevents; i++) {
+		ev = &events[i];
+		fprintf(fp, "%s\n{\"name\":", i ? "," : "");
+		timeline_put_str(fp, ev->name);
+		fprintf(fp, ",\"start_us\":%lu", ev->start / 1000);
+		if (ev->end)
+			fprintf(fp, ",\"duration_us\":%lu",
+				(ev->end - ev->start) / 1000);
+		fputc('}', fp);
+	}
+	fprintf(fp, "]}\n");
+	pthread_mutex_unlock(&timeline_mtx);
+
+	return ferror(fp) ? -1 : 0;
+}
+
+int
+timeline_write(const char *path)
+{
+	FILE *fp;
+	int err;
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "timeline: cannot open %s\n", path);
+		return -1;
+	}
+
+	err = timeline_dump(fp);
+	if (fclose(fp) != 0)
+		err = -1;
+
+	return err;
+}
+
+/* REQ_TIMELINE, the JSON text goes out in struct vmm_msg_metrics chunks */
+static void
+timeline_monitor_query(struct vmm_msg *msg, struct msg_sender *sender,
+		       void *priv)
+{
+	char *json = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	fp = open_memstream(&json, &len);
+	if (fp == NULL)
+		return;
+	timeline_dump(fp);
+	fclose(fp);
+
+	if (monitor_send_chunks(sender, REQ_TIMELINE, json, len) < 0)
+		fprintf(stderr, "timeline: reply failed\n");
+	free(json);
+}
+
+/* handlers outlive monitor_close(), register only once across resets */
+int
+timeline_monitor_init(void)
+{
+	struct vmm_msg msg = { .msgid = REQ_TIMELINE };
+	static bool registered;
+
+	if (registered)
+		return 0;
+
+	if (monitor_register_handler(&msg, timeline_monitor_query, NULL))
+		return -1;
+
+	registered = true;
+	return 0;
+}
@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dm.h"
+#include "mevent.h"
+#include "monitor.h"
+#include "tracepoint.h"
+
+/* trigger socket of acrntrace in flight recorder mode, see acrntrace -f */
+#define ACRNTRACE_FLIGHT_SOCK	"/run/acrn/acrntrace.socket"
+
+uint32_t tracepoint_mask;
+__thread struct tp_ring *tp_ring;
+
+static const char * const tracepoint_name[TRACEPOINT_MAX] = {
+	[TP_VMEXIT]		= "vmexit",
+	[TP_VQ_NOTIFY]		= "vq_notify",
+	[TP_VQ_ENDCHAINS]	= "vq_endchains",
+	[TP_BLOCKIF_ENQUEUE]	= "blockif_enqueue",
+	[TP_BLOCKIF_DEQUEUE]	= "blockif_dequeue",
+	[TP_BLOCKIF_COMPLETE]	= "blockif_complete",
+	[TP_INTR_MSI]		= "intr_msi",
+	[TP_INTR_LINE]		= "intr_line",
+	[TP_MEVENT]		= "mevent",
+};
+
+/* rings of all threads that ever hit an enabled tracepoint */
+static LIST_HEAD(, tp_ring) tp_rings = LIST_HEAD_INITIALIZER(tp_rings);
+static pthread_mutex_t tp_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tp_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tp_key;
+
+/* TSC and CLOCK_MONOTONIC when tracing was enabled, to scale the TSC */
+static uint64_t tp_ref_tsc;
+static uint64_t tp_ref_ns;
+
+/* records overwritten before a drain got them */
+static uint64_t tp_lost;
+
+static uint64_t
+tp_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* the thread exits, its ring goes once drained */
+static void
+tp_ring_exit(void *arg)
+{
+	struct tp_ring *r = arg;
+
+	__atomic_store_n(&r->tid, 0, __ATOMIC_RELEASE);
+}
+
+static void
+tp_key_init(void)
+{
+	pthread_key_create(&tp_key, tp_ring_exit);
+}
+
+struct tp_ring *
+tp_ring_init(void)
+{
+	struct tp_ring *r;
+
+	pthread_once(&tp_once, tp_key_init);
+
+	if (posix_memalign((void **)&r, 64, sizeof(*r))) {
+		/* do not try again on every tracepoint */
+		__atomic_store_n(&tracepoint_mask, 0, __ATOMIC_RELAXED);
+		fprintf(stderr, "%s: no memory, tracing disabled\n", __func__);
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&tp_mtx);
+	LIST_INSERT_HEAD(&tp_rings, r, list);
+	pthread_mutex_unlock(&tp_mtx);
+
+	pthread_setspecific(tp_key, r);
+	tp_ring = r;
+	return r;
+}
+
+/* "all" or names separated by ',', 0 on success */
+int
+tracepoint_parse(const char *list, uint32_t *mask)
+{
+	char *buf, *name, *save;
+	int i, err = 0;
+
+	*mask = 0;
+	if (!strcmp(list, "all")) {
+		*mask = (1U << TRACEPOINT_MAX) - 1;
+		return 0;
+	}
+
+	buf = strdup(list);
+	if (!buf)
+		return -1;
+
+	for (name = strtok_r(buf, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < TRACEPOINT_MAX; i++)
+			if (!strcmp(name, tracepoint_name[i]))
+				break;
+		if (i == TRACEPOINT_MAX) {
+			fprintf(stderr, "unknown tracepoint %s\n", name);
+			err = -1;
+			break;
+		}
+		*mask |= 1U << i;
+	}
+
+	free(buf);
+	return err;
+}
+
+void
+tracepoint_enable(uint32_t mask)
+{
+	mask &= (1U << TRACEPOINT_MAX) - 1;
+
+	pthread_mutex_lock(&tp_mtx);
+	if (!tracepoint_mask && mask) {
+		tp_ref_tsc = __builtin_ia32_rdtsc();
+		tp_ref_ns = tp_now_ns();
+	}
+	__atomic_store_n(&tracepoint_mask, mask, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&tp_mtx);
+}
+
+/* records of one ring taken for a drain */
+struct tp_snap {
+	struct tp_ring	*ring;
+	struct tp_record *rec;
+	uint64_t	first;		/* index of rec[0] in the ring */
+	uint64_t	n;
+	uint64_t	pos;		/* next one to merge */
+};
+
+/*
+ * Copy what ring recorded since the last drain. The owner may lap us
+ * while copying, so whatever it may have overwritten meanwhile, seen
+ * from the head after the copy, is dropped as lost.
+ */
+static int
+tp_snap_ring(struct tp_snap *s, struct tp_ring *r)
+{
+	uint64_t head, end, first, i;
+
+	end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	first = r->drained;
+	if (end - first > TP_RING_SIZE)
+		first = end - TP_RING_SIZE;
+
+	s->ring = r;
+	s->pos = 0;
+	s->n = 0;
+	s->rec = malloc((end - first) * sizeof(struct tp_record));
+	if (end > first && !s->rec)
+		return -1;
+
+	for (i = first; i < end; i++)
+		s->rec[i - first] = r->rec[i & (TP_RING_SIZE - 1)];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	if (head >= TP_RING_SIZE && head - TP_RING_SIZE + 1 > first) {
+		i = head - TP_RING_SIZE + 1;
+		if (i > end)
+			i = end;
+		memmove(s->rec, s->rec + (i - first),
+			(end - i) * sizeof(struct tp_record));
+		first = i;
+	}
+
+	tp_lost += first - r->drained;
+	s->first = first;
+	s->n = end - first;
+	return 0;
+}
+
+/*
+ * Write at most TRACE_DRAIN_MAX records out of all rings in TSC order.
+ * Every ring is in order already, so a plain merge over the heads does,
+ * the rings are few. Records not taken stay for the next drain.
+ */
+static void
+tracepoint_drain(FILE *fp)
+{
+	struct tp_snap *snap = NULL, *s, *min;
+	struct tp_ring *r, *tmp;
+	struct tp_record *rec;
+	uint64_t now_tsc, now_ns, hz = 0, ns;
+	int i, n = 0, count;
+	char *out = NULL;
+	size_t len = 0;
+	FILE *body;
+	bool more;
+
+	body = open_memstream(&out, &len);
+	if (!body)
+		return;
+
+	pthread_mutex_lock(&tp_mtx);
+	now_tsc = __builtin_ia32_rdtsc();
+	now_ns = tp_now_ns();
+	if (now_ns > tp_ref_ns)
+		hz = (now_tsc - tp_ref_tsc) * 1000000000.0 /
+			(now_ns - tp_ref_ns);
+
+	LIST_FOREACH(r, &tp_rings, list)
+		n++;
+	snap = calloc(n ? n : 1, sizeof(*snap));
+	n = 0;
+	if (snap)
+		LIST_FOREACH(r, &tp_rings, list)
+			if (!tp_snap_ring(&snap[n], r))
+				n++;
+
+	for (count = 0; count < TRACE_DRAIN_MAX; count++) {
+		min = NULL;
+		for (i = 0; i < n; i++) {
+			s = &snap[i];
+			if (s->pos < s->n && (!min || s->rec[s->pos].tsc <
+					      min->rec[min->pos].tsc))
+				min = s;
+		}
+		if (!min)
+			break;
+
+		rec = &min->rec[min->pos++];
+		ns = hz ? (rec->tsc - tp_ref_tsc) * 1000000000.0 / hz : 0;
+		fprintf(body, "%lu %lu %u %s %#lx %#lx\n", rec->tsc, ns,
+			rec->tid, rec->id < TRACEPOINT_MAX ?
+			tracepoint_name[rec->id] : "unknown",
+			rec->arg[0], rec->arg[1]);
+	}
+
+	more = false;
+	for (i = 0; i < n; i++) {
+		s = &snap[i];
+		s->ring->drained = s->first + s->pos;
+		if (s->pos < s->n)
+			more = true;
+		free(s->rec);
+	}
+	free(snap);
+
+	/* rings of gone threads are freed once nothing is left in them */
+	list_foreach_safe(r, &tp_rings, list, tmp) {
+		if (__atomic_load_n(&r->tid, __ATOMIC_ACQUIRE) ||
+		    r->drained != r->head)
+			continue;
+		LIST_REMOVE(r, list);
+		free(r);
+	}
+
+	fprintf(fp, "# tsc_hz %lu lost %lu more %d\n", hz, tp_lost, more);
+	tp_lost = 0;
+	pthread_mutex_unlock(&tp_mtx);
+
+	fclose(body);
+	fwrite(out, 1, len, fp);
+	free(out);
+}
+
+/*
+ * Ask acrntrace to dump its flight recorder. The datagram text is logged
+ * by acrntrace as the reason of the dump.
+ */
+static void
+tracepoint_flight(FILE *fp, const char *reason)
+{
+	struct sockaddr_un addr;
+	char buf[64];
+	int fd, len;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, ACRNTRACE_FLIGHT_SOCK,
+		sizeof(addr.sun_path) - 1);
+	len = snprintf(buf, sizeof(buf), "%s: %s", vmname,
+		       reason[0] ? reason : "monitor request");
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || sendto(fd, buf, len, MSG_DONTWAIT,
+			     (struct sockaddr *)&addr, sizeof(addr)) != len)
+		fprintf(fp, "no flight recorder at %s: %s\n",
+			ACRNTRACE_FLIGHT_SOCK, strerror(errno));
+	else
+		fprintf(fp, "flight recorder dump requested\n");
+	if (fd >= 0)
+		close(fd);
+}
+
+/* REQ_TRACE, see struct vmm_msg_trace */
+static void
+tracepoint_monitor_req(struct vmm_msg *msg, struct msg_sender *sender,
+		       void *priv)
+{
+	struct vmm_msg_trace *req = (struct vmm_msg_trace *)msg;
+	char *dump = NULL;
+	size_t len = 0;
+	uint32_t mask;
+	FILE *fp;
+	int i;
+
+	if (msg->len < sizeof(*req))
+		return;
+
+	fp = open_memstream(&dump, &len);
+	if (fp == NULL)
+		return;
+
+	if (req->op == TRACE_OP_DRAIN)
+		tracepoint_drain(fp);
+	else if (req->op == TRACE_OP_FLIGHT) {
+		req->tracepoints[sizeof(req->tracepoints) - 1] = 0;
+		tracepoint_flight(fp, req->tracepoints);
+	} else if (req->op == TRACE_OP_ENABLE) {
+		req->tracepoints[sizeof(req->tracepoints) - 1] = 0;
+		if (!req->tracepoints[0])
+			tracepoint_enable(0);
+		else if (!tracepoint_parse(req->tracepoints, &mask))
+			tracepoint_enable(mask);
+		else
+			fprintf(fp, "invalid tracepoints %s\n",
+				req->tracepoints);
+		mask = __atomic_load_n(&tracepoint_mask, __ATOMIC_RELAXED);
+		fprintf(fp, "tracepoints enabled:");
+		for (i = 0; i < TRACEPOINT_MAX; i++)
+			if (mask & (1U << i))
+				fprintf(fp, " %s", tracepoint_name[i]);
+		fprintf(fp, "%s\n", mask ? "" : " none");
+	} else
+		fprintf(fp, "unknown op %u\n", req->op);
+	fclose(fp);
+
+	if (monitor_send_chunks(sender, REQ_TRACE, dump, len) < 0)
+		fprintf(stderr, "trace: reply failed\n");
+	free(dump);
+}
+
+/* handlers outlive monitor_close(), register only once across resets */
+int
+tracepoint_monitor_init(void)
+{
+	struct vmm_msg msg = { .msgid = REQ_TRACE };
+	static bool registered;
+
+	if (registered)
+		return 0;
+
+	if (monitor_register_handler(&msg, tracepoint_monitor_req, NULL))
+		return -1;
+
+	registered = true;
+	return 0;
+}
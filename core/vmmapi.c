@@ -55,6 +55,7 @@
 
 #include "vmmapi.h"
 #include "mevent.h"
+#include "tracepoint.h"
 
 #include "dm.h"
 
@@ -172,6 +173,46 @@ err:
 	return NULL;
 }
 
+/*
+ * Take over a VM which is already running under another DM process, see
+ * handover.c. 'fd' is that DM's VHM device fd passed over to us.
+ */
+struct vmctx *
+vm_adopt(const char *name, int fd, int vmid)
+{
+	struct vmctx *ctx;
+	int error;
+
+	ctx = calloc(1, sizeof(struct vmctx) + strlen(name) + 1);
+	assert(ctx != NULL);
+	assert(devfd == -1);
+
+	if (check_api(fd) < 0)
+		goto err;
+
+	if (guest_uuid_str == NULL)
+		guest_uuid_str = "d2795438-25d6-11e8-864e-cb7a18b34643";
+
+	error = uuid_parse(guest_uuid_str, ctx->vm_uuid);
+	if (error != 0)
+		goto err;
+
+	devfd = fd;
+	ctx->fd = fd;
+	ctx->vmid = vmid;
+	ctx->adopted = 1;
+	ctx->memflags = 0;
+	ctx->lowmem_limit = 2 * GB;
+	ctx->name = (char *)(ctx + 1);
+	strcpy(ctx->name, name);
+
+	return ctx;
+
+err:
+	free(ctx);
+	return NULL;
+}
+
 void
 vm_close(struct vmctx *ctx)
 {
@@ -330,6 +371,22 @@ vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	return ioctl(ctx->fd, IC_SET_MEMSEG, &memmap);
 }
 
+int
+vm_unmap_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+	uint64_t vma, int prot)
+{
+	struct vm_memmap memmap;
+
+	bzero(&memmap, sizeof(struct vm_memmap));
+	memmap.type = VM_MEMMAP_SYSMEM;
+	memmap.using_vma = 1;
+	memmap.vma_base = vma;
+	memmap.len = len;
+	memmap.gpa = gpa;
+	memmap.prot = prot;
+	return ioctl(ctx->fd, IC_UNSET_MEMSEG, &memmap);
+}
+
 static int
 vm_alloc_set_memseg(struct vmctx *ctx, int segid, size_t len,
 		vm_paddr_t gpa, int prot, char *base, char **ptr)
@@ -339,21 +396,24 @@ vm_alloc_set_memseg(struct vmctx *ctx, int segid, size_t len,
 	int error, flags;
 
 	if (segid == VM_MEMMAP_SYSMEM) {
-		bzero(&memseg, sizeof(struct vm_memseg));
-		memseg.len = len;
-		memseg.gpa = gpa;
-		error = ioctl(ctx->fd, IC_ALLOC_MEMSEG, &memseg);
-		if (error)
-			return error;
-
-		bzero(&memmap, sizeof(struct vm_memmap));
-		memmap.type = segid;
-		memmap.len = len;
-		memmap.gpa = gpa;
-		memmap.prot = PROT_ALL;
-		error = ioctl(ctx->fd, IC_SET_MEMSEG, &memmap);
-		if (error)
-			return error;
+		/* an adopted VM keeps the memory its previous DM set up */
+		if (!ctx->adopted) {
+			bzero(&memseg, sizeof(struct vm_memseg));
+			memseg.len = len;
+			memseg.gpa = gpa;
+			error = ioctl(ctx->fd, IC_ALLOC_MEMSEG, &memseg);
+			if (error)
+				return error;
+
+			bzero(&memmap, sizeof(struct vm_memmap));
+			memmap.type = segid;
+			memmap.len = len;
+			memmap.gpa = gpa;
+			memmap.prot = PROT_ALL;
+			error = ioctl(ctx->fd, IC_SET_MEMSEG, &memmap);
+			if (error)
+				return error;
+		}
 
 		flags = MAP_SHARED | MAP_FIXED;
 		if ((ctx->memflags & VM_MEM_F_INCORE) == 0)
@@ -559,6 +619,7 @@ vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg)
 	bzero(&msi, sizeof(msi));
 	msi.msi_addr = addr;
 	msi.msi_data = msg;
+	TRACEPOINT(TP_INTR_MSI, addr, msg);
 
 	return ioctl(ctx->fd, IC_INJECT_MSI, &msi);
 }
@@ -571,6 +632,7 @@ vm_ioapic_assert_irq(struct vmctx *ctx, int irq)
 	bzero(&ioapic_irq, sizeof(ioapic_irq));
 	ioapic_irq.intr_type = ACRN_INTR_TYPE_IOAPIC;
 	ioapic_irq.ioapic_irq = irq;
+	TRACEPOINT(TP_INTR_LINE, irq, 1);
 
 	return ioctl(ctx->fd, IC_ASSERT_IRQLINE, &ioapic_irq);
 }
@@ -583,6 +645,7 @@ vm_ioapic_deassert_irq(struct vmctx *ctx, int irq)
 	bzero(&ioapic_irq, sizeof(ioapic_irq));
 	ioapic_irq.intr_type = ACRN_INTR_TYPE_IOAPIC;
 	ioapic_irq.ioapic_irq = irq;
+	TRACEPOINT(TP_INTR_LINE, irq, 0);
 
 	return ioctl(ctx->fd, IC_DEASSERT_IRQLINE, &ioapic_irq);
 }
@@ -596,6 +659,8 @@ vm_isa_irq(struct vmctx *ctx, int irq, int ioapic_irq, unsigned long call_id)
 	isa_irq.intr_type = ACRN_INTR_TYPE_ISA;
 	isa_irq.pic_irq = irq;
 	isa_irq.ioapic_irq = ioapic_irq;
+	TRACEPOINT(TP_INTR_LINE, ioapic_irq, call_id == IC_ASSERT_IRQLINE ? 1 :
+		   call_id == IC_DEASSERT_IRQLINE ? 0 : 2);
 
 	return ioctl(ctx->fd, call_id, &isa_irq);
 }
@@ -0,0 +1,866 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dm.h"
+#include "gc.h"
+#include "console.h"
+#include "vnc.h"
+
+#define VNC_DEF_HOST		"127.0.0.1"
+#define VNC_DEF_FPS		30
+
+/* the image is compared and sent in tiles of VNC_TILE x VNC_TILE */
+#define VNC_TILE		64
+#define VNC_OBUF_SIZE		(256 * 1024)
+
+#define RFB_VERSION		"RFB 003.008\n"
+#define RFB_VERSION_LEN		12
+
+#define RFB_SEC_NONE		1
+
+#define RFB_SET_PIXEL_FORMAT	0
+#define RFB_SET_ENCODINGS	2
+#define RFB_FB_UPDATE_REQ	3
+#define RFB_KEY_EVENT		4
+#define RFB_POINTER_EVENT	5
+#define RFB_CLIENT_CUT_TEXT	6
+
+#define RFB_FB_UPDATE		0
+
+#define RFB_ENC_RAW		0
+#define RFB_ENC_RRE		2
+#define RFB_ENC_ZLIB		6
+#define RFB_ENC_DESKTOP_SIZE	-223
+
+struct rfb_pixfmt {
+	uint8_t		bpp;
+	uint8_t		depth;
+	uint8_t		bigendian;
+	uint8_t		truecolor;
+	uint16_t	red_max;
+	uint16_t	green_max;
+	uint16_t	blue_max;
+	uint8_t		red_shift;
+	uint8_t		green_shift;
+	uint8_t		blue_shift;
+	uint8_t		pad[3];
+} __attribute__((packed));
+
+/* the console image holds 0x00RRGGBB pixels in host (little) endian */
+static const struct rfb_pixfmt vnc_native_pixfmt = {
+	.bpp = 32,
+	.depth = 24,
+	.truecolor = 1,
+	.red_max = 255,
+	.green_max = 255,
+	.blue_max = 255,
+	.red_shift = 16,
+	.green_shift = 8,
+	.blue_shift = 0,
+};
+
+struct vnc_client {
+	int		fd;
+
+	/* pixel format and encodings the client asked for */
+	struct rfb_pixfmt pixfmt;
+	bool		native;
+	bool		enc_rre;
+	bool		enc_zlib;
+	bool		enc_resize;
+
+	/* a FramebufferUpdateRequest waits for changes to send */
+	bool		update_pending;
+	bool		update_full;
+	uint64_t	next_scan;
+	unsigned long	fb_seq;		/* console_fb_seq() last scanned */
+
+	/* copy of the image as the client has it */
+	int		width;
+	int		height;
+	uint32_t	*shadow;
+	uint8_t		*dirty;
+
+	uint32_t	tile[VNC_TILE * VNC_TILE];
+
+	z_stream	zs;
+	bool		zs_init;
+	uint8_t		*zbuf;
+	size_t		zsize;
+
+	uint8_t		*obuf;
+	size_t		olen;
+};
+
+static struct {
+	char		host[64];
+	char		port[8];
+	int		fps;
+
+	int		lfd;
+	int		cfd;
+	pthread_t	tid;
+	bool		started;
+	volatile bool	quit;
+} vnc = {
+	.lfd = -1,
+	.cfd = -1,
+};
+
+static uint64_t
+vnc_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+vnc_read(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+vnc_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+vnc_flush(struct vnc_client *c)
+{
+	int ret;
+
+	ret = vnc_write(c->fd, c->obuf, c->olen);
+	c->olen = 0;
+	return ret;
+}
+
+/*
+ * Messages are assembled in obuf and written out once it fills up or
+ * the update is complete, so a frame costs a few large writes.
+ */
+static int
+vnc_put(struct vnc_client *c, const void *data, size_t len)
+{
+	if (c->olen + len > VNC_OBUF_SIZE) {
+		if (vnc_flush(c))
+			return -1;
+		if (len > VNC_OBUF_SIZE)
+			return vnc_write(c->fd, data, len);
+	}
+	memcpy(c->obuf + c->olen, data, len);
+	c->olen += len;
+	return 0;
+}
+
+static int
+vnc_put_u8(struct vnc_client *c, uint8_t v)
+{
+	return vnc_put(c, &v, sizeof(v));
+}
+
+static int
+vnc_put_u16(struct vnc_client *c, uint16_t v)
+{
+	v = htons(v);
+	return vnc_put(c, &v, sizeof(v));
+}
+
+static int
+vnc_put_u32(struct vnc_client *c, uint32_t v)
+{
+	v = htonl(v);
+	return vnc_put(c, &v, sizeof(v));
+}
+
+static int
+vnc_put_rect(struct vnc_client *c, int x, int y, int w, int h, int32_t enc)
+{
+	if (vnc_put_u16(c, x) || vnc_put_u16(c, y) ||
+	    vnc_put_u16(c, w) || vnc_put_u16(c, h))
+		return -1;
+	return vnc_put_u32(c, (uint32_t)enc);
+}
+
+static uint32_t
+vnc_pixel(struct vnc_client *c, uint32_t p)
+{
+	struct rfb_pixfmt *pf = &c->pixfmt;
+	uint32_t v;
+
+	if (c->native)
+		return p;
+
+	v = (((p >> 16) & 0xff) * pf->red_max / 255) << pf->red_shift;
+	v |= (((p >> 8) & 0xff) * pf->green_max / 255) << pf->green_shift;
+	v |= ((p & 0xff) * pf->blue_max / 255) << pf->blue_shift;
+	return pf->bigendian ? __builtin_bswap32(v) : v;
+}
+
+/*
+ * Compare a tile of the image against the shadow copy. This runs over
+ * the whole image for every update, so it is done 4 pixels at a time
+ * and a row is only checked once all of it has been compared.
+ */
+static bool
+vnc_tile_changed(const uint32_t *img, const uint32_t *shadow, int stride,
+		 int w, int h)
+{
+	const uint32_t *a, *b;
+	int x, y;
+
+	for (y = 0; y < h; y++) {
+		a = img + y * stride;
+		b = shadow + y * stride;
+		x = 0;
+#ifdef __SSE2__
+		{
+			__m128i eq = _mm_set1_epi32(-1);
+			__m128i va, vb;
+
+			for (; x + 4 <= w; x += 4) {
+				va = _mm_loadu_si128((const __m128i *)(a + x));
+				vb = _mm_loadu_si128((const __m128i *)(b + x));
+				eq = _mm_and_si128(eq, _mm_cmpeq_epi32(va, vb));
+			}
+			if (_mm_movemask_epi8(eq) != 0xffff)
+				return true;
+		}
+#endif
+		for (; x < w; x++)
+			if (a[x] != b[x])
+				return true;
+	}
+	return false;
+}
+
+static void
+vnc_tile_copy(uint32_t *dst, const uint32_t *src, int stride, int w, int h)
+{
+	int y;
+
+	for (y = 0; y < h; y++)
+		memcpy(dst + y * stride, src + y * stride,
+		       w * sizeof(uint32_t));
+}
+
+static int
+vnc_send_zlib(struct vnc_client *c, int x, int y, int w, int h)
+{
+	size_t out = 0;
+	int err;
+
+	c->zs.next_in = (Bytef *)c->tile;
+	c->zs.avail_in = w * h * sizeof(uint32_t);
+	do {
+		if (out == c->zsize) {
+			c->zbuf = realloc(c->zbuf, c->zsize * 2);
+			if (c->zbuf == NULL)
+				return -1;
+			c->zsize *= 2;
+		}
+		c->zs.next_out = c->zbuf + out;
+		c->zs.avail_out = c->zsize - out;
+		err = deflate(&c->zs, Z_SYNC_FLUSH);
+		if (err != Z_OK && err != Z_BUF_ERROR)
+			return -1;
+		out = c->zsize - c->zs.avail_out;
+	} while (c->zs.avail_out == 0);
+
+	if (vnc_put_rect(c, x, y, w, h, RFB_ENC_ZLIB) ||
+	    vnc_put_u32(c, out))
+		return -1;
+	return vnc_put(c, c->zbuf, out);
+}
+
+/*
+ * Send one tile from the shadow copy. A tile of one color, like most of
+ * an idle desktop, goes out as a RRE rectangle without subrectangles.
+ */
+static int
+vnc_send_tile(struct vnc_client *c, int x, int y, int w, int h)
+{
+	const uint32_t *src = c->shadow + y * c->width + x;
+	uint32_t *dst = c->tile;
+	uint32_t bg = src[0];
+	bool solid = true;
+	int i, j;
+
+	for (j = 0; j < h; j++, src += c->width) {
+		for (i = 0; i < w; i++) {
+			solid = solid && src[i] == bg;
+			*dst++ = vnc_pixel(c, src[i]);
+		}
+	}
+
+	if (solid && c->enc_rre) {
+		bg = vnc_pixel(c, bg);
+		if (vnc_put_rect(c, x, y, w, h, RFB_ENC_RRE) ||
+		    vnc_put_u32(c, 0))
+			return -1;
+		return vnc_put(c, &bg, sizeof(bg));
+	}
+
+	if (c->enc_zlib)
+		return vnc_send_zlib(c, x, y, w, h);
+
+	if (vnc_put_rect(c, x, y, w, h, RFB_ENC_RAW))
+		return -1;
+	return vnc_put(c, c->tile, w * h * sizeof(uint32_t));
+}
+
+static int
+vnc_resize(struct vnc_client *c, int width, int height)
+{
+	int ntiles;
+
+	ntiles = ((width + VNC_TILE - 1) / VNC_TILE) *
+		 ((height + VNC_TILE - 1) / VNC_TILE);
+
+	free(c->shadow);
+	free(c->dirty);
+	c->shadow = calloc(width * height, sizeof(uint32_t));
+	c->dirty = calloc(ntiles, 1);
+	if (c->shadow == NULL || c->dirty == NULL) {
+		fprintf(stderr, "vnc: cannot allocate %dx%d shadow\n",
+			width, height);
+		return -1;
+	}
+	c->width = width;
+	c->height = height;
+	c->update_full = true;
+	return 0;
+}
+
+/*
+ * Answer the pending FramebufferUpdateRequest with the tiles that
+ * changed. Without changes the request stays pending, and the image is
+ * scanned again on a frame tick after the display device marked it
+ * dirty.
+ */
+static int
+vnc_send_update(struct vnc_client *c)
+{
+	struct gfx_ctx_image *img;
+	int x, y, w, h, n, ndirty;
+
+	console_refresh();
+	img = console_get_image();
+	if (img == NULL || img->data == NULL)
+		return 0;
+
+	if (img->width != c->width || img->height != c->height) {
+		if (!c->enc_resize) {
+			fprintf(stderr, "vnc: client cannot follow resize "
+				"to %dx%d\n", img->width, img->height);
+			return -1;
+		}
+		if (vnc_resize(c, img->width, img->height))
+			return -1;
+		c->update_pending = false;
+		if (vnc_put_u8(c, RFB_FB_UPDATE) || vnc_put_u8(c, 0) ||
+		    vnc_put_u16(c, 1) ||
+		    vnc_put_rect(c, 0, 0, c->width, c->height,
+				 RFB_ENC_DESKTOP_SIZE))
+			return -1;
+		return vnc_flush(c);
+	}
+
+	ndirty = 0;
+	for (n = 0, y = 0; y < c->height; y += VNC_TILE) {
+		h = c->height - y < VNC_TILE ? c->height - y : VNC_TILE;
+		for (x = 0; x < c->width; x += VNC_TILE, n++) {
+			w = c->width - x < VNC_TILE ? c->width - x : VNC_TILE;
+			c->dirty[n] = c->update_full ||
+				vnc_tile_changed(img->data + y * c->width + x,
+						 c->shadow + y * c->width + x,
+						 c->width, w, h);
+			if (!c->dirty[n])
+				continue;
+			vnc_tile_copy(c->shadow + y * c->width + x,
+				      img->data + y * c->width + x,
+				      c->width, w, h);
+			ndirty++;
+		}
+	}
+	if (ndirty == 0)
+		return 0;
+
+	if (vnc_put_u8(c, RFB_FB_UPDATE) || vnc_put_u8(c, 0) ||
+	    vnc_put_u16(c, ndirty))
+		return -1;
+	for (n = 0, y = 0; y < c->height; y += VNC_TILE) {
+		h = c->height - y < VNC_TILE ? c->height - y : VNC_TILE;
+		for (x = 0; x < c->width; x += VNC_TILE, n++) {
+			w = c->width - x < VNC_TILE ? c->width - x : VNC_TILE;
+			if (c->dirty[n] && vnc_send_tile(c, x, y, w, h))
+				return -1;
+		}
+	}
+
+	c->update_pending = false;
+	c->update_full = false;
+	return vnc_flush(c);
+}
+
+static int
+vnc_set_pixfmt(struct vnc_client *c, struct rfb_pixfmt *pf)
+{
+	if (pf->bpp != 32 || !pf->truecolor) {
+		fprintf(stderr, "vnc: unsupported pixel format, %d bpp%s\n",
+			pf->bpp, pf->truecolor ? "" : " colormap");
+		return -1;
+	}
+
+	c->pixfmt = *pf;
+	c->pixfmt.red_max = ntohs(pf->red_max);
+	c->pixfmt.green_max = ntohs(pf->green_max);
+	c->pixfmt.blue_max = ntohs(pf->blue_max);
+	c->native = !c->pixfmt.bigendian &&
+		c->pixfmt.red_max == 255 && c->pixfmt.red_shift == 16 &&
+		c->pixfmt.green_max == 255 && c->pixfmt.green_shift == 8 &&
+		c->pixfmt.blue_max == 255 && c->pixfmt.blue_shift == 0;
+	c->update_full = true;
+	return 0;
+}
+
+static int
+vnc_set_encodings(struct vnc_client *c, int n)
+{
+	int32_t enc;
+
+	c->enc_rre = false;
+	c->enc_zlib = false;
+	c->enc_resize = false;
+	while (n-- > 0) {
+		if (vnc_read(c->fd, &enc, sizeof(enc)))
+			return -1;
+		switch ((int32_t)ntohl(enc)) {
+		case RFB_ENC_RRE:
+			c->enc_rre = true;
+			break;
+		case RFB_ENC_ZLIB:
+			c->enc_zlib = true;
+			break;
+		case RFB_ENC_DESKTOP_SIZE:
+			c->enc_resize = true;
+			break;
+		}
+	}
+	return 0;
+}
+
+static int
+vnc_recv_msg(struct vnc_client *c)
+{
+	uint8_t type, buf[19];
+	uint32_t len;
+
+	if (vnc_read(c->fd, &type, 1))
+		return -1;
+
+	switch (type) {
+	case RFB_SET_PIXEL_FORMAT:
+		if (vnc_read(c->fd, buf, 19))
+			return -1;
+		return vnc_set_pixfmt(c, (struct rfb_pixfmt *)(buf + 3));
+	case RFB_SET_ENCODINGS:
+		if (vnc_read(c->fd, buf, 3))
+			return -1;
+		return vnc_set_encodings(c, buf[1] << 8 | buf[2]);
+	case RFB_FB_UPDATE_REQ:
+		/* the request region is ignored, tiles cover the image */
+		if (vnc_read(c->fd, buf, 9))
+			return -1;
+		c->update_pending = true;
+		if (!buf[0])
+			c->update_full = true;
+		return 0;
+	case RFB_KEY_EVENT:
+		if (vnc_read(c->fd, buf, 7))
+			return -1;
+		console_key_event(buf[0], (uint32_t)buf[3] << 24 |
+				  buf[4] << 16 | buf[5] << 8 | buf[6]);
+		return 0;
+	case RFB_POINTER_EVENT:
+		if (vnc_read(c->fd, buf, 5))
+			return -1;
+		console_ptr_event(buf[0], buf[1] << 8 | buf[2],
+				  buf[3] << 8 | buf[4]);
+		return 0;
+	case RFB_CLIENT_CUT_TEXT:
+		if (vnc_read(c->fd, buf, 7))
+			return -1;
+		len = (uint32_t)buf[3] << 24 | buf[4] << 16 |
+		      buf[5] << 8 | buf[6];
+		while (len > 0) {
+			if (vnc_read(c->fd, buf,
+				     len < sizeof(buf) ? len : sizeof(buf)))
+				return -1;
+			len -= len < sizeof(buf) ? len : sizeof(buf);
+		}
+		return 0;
+	default:
+		fprintf(stderr, "vnc: unknown client message %d\n", type);
+		return -1;
+	}
+}
+
+static int
+vnc_handshake(struct vnc_client *c)
+{
+	struct gfx_ctx_image *img;
+	char ver[RFB_VERSION_LEN + 1];
+	char name[64];
+	uint8_t sec;
+	int minor;
+
+	if (vnc_write(c->fd, RFB_VERSION, RFB_VERSION_LEN) ||
+	    vnc_read(c->fd, ver, RFB_VERSION_LEN))
+		return -1;
+	ver[RFB_VERSION_LEN] = '\0';
+	if (sscanf(ver, "RFB 003.%03d\n", &minor) != 1) {
+		fprintf(stderr, "vnc: bad client version\n");
+		return -1;
+	}
+
+	/* no authentication, the server only listens on loopback */
+	if (minor < 7) {
+		if (vnc_put_u32(c, RFB_SEC_NONE) || vnc_flush(c))
+			return -1;
+	} else {
+		if (vnc_put_u8(c, 1) || vnc_put_u8(c, RFB_SEC_NONE) ||
+		    vnc_flush(c) || vnc_read(c->fd, &sec, 1))
+			return -1;
+		if (sec != RFB_SEC_NONE)
+			return -1;
+		if (minor >= 8 && (vnc_put_u32(c, 0) || vnc_flush(c)))
+			return -1;
+	}
+
+	/* ClientInit, shared flag: a new client replaces the old anyway */
+	if (vnc_read(c->fd, &sec, 1))
+		return -1;
+
+	img = console_get_image();
+	if (img == NULL)
+		return -1;
+	if (vnc_resize(c, img->width, img->height))
+		return -1;
+	c->pixfmt = vnc_native_pixfmt;
+	c->native = true;
+
+	snprintf(name, sizeof(name), "acrn-dm %s", vmname ? vmname : "");
+	if (vnc_put_u16(c, c->width) || vnc_put_u16(c, c->height))
+		return -1;
+	if (vnc_put_u8(c, 32) || vnc_put_u8(c, 24) || vnc_put_u8(c, 0) ||
+	    vnc_put_u8(c, 1) || vnc_put_u16(c, 255) || vnc_put_u16(c, 255) ||
+	    vnc_put_u16(c, 255) || vnc_put_u8(c, 16) || vnc_put_u8(c, 8) ||
+	    vnc_put_u8(c, 0) || vnc_put(c, "\0\0\0", 3))
+		return -1;
+	if (vnc_put_u32(c, strlen(name)) || vnc_put(c, name, strlen(name)))
+		return -1;
+	return vnc_flush(c);
+}
+
+static void
+vnc_serve(int fd)
+{
+	struct vnc_client *c;
+	struct pollfd pfd;
+	unsigned long seq;
+	uint64_t now;
+	int timeout, n, one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return;
+	c->fd = fd;
+	c->obuf = malloc(VNC_OBUF_SIZE);
+	c->zsize = sizeof(c->tile) + 1024;
+	c->zbuf = malloc(c->zsize);
+	if (c->obuf == NULL || c->zbuf == NULL)
+		goto done;
+	if (deflateInit(&c->zs, Z_BEST_SPEED) != Z_OK)
+		goto done;
+	c->zs_init = true;
+
+	if (vnc_handshake(c))
+		goto done;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!vnc.quit) {
+		/* scan for changes at most once per frame tick */
+		timeout = -1;
+		if (c->update_pending) {
+			now = vnc_now_ms();
+			timeout = c->next_scan > now ? c->next_scan - now : 0;
+		}
+
+		n = poll(&pfd, 1, timeout);
+		if (n < 0 && errno != EINTR)
+			break;
+		if (n > 0 && vnc_recv_msg(c))
+			break;
+
+		now = vnc_now_ms();
+		if (c->update_pending && now >= c->next_scan) {
+			c->next_scan = now + 1000 / vnc.fps;
+			seq = console_fb_seq();
+			if (!c->update_full && seq == c->fb_seq)
+				continue;
+			c->fb_seq = seq;
+			if (vnc_send_update(c))
+				break;
+		}
+	}
+
+done:
+	if (c->zs_init)
+		deflateEnd(&c->zs);
+	free(c->zbuf);
+	free(c->obuf);
+	free(c->shadow);
+	free(c->dirty);
+	free(c);
+}
+
+static void *
+vnc_thread(void *arg)
+{
+	int fd;
+
+	while (!vnc.quit) {
+		fd = accept(vnc.lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (!vnc.quit)
+				perror("vnc: accept");
+			break;
+		}
+		vnc.cfd = fd;
+		vnc_serve(fd);
+		vnc.cfd = -1;
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * --vnc [host:]port[,fps=N]
+ * There is no authentication, host must be a loopback address.
+ */
+int
+vnc_parse(const char *opts)
+{
+	char *str, *cp, *tok, *port;
+
+	str = strdup(opts);
+	if (str == NULL)
+		return -1;
+
+	snprintf(vnc.host, sizeof(vnc.host), "%s", VNC_DEF_HOST);
+	vnc.fps = VNC_DEF_FPS;
+
+	cp = str;
+	tok = strsep(&cp, ",");
+	port = strrchr(tok, ':');
+	if (port) {
+		*port++ = '\0';
+		snprintf(vnc.host, sizeof(vnc.host), "%s", tok);
+	} else
+		port = tok;
+	if (*port == '\0' || strlen(port) >= sizeof(vnc.port))
+		goto bad;
+	snprintf(vnc.port, sizeof(vnc.port), "%s", port);
+
+	while ((tok = strsep(&cp, ",")) != NULL) {
+		if (!strncmp(tok, "fps=", 4)) {
+			vnc.fps = atoi(tok + 4);
+			if (vnc.fps <= 0 || vnc.fps > 1000)
+				goto bad;
+		} else
+			goto bad;
+	}
+
+	free(str);
+	return 0;
+bad:
+	fprintf(stderr, "vnc: invalid option %s\n", opts);
+	free(str);
+	return -1;
+}
+
+static bool
+vnc_loopback(const struct sockaddr *sa)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+	if (sa->sa_family == AF_INET)
+		return (ntohl(sin->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+	if (sa->sa_family == AF_INET6)
+		return IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr);
+	return false;
+}
+
+int
+vnc_init(void)
+{
+	struct addrinfo hints, *ai, *res;
+	int err, one = 1;
+
+	if (vnc.started || vnc.port[0] == '\0')
+		return 0;
+
+	/* the display device sets up the console image */
+	if (console_get_image() == NULL) {
+		fprintf(stderr, "vnc: no display device to serve\n");
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	err = getaddrinfo(vnc.host, vnc.port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "vnc: %s:%s: %s\n", vnc.host, vnc.port,
+			gai_strerror(err));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (!vnc_loopback(ai->ai_addr)) {
+			fprintf(stderr, "vnc: %s is not a loopback address, "
+				"no authentication to protect it\n", vnc.host);
+			freeaddrinfo(res);
+			return -1;
+		}
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		vnc.lfd = socket(ai->ai_family, ai->ai_socktype,
+				 ai->ai_protocol);
+		if (vnc.lfd < 0)
+			continue;
+		setsockopt(vnc.lfd, SOL_SOCKET, SO_REUSEADDR, &one,
+			   sizeof(one));
+		if (bind(vnc.lfd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(vnc.lfd, 1) == 0)
+			break;
+		close(vnc.lfd);
+		vnc.lfd = -1;
+	}
+	freeaddrinfo(res);
+	if (vnc.lfd < 0) {
+		fprintf(stderr, "vnc: cannot listen on %s:%s\n", vnc.host,
+			vnc.port);
+		return -1;
+	}
+
+	vnc.quit = false;
+	if (pthread_create(&vnc.tid, NULL, vnc_thread, NULL)) {
+		fprintf(stderr, "vnc: cannot create thread\n");
+		close(vnc.lfd);
+		vnc.lfd = -1;
+		return -1;
+	}
+	pthread_setname_np(vnc.tid, "vnc");
+	vnc.started = true;
+	return 0;
+}
+
+void
+vnc_deinit(void)
+{
+	if (!vnc.started)
+		return;
+
+	vnc.quit = true;
+	shutdown(vnc.lfd, SHUT_RDWR);
+	if (vnc.cfd >= 0)
+		shutdown(vnc.cfd, SHUT_RDWR);
+	pthread_join(vnc.tid, NULL);
+	close(vnc.lfd);
+	vnc.lfd = -1;
+	vnc.started = false;
+}
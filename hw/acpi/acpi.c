@@ -30,9 +30,10 @@
  * dm ACPI table generator.
  *
  * Create the minimal set of ACPI tables required to boot FreeBSD (and
- * hopefully other o/s's) by writing out ASL template files for each of
- * the tables and the compiling them to AML with the Intel iasl compiler.
- * The AML files are then read into guest memory.
+ * hopefully other o/s's). The fixed tables are encoded directly into
+ * guest memory. The DSDT is written out as ASL and compiled to AML with
+ * the Intel iasl compiler, the AML is cached keyed by the ASL source so
+ * that iasl only runs when the device configuration changes.
  *
  *  The tables are placed in the guest's ROM area just below 1MB physical,
  * above the MPTable.
@@ -88,6 +89,8 @@
 #define	ASL_TEMPLATE	"dm.XXXXXXX"
 #define ASL_SUFFIX	".aml"
 #define ASL_COMPILER	"/usr/sbin/iasl"
+#define ACPI_STATE_DIR	"/var/lib/acrn"
+#define ACPI_CACHE_DIR	ACPI_STATE_DIR "/acpi"	/* survives host reboots */
 
 static int basl_keep_temps;
 static int basl_verbose_iasl;
@@ -117,470 +120,515 @@ struct basl_fio {
 #define EFPRINTF(...) fprintf(__VA_ARGS__)
 #define EFFLUSH(x) fflush(x)
 
+/*
+ * The fixed tables are encoded in-process straight into guest memory,
+ * only the DSDT goes through iasl (see basl_build_dsdt).
+ */
+#define BASL_OEM_ID		"DM "
+#define BASL_CREATOR_ID		"DM  "
+#define BASL_CREATOR_REV	1
+
+struct acpi_table_hdr {
+	char		signature[4];
+	uint32_t	length;
+	uint8_t		revision;
+	uint8_t		checksum;
+	char		oem_id[6];
+	char		oem_table_id[8];
+	uint32_t	oem_revision;
+	char		asl_compiler_id[4];
+	uint32_t	asl_compiler_revision;
+} __attribute__((packed));
+
+struct acpi_gas {
+	uint8_t		space_id;
+	uint8_t		bit_width;
+	uint8_t		bit_offset;
+	uint8_t		access_width;
+	uint64_t	address;
+} __attribute__((packed));
+
+struct acpi_rsdp {
+	char		signature[8];
+	uint8_t		checksum;
+	char		oem_id[6];
+	uint8_t		revision;
+	uint32_t	rsdt_address;
+	uint32_t	length;
+	uint64_t	xsdt_address;
+	uint8_t		extended_checksum;
+	uint8_t		reserved[3];
+} __attribute__((packed));
+
+struct acpi_madt_lapic {
+	uint8_t		type;
+	uint8_t		length;
+	uint8_t		processor_id;
+	uint8_t		apic_id;
+	uint32_t	flags;
+} __attribute__((packed));
+
+struct acpi_madt_ioapic {
+	uint8_t		type;
+	uint8_t		length;
+	uint8_t		ioapic_id;
+	uint8_t		reserved;
+	uint32_t	address;
+	uint32_t	gsi_base;
+} __attribute__((packed));
+
+struct acpi_madt_iso {
+	uint8_t		type;
+	uint8_t		length;
+	uint8_t		bus;
+	uint8_t		source;
+	uint32_t	gsi;
+	uint16_t	flags;
+} __attribute__((packed));
+
+struct acpi_madt_lapic_nmi {
+	uint8_t		type;
+	uint8_t		length;
+	uint8_t		processor_id;
+	uint16_t	flags;
+	uint8_t		lint;
+} __attribute__((packed));
+
+struct acpi_fadt {
+	struct acpi_table_hdr	hdr;
+	uint32_t	facs;
+	uint32_t	dsdt;
+	uint8_t		model;
+	uint8_t		pm_profile;
+	uint16_t	sci_int;
+	uint32_t	smi_cmd;
+	uint8_t		acpi_enable;
+	uint8_t		acpi_disable;
+	uint8_t		s4bios_req;
+	uint8_t		pstate_cnt;
+	uint32_t	pm1a_evt_blk;
+	uint32_t	pm1b_evt_blk;
+	uint32_t	pm1a_cnt_blk;
+	uint32_t	pm1b_cnt_blk;
+	uint32_t	pm2_cnt_blk;
+	uint32_t	pm_tmr_blk;
+	uint32_t	gpe0_blk;
+	uint32_t	gpe1_blk;
+	uint8_t		pm1_evt_len;
+	uint8_t		pm1_cnt_len;
+	uint8_t		pm2_cnt_len;
+	uint8_t		pm_tmr_len;
+	uint8_t		gpe0_blk_len;
+	uint8_t		gpe1_blk_len;
+	uint8_t		gpe1_base;
+	uint8_t		cst_cnt;
+	uint16_t	p_lvl2_lat;
+	uint16_t	p_lvl3_lat;
+	uint16_t	flush_size;
+	uint16_t	flush_stride;
+	uint8_t		duty_offset;
+	uint8_t		duty_width;
+	uint8_t		day_alrm;
+	uint8_t		mon_alrm;
+	uint8_t		century;
+	uint16_t	iapc_boot_arch;
+	uint8_t		reserved;
+	uint32_t	flags;
+	struct acpi_gas	reset_reg;
+	uint8_t		reset_value;
+	uint16_t	arm_boot_arch;
+	uint8_t		minor_revision;
+	uint64_t	x_facs;
+	uint64_t	x_dsdt;
+	struct acpi_gas	x_pm1a_evt_blk;
+	struct acpi_gas	x_pm1b_evt_blk;
+	struct acpi_gas	x_pm1a_cnt_blk;
+	struct acpi_gas	x_pm1b_cnt_blk;
+	struct acpi_gas	x_pm2_cnt_blk;
+	struct acpi_gas	x_pm_tmr_blk;
+	struct acpi_gas	x_gpe0_blk;
+	struct acpi_gas	x_gpe1_blk;
+	struct acpi_gas	sleep_control;
+	struct acpi_gas	sleep_status;
+} __attribute__((packed));
+static_assert(sizeof(struct acpi_fadt) == 268, "compile-time assertion failed");
+
+struct acpi_hpet {
+	struct acpi_table_hdr	hdr;
+	uint32_t	id;
+	struct acpi_gas	address;
+	uint8_t		sequence;
+	uint16_t	minimum_tick;
+	uint8_t		flags;
+} __attribute__((packed));
+static_assert(sizeof(struct acpi_hpet) == 56, "compile-time assertion failed");
+
+struct acpi_mcfg {
+	struct acpi_table_hdr	hdr;
+	uint8_t		reserved[8];
+	uint64_t	base_address;
+	uint16_t	pci_segment;
+	uint8_t		start_bus;
+	uint8_t		end_bus;
+	uint32_t	reserved1;
+} __attribute__((packed));
+static_assert(sizeof(struct acpi_mcfg) == 60, "compile-time assertion failed");
+
+struct acpi_facs {
+	char		signature[4];
+	uint32_t	length;
+	uint32_t	hardware_signature;
+	uint32_t	firmware_waking_vector;
+	uint32_t	global_lock;
+	uint32_t	flags;
+	uint64_t	x_firmware_waking_vector;
+	uint8_t		version;
+	uint8_t		reserved[3];
+	uint32_t	ospm_flags;
+	uint8_t		reserved1[24];
+} __attribute__((packed));
+static_assert(sizeof(struct acpi_facs) == 64, "compile-time assertion failed");
+
+/* MADT interrupt source override / NMI flags */
+#define	MPS_INTI_POL_HIGH	0x1
+#define	MPS_INTI_POL_LOW	0x3
+#define	MPS_INTI_TRIG_EDGE	(0x1 << 2)
+#define	MPS_INTI_TRIG_LEVEL	(0x3 << 2)
+
+/* FADT flags and boot architecture flags */
+#define	FADT_F_WBINVD		(1 << 0)
+#define	FADT_F_C1_SUPPORTED	(1 << 2)
+#define	FADT_F_SLEEP_BUTTON	(1 << 5)
+#define	FADT_F_TMR_VAL_EXT	(1 << 8)
+#define	FADT_F_RESET_REG_SUP	(1 << 10)
+#define	FADT_F_HEADLESS		(1 << 12)
+#define	FADT_BA_NO_VGA		(1 << 2)
+#define	FADT_BA_NO_ASPM		(1 << 4)
+
+#define	GAS_SYSTEM_MEMORY	0
+#define	GAS_SYSTEM_IO		1
+
+static uint8_t
+basl_checksum(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint8_t sum = 0;
+
+	while (len--)
+		sum += *p++;
+
+	return (uint8_t)-sum;
+}
+
+/*
+ * Map the guest memory of a table and clear it, the tables are laid
+ * out back to back so bound the size by the next table's offset.
+ */
+static void *
+basl_table_map(struct vmctx *ctx, uint64_t offset, size_t len)
+{
+	void *gaddr;
+
+	gaddr = paddr_guest2host(ctx, basl_acpi_base + offset, len);
+	if (gaddr == NULL) {
+		fprintf(stderr, "%s: no guest memory at 0x%lx\n", __func__,
+			basl_acpi_base + offset);
+		return NULL;
+	}
+
+	memset(gaddr, 0, len);
+	return gaddr;
+}
+
+/* Fixed width id fields, the table memory is cleared beforehand */
+static void
+basl_id(char *dst, const char *id, size_t len)
+{
+	memcpy(dst, id, MIN(strlen(id), len));
+}
+
+static void
+basl_table_hdr(struct acpi_table_hdr *hdr, const char *sig, uint8_t rev,
+	       const char *oem_id, const char *oem_table_id,
+	       uint32_t oem_rev)
+{
+	memcpy(hdr->signature, sig, sizeof(hdr->signature));
+	hdr->revision = rev;
+	basl_id(hdr->oem_id, oem_id, sizeof(hdr->oem_id));
+	basl_id(hdr->oem_table_id, oem_table_id, sizeof(hdr->oem_table_id));
+	hdr->oem_revision = oem_rev;
+	memcpy(hdr->asl_compiler_id, BASL_CREATOR_ID,
+	       sizeof(hdr->asl_compiler_id));
+	hdr->asl_compiler_revision = BASL_CREATOR_REV;
+}
+
+static void
+basl_table_done(struct acpi_table_hdr *hdr, uint32_t len)
+{
+	hdr->length = len;
+	hdr->checksum = 0;
+	hdr->checksum = basl_checksum(hdr, len);
+}
+
+static void
+basl_gas(struct acpi_gas *gas, uint8_t space_id, uint8_t bit_width,
+	 uint8_t access_width, uint64_t address)
+{
+	gas->space_id = space_id;
+	gas->bit_width = bit_width;
+	gas->bit_offset = 0;
+	gas->access_width = access_width;
+	gas->address = address;
+}
+
+/* Tables listed in the RSDT/XSDT */
+static const uint64_t basl_sdt_offsets[] = {
+	MADT_OFFSET, FADT_OFFSET, HPET_OFFSET, MCFG_OFFSET
+};
+
 static int
-basl_fwrite_rsdp(FILE *fp, struct vmctx *ctx)
+basl_build_rsdp(struct vmctx *ctx, uint64_t offset)
 {
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm RSDP template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0008]\t\tSignature : \"RSD PTR \"\n");
-	EFPRINTF(fp, "[0001]\t\tChecksum : 43\n");
-	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
-	EFPRINTF(fp, "[0001]\t\tRevision : 02\n");
-	EFPRINTF(fp, "[0004]\t\tRSDT Address : %08X\n",
-	    basl_acpi_base + RSDT_OFFSET);
-	EFPRINTF(fp, "[0004]\t\tLength : 00000024\n");
-	EFPRINTF(fp, "[0008]\t\tXSDT Address : 00000000%08X\n",
-	    basl_acpi_base + XSDT_OFFSET);
-	EFPRINTF(fp, "[0001]\t\tExtended Checksum : 00\n");
-	EFPRINTF(fp, "[0003]\t\tReserved : 000000\n");
+	struct acpi_rsdp *rsdp;
 
-	EFFLUSH(fp);
+	rsdp = basl_table_map(ctx, offset, sizeof(*rsdp));
+	if (rsdp == NULL)
+		return -1;
+
+	memcpy(rsdp->signature, "RSD PTR ", sizeof(rsdp->signature));
+	basl_id(rsdp->oem_id, BASL_OEM_ID, sizeof(rsdp->oem_id));
+	rsdp->revision = 2;
+	rsdp->rsdt_address = basl_acpi_base + RSDT_OFFSET;
+	rsdp->length = sizeof(*rsdp);
+	rsdp->xsdt_address = basl_acpi_base + XSDT_OFFSET;
+
+	/* the v1 checksum covers the first 20 bytes only */
+	rsdp->checksum = basl_checksum(rsdp, 20);
+	rsdp->extended_checksum = basl_checksum(rsdp, sizeof(*rsdp));
 
 	return 0;
 }
 
 static int
-basl_fwrite_rsdt(FILE *fp, struct vmctx *ctx)
+basl_build_rsdt(struct vmctx *ctx, uint64_t offset)
 {
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm RSDT template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0004]\t\tSignature : \"RSDT\"\n");
-	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
-	EFPRINTF(fp, "[0001]\t\tRevision : 01\n");
-	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
-	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
-	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMRSDT  \"\n");
-	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
-	/* iasl will fill in the compiler ID/revision fields */
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
-	EFPRINTF(fp, "\n");
-
-	/* Add in pointers to the MADT, FADT and HPET */
-	EFPRINTF(fp, "[0004]\t\tACPI Table Address 0 : %08X\n",
-	    basl_acpi_base + MADT_OFFSET);
-	EFPRINTF(fp, "[0004]\t\tACPI Table Address 1 : %08X\n",
-	    basl_acpi_base + FADT_OFFSET);
-	EFPRINTF(fp, "[0004]\t\tACPI Table Address 2 : %08X\n",
-	    basl_acpi_base + HPET_OFFSET);
-	EFPRINTF(fp, "[0004]\t\tACPI Table Address 3 : %08X\n",
-	    basl_acpi_base + MCFG_OFFSET);
+	struct acpi_table_hdr *hdr;
+	uint32_t *entry;
+	uint32_t len;
+	int i;
 
-	EFFLUSH(fp);
+	len = sizeof(*hdr) + sizeof(uint32_t) * ARRAY_SIZE(basl_sdt_offsets);
+	hdr = basl_table_map(ctx, offset, len);
+	if (hdr == NULL)
+		return -1;
+
+	basl_table_hdr(hdr, "RSDT", 1, BASL_OEM_ID, "DMRSDT  ", 1);
+	entry = (uint32_t *)(hdr + 1);
+	for (i = 0; i < ARRAY_SIZE(basl_sdt_offsets); i++)
+		entry[i] = basl_acpi_base + basl_sdt_offsets[i];
+	basl_table_done(hdr, len);
 
 	return 0;
 }
 
 static int
-basl_fwrite_xsdt(FILE *fp, struct vmctx *ctx)
+basl_build_xsdt(struct vmctx *ctx, uint64_t offset)
 {
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm XSDT template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0004]\t\tSignature : \"XSDT\"\n");
-	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
-	EFPRINTF(fp, "[0001]\t\tRevision : 01\n");
-	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
-	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
-	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMXSDT  \"\n");
-	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
-	/* iasl will fill in the compiler ID/revision fields */
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
-	EFPRINTF(fp, "\n");
-
-	/* Add in pointers to the MADT, FADT and HPET */
-	EFPRINTF(fp, "[0004]\t\tACPI Table Address 0 : 00000000%08X\n",
-	    basl_acpi_base + MADT_OFFSET);
-	EFPRINTF(fp, "[0004]\t\tACPI Table Address 1 : 00000000%08X\n",
-	    basl_acpi_base + FADT_OFFSET);
-	EFPRINTF(fp, "[0004]\t\tACPI Table Address 2 : 00000000%08X\n",
-	    basl_acpi_base + HPET_OFFSET);
-	EFPRINTF(fp, "[0004]\t\tACPI Table Address 3 : 00000000%08X\n",
-	    basl_acpi_base + MCFG_OFFSET);
+	struct acpi_table_hdr *hdr;
+	uint64_t *entry;
+	uint32_t len;
+	int i;
 
-	EFFLUSH(fp);
+	len = sizeof(*hdr) + sizeof(uint64_t) * ARRAY_SIZE(basl_sdt_offsets);
+	hdr = basl_table_map(ctx, offset, len);
+	if (hdr == NULL)
+		return -1;
+
+	basl_table_hdr(hdr, "XSDT", 1, BASL_OEM_ID, "DMXSDT  ", 1);
+	entry = (uint64_t *)(hdr + 1);
+	for (i = 0; i < ARRAY_SIZE(basl_sdt_offsets); i++)
+		entry[i] = basl_acpi_base + basl_sdt_offsets[i];
+	basl_table_done(hdr, len);
 
 	return 0;
 }
 
 static int
-basl_fwrite_madt(FILE *fp, struct vmctx *ctx)
+basl_build_madt(struct vmctx *ctx, uint64_t offset)
 {
+	struct acpi_table_hdr *hdr;
+	struct acpi_madt_lapic *lapic;
+	struct acpi_madt_ioapic *ioapic;
+	struct acpi_madt_iso *iso;
+	struct acpi_madt_lapic_nmi *nmi;
+	uint32_t *madt;
+	uint8_t *p;
+	uint32_t len;
 	int i;
 
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm MADT template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0004]\t\tSignature : \"APIC\"\n");
-	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
-	EFPRINTF(fp, "[0001]\t\tRevision : 01\n");
-	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
-	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
-	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMMADT  \"\n");
-	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
-
-	/* iasl will fill in the compiler ID/revision fields */
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0004]\t\tLocal Apic Address : FEE00000\n");
-	EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000001\n");
-	EFPRINTF(fp, "\t\t\tPC-AT Compatibility : 1\n");
-	EFPRINTF(fp, "\n");
+	len = sizeof(*hdr) + 2 * sizeof(uint32_t) +
+		basl_ncpu * sizeof(*lapic) + sizeof(*ioapic) +
+		2 * sizeof(*iso) + sizeof(*nmi);
+	if (len > FADT_OFFSET - MADT_OFFSET) {
+		fprintf(stderr, "MADT exceeds reserved room\n");
+		return -1;
+	}
+
+	hdr = basl_table_map(ctx, offset, len);
+	if (hdr == NULL)
+		return -1;
+
+	basl_table_hdr(hdr, "APIC", 1, BASL_OEM_ID, "DMMADT  ", 1);
+
+	/* Local APIC address and PC-AT compatibility */
+	madt = (uint32_t *)(hdr + 1);
+	madt[0] = 0xFEE00000;
+	madt[1] = 1;
+	p = (uint8_t *)&madt[2];
 
 	/* Add a Processor Local APIC entry for each CPU */
 	for (i = 0; i < basl_ncpu; i++) {
-		EFPRINTF(fp, "[0001]\t\tSubtable Type : 00\n");
-		EFPRINTF(fp, "[0001]\t\tLength : 08\n");
-		/* iasl expects hex values for the proc and apic id's */
-		EFPRINTF(fp, "[0001]\t\tProcessor ID : %02x\n", i);
-		EFPRINTF(fp, "[0001]\t\tLocal Apic ID : %02x\n", i);
-		EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000001\n");
-		EFPRINTF(fp, "\t\t\tProcessor Enabled : 1\n");
-		EFPRINTF(fp, "\n");
+		lapic = (struct acpi_madt_lapic *)p;
+		lapic->type = 0;
+		lapic->length = sizeof(*lapic);
+		lapic->processor_id = i;
+		lapic->apic_id = i;
+		lapic->flags = 1;	/* enabled */
+		p += sizeof(*lapic);
 	}
 
 	/* Always a single IOAPIC entry, with ID 0 */
-	EFPRINTF(fp, "[0001]\t\tSubtable Type : 01\n");
-	EFPRINTF(fp, "[0001]\t\tLength : 0C\n");
-	/* iasl expects a hex value for the i/o apic id */
-	EFPRINTF(fp, "[0001]\t\tI/O Apic ID : %02x\n", 0);
-	EFPRINTF(fp, "[0001]\t\tReserved : 00\n");
-	EFPRINTF(fp, "[0004]\t\tAddress : fec00000\n");
-	EFPRINTF(fp, "[0004]\t\tInterrupt : 00000000\n");
-	EFPRINTF(fp, "\n");
+	ioapic = (struct acpi_madt_ioapic *)p;
+	ioapic->type = 1;
+	ioapic->length = sizeof(*ioapic);
+	ioapic->address = 0xFEC00000;
+	p += sizeof(*ioapic);
 
 	/* Legacy IRQ0 is connected to pin 2 of the IOAPIC */
-	EFPRINTF(fp, "[0001]\t\tSubtable Type : 02\n");
-	EFPRINTF(fp, "[0001]\t\tLength : 0A\n");
-	EFPRINTF(fp, "[0001]\t\tBus : 00\n");
-	EFPRINTF(fp, "[0001]\t\tSource : 00\n");
-	EFPRINTF(fp, "[0004]\t\tInterrupt : 00000002\n");
-	EFPRINTF(fp, "[0002]\t\tFlags (decoded below) : 0005\n");
-	EFPRINTF(fp, "\t\t\tPolarity : 1\n");
-	EFPRINTF(fp, "\t\t\tTrigger Mode : 1\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0001]\t\tSubtable Type : 02\n");
-	EFPRINTF(fp, "[0001]\t\tLength : 0A\n");
-	EFPRINTF(fp, "[0001]\t\tBus : 00\n");
-	EFPRINTF(fp, "[0001]\t\tSource : %02X\n", SCI_INT);
-	EFPRINTF(fp, "[0004]\t\tInterrupt : %08X\n", SCI_INT);
-	EFPRINTF(fp, "[0002]\t\tFlags (decoded below) : 0000\n");
-	EFPRINTF(fp, "\t\t\tPolarity : 3\n");
-	EFPRINTF(fp, "\t\t\tTrigger Mode : 3\n");
-	EFPRINTF(fp, "\n");
+	iso = (struct acpi_madt_iso *)p;
+	iso->type = 2;
+	iso->length = sizeof(*iso);
+	iso->source = 0;
+	iso->gsi = 2;
+	iso->flags = MPS_INTI_POL_HIGH | MPS_INTI_TRIG_EDGE;
+	p += sizeof(*iso);
+
+	iso = (struct acpi_madt_iso *)p;
+	iso->type = 2;
+	iso->length = sizeof(*iso);
+	iso->source = SCI_INT;
+	iso->gsi = SCI_INT;
+	iso->flags = MPS_INTI_POL_LOW | MPS_INTI_TRIG_LEVEL;
+	p += sizeof(*iso);
 
 	/* Local APIC NMI is connected to LINT 1 on all CPUs */
-	EFPRINTF(fp, "[0001]\t\tSubtable Type : 04\n");
-	EFPRINTF(fp, "[0001]\t\tLength : 06\n");
-	EFPRINTF(fp, "[0001]\t\tProcessorId : FF\n");
-	EFPRINTF(fp, "[0002]\t\tFlags (decoded below) : 0005\n");
-	EFPRINTF(fp, "\t\t\tPolarity : 1\n");
-	EFPRINTF(fp, "\t\t\tTrigger Mode : 1\n");
-	EFPRINTF(fp, "[0001]\t\tInterrupt : 01\n");
-	EFPRINTF(fp, "\n");
+	nmi = (struct acpi_madt_lapic_nmi *)p;
+	nmi->type = 4;
+	nmi->length = sizeof(*nmi);
+	nmi->processor_id = 0xFF;
+	nmi->flags = MPS_INTI_POL_HIGH | MPS_INTI_TRIG_EDGE;
+	nmi->lint = 1;
 
-	EFFLUSH(fp);
+	basl_table_done(hdr, len);
 
 	return 0;
 }
 
 static int
-basl_fwrite_fadt(FILE *fp, struct vmctx *ctx)
+basl_build_fadt(struct vmctx *ctx, uint64_t offset)
 {
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm FADT template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0004]\t\tSignature : \"FACP\"\n");
-	EFPRINTF(fp, "[0004]\t\tTable Length : 0000010C\n");
-	EFPRINTF(fp, "[0001]\t\tRevision : 05\n");
-	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
-	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
-	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMFACP  \"\n");
-	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
-	/* iasl will fill in the compiler ID/revision fields */
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0004]\t\tFACS Address : %08X\n",
-	    basl_acpi_base + FACS_OFFSET);
-	EFPRINTF(fp, "[0004]\t\tDSDT Address : %08X\n",
-	    basl_acpi_base + DSDT_OFFSET);
-	EFPRINTF(fp, "[0001]\t\tModel : 01\n");
-	EFPRINTF(fp, "[0001]\t\tPM Profile : 00 [Unspecified]\n");
-	EFPRINTF(fp, "[0002]\t\tSCI Interrupt : %04X\n",
-	    SCI_INT);
-	EFPRINTF(fp, "[0004]\t\tSMI Command Port : %08X\n",
-	    SMI_CMD);
-	EFPRINTF(fp, "[0001]\t\tACPI Enable Value : %02X\n",
-	    ACPI_ENABLE);
-	EFPRINTF(fp, "[0001]\t\tACPI Disable Value : %02X\n",
-	    ACPI_DISABLE);
-	EFPRINTF(fp, "[0001]\t\tS4BIOS Command : 00\n");
-	EFPRINTF(fp, "[0001]\t\tP-State Control : 00\n");
-	EFPRINTF(fp, "[0004]\t\tPM1A Event Block Address : %08X\n",
-	    PM1A_EVT_ADDR);
-	EFPRINTF(fp, "[0004]\t\tPM1B Event Block Address : 00000000\n");
-	EFPRINTF(fp, "[0004]\t\tPM1A Control Block Address : %08X\n",
-	    PM1A_CNT_ADDR);
-	EFPRINTF(fp, "[0004]\t\tPM1B Control Block Address : 00000000\n");
-	EFPRINTF(fp, "[0004]\t\tPM2 Control Block Address : 00000000\n");
-	EFPRINTF(fp, "[0004]\t\tPM Timer Block Address : %08X\n",
-	    IO_PMTMR);
-	EFPRINTF(fp, "[0004]\t\tGPE0 Block Address : 00000000\n");
-	EFPRINTF(fp, "[0004]\t\tGPE1 Block Address : 00000000\n");
-	EFPRINTF(fp, "[0001]\t\tPM1 Event Block Length : 04\n");
-	EFPRINTF(fp, "[0001]\t\tPM1 Control Block Length : 02\n");
-	EFPRINTF(fp, "[0001]\t\tPM2 Control Block Length : 00\n");
-	EFPRINTF(fp, "[0001]\t\tPM Timer Block Length : 04\n");
-	EFPRINTF(fp, "[0001]\t\tGPE0 Block Length : 00\n");
-	EFPRINTF(fp, "[0001]\t\tGPE1 Block Length : 00\n");
-	EFPRINTF(fp, "[0001]\t\tGPE1 Base Offset : 00\n");
-	EFPRINTF(fp, "[0001]\t\t_CST Support : 00\n");
-	EFPRINTF(fp, "[0002]\t\tC2 Latency : 0000\n");
-	EFPRINTF(fp, "[0002]\t\tC3 Latency : 0000\n");
-	EFPRINTF(fp, "[0002]\t\tCPU Cache Size : 0000\n");
-	EFPRINTF(fp, "[0002]\t\tCache Flush Stride : 0000\n");
-	EFPRINTF(fp, "[0001]\t\tDuty Cycle Offset : 00\n");
-	EFPRINTF(fp, "[0001]\t\tDuty Cycle Width : 00\n");
-	EFPRINTF(fp, "[0001]\t\tRTC Day Alarm Index : 00\n");
-	EFPRINTF(fp, "[0001]\t\tRTC Month Alarm Index : 00\n");
-	EFPRINTF(fp, "[0001]\t\tRTC Century Index : 32\n");
-	EFPRINTF(fp, "[0002]\t\tBoot Flags (decoded below) : 0000\n");
-	EFPRINTF(fp, "\t\t\tLegacy Devices Supported (V2) : 0\n");
-	EFPRINTF(fp, "\t\t\t8042 Present on ports 60/64 (V2) : 0\n");
-	EFPRINTF(fp, "\t\t\tVGA Not Present (V4) : 1\n");
-	EFPRINTF(fp, "\t\t\tMSI Not Supported (V4) : 0\n");
-	EFPRINTF(fp, "\t\t\tPCIe ASPM Not Supported (V4) : 1\n");
-	EFPRINTF(fp, "\t\t\tCMOS RTC Not Present (V5) : 0\n");
-	EFPRINTF(fp, "[0001]\t\tReserved : 00\n");
-	EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000000\n");
-	EFPRINTF(fp, "\t\t\tWBINVD instruction is operational (V1) : 1\n");
-	EFPRINTF(fp, "\t\t\tWBINVD flushes all caches (V1) : 0\n");
-	EFPRINTF(fp, "\t\t\tAll CPUs support C1 (V1) : 1\n");
-	EFPRINTF(fp, "\t\t\tC2 works on MP system (V1) : 0\n");
-	EFPRINTF(fp, "\t\t\tControl Method Power Button (V1) : 0\n");
-	EFPRINTF(fp, "\t\t\tControl Method Sleep Button (V1) : 1\n");
-	EFPRINTF(fp, "\t\t\tRTC wake not in fixed reg space (V1) : 0\n");
-	EFPRINTF(fp, "\t\t\tRTC can wake system from S4 (V1) : 0\n");
-	EFPRINTF(fp, "\t\t\t32-bit PM Timer (V1) : 1\n");
-	EFPRINTF(fp, "\t\t\tDocking Supported (V1) : 0\n");
-	EFPRINTF(fp, "\t\t\tReset Register Supported (V2) : 1\n");
-	EFPRINTF(fp, "\t\t\tSealed Case (V3) : 0\n");
-	EFPRINTF(fp, "\t\t\tHeadless - No Video (V3) : 1\n");
-	EFPRINTF(fp, "\t\t\tUse native instr after SLP_TYPx (V3) : 0\n");
-	EFPRINTF(fp, "\t\t\tPCIEXP_WAK Bits Supported (V4) : 0\n");
-	EFPRINTF(fp, "\t\t\tUse Platform Timer (V4) : 0\n");
-	EFPRINTF(fp, "\t\t\tRTC_STS valid on S4 wake (V4) : 0\n");
-	EFPRINTF(fp, "\t\t\tRemote Power-on capable (V4) : 0\n");
-	EFPRINTF(fp, "\t\t\tUse APIC Cluster Model (V4) : 0\n");
-	EFPRINTF(fp, "\t\t\tUse APIC Physical Destination Mode (V4) : 0\n");
-	EFPRINTF(fp, "\t\t\tHardware Reduced (V5) : 0\n");
-	EFPRINTF(fp, "\t\t\tLow Power S0 Idle (V5) : 0\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp,
-	    "[0012]\t\tReset Register : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 08\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp, "[0001]\t\tEncoded Access Width : 01 [Byte Access:8]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 0000000000000CF9\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0001]\t\tValue to cause reset : 0E\n");
-	EFPRINTF(fp, "[0002]\t\tARM Flags (decoded below): 0000\n");
-	EFPRINTF(fp, "\t\t\tPSCI Compliant : 0\n");
-	EFPRINTF(fp, "\t\t\tMust use HVC for PSCI : 0\n");
-	EFPRINTF(fp, "[0001]\t\tFADT Minor Revision : 01\n");
-	EFPRINTF(fp, "[0008]\t\tFACS Address : 00000000%08X\n",
-	    basl_acpi_base + FACS_OFFSET);
-	EFPRINTF(fp, "[0008]\t\tDSDT Address : 00000000%08X\n",
-	    basl_acpi_base + DSDT_OFFSET);
-	EFPRINTF(fp,
-	    "[0012]\t\tPM1A Event Block : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 20\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp, "[0001]\t\tEncoded Access Width : 02 [Word Access:16]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 00000000%08X\n",
-	    PM1A_EVT_ADDR);
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp,
-	    "[0012]\t\tPM1B Event Block : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 00\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp,
-	    "[0001]\t\tEncoded Access Width : 00 [Undefined/Legacy]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 0000000000000000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp,
-	    "[0012]\t\tPM1A Control Block : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 10\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp, "[0001]\t\tEncoded Access Width : 02 [Word Access:16]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 00000000%08X\n",
-	    PM1A_CNT_ADDR);
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp,
-	    "[0012]\t\tPM1B Control Block : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 00\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp,
-	    "[0001]\t\tEncoded Access Width : 00 [Undefined/Legacy]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 0000000000000000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp,
-	    "[0012]\t\tPM2 Control Block : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 08\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp,
-	    "[0001]\t\tEncoded Access Width : 00 [Undefined/Legacy]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 0000000000000000\n");
-	EFPRINTF(fp, "\n");
+	struct acpi_fadt *fadt;
+
+	fadt = basl_table_map(ctx, offset, sizeof(*fadt));
+	if (fadt == NULL)
+		return -1;
 
+	basl_table_hdr(&fadt->hdr, "FACP", 5, BASL_OEM_ID, "DMFACP  ", 1);
+
+	fadt->facs = basl_acpi_base + FACS_OFFSET;
+	fadt->dsdt = basl_acpi_base + DSDT_OFFSET;
+	fadt->model = 1;
+	fadt->pm_profile = 0;	/* unspecified */
+	fadt->sci_int = SCI_INT;
+	fadt->smi_cmd = SMI_CMD;
+	fadt->acpi_enable = ACPI_ENABLE;
+	fadt->acpi_disable = ACPI_DISABLE;
+	fadt->pm1a_evt_blk = PM1A_EVT_ADDR;
+	fadt->pm1a_cnt_blk = PM1A_CNT_ADDR;
+	fadt->pm_tmr_blk = IO_PMTMR;
+	fadt->pm1_evt_len = 4;
+	fadt->pm1_cnt_len = 2;
+	fadt->pm_tmr_len = 4;
+	fadt->century = 0x32;
+	fadt->iapc_boot_arch = FADT_BA_NO_VGA | FADT_BA_NO_ASPM;
+	fadt->flags = FADT_F_WBINVD | FADT_F_C1_SUPPORTED |
+		FADT_F_SLEEP_BUTTON | FADT_F_TMR_VAL_EXT |
+		FADT_F_RESET_REG_SUP | FADT_F_HEADLESS;
+
+	basl_gas(&fadt->reset_reg, GAS_SYSTEM_IO, 8, 1, 0xCF9);
+	fadt->reset_value = 0x0E;
+	fadt->minor_revision = 1;
+	fadt->x_facs = basl_acpi_base + FACS_OFFSET;
+	fadt->x_dsdt = basl_acpi_base + DSDT_OFFSET;
+
+	basl_gas(&fadt->x_pm1a_evt_blk, GAS_SYSTEM_IO, 32, 2, PM1A_EVT_ADDR);
+	basl_gas(&fadt->x_pm1b_evt_blk, GAS_SYSTEM_IO, 0, 0, 0);
+	basl_gas(&fadt->x_pm1a_cnt_blk, GAS_SYSTEM_IO, 16, 2, PM1A_CNT_ADDR);
+	basl_gas(&fadt->x_pm1b_cnt_blk, GAS_SYSTEM_IO, 0, 0, 0);
+	basl_gas(&fadt->x_pm2_cnt_blk, GAS_SYSTEM_IO, 8, 0, 0);
 	/* Valid for dm */
-	EFPRINTF(fp,
-	    "[0012]\t\tPM Timer Block : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 20\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp,
-	    "[0001]\t\tEncoded Access Width : 03 [DWord Access:32]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 00000000%08X\n",
-	    IO_PMTMR);
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0012]\t\tGPE0 Block : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 00\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp, "[0001]\t\tEncoded Access Width : 01 [Byte Access:8]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 0000000000000000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0012]\t\tGPE1 Block : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 00\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp,
-	    "[0001]\t\tEncoded Access Width : 00 [Undefined/Legacy]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 0000000000000000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp,
-	   "[0012]\t\tSleep Control Register : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 08\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp, "[0001]\t\tEncoded Access Width : 01 [Byte Access:8]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 0000000000000000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp,
-	    "[0012]\t\tSleep Status Register : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 01 [SystemIO]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 08\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp, "[0001]\t\tEncoded Access Width : 01 [Byte Access:8]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 0000000000000000\n");
+	basl_gas(&fadt->x_pm_tmr_blk, GAS_SYSTEM_IO, 32, 3, IO_PMTMR);
+	basl_gas(&fadt->x_gpe0_blk, GAS_SYSTEM_IO, 0, 1, 0);
+	basl_gas(&fadt->x_gpe1_blk, GAS_SYSTEM_IO, 0, 0, 0);
+	basl_gas(&fadt->sleep_control, GAS_SYSTEM_IO, 8, 1, 0);
+	basl_gas(&fadt->sleep_status, GAS_SYSTEM_IO, 8, 1, 0);
 
-	EFFLUSH(fp);
+	basl_table_done(&fadt->hdr, sizeof(*fadt));
 
 	return 0;
 }
 
 static int
-basl_fwrite_hpet(FILE *fp, struct vmctx *ctx)
+basl_build_hpet(struct vmctx *ctx, uint64_t offset)
 {
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm HPET template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0004]\t\tSignature : \"HPET\"\n");
-	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
-	EFPRINTF(fp, "[0001]\t\tRevision : 01\n");
-	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
-	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
-	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMHPET  \"\n");
-	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
-
-	/* iasl will fill in the compiler ID/revision fields */
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0004]\t\tTimer Block ID : 00000000\n");
-	EFPRINTF(fp,
-	    "[0012]\t\tTimer Block Register : [Generic Address Structure]\n");
-	EFPRINTF(fp, "[0001]\t\tSpace ID : 00 [SystemMemory]\n");
-	EFPRINTF(fp, "[0001]\t\tBit Width : 00\n");
-	EFPRINTF(fp, "[0001]\t\tBit Offset : 00\n");
-	EFPRINTF(fp,
-		 "[0001]\t\tEncoded Access Width : 00 [Undefined/Legacy]\n");
-	EFPRINTF(fp, "[0008]\t\tAddress : 00000000FED00000\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0001]\t\tHPET Number : 00\n");
-	EFPRINTF(fp, "[0002]\t\tMinimum Clock Ticks : 0000\n");
-	EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000001\n");
-	EFPRINTF(fp, "\t\t\t4K Page Protect : 1\n");
-	EFPRINTF(fp, "\t\t\t64K Page Protect : 0\n");
-	EFPRINTF(fp, "\n");
+	struct acpi_hpet *hpet;
 
-	EFFLUSH(fp);
+	hpet = basl_table_map(ctx, offset, sizeof(*hpet));
+	if (hpet == NULL)
+		return -1;
+
+	basl_table_hdr(&hpet->hdr, "HPET", 1, BASL_OEM_ID, "DMHPET  ", 1);
+	basl_gas(&hpet->address, GAS_SYSTEM_MEMORY, 0, 0, 0xFED00000);
+	hpet->flags = 1;	/* 4K page protect */
+	basl_table_done(&hpet->hdr, sizeof(*hpet));
 
 	return 0;
 }
 
 static int
-basl_fwrite_mcfg(FILE *fp, struct vmctx *ctx)
+basl_build_mcfg(struct vmctx *ctx, uint64_t offset)
 {
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm MCFG template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0004]\t\tSignature : \"MCFG\"\n");
-	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
-	EFPRINTF(fp, "[0001]\t\tRevision : 01\n");
-	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
-	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
-	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMMCFG  \"\n");
-	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
-
-	/* iasl will fill in the compiler ID/revision fields */
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
-	EFPRINTF(fp, "[0008]\t\tReserved : 0\n");
-	EFPRINTF(fp, "\n");
-
-	EFPRINTF(fp, "[0008]\t\tBase Address : %016lX\n", pci_ecfg_base());
-	EFPRINTF(fp, "[0002]\t\tSegment Group: 0000\n");
-	EFPRINTF(fp, "[0001]\t\tStart Bus: 00\n");
-	EFPRINTF(fp, "[0001]\t\tEnd Bus: FF\n");
-	EFPRINTF(fp, "[0004]\t\tReserved : 0\n");
-	EFFLUSH(fp);
+	struct acpi_mcfg *mcfg;
+
+	mcfg = basl_table_map(ctx, offset, sizeof(*mcfg));
+	if (mcfg == NULL)
+		return -1;
+
+	basl_table_hdr(&mcfg->hdr, "MCFG", 1, BASL_OEM_ID, "DMMCFG  ", 1);
+	mcfg->base_address = pci_ecfg_base();
+	mcfg->start_bus = 0;
+	mcfg->end_bus = 0xFF;
+	basl_table_done(&mcfg->hdr, sizeof(*mcfg));
 
 	return 0;
 }
 
 static int
-basl_fwrite_nhlt(FILE *fp, struct vmctx *ctx)
+basl_build_nhlt(struct vmctx *ctx, uint64_t offset)
 {
-	int offset, len;
-	uint8_t data;
+	struct acpi_table_hdr *hdr;
+	off_t size;
+	ssize_t len;
 	int fd = open("/sys/firmware/acpi/tables/NHLT", O_RDONLY);
 
 	if (fd < 0) {
@@ -589,72 +637,45 @@ basl_fwrite_nhlt(FILE *fp, struct vmctx *ctx)
 	}
 
 	/* check if file size exceeds reserved room */
-	if (lseek(fd, 0, SEEK_END) > DSDT_OFFSET - NHLT_OFFSET) {
+	size = lseek(fd, 0, SEEK_END);
+	if (size > DSDT_OFFSET - NHLT_OFFSET || size < sizeof(*hdr)) {
 		fprintf(stderr, "Host NHLT exceeds reserved room!\n");
 		close(fd);
 		return -1;
 	}
 
-	/* skip 36 bytes as NHLT table header */
-	offset = lseek(fd, 36, SEEK_SET);
-	if (offset != 36) {
-		fprintf(stderr, "Seek NHLT data fail! %s\n", strerror(errno));
+	hdr = basl_table_map(ctx, offset, size);
+	if (hdr == NULL) {
 		close(fd);
 		return -1;
 	}
 
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm NHLT template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0004]\t\tSignature : \"NHLT\"\n");
-	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
-	EFPRINTF(fp, "[0001]\t\tRevision : 00\n");
-	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
-	EFPRINTF(fp, "[0006]\t\tOem ID : \"INTEL \"\n");
-	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"NHLT-GPA\"\n");
-	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000008\n");
-
-	/* iasl will fill in the compiler ID/revision fields */
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
-	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
-
-	while ((len = read(fd, &data, 1)) == 1)
-		EFPRINTF(fp, "UINT8 : %02X\n", data);
-
-	if (len < 0) {
+	/* keep the host NHLT data, with our own 36 bytes table header */
+	len = pread(fd, hdr + 1, size - sizeof(*hdr), sizeof(*hdr));
+	close(fd);
+	if (len != size - sizeof(*hdr)) {
 		fprintf(stderr, "Read host NHLT fail! %s\n", strerror(errno));
-		close(fd);
 		return -1;
 	}
 
-	EFFLUSH(fp);
-	close(fd);
+	basl_table_hdr(hdr, "NHLT", 0, "INTEL ", "NHLT-GPA", 8);
+	basl_table_done(hdr, size);
 
 	return 0;
 }
 
 static int
-basl_fwrite_facs(FILE *fp, struct vmctx *ctx)
+basl_build_facs(struct vmctx *ctx, uint64_t offset)
 {
-	EFPRINTF(fp, "/*\n");
-	EFPRINTF(fp, " * dm FACS template\n");
-	EFPRINTF(fp, " */\n");
-	EFPRINTF(fp, "[0004]\t\tSignature : \"FACS\"\n");
-	EFPRINTF(fp, "[0004]\t\tLength : 00000040\n");
-	EFPRINTF(fp, "[0004]\t\tHardware Signature : 00000000\n");
-	EFPRINTF(fp, "[0004]\t\t32 Firmware Waking Vector : 00000000\n");
-	EFPRINTF(fp, "[0004]\t\tGlobal Lock : 00000000\n");
-	EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000000\n");
-	EFPRINTF(fp, "\t\t\tS4BIOS Support Present : 0\n");
-	EFPRINTF(fp, "\t\t\t64-bit Wake Supported (V2) : 0\n");
-	EFPRINTF(fp,
-	    "[0008]\t\t64 Firmware Waking Vector : 0000000000000000\n");
-	EFPRINTF(fp, "[0001]\t\tVersion : 02\n");
-	EFPRINTF(fp, "[0003]\t\tReserved : 000000\n");
-	EFPRINTF(fp, "[0004]\t\tOspmFlags (decoded below) : 00000000\n");
-	EFPRINTF(fp, "\t\t\t64-bit Wake Env Required (V2) : 0\n");
+	struct acpi_facs *facs;
 
-	EFFLUSH(fp);
+	facs = basl_table_map(ctx, offset, sizeof(*facs));
+	if (facs == NULL)
+		return -1;
+
+	memcpy(facs->signature, "FACS", sizeof(facs->signature));
+	facs->length = sizeof(*facs);
+	facs->version = 2;
 
 	return 0;
 }
@@ -836,28 +857,34 @@ basl_end(struct basl_fio *in, struct basl_fio *out)
 }
 
 static int
-basl_load(struct vmctx *ctx, int fd, uint64_t off)
+basl_read(int fd, uint8_t **buf, size_t *len)
 {
 	struct stat sb;
-	void *gaddr;
+	uint8_t *data;
 
-	if (fstat(fd, &sb) < 0)
+	if (fstat(fd, &sb) < 0 || sb.st_size <= 0)
 		return -1;
 
-	gaddr = paddr_guest2host(ctx, basl_acpi_base + off, sb.st_size);
-	if (gaddr == NULL)
+	data = malloc(sb.st_size);
+	if (data == NULL)
 		return -1;
 
-	if (read(fd, gaddr, sb.st_size) < 0)
+	if (pread(fd, data, sb.st_size, 0) != sb.st_size) {
+		free(data);
 		return -1;
+	}
 
+	*buf = data;
+	*len = sb.st_size;
 	return 0;
 }
 
+/*
+ * Compile the DSDT ASL source with iasl. On success the AML is returned
+ * in a malloc'ed buffer.
+ */
 static int
-basl_compile(struct vmctx *ctx,
-		int (*fwrite_section)(FILE *, struct vmctx *),
-		uint64_t offset)
+basl_compile(const char *asl, size_t asl_len, uint8_t **aml, size_t *aml_len)
 {
 	struct basl_fio io[2];
 	static char iaslbuf[3*MAXPATHLEN + 10];
@@ -865,7 +892,9 @@ basl_compile(struct vmctx *ctx,
 
 	err = basl_start(&io[0], &io[1]);
 	if (!err) {
-		err = (*fwrite_section)(io[0].fp, ctx);
+		if (fwrite(asl, 1, asl_len, io[0].fp) != asl_len ||
+		    fflush(io[0].fp) != 0)
+			err = -1;
 
 		if (!err) {
 			/*
@@ -888,13 +917,9 @@ basl_compile(struct vmctx *ctx,
 
 			err = system(iaslbuf);
 
-			if (!err) {
-				/*
-				 * Copy the aml output file into guest
-				 * memory at the specified location
-				 */
-				err = basl_load(ctx, io[1].fd, offset);
-			} else
+			if (!err)
+				err = basl_read(io[1].fd, aml, aml_len);
+			else
 				err = -1;
 		}
 		basl_end(&io[0], &io[1]);
@@ -903,6 +928,146 @@ basl_compile(struct vmctx *ctx,
 	return err;
 }
 
+/* FNV-1a, used to key the compiled DSDT by its ASL source */
+static uint64_t
+basl_hash(const char *data, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325UL;
+
+	while (len--) {
+		hash ^= (uint8_t)*data++;
+		hash *= 0x100000001b3UL;
+	}
+	return hash;
+}
+
+static bool
+basl_aml_valid(const uint8_t *aml, size_t len)
+{
+	const struct acpi_table_hdr *hdr = (const struct acpi_table_hdr *)aml;
+
+	return len >= sizeof(*hdr) && hdr->length == len &&
+		memcmp(hdr->signature, "DSDT", 4) == 0 &&
+		basl_checksum(aml, len) == 0;
+}
+
+static int
+basl_cache_lookup(uint64_t hash, uint8_t **aml, size_t *len)
+{
+	char path[MAXPATHLEN];
+	int fd, err;
+
+	snprintf(path, sizeof(path), ACPI_CACHE_DIR "/dsdt-%016lx.aml", hash);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	err = basl_read(fd, aml, len);
+	close(fd);
+	if (err)
+		return -1;
+
+	if (!basl_aml_valid(*aml, *len)) {
+		free(*aml);
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Failing to cache only costs the next boot an iasl run */
+static void
+basl_cache_store(uint64_t hash, const uint8_t *aml, size_t len)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN];
+	int fd;
+
+	if (mkdir(ACPI_STATE_DIR, 0755) < 0 && errno != EEXIST)
+		return;
+	if (mkdir(ACPI_CACHE_DIR, 0700) < 0 && errno != EEXIST)
+		return;
+
+	snprintf(path, sizeof(path), ACPI_CACHE_DIR "/dsdt-%016lx.aml", hash);
+	snprintf(tmp, sizeof(tmp), ACPI_CACHE_DIR "/dsdt-%016lx.aml.XXXXXX",
+		 hash);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+
+	if (write(fd, aml, len) != len || rename(tmp, path) < 0)
+		unlink(tmp);
+	close(fd);
+}
+
+/*
+ * The DSDT is the only table with free-form content, devices add to
+ * it through vdev_write_dsdt. It still needs iasl, but the compiled
+ * AML is kept in memory for VM resets and in ACPI_CACHE_DIR across
+ * DM runs and host reboots, so iasl only runs the first time a device
+ * configuration is seen.
+ */
+static struct {
+	uint64_t	hash;
+	uint8_t		*aml;
+	size_t		len;
+} dsdt_cache;
+
+static int
+basl_build_dsdt(struct vmctx *ctx, uint64_t offset)
+{
+	char *asl = NULL;
+	size_t asl_len = 0;
+	uint8_t *aml;
+	size_t aml_len;
+	uint64_t hash;
+	void *gaddr;
+	FILE *fp;
+	int err;
+
+	fp = open_memstream(&asl, &asl_len);
+	if (fp == NULL)
+		return -1;
+
+	err = basl_fwrite_dsdt(fp, ctx);
+	fclose(fp);
+	if (err) {
+		free(asl);
+		return err;
+	}
+
+	hash = basl_hash(asl, asl_len);
+	if (dsdt_cache.aml == NULL || dsdt_cache.hash != hash) {
+		/* with ACPI_KEEPTMPS always compile to leave the ASL behind */
+		if (basl_keep_temps || basl_cache_lookup(hash, &aml, &aml_len)) {
+			err = basl_compile(asl, asl_len, &aml, &aml_len);
+			if (!err)
+				basl_cache_store(hash, aml, aml_len);
+		}
+
+		if (!err) {
+			free(dsdt_cache.aml);
+			dsdt_cache.aml = aml;
+			dsdt_cache.len = aml_len;
+			dsdt_cache.hash = hash;
+		}
+	}
+	free(asl);
+	if (err)
+		return err;
+
+	if (dsdt_cache.len > ACPI_LENGTH - DSDT_OFFSET) {
+		fprintf(stderr, "DSDT exceeds reserved room!\n");
+		return -1;
+	}
+
+	gaddr = paddr_guest2host(ctx, basl_acpi_base + offset, dsdt_cache.len);
+	if (gaddr == NULL)
+		return -1;
+
+	memcpy(gaddr, dsdt_cache.aml, dsdt_cache.len);
+	return 0;
+}
+
 static int
 basl_make_templates(void)
 {
@@ -952,20 +1117,20 @@ basl_make_templates(void)
 }
 
 static struct {
-	int	(*wsect)(FILE *fp, struct vmctx *ctx);
+	int	(*build)(struct vmctx *ctx, uint64_t offset);
 	uint64_t  offset;
 	bool	valid;
 } basl_ftables[] = {
-	{ basl_fwrite_rsdp, 0,		 true  },
-	{ basl_fwrite_rsdt, RSDT_OFFSET, true  },
-	{ basl_fwrite_xsdt, XSDT_OFFSET, true  },
-	{ basl_fwrite_madt, MADT_OFFSET, true  },
-	{ basl_fwrite_fadt, FADT_OFFSET, true  },
-	{ basl_fwrite_hpet, HPET_OFFSET, true  },
-	{ basl_fwrite_mcfg, MCFG_OFFSET, true  },
-	{ basl_fwrite_facs, FACS_OFFSET, true  },
-	{ basl_fwrite_nhlt, NHLT_OFFSET, false }, /*valid with audio ptdev*/
-	{ basl_fwrite_dsdt, DSDT_OFFSET, true  }
+	{ basl_build_rsdp, 0,		 true  },
+	{ basl_build_rsdt, RSDT_OFFSET, true  },
+	{ basl_build_xsdt, XSDT_OFFSET, true  },
+	{ basl_build_madt, MADT_OFFSET, true  },
+	{ basl_build_fadt, FADT_OFFSET, true  },
+	{ basl_build_hpet, HPET_OFFSET, true  },
+	{ basl_build_mcfg, MCFG_OFFSET, true  },
+	{ basl_build_facs, FACS_OFFSET, true  },
+	{ basl_build_nhlt, NHLT_OFFSET, false }, /*valid with audio ptdev*/
+	{ basl_build_dsdt, DSDT_OFFSET, true  }
 };
 
 void
@@ -1017,12 +1182,11 @@ acpi_build(struct vmctx *ctx, int ncpu)
 	err = basl_make_templates();
 
 	/*
-	 * Run through all the ASL files, compiling them and
-	 * copying them into guest memory
+	 * Run through all the tables, building them in guest memory
 	 */
 	while (!err && (i < ARRAY_SIZE(basl_ftables))) {
 		if (basl_ftables[i].valid)
-			err = basl_compile(ctx, basl_ftables[i].wsect,
+			err = basl_ftables[i].build(ctx,
 					basl_ftables[i].offset);
 		i++;
 	}
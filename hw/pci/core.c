@@ -49,6 +49,9 @@
 #include "irq.h"
 #include "lpc.h"
 #include "sw_load.h"
+#include "handover.h"
+#include "timeline.h"
+#include "metrics.h"
 
 #define CONF1_ADDR_PORT    0x0cf8
 #define CONF1_DATA_PORT    0x0cfc
@@ -63,6 +66,7 @@ struct funcinfo {
 	char	*fi_name;
 	char	*fi_param;
 	char	*fi_param_saved; /* save for reboot */
+	bool	fi_lazy;	/* defer backend setup, see vdev_activate */
 	struct pci_vdev *fi_devi;
 };
 
@@ -162,8 +166,9 @@ pci_parse_slot(char *opt)
 {
 	struct businfo *bi;
 	struct slotinfo *si;
-	char *emul, *config, *str, *cp, *b = NULL;
+	char *emul, *config, *str, *cp;
 	int error, bnum, snum, fnum;
+	bool boot = false, lazy = false;
 
 	error = -1;
 	str = strdup(opt);
@@ -181,17 +186,26 @@ pci_parse_slot(char *opt)
 		if (cp != NULL) {
 			*cp = '\0';
 			config = cp + 1;
-			cp = strchr(config, ',');
-			if (cp != NULL) {
-				*cp = '\0';
-				b = cp + 1;
-			}
 		}
 	} else {
 		pci_parse_slot_usage(opt);
 		goto done;
 	}
 
+	/*
+	 * The device config runs to the end of the option, but for the slot
+	 * flags trailing it as whole tokens: "b" (vsbl boot disk) and "lazy".
+	 */
+	while (config && (cp = strrchr(config, ',')) != NULL) {
+		if (!strcmp(cp + 1, "b"))
+			boot = true;
+		else if (!strcmp(cp + 1, "lazy"))
+			lazy = true;
+		else
+			break;
+		*cp = '\0';
+	}
+
 	/* <bus>:<slot>:<func> */
 	if (sscanf(str, "%d:%d:%d", &bnum, &snum, &fnum) != 3) {
 		bnum = 0;
@@ -233,12 +247,9 @@ pci_parse_slot(char *opt)
 	/* saved fi param in case reboot */
 	si->si_funcs[fnum].fi_param_saved = config;
 
-	if (b != NULL) {
-		if ((strcmp("virtio-blk", emul) == 0) &&  (b != NULL) &&
-			(strchr(b, 'b') != NULL)) {
-			vsbl_set_bdf(bnum, snum, fnum);
-		}
-	}
+	if (boot && strcmp("virtio-blk", emul) == 0)
+		vsbl_set_bdf(bnum, snum, fnum);
+	si->si_funcs[fnum].fi_lazy = lazy;
 done:
 	if (error)
 		free(str);
@@ -364,6 +375,7 @@ pci_emul_io_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 	uint64_t offset;
 	int i;
 
+	metric_inc(pdi->m_access);
 	for (i = 0; i <= PCI_BARMAX; i++) {
 		if (pdi->bar[i].type == PCIBAR_IO &&
 		    port >= pdi->bar[i].addr &&
@@ -390,6 +402,7 @@ pci_emul_mem_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 	uint64_t offset;
 	int bidx = (int) arg2;
 
+	metric_inc(pdi->m_access);
 	assert(bidx <= PCI_BARMAX);
 	assert(pdi->bar[bidx].type == PCIBAR_MEM32 ||
 	       pdi->bar[bidx].type == PCIBAR_MEM64);
@@ -733,17 +746,105 @@ pci_emul_finddev(char *name)
 	return NULL;
 }
 
+static void
+pci_emul_handover_name(struct pci_vdev *dev, char *name, size_t len)
+{
+	snprintf(name, len, "pci-%d:%d.%d", dev->bus, dev->slot, dev->func);
+}
+
+static bool
+bar_decoded(struct pci_vdev *dev, int idx)
+{
+	switch (dev->bar[idx].type) {
+	case PCIBAR_IO:
+		return porten(dev) != 0;
+	case PCIBAR_MEM32:
+	case PCIBAR_MEM64:
+		return memen(dev) != 0;
+	default:
+		return false;
+	}
+}
+
 static int
-pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
-	      int func, struct funcinfo *fi)
+pci_emul_save(void *arg, struct handover_buf *hb)
 {
-	struct pci_vdev *pdi;
+	struct pci_vdev *dev = arg;
 	int err;
 
+	err = handover_put(hb, dev->cfgdata, sizeof(dev->cfgdata));
+	err |= handover_put(hb, dev->bar, sizeof(dev->bar));
+	err |= handover_put(hb, &dev->lintr.state, sizeof(dev->lintr.state));
+	err |= handover_put(hb, &dev->msi.enabled, sizeof(dev->msi.enabled));
+	err |= handover_put(hb, &dev->msi.addr, sizeof(dev->msi.addr));
+	err |= handover_put(hb, &dev->msi.msg_data, sizeof(dev->msi.msg_data));
+	err |= handover_put(hb, &dev->msix.enabled, sizeof(dev->msix.enabled));
+	err |= handover_put(hb, &dev->msix.function_mask,
+			sizeof(dev->msix.function_mask));
+	err |= handover_put(hb, &dev->msix.table_count,
+			sizeof(dev->msix.table_count));
+	if (dev->msix.table_count > 0)
+		err |= handover_put(hb, dev->msix.table,
+			dev->msix.table_count * MSIX_TABLE_ENTRY_SIZE);
+	if (err)
+		return -1;
+
+	if (dev->dev_ops->vdev_save)
+		return (*dev->dev_ops->vdev_save)(dev->vmctx, dev, hb);
+	return 0;
+}
+
+static int
+pci_emul_restore(void *arg, struct handover_buf *hb)
+{
+	struct pci_vdev *dev = arg;
+	int i, count, err;
+
+	/*
+	 * The BARs were registered at their default location by vdev_init,
+	 * move them to where the guest has programmed them.
+	 */
+	for (i = 0; i <= PCI_BARMAX; i++)
+		if (bar_decoded(dev, i))
+			unregister_bar(dev, i);
+
+	err = handover_get(hb, dev->cfgdata, sizeof(dev->cfgdata));
+	err |= handover_get(hb, dev->bar, sizeof(dev->bar));
+	err |= handover_get(hb, &dev->lintr.state, sizeof(dev->lintr.state));
+	err |= handover_get(hb, &dev->msi.enabled, sizeof(dev->msi.enabled));
+	err |= handover_get(hb, &dev->msi.addr, sizeof(dev->msi.addr));
+	err |= handover_get(hb, &dev->msi.msg_data, sizeof(dev->msi.msg_data));
+	err |= handover_get(hb, &dev->msix.enabled, sizeof(dev->msix.enabled));
+	err |= handover_get(hb, &dev->msix.function_mask,
+			sizeof(dev->msix.function_mask));
+	err |= handover_get(hb, &count, sizeof(count));
+	if (err || count != dev->msix.table_count) {
+		fprintf(stderr, "%s: bad handover state\n", dev->name);
+		return -1;
+	}
+	if (count > 0 && handover_get(hb, dev->msix.table,
+			count * MSIX_TABLE_ENTRY_SIZE) != 0)
+		return -1;
+
+	for (i = 0; i <= PCI_BARMAX; i++)
+		if (bar_decoded(dev, i))
+			register_bar(dev, i);
+
+	if (dev->dev_ops->vdev_restore)
+		return (*dev->dev_ops->vdev_restore)(dev->vmctx, dev, hb);
+	return 0;
+}
+
+static struct pci_vdev *
+pci_emul_alloc(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
+	       int func, struct funcinfo *fi)
+{
+	struct pci_vdev *pdi;
+
 	pdi = calloc(1, sizeof(struct pci_vdev));
 	if (!pdi) {
 		fprintf(stderr, "%s: calloc returns NULL\n", __func__);
-		return -1;
+		return NULL;
 	}
 
 	pdi->vmctx = ctx;
@@ -769,24 +870,179 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		fi->fi_param = strdup(fi->fi_param_saved);
 	else
 		fi->fi_param = NULL;
+
+	if (fi->fi_lazy) {
+		if (ops->vdev_activate)
+			pdi->lazy = PCI_LAZY_ENABLE;
+		else
+			fprintf(stderr, "%s: lazy setup not supported, "
+				"ignored\n", pdi->name);
+	}
+
+	return pdi;
+}
+
+/* Drop a device whose vdev_init has not succeeded */
+static void
+pci_emul_release(struct vmctx *ctx, struct pci_vdev *pdi, struct funcinfo *fi,
+		 bool prepared)
+{
+	struct pci_vdev_ops *ops = pdi->dev_ops;
+
+	if (prepared && ops->vdev_prepare && ops->vdev_deinit)
+		(*ops->vdev_deinit)(ctx, pdi, fi->fi_param);
+	free(pdi);
+}
+
+static int
+pci_emul_init(struct vmctx *ctx, struct pci_vdev *pdi, struct funcinfo *fi)
+{
+	struct pci_vdev_ops *ops = pdi->dev_ops;
+	char name[HANDOVER_NAME_LEN];
+	int err, tl;
+
+	tl = timeline_begin("vdev_init:%s@%d:%d.%d", ops->class_name,
+			    pdi->bus, pdi->slot, pdi->func);
 	err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
-	if (err == 0)
+	timeline_end(tl);
+	if (err == 0) {
 		fi->fi_devi = pdi;
-	else
-		free(pdi);
+		pdi->m_access = metric_register(METRIC_COUNTER,
+			"acrn_pci_bar_accesses_total", "dev=\"%s@%d:%d.%d\"",
+			ops->class_name, pdi->bus, pdi->slot, pdi->func);
+		pdi->m_intr = metric_register(METRIC_COUNTER,
+			"acrn_pci_interrupts_total", "dev=\"%s@%d:%d.%d\"",
+			ops->class_name, pdi->bus, pdi->slot, pdi->func);
+		/* devices without vdev_restore block a live handover */
+		pci_emul_handover_name(pdi, name, sizeof(name));
+		handover_register(name,
+			ops->vdev_restore ? pci_emul_save : NULL,
+			pci_emul_restore, pdi);
+	} else
+		pci_emul_release(ctx, pdi, fi, true);
 
 	return err;
 }
 
+/*
+ * Device initialization runs in two phases. vdev_prepare does the slow
+ * backend work (opening images, spawning threads) that only touches the
+ * device's own state, so the prepare callbacks of all devices run in
+ * parallel on a small pool of threads. vdev_init then runs for each
+ * device in bus/slot/function order, exactly as before, so that BAR
+ * allocation, IRQ assignment and DSDT order do not depend on timing.
+ */
+#define	PCI_PREPARE_THREADS	8
+
+struct pci_init_job {
+	struct funcinfo	*fi;
+	struct pci_vdev	*dev;
+	int		err;
+	bool		prepared;
+};
+
+static struct {
+	struct pci_init_job *jobs;
+	int		njobs;
+	int		next;
+	pthread_mutex_t	mtx;
+} pci_prepare_pool = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *
+pci_prepare_worker(void *arg)
+{
+	struct pci_init_job *job;
+	struct pci_vdev *dev;
+	int i, tl;
+
+	for (;;) {
+		pthread_mutex_lock(&pci_prepare_pool.mtx);
+		i = pci_prepare_pool.next++;
+		pthread_mutex_unlock(&pci_prepare_pool.mtx);
+		if (i >= pci_prepare_pool.njobs)
+			break;
+
+		job = &pci_prepare_pool.jobs[i];
+		dev = job->dev;
+		if (dev->dev_ops->vdev_prepare == NULL)
+			continue;
+
+		tl = timeline_begin("vdev_prepare:%s@%d:%d.%d",
+				    dev->dev_ops->class_name,
+				    dev->bus, dev->slot, dev->func);
+		job->err = (*dev->dev_ops->vdev_prepare)(dev->vmctx, dev,
+							 job->fi->fi_param);
+		job->prepared = (job->err == 0);
+		timeline_end(tl);
+	}
+
+	return NULL;
+}
+
+static int
+pci_prepare_all(struct pci_init_job *jobs, int njobs)
+{
+	pthread_t tids[PCI_PREPARE_THREADS];
+	int i, n, nthreads;
+
+	for (i = 0, n = 0; i < njobs; i++)
+		if (jobs[i].dev->dev_ops->vdev_prepare)
+			n++;
+
+	pci_prepare_pool.jobs = jobs;
+	pci_prepare_pool.njobs = njobs;
+	pci_prepare_pool.next = 0;
+
+	/* the calling thread is one of the workers */
+	nthreads = MIN(n, PCI_PREPARE_THREADS) - 1;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, pci_prepare_worker,
+				   NULL) != 0) {
+			nthreads = i;
+			break;
+		}
+		pthread_setname_np(tids[i], "pci-prepare");
+	}
+	pci_prepare_worker(NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].err) {
+			fprintf(stderr, "%s: failed to prepare %s\n", __func__,
+				jobs[i].dev->name);
+			return jobs[i].err;
+		}
+	}
+	return 0;
+}
+
 static void
 pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		int func, struct funcinfo *fi)
 {
+	char name[HANDOVER_NAME_LEN];
+
+	if (fi->fi_devi) {
+		pci_emul_handover_name(fi->fi_devi, name, sizeof(name));
+		handover_unregister(name);
+	}
+
 	if (ops->vdev_deinit)
 		(*ops->vdev_deinit)(ctx, fi->fi_devi, fi->fi_param);
 	if (fi->fi_param)
 		free(fi->fi_param);
 
+	/* The device threads, which raise interrupts, are gone now */
+	if (fi->fi_devi) {
+		metric_unregister(fi->fi_devi->m_access);
+		metric_unregister(fi->fi_devi->m_intr);
+		fi->fi_devi->m_access = NULL;
+		fi->fi_devi->m_intr = NULL;
+	}
+
 	pci_emul_free_bars(fi->fi_devi);
 	if (fi->fi_devi)
 		free(fi->fi_devi);
@@ -1106,14 +1362,61 @@ init_pci(struct vmctx *ctx)
 	struct businfo *bi;
 	struct slotinfo *si;
 	struct funcinfo *fi;
+	struct pci_init_job *jobs;
 	size_t lowmem;
 	int bus, slot, func;
-	int error;
+	int error, i, njobs, next;
 
 	pci_emul_iobase = PCI_EMUL_IOBASE;
 	pci_emul_membase32 = vm_get_lowmem_limit(ctx);
 	pci_emul_membase64 = PCI_EMUL_MEMBASE64;
 
+	/* collect all configured functions, in initialization order */
+	njobs = 0;
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+		for (slot = 0; slot < MAXSLOTS; slot++)
+			for (func = 0; func < MAXFUNCS; func++)
+				if (bi->slotinfo[slot].si_funcs[func].fi_name)
+					njobs++;
+	}
+
+	jobs = calloc(njobs ? njobs : 1, sizeof(struct pci_init_job));
+	if (jobs == NULL)
+		return -1;
+
+	njobs = 0;
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			si = &bi->slotinfo[slot];
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &si->si_funcs[func];
+				if (fi->fi_name == NULL)
+					continue;
+				ops = pci_emul_finddev(fi->fi_name);
+				assert(ops != NULL);
+				jobs[njobs].fi = fi;
+				jobs[njobs].dev = pci_emul_alloc(ctx, ops, bus,
+						slot, func, fi);
+				if (jobs[njobs].dev == NULL) {
+					error = -1;
+					goto release;
+				}
+				njobs++;
+			}
+		}
+	}
+
+	error = pci_prepare_all(jobs, njobs);
+	if (error)
+		goto release;
+
+	next = 0;
 	for (bus = 0; bus < MAXBUSES; bus++) {
 		bi = pci_businfo[bus];
 		if (bi == NULL)
@@ -1132,12 +1435,11 @@ init_pci(struct vmctx *ctx)
 				fi = &si->si_funcs[func];
 				if (fi->fi_name == NULL)
 					continue;
-				ops = pci_emul_finddev(fi->fi_name);
-				assert(ops != NULL);
-				error = pci_emul_init(ctx, ops, bus, slot,
-				    func, fi);
+				assert(jobs[next].fi == fi);
+				error = pci_emul_init(ctx, jobs[next].dev, fi);
+				jobs[next++].dev = NULL;
 				if (error)
-					return error;
+					goto release;
 			}
 		}
 
@@ -1186,6 +1488,7 @@ init_pci(struct vmctx *ctx)
 		}
 	}
 	lpc_pirq_routed();
+	free(jobs);
 
 	/*
 	 * The guest physical memory map looks like the following:
@@ -1222,6 +1525,15 @@ init_pci(struct vmctx *ctx)
 	assert(error == 0);
 
 	return 0;
+
+release:
+	/* devices that have not been handed to vdev_init */
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].dev)
+			pci_emul_release(ctx, jobs[i].dev, jobs[i].fi,
+					 jobs[i].prepared);
+	free(jobs);
+	return error;
 }
 
 void
@@ -1522,6 +1834,7 @@ pci_generate_msix(struct pci_vdev *dev, int index)
 	mte = &dev->msix.table[index];
 	if ((mte->vector_control & PCIM_MSIX_VCTRL_MASK) == 0) {
 		/* XXX Set PBA bit if interrupt is disabled */
+		metric_inc(dev->m_intr);
 		vm_lapic_msi(dev->vmctx, mte->addr, mte->msg_data);
 	}
 }
@@ -1530,6 +1843,7 @@ void
 pci_generate_msi(struct pci_vdev *dev, int index)
 {
 	if (pci_msi_enabled(dev) && index < pci_msi_maxmsgnum(dev)) {
+		metric_inc(dev->m_intr);
 		vm_lapic_msi(dev->vmctx, dev->msi.addr,
 			     dev->msi.msg_data + index);
 	}
@@ -1617,6 +1931,7 @@ pci_lintr_assert(struct pci_vdev *dev)
 	if (dev->lintr.state == IDLE) {
 		if (pci_lintr_permitted(dev)) {
 			dev->lintr.state = ASSERTED;
+			metric_inc(dev->m_intr);
 			pci_irq_assert(dev);
 		} else
 			dev->lintr.state = PENDING;
@@ -1803,6 +2118,15 @@ pci_emul_cmdsts_write(struct pci_vdev *dev, int coff, uint32_t new, int bytes)
 		}
 	}
 
+	/*
+	 * A lazy device gets its backend once decoding is turned on.
+	 * Guests toggle decoding while sizing BARs, which is why virtio
+	 * devices wait for DRIVER_OK instead.
+	 */
+	if (dev->lazy == PCI_LAZY_ENABLE &&
+	    (changed & cmd2 & (PCIM_CMD_PORTEN | PCIM_CMD_MEMEN)))
+		pci_emul_activate(dev);
+
 	/*
 	 * If INTx has been unmasked and is pending, assert the
 	 * interrupt.
@@ -1810,6 +2134,25 @@ pci_emul_cmdsts_write(struct pci_vdev *dev, int coff, uint32_t new, int bytes)
 	pci_lintr_update(dev);
 }
 
+/*
+ * Set up the backend of a lazy device. Called from the vCPU thread
+ * that enabled the device; only the first caller does the work. If
+ * it fails the device stays without a backend, which the emulation
+ * treats like a backend that is gone.
+ */
+void
+pci_emul_activate(struct pci_vdev *dev)
+{
+	enum pci_lazy lazy = dev->lazy;
+
+	if (lazy == PCI_LAZY_NONE ||
+	    !__sync_bool_compare_and_swap(&dev->lazy, lazy, PCI_LAZY_NONE))
+		return;
+
+	if ((*dev->dev_ops->vdev_activate)(dev->vmctx, dev) != 0)
+		fprintf(stderr, "%s: backend setup failed\n", dev->name);
+}
+
 static void
 pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot, int func,
 	  int coff, int bytes, uint32_t *eax)
@@ -55,14 +55,24 @@ pci_amd_hostbridge_init(struct vmctx *ctx, struct pci_vdev *pi, char *opts)
 	return 0;
 }
 
+/* all the state is in config space which the PCI core carries over */
+static int
+pci_hostbridge_restore(struct vmctx *ctx, struct pci_vdev *pi,
+		       struct handover_buf *hb)
+{
+	return 0;
+}
+
 struct pci_vdev_ops pci_ops_amd_hostbridge = {
 	.class_name	= "amd_hostbridge",
 	.vdev_init	= pci_amd_hostbridge_init,
+	.vdev_restore	= pci_hostbridge_restore,
 };
 DEFINE_PCI_DEVTYPE(pci_ops_amd_hostbridge);
 
 struct pci_vdev_ops pci_ops_hostbridge = {
 	.class_name	= "hostbridge",
 	.vdev_init	= pci_hostbridge_init,
+	.vdev_restore	= pci_hostbridge_restore,
 };
 DEFINE_PCI_DEVTYPE(pci_ops_hostbridge);
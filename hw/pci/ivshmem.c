@@ -0,0 +1,760 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Inter-VM shared memory device (ivshmem)
+ *
+ * Exposes a host shared memory object to several VMs at once, with the
+ * ids and register layout of the QEMU ivshmem device so the existing guest
+ * drivers can be used:
+ *
+ *	BAR0	registers
+ *	BAR1	MSI-X table and PBA
+ *	BAR2	shared memory, mapped into the guest where it was set up,
+ *		the guest can't move it
+ *
+ * Plain shared memory, a file on hugetlbfs that every VM opens:
+ *	-s <slot>,ivshmem,shm=/dev/hugepages/<name>,size=<size>
+ *
+ * Shared memory and doorbells from an ivshmem server, see ivshmem.h:
+ *	-s <slot>,ivshmem,server=<socket>[,vectors=<n>]
+ *
+ * A doorbell write from the guest goes straight to the eventfd of the
+ * peer vector; eventfds of our own vectors are turned into MSI-X messages,
+ * or into INTx when MSI-X is disabled.
+ *
+ * The shared memory is mapped into the guest through its host virtual
+ * address, which the hypervisor only supports for hugetlb pages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "mevent.h"
+#include "pci_core.h"
+#include "ivshmem.h"
+
+static int ivshmem_debug;
+#define DPRINTF(params) do { if (ivshmem_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+#define IVSHMEM_VENDOR		0x1af4
+#define IVSHMEM_DEV		0x1110
+
+#define IVSHMEM_REG_BAR		0
+#define IVSHMEM_MSIX_BAR	1
+#define IVSHMEM_MEM_BAR		2
+
+#define IVSHMEM_REG_SIZE	0x100
+
+/* BAR0 registers */
+#define IVSHMEM_REG_INTRMASK	0x00
+#define IVSHMEM_REG_INTRSTATUS	0x04
+#define IVSHMEM_REG_IVPOSITION	0x08
+#define IVSHMEM_REG_DOORBELL	0x0c
+
+#define IVSHMEM_HUGETLBFS_MAGIC	0x958458f6
+
+struct ivshmem_peer {
+	LIST_ENTRY(ivshmem_peer) link;
+	int id;
+	int nvecs;
+	int efd[IVSHMEM_MAX_VECTORS];
+};
+
+struct ivshmem_vec {
+	struct pci_ivshmem_vdev *ivdev;
+	int idx;
+	int efd;
+	struct mevent *mev;
+};
+
+struct pci_ivshmem_vdev {
+	struct pci_vdev *dev;
+	pthread_mutex_t mtx;		/* peers and interrupt registers */
+
+	int shm_fd;
+	void *shm;
+	size_t size;
+	uint64_t gpa;			/* where shm is mapped, 0 if not */
+
+	int sock;			/* server connection, -1 if none */
+	struct mevent *sock_mev;
+	int id;				/* our peer id */
+	int nvecs;
+	struct ivshmem_vec vecs[IVSHMEM_MAX_VECTORS];
+	LIST_HEAD(, ivshmem_peer) peers;
+
+	uint32_t intr_mask;
+	uint32_t intr_status;
+};
+
+static int
+ivshmem_parse_size(const char *str, size_t *size)
+{
+	char *end;
+	uint64_t val;
+
+	val = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'g':
+	case 'G':
+		val <<= 10;
+	case 'm':
+	case 'M':
+		val <<= 10;
+	case 'k':
+	case 'K':
+		val <<= 10;
+		end++;
+		break;
+	}
+	if (*end != '\0' || val == 0)
+		return -1;
+	*size = val;
+	return 0;
+}
+
+/*
+ * Receive one server message, fd is -1 if none came with it.
+ * Returns 0, or -1 on error or when the server went away.
+ */
+static int
+ivshmem_recv_msg(int sock, int64_t *val, int *fd, int flags)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t len;
+
+	*fd = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = val;
+	iov.iov_len = sizeof(*val);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	do {
+		len = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0)
+		return -1;
+	if (len != sizeof(*val)) {
+		errno = len ? EPROTO : ECONNRESET;
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_RIGHTS &&
+				cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	*val = le64toh(*val);
+	return 0;
+}
+
+static struct ivshmem_peer *
+ivshmem_find_peer(struct pci_ivshmem_vdev *ivdev, int id)
+{
+	struct ivshmem_peer *peer;
+
+	LIST_FOREACH(peer, &ivdev->peers, link)
+		if (peer->id == id)
+			return peer;
+	return NULL;
+}
+
+static void
+ivshmem_free_peer(struct ivshmem_peer *peer)
+{
+	int i;
+
+	LIST_REMOVE(peer, link);
+	for (i = 0; i < peer->nvecs; i++)
+		close(peer->efd[i]);
+	free(peer);
+}
+
+/*
+ * Level of the INTx line, called with the mutex held. Only the doorbell
+ * mode has an interrupt.
+ */
+static void
+ivshmem_update_intx(struct pci_ivshmem_vdev *ivdev)
+{
+	if (ivdev->sock < 0)
+		return;
+	if (ivdev->intr_status & ivdev->intr_mask)
+		pci_lintr_assert(ivdev->dev);
+	else
+		pci_lintr_deassert(ivdev->dev);
+}
+
+/*
+ * An eventfd of one of our vectors was signaled by a peer.
+ */
+static void
+ivshmem_vec_handler(int fd, enum ev_type t, void *arg)
+{
+	struct ivshmem_vec *vec = arg;
+	struct pci_ivshmem_vdev *ivdev = vec->ivdev;
+	struct pci_vdev *dev = ivdev->dev;
+	uint64_t cnt;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+
+	if (pci_msix_enabled(dev)) {
+		pci_generate_msix(dev, vec->idx);
+		return;
+	}
+
+	pthread_mutex_lock(&ivdev->mtx);
+	ivdev->intr_status |= 1;
+	ivshmem_update_intx(ivdev);
+	pthread_mutex_unlock(&ivdev->mtx);
+}
+
+static void
+ivshmem_add_vec(struct pci_ivshmem_vdev *ivdev, int fd)
+{
+	struct ivshmem_vec *vec;
+	int idx;
+
+	for (idx = 0; idx < ivdev->nvecs; idx++)
+		if (ivdev->vecs[idx].efd < 0)
+			break;
+	if (idx == ivdev->nvecs) {
+		DPRINTF(("ivshmem: ignore vector %d, only %d configured\n",
+				idx, ivdev->nvecs));
+		close(fd);
+		return;
+	}
+
+	vec = &ivdev->vecs[idx];
+	vec->efd = fd;
+	vec->mev = mevent_add(fd, EVF_READ, ivshmem_vec_handler, vec);
+	if (!vec->mev) {
+		WPRINTF(("ivshmem: failed to add vector %d\n", idx));
+		close(fd);
+		vec->efd = -1;
+	}
+}
+
+/*
+ * Handle one peer update from the server: a new vector of a peer, or a
+ * peer that went away.
+ */
+static void
+ivshmem_handle_msg(struct pci_ivshmem_vdev *ivdev, int64_t id, int fd)
+{
+	struct ivshmem_peer *peer;
+
+	if (id < 0 || id >= IVSHMEM_MAX_PEERS) {
+		WPRINTF(("ivshmem: invalid peer id %ld\n", id));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	if (id == ivdev->id) {
+		if (fd >= 0)
+			ivshmem_add_vec(ivdev, fd);
+		return;
+	}
+
+	pthread_mutex_lock(&ivdev->mtx);
+	peer = ivshmem_find_peer(ivdev, id);
+	if (fd < 0) {
+		if (peer) {
+			DPRINTF(("ivshmem: peer %ld left\n", id));
+			ivshmem_free_peer(peer);
+		}
+		goto done;
+	}
+
+	if (!peer) {
+		peer = calloc(1, sizeof(*peer));
+		if (!peer) {
+			close(fd);
+			goto done;
+		}
+		peer->id = id;
+		LIST_INSERT_HEAD(&ivdev->peers, peer, link);
+		DPRINTF(("ivshmem: peer %ld joined\n", id));
+	}
+	if (peer->nvecs < IVSHMEM_MAX_VECTORS)
+		peer->efd[peer->nvecs++] = fd;
+	else
+		close(fd);
+done:
+	pthread_mutex_unlock(&ivdev->mtx);
+}
+
+static void
+ivshmem_sock_handler(int fd, enum ev_type t, void *arg)
+{
+	struct pci_ivshmem_vdev *ivdev = arg;
+	int64_t val;
+	int efd;
+
+	while (ivshmem_recv_msg(fd, &val, &efd, MSG_DONTWAIT) == 0)
+		ivshmem_handle_msg(ivdev, val, efd);
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		WPRINTF(("ivshmem: lost the server connection\n"));
+		mevent_delete(ivdev->sock_mev);
+		ivdev->sock_mev = NULL;
+	}
+}
+
+/*
+ * Connect to the server and get the peer id and shared memory, the
+ * doorbells follow asynchronously.
+ */
+static int
+ivshmem_server_connect(struct pci_ivshmem_vdev *ivdev, const char *path)
+{
+	struct sockaddr_un addr;
+	int64_t val;
+	int fd;
+
+	ivdev->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ivdev->sock < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		WPRINTF(("ivshmem: socket path %s too long\n", path));
+		return -1;
+	}
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(ivdev->sock, (struct sockaddr *)&addr,
+				sizeof(addr)) < 0) {
+		WPRINTF(("ivshmem: connect to %s failed: %s\n", path,
+				strerror(errno)));
+		return -1;
+	}
+
+	if (ivshmem_recv_msg(ivdev->sock, &val, &fd, 0) < 0 || fd >= 0 ||
+			val != IVSHMEM_PROTOCOL_VERSION) {
+		WPRINTF(("ivshmem: unsupported server protocol\n"));
+		goto fail;
+	}
+	if (ivshmem_recv_msg(ivdev->sock, &val, &fd, 0) < 0 || fd >= 0 ||
+			val < 0 || val >= IVSHMEM_MAX_PEERS) {
+		WPRINTF(("ivshmem: invalid peer id from server\n"));
+		goto fail;
+	}
+	ivdev->id = val;
+	if (ivshmem_recv_msg(ivdev->sock, &val, &fd, 0) < 0 || fd < 0 ||
+			val != -1) {
+		WPRINTF(("ivshmem: no shared memory from server\n"));
+		goto fail;
+	}
+	ivdev->shm_fd = fd;
+	return 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+static int
+ivshmem_open_shm(struct pci_ivshmem_vdev *ivdev, const char *path)
+{
+	struct statfs fs;
+	struct stat st;
+
+	ivdev->shm_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (ivdev->shm_fd < 0) {
+		WPRINTF(("ivshmem: open %s failed: %s\n", path,
+				strerror(errno)));
+		return -1;
+	}
+	if (fstatfs(ivdev->shm_fd, &fs) == 0 &&
+			fs.f_type != IVSHMEM_HUGETLBFS_MAGIC)
+		WPRINTF(("ivshmem: %s is not on hugetlbfs\n", path));
+
+	if (fstat(ivdev->shm_fd, &st) < 0) {
+		WPRINTF(("ivshmem: stat %s failed: %s\n", path,
+				strerror(errno)));
+		return -1;
+	}
+
+	/*
+	 * The first VM sizes the object, the others must agree: resizing
+	 * it would pull the memory from under the VMs mapping it already.
+	 */
+	if (st.st_size == 0 && ftruncate(ivdev->shm_fd, ivdev->size) < 0) {
+		WPRINTF(("ivshmem: can't size %s to 0x%lx: %s\n", path,
+				ivdev->size, strerror(errno)));
+		return -1;
+	}
+	if (st.st_size != 0 && (uint64_t)st.st_size != ivdev->size) {
+		WPRINTF(("ivshmem: %s is 0x%lx bytes, not 0x%lx\n", path,
+				(unsigned long)st.st_size, ivdev->size));
+		return -1;
+	}
+	return 0;
+}
+
+static void
+ivshmem_bar_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+		  int baridx, uint64_t offset, int size, uint64_t value)
+{
+	struct pci_ivshmem_vdev *ivdev = dev->arg;
+	struct ivshmem_peer *peer;
+	uint64_t one = 1;
+	int id, vec;
+
+	if (baridx == pci_msix_table_bar(dev) ||
+			baridx == pci_msix_pba_bar(dev)) {
+		pci_emul_msix_twrite(dev, offset, size, value);
+		return;
+	}
+
+	/* past the memory, in the rounded up BAR */
+	if (baridx == IVSHMEM_MEM_BAR)
+		return;
+
+	assert(baridx == IVSHMEM_REG_BAR);
+	if (size != 4)
+		return;
+
+	switch (offset) {
+	case IVSHMEM_REG_INTRMASK:
+		pthread_mutex_lock(&ivdev->mtx);
+		ivdev->intr_mask = value;
+		ivshmem_update_intx(ivdev);
+		pthread_mutex_unlock(&ivdev->mtx);
+		break;
+	case IVSHMEM_REG_DOORBELL:
+		id = (value >> 16) & 0xffff;
+		vec = value & 0xffff;
+		pthread_mutex_lock(&ivdev->mtx);
+		peer = ivshmem_find_peer(ivdev, id);
+		if (peer && vec < peer->nvecs) {
+			if (write(peer->efd[vec], &one, sizeof(one)) < 0)
+				DPRINTF(("ivshmem: doorbell %d:%d failed\n",
+						id, vec));
+		} else
+			DPRINTF(("ivshmem: no doorbell %d:%d\n", id, vec));
+		pthread_mutex_unlock(&ivdev->mtx);
+		break;
+	default:
+		DPRINTF(("ivshmem: write to read-only register 0x%lx\n",
+				offset));
+		break;
+	}
+}
+
+static uint64_t
+ivshmem_bar_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+		 int baridx, uint64_t offset, int size)
+{
+	struct pci_ivshmem_vdev *ivdev = dev->arg;
+	uint64_t value = 0;
+
+	if (baridx == pci_msix_table_bar(dev) ||
+			baridx == pci_msix_pba_bar(dev))
+		return pci_emul_msix_tread(dev, offset, size);
+
+	/* past the memory, in the rounded up BAR */
+	if (baridx == IVSHMEM_MEM_BAR)
+		return 0;
+
+	assert(baridx == IVSHMEM_REG_BAR);
+	if (size != 4)
+		return 0;
+
+	switch (offset) {
+	case IVSHMEM_REG_INTRMASK:
+		value = ivdev->intr_mask;
+		break;
+	case IVSHMEM_REG_INTRSTATUS:
+		/* Reading the status acknowledges the interrupt */
+		pthread_mutex_lock(&ivdev->mtx);
+		value = ivdev->intr_status;
+		ivdev->intr_status = 0;
+		ivshmem_update_intx(ivdev);
+		pthread_mutex_unlock(&ivdev->mtx);
+		break;
+	case IVSHMEM_REG_IVPOSITION:
+		value = ivdev->sock >= 0 ? ivdev->id : 0;
+		break;
+	}
+	return value;
+}
+
+static void
+ivshmem_free(struct vmctx *ctx, struct pci_ivshmem_vdev *ivdev)
+{
+	struct ivshmem_vec *vec;
+	int i;
+
+	for (i = 0; i < ivdev->nvecs; i++) {
+		vec = &ivdev->vecs[i];
+		if (vec->mev)
+			mevent_delete_close(vec->mev);
+		else if (vec->efd >= 0)
+			close(vec->efd);
+	}
+	while (!LIST_EMPTY(&ivdev->peers))
+		ivshmem_free_peer(LIST_FIRST(&ivdev->peers));
+	if (ivdev->sock_mev)
+		mevent_delete(ivdev->sock_mev);
+	if (ivdev->sock >= 0)
+		close(ivdev->sock);
+	if (ivdev->gpa && vm_unmap_memseg_vma(ctx, ivdev->size, ivdev->gpa,
+				(uint64_t)ivdev->shm, PROT_ALL) < 0)
+		WPRINTF(("ivshmem: failed to unmap the shared memory at "
+				"0x%lx\n", ivdev->gpa));
+	if (ivdev->shm)
+		munmap(ivdev->shm, ivdev->size);
+	if (ivdev->shm_fd >= 0)
+		close(ivdev->shm_fd);
+	pthread_mutex_destroy(&ivdev->mtx);
+	free(ivdev);
+}
+
+static int
+pci_ivshmem_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct pci_ivshmem_vdev *ivdev;
+	char *opt = NULL, *key = NULL, *shm_path = NULL, *server = NULL;
+	struct stat st;
+	int i;
+
+	ivdev = calloc(1, sizeof(*ivdev));
+	if (!ivdev) {
+		WPRINTF(("ivshmem: calloc returns NULL\n"));
+		return -1;
+	}
+	ivdev->dev = dev;
+	ivdev->shm_fd = -1;
+	ivdev->sock = -1;
+	ivdev->nvecs = 1;
+	for (i = 0; i < IVSHMEM_MAX_VECTORS; i++) {
+		ivdev->vecs[i].ivdev = ivdev;
+		ivdev->vecs[i].idx = i;
+		ivdev->vecs[i].efd = -1;
+	}
+	LIST_INIT(&ivdev->peers);
+	pthread_mutex_init(&ivdev->mtx, NULL);
+
+	while (opts && (opt = strsep(&opts, ",")) != NULL) {
+		key = strsep(&opt, "=");
+		if (opt == NULL)
+			goto bad_opt;
+		if (!strcmp(key, "shm"))
+			shm_path = opt;
+		else if (!strcmp(key, "server"))
+			server = opt;
+		else if (!strcmp(key, "size")) {
+			if (ivshmem_parse_size(opt, &ivdev->size) < 0)
+				goto bad_opt;
+		} else if (!strcmp(key, "vectors")) {
+			ivdev->nvecs = atoi(opt);
+			if (ivdev->nvecs < 1 ||
+					ivdev->nvecs > IVSHMEM_MAX_VECTORS)
+				goto bad_opt;
+		} else
+			goto bad_opt;
+	}
+
+	if (!shm_path == !server) {
+		WPRINTF(("ivshmem: need either shm=<path> or "
+				"server=<socket>\n"));
+		goto fail;
+	}
+	if (shm_path) {
+		if (ivdev->size == 0) {
+			WPRINTF(("ivshmem: size of %s missing\n", shm_path));
+			goto fail;
+		}
+		if (ivshmem_open_shm(ivdev, shm_path) < 0)
+			goto fail;
+	} else {
+		if (ivshmem_server_connect(ivdev, server) < 0)
+			goto fail;
+		if (fstat(ivdev->shm_fd, &st) < 0 || st.st_size == 0) {
+			WPRINTF(("ivshmem: invalid shared memory from "
+					"server\n"));
+			goto fail;
+		}
+		if (ivdev->size && ivdev->size != st.st_size) {
+			WPRINTF(("ivshmem: server memory is 0x%lx bytes\n",
+					st.st_size));
+			goto fail;
+		}
+		ivdev->size = st.st_size;
+	}
+
+	ivdev->shm = mmap(NULL, ivdev->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, ivdev->shm_fd, 0);
+	if (ivdev->shm == MAP_FAILED) {
+		WPRINTF(("ivshmem: mmap failed: %s\n", strerror(errno)));
+		ivdev->shm = NULL;
+		goto fail;
+	}
+
+	dev->arg = ivdev;
+
+	pci_set_cfgdata16(dev, PCIR_VENDOR, IVSHMEM_VENDOR);
+	pci_set_cfgdata16(dev, PCIR_DEVICE, IVSHMEM_DEV);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, IVSHMEM_VENDOR);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, IVSHMEM_DEV);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_MEMORY);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_MEMORY_RAM);
+
+	if (pci_emul_alloc_bar(dev, IVSHMEM_REG_BAR, PCIBAR_MEM32,
+				IVSHMEM_REG_SIZE))
+		goto fail;
+
+	if (ivdev->sock >= 0) {
+		if (pci_emul_add_msixcap(dev, ivdev->nvecs, IVSHMEM_MSIX_BAR))
+			goto fail;
+		pci_lintr_request(dev);
+	}
+
+	/* The BAR size is a power of 2, only the object itself is mapped */
+	if (pci_emul_alloc_bar(dev, IVSHMEM_MEM_BAR, PCIBAR_MEM64,
+				ivdev->size))
+		goto fail;
+	if (vm_map_memseg_vma(ctx, ivdev->size, dev->bar[IVSHMEM_MEM_BAR].addr,
+				(uint64_t)ivdev->shm, PROT_ALL) < 0) {
+		WPRINTF(("ivshmem: failed to map the shared memory at "
+				"0x%lx\n", dev->bar[IVSHMEM_MEM_BAR].addr));
+		goto fail;
+	}
+	ivdev->gpa = dev->bar[IVSHMEM_MEM_BAR].addr;
+
+	if (ivdev->sock >= 0) {
+		fcntl(ivdev->sock, F_SETFL, O_NONBLOCK);
+		ivdev->sock_mev = mevent_add(ivdev->sock, EVF_READ,
+				ivshmem_sock_handler, ivdev);
+		if (!ivdev->sock_mev)
+			goto fail;
+	}
+
+	DPRINTF(("ivshmem: peer %d, 0x%lx bytes at 0x%lx, %d vectors\n",
+		ivdev->id, ivdev->size, dev->bar[IVSHMEM_MEM_BAR].addr,
+		ivdev->sock >= 0 ? ivdev->nvecs : 0));
+	return 0;
+
+bad_opt:
+	WPRINTF(("ivshmem: invalid option %s%s%s\n", key, opt ? "=" : "",
+			opt ? opt : ""));
+fail:
+	dev->arg = NULL;
+	ivshmem_free(ctx, ivdev);
+	return -1;
+}
+
+static void
+pci_ivshmem_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct pci_ivshmem_vdev *ivdev = dev->arg;
+
+	if (!ivdev)
+		return;
+	dev->arg = NULL;
+	ivshmem_free(ctx, ivdev);
+}
+
+/*
+ * The guest can't move BAR2, it stays where the memory is mapped: all
+ * ones is taken for sizing, anything else leaves the address as it is.
+ */
+static int
+pci_ivshmem_cfgwrite(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
+		     int offset, int bytes, uint32_t val)
+{
+	struct pci_ivshmem_vdev *ivdev = dev->arg;
+	uint64_t addr = dev->bar[IVSHMEM_MEM_BAR].addr;
+	uint64_t mask = ~(dev->bar[IVSHMEM_MEM_BAR].size - 1);
+	uint32_t bar;
+
+	if (offset == PCIR_BAR(IVSHMEM_MEM_BAR)) {
+		if (bytes != 4)
+			return 0;
+		bar = val == ~0U ? (uint32_t)mask : (uint32_t)addr;
+		bar |= pci_get_cfgdata32(dev, offset) & ~PCIM_BAR_MEM_BASE;
+		if (val != ~0U && (val & (uint32_t)mask) != (uint32_t)addr)
+			WPRINTF(("ivshmem: peer %d, BAR2 can't be moved\n",
+					ivdev->id));
+	} else if (offset == PCIR_BAR(IVSHMEM_MEM_BAR + 1)) {
+		if (bytes != 4)
+			return 0;
+		bar = val == ~0U ? mask >> 32 : addr >> 32;
+		if (val != ~0U && val != addr >> 32)
+			WPRINTF(("ivshmem: peer %d, BAR2 can't be moved\n",
+					ivdev->id));
+	} else
+		return -1;
+
+	pci_set_cfgdata32(dev, offset, bar);
+	return 0;
+}
+
+struct pci_vdev_ops pci_ops_ivshmem = {
+	.class_name	= "ivshmem",
+	.vdev_init	= pci_ivshmem_init,
+	.vdev_deinit	= pci_ivshmem_deinit,
+	.vdev_cfgwrite	= pci_ivshmem_cfgwrite,
+	.vdev_barwrite	= ivshmem_bar_write,
+	.vdev_barread	= ivshmem_bar_read
+};
+DEFINE_PCI_DEVTYPE(pci_ops_ivshmem);
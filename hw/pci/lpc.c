@@ -444,6 +444,41 @@ pci_lpc_deinit(struct vmctx *ctx, struct pci_vdev *pi, char *opts)
 	lpc_deinit(ctx);
 }
 
+static int
+pci_lpc_save(struct vmctx *ctx, struct pci_vdev *pi, struct handover_buf *hb)
+{
+	int unit;
+
+	for (unit = 0; unit < LPC_UART_NUM; unit++) {
+		if (!lpc_uart_vdev[unit].enabled)
+			continue;
+		if (uart_save(lpc_uart_vdev[unit].uart, hb) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+pci_lpc_restore(struct vmctx *ctx, struct pci_vdev *pi,
+		struct handover_buf *hb)
+{
+	int pin, unit;
+
+	/* the PIRQ routing lives in config space, replay it */
+	for (pin = 0; pin < 4; pin++)
+		pirq_write(ctx, pin + 1, pci_get_cfgdata8(pi, 0x60 + pin));
+	for (pin = 0; pin < 4; pin++)
+		pirq_write(ctx, pin + 5, pci_get_cfgdata8(pi, 0x68 + pin));
+
+	for (unit = 0; unit < LPC_UART_NUM; unit++) {
+		if (!lpc_uart_vdev[unit].enabled)
+			continue;
+		if (uart_restore(lpc_uart_vdev[unit].uart, hb) != 0)
+			return -1;
+	}
+	return 0;
+}
+
 char *
 lpc_pirq_name(int pin)
 {
@@ -482,6 +517,8 @@ struct pci_vdev_ops pci_ops_lpc = {
 	.vdev_write_dsdt	= pci_lpc_write_dsdt,
 	.vdev_cfgwrite		= pci_lpc_cfgwrite,
 	.vdev_barwrite		= pci_lpc_write,
-	.vdev_barread		= pci_lpc_read
+	.vdev_barread		= pci_lpc_read,
+	.vdev_save		= pci_lpc_save,
+	.vdev_restore		= pci_lpc_restore
 };
 DEFINE_PCI_DEVTYPE(pci_ops_lpc);
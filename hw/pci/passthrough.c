@@ -854,72 +854,101 @@ pciaccess_init(void)
 	return 0;	/* success */
 }
 
+static void
+pciaccess_cleanup(void)
+{
+	pthread_mutex_lock(&ref_cnt_mtx);
+	pciaccess_ref_cnt--;
+	if (!pciaccess_ref_cnt)
+		pci_system_cleanup();
+	pthread_mutex_unlock(&ref_cnt_mtx);
+}
+
 /*
- * Passthrough device initialization function:
- * - initialize virtual config space
- * - read physical info via libpciaccess
- * - issue related hypercall for passthrough
- * - Do some specific actions:
- *     - enable NHLT for audio pt dev
- *     - emulate INTPIN/INTLINE
- *     - hide INTx link if ptdev support both MSI and INTx to force guest using
- *       MSI, so that mitigate ptdev GSI sharing issue.
+ * Claim the physical device and look it up via libpciaccess. This runs
+ * in parallel with the other devices' backends, see vdev_prepare; the
+ * libpciaccess setup is shared and serialized by ref_cnt_mtx.
  */
 static int
-passthru_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+passthru_prepare(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
-	int bus, slot, func, error;
+	int bus, slot, func;
 	struct passthru_dev *ptdev;
 	struct pci_device_iterator *iter;
 	struct pci_device *phys_dev;
 
-	ptdev = NULL;
-	error = 1;
-
 	if (opts == NULL ||
 	    sscanf(opts, "%x/%x/%x", &bus, &slot, &func) != 3) {
 		warnx("invalid passthru options, %s", opts);
-		return error;
+		return 1;
 	}
 
 	if (vm_assign_ptdev(ctx, bus, slot, func) != 0) {
 		warnx("PCI device at %x/%x/%x is not using the pt(4) driver",
 			bus, slot, func);
-		goto done;
+		vm_unassign_ptdev(ctx, bus, slot, func);
+		return 1;
 	}
 
 	ptdev = calloc(1, sizeof(struct passthru_dev));
 	if (ptdev == NULL) {
 		warnx("%s: calloc FAIL!", __func__);
-		return error;
+		goto err;
 	}
 
 	ptdev->phys_bdf = PCI_BDF(bus, slot, func);
 
-	error = pciaccess_init();
-	if (error)
-		return error;
+	if (pciaccess_init() != 0)
+		goto err;
 
-	error = 1;
 	iter = pci_slot_match_iterator_create(NULL);
 	while ((phys_dev = pci_device_next(iter)) != NULL) {
 		if (phys_dev->bus == bus && phys_dev->dev == slot &&
 			phys_dev->func == func) {
 			ptdev->phys_dev = phys_dev;
-			error = 0;
 			break;
 		}
 	}
 
-	if (error) {
+	if (ptdev->phys_dev == NULL) {
 		warnx("No PCI device %x:%x.%x", bus, slot, func);
-		return error;
+		pciaccess_cleanup();
+		goto err;
 	}
 
 	pci_device_probe(ptdev->phys_dev);
 
 	dev->arg = ptdev;
 	ptdev->dev = dev;
+	return 0;
+
+err:
+	free(ptdev);
+	vm_unassign_ptdev(ctx, bus, slot, func);
+	return 1;
+}
+
+/*
+ * Passthrough device initialization function:
+ * - initialize virtual config space
+ * - read physical info via libpciaccess
+ * - issue related hypercall for passthrough
+ * - Do some specific actions:
+ *     - enable NHLT for audio pt dev
+ *     - emulate INTPIN/INTLINE
+ *     - hide INTx link if ptdev support both MSI and INTx to force guest using
+ *       MSI, so that mitigate ptdev GSI sharing issue.
+ * A failure is cleaned up by passthru_deinit, like for any prepared device.
+ */
+static int
+passthru_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	int bus, slot, func, error;
+	struct passthru_dev *ptdev = dev->arg;
+
+	bus = (ptdev->phys_bdf >> 8) & 0xff;
+	slot = (ptdev->phys_bdf & 0xff) >> 3;
+	func = ptdev->phys_bdf & 0x7;
 
 	/* handle 0x3c~0x3f config space
 	 * INTLINE/INTPIN: from emulated configuration space
@@ -938,7 +967,7 @@ passthru_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* initialize config space */
 	error = cfginit(ctx, ptdev, bus, slot, func);
 	if (error < 0)
-		goto done;
+		return error;
 
 	/* If ptdev support MSI/MSIX, stop here to skip virtual INTx setup.
 	 * Forge Guest to use MSI/MSIX in this case to mitigate IRQ sharing
@@ -955,26 +984,10 @@ passthru_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (ptdev->phys_pin == -1 || ptdev->phys_pin > 256) {
 		warnx("ptdev %x/%x/%x has wrong phys_pin %d, likely fail!",
 		    bus, slot, func, ptdev->phys_pin);
-		goto done;
-	}
-
-	error = 0;		/* success */
-done:
-	if (error) {
-		free(ptdev);
-		vm_unassign_ptdev(ctx, bus, slot, func);
+		return error;
 	}
-	return error;
-}
 
-static void
-pciaccess_cleanup(void)
-{
-	pthread_mutex_lock(&ref_cnt_mtx);
-	pciaccess_ref_cnt--;
-	if (!pciaccess_ref_cnt)
-		pci_system_cleanup();
-	pthread_mutex_unlock(&ref_cnt_mtx);
+	return 0;		/* success */
 }
 
 static void
@@ -1863,6 +1876,7 @@ passthru_write_dsdt(struct pci_vdev *dev)
 
 struct pci_vdev_ops passthru = {
 	.class_name		= "passthru",
+	.vdev_prepare		= passthru_prepare,
 	.vdev_init		= passthru_init,
 	.vdev_deinit		= passthru_deinit,
 	.vdev_cfgwrite		= passthru_cfgwrite,
@@ -29,11 +29,14 @@
 #include <sys/uio.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 
 #include "dm.h"
 #include "pci_core.h"
 #include "virtio.h"
+#include "handover.h"
+#include "tracepoint.h"
 
 /*
  * Functions for dealing with generalized "virtual devices" as
@@ -64,6 +67,10 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	base->dev = dev;
 	dev->arg = base;
 
+	/* a lazy virtio device waits for the driver, not for BAR enable */
+	if (dev->lazy != PCI_LAZY_NONE)
+		dev->lazy = PCI_LAZY_DRIVER_OK;
+
 	base->queues = queues;
 	for (i = 0; i < vops->nvq; i++) {
 		queues[i].base = base;
@@ -538,6 +545,7 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 		intr = new_idx != old_idx &&
 		    !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
 	}
+	TRACEPOINT(TP_VQ_ENDCHAINS, (uintptr_t)base, vq->num | intr << 16);
 	if (intr)
 		vq_interrupt(base, vq);
 }
@@ -840,6 +848,7 @@ bad:
 			goto done;
 		}
 		vq = &base->queues[value];
+		TRACEPOINT(TP_VQ_NOTIFY, (uintptr_t)base, value);
 		if (vq->notify)
 			(*vq->notify)(DEV_STRUCT(base), vq);
 		else if (vops->qnotify)
@@ -851,6 +860,8 @@ bad:
 		break;
 	case VIRTIO_CR_STATUS:
 		base->status = value;
+		if (value & VIRTIO_CR_STATUS_DRIVER_OK)
+			pci_emul_activate(base->dev);
 		if (vops->set_status)
 			(*vops->set_status)(DEV_STRUCT(base), value);
 		if (value == 0)
@@ -1021,6 +1032,123 @@ virtio_dev_error(struct virtio_base *base)
 	}
 }
 
+/* per queue state carried over a live handover */
+struct virtio_vq_state {
+	uint16_t qsize;
+	uint16_t flags;
+	uint16_t last_avail;
+	uint16_t save_used;
+	uint16_t msix_idx;
+	uint16_t enabled;
+	uint32_t pfn;
+	uint32_t gpa_desc[2];
+	uint32_t gpa_avail[2];
+	uint32_t gpa_used[2];
+};
+
+int
+virtio_save(struct virtio_base *base, struct handover_buf *hb)
+{
+	struct virtio_vq_info *vq;
+	struct virtio_vq_state vs;
+	int i, err;
+
+	VIRTIO_BASE_LOCK(base);
+	err = handover_put(hb, &base->negotiated_caps,
+			sizeof(base->negotiated_caps));
+	err |= handover_put(hb, &base->curq, sizeof(base->curq));
+	err |= handover_put(hb, &base->status, sizeof(base->status));
+	err |= handover_put(hb, &base->isr, sizeof(base->isr));
+	err |= handover_put(hb, &base->msix_cfg_idx,
+			sizeof(base->msix_cfg_idx));
+	err |= handover_put(hb, &base->config_generation,
+			sizeof(base->config_generation));
+	err |= handover_put(hb, &base->device_feature_select,
+			sizeof(base->device_feature_select));
+	err |= handover_put(hb, &base->driver_feature_select,
+			sizeof(base->driver_feature_select));
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		vs.qsize = vq->qsize;
+		vs.flags = vq->flags;
+		vs.last_avail = vq->last_avail;
+		vs.save_used = vq->save_used;
+		vs.msix_idx = vq->msix_idx;
+		vs.enabled = vq->enabled;
+		vs.pfn = vq->pfn;
+		memcpy(vs.gpa_desc, vq->gpa_desc, sizeof(vs.gpa_desc));
+		memcpy(vs.gpa_avail, vq->gpa_avail, sizeof(vs.gpa_avail));
+		memcpy(vs.gpa_used, vq->gpa_used, sizeof(vs.gpa_used));
+		err |= handover_put(hb, &vs, sizeof(vs));
+	}
+	VIRTIO_BASE_UNLOCK(base);
+
+	return err ? -1 : 0;
+}
+
+int
+virtio_restore(struct virtio_base *base, struct handover_buf *hb)
+{
+	struct virtio_vq_info *vq;
+	struct virtio_vq_state vs;
+	int i, curq, err;
+
+	err = handover_get(hb, &base->negotiated_caps,
+			sizeof(base->negotiated_caps));
+	err |= handover_get(hb, &curq, sizeof(curq));
+	err |= handover_get(hb, &base->status, sizeof(base->status));
+	err |= handover_get(hb, &base->isr, sizeof(base->isr));
+	err |= handover_get(hb, &base->msix_cfg_idx,
+			sizeof(base->msix_cfg_idx));
+	err |= handover_get(hb, &base->config_generation,
+			sizeof(base->config_generation));
+	err |= handover_get(hb, &base->device_feature_select,
+			sizeof(base->device_feature_select));
+	err |= handover_get(hb, &base->driver_feature_select,
+			sizeof(base->driver_feature_select));
+	if (err)
+		return -1;
+
+	/* the driver was already running in the old process */
+	if (base->status & VIRTIO_CR_STATUS_DRIVER_OK)
+		pci_emul_activate(base->dev);
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (handover_get(hb, &vs, sizeof(vs)) != 0)
+			return -1;
+		if (vs.qsize != vq->qsize) {
+			fprintf(stderr, "%s: queue %d size mismatch\n",
+				base->vops->name, i);
+			return -1;
+		}
+
+		vq->msix_idx = vs.msix_idx;
+		vq->pfn = vs.pfn;
+		memcpy(vq->gpa_desc, vs.gpa_desc, sizeof(vs.gpa_desc));
+		memcpy(vq->gpa_avail, vs.gpa_avail, sizeof(vs.gpa_avail));
+		memcpy(vq->gpa_used, vs.gpa_used, sizeof(vs.gpa_used));
+
+		/* map the rings again, this resets the ring positions */
+		if (vs.flags & VQ_ALLOC) {
+			base->curq = i;
+			if (base->negotiated_caps & VIRTIO_F_VERSION_1)
+				virtio_vq_enable(base);
+			else
+				virtio_vq_init(base, vs.pfn);
+		}
+
+		vq->flags = vs.flags;
+		vq->last_avail = vs.last_avail;
+		vq->save_used = vs.save_used;
+		vq->enabled = vs.enabled;
+	}
+	base->curq = curq;
+
+	return 0;
+}
+
 static struct cap_region {
 	uint64_t	cap_offset;	/* offset of capability region */
 	int		cap_size;	/* size of capability region */
@@ -1226,6 +1354,8 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 		break;
 	case VIRTIO_COMMON_STATUS:
 		base->status = value & 0xff;
+		if (value & VIRTIO_CR_STATUS_DRIVER_OK)
+			pci_emul_activate(base->dev);
 		if (vops->set_status)
 			(*vops->set_status)(DEV_STRUCT(base), value);
 		if (base->status == 0)
@@ -1403,6 +1533,7 @@ virtio_notify_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 	}
 
 	vq = &base->queues[idx];
+	TRACEPOINT(TP_VQ_NOTIFY, (uintptr_t)base, idx);
 	if (vq->notify)
 		(*vq->notify)(DEV_STRUCT(base), vq);
 	else if (vops->qnotify)
@@ -1572,6 +1703,7 @@ virtio_pci_modern_pio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		pthread_mutex_lock(base->mtx);
 
 	vq = &base->queues[idx];
+	TRACEPOINT(TP_VQ_NOTIFY, (uintptr_t)base, idx);
 	if (vq->notify)
 		(*vq->notify)(DEV_STRUCT(base), vq);
 	else if (vops->qnotify)
@@ -0,0 +1,2109 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * virtio 9p device emulation, exporting a host directory with 9P2000.L.
+ *
+ *	-s <slot>,virtio-9p,tag=<mount tag>,path=<host dir>[,ro]
+ *	   [,msize=<bytes>][,threads=<n>]
+ *
+ * The guest mounts it with
+ *
+ *	mount -t 9p -o trans=virtio,version=9p2000.L,msize=<bytes> <tag> <dir>
+ *
+ * Requests are taken off the ring by the notifying vcpu and handed to a
+ * pool of worker threads, so slow file system calls don't stall the vcpu
+ * and independent requests run in parallel. Tread and Twrite payloads go
+ * between the file and the guest buffers with preadv/pwritev, without a
+ * bounce buffer; with a large msize the guest passes its page cache pages
+ * directly in the descriptor chain.
+ *
+ * Every fid keeps an O_PATH descriptor of its file, and the descriptor
+ * from Tlopen/Tlcreate, so reads and writes never reopen or resolve a path.
+ * Walks open one component at a time with O_NOFOLLOW, which keeps the
+ * guest inside the exported directory whatever symlinks it creates.
+ *
+ * Files are accessed with the credentials of the device model, like the
+ * "none" security model of other 9p servers. The guest can't create host
+ * device nodes, nor open special files through the export.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+
+#define VIRTIO_9P_RINGSZ	128
+#define VIRTIO_9P_MAXSEGS	512	/* header and data pages of a request */
+#define VIRTIO_9P_MAXTHR	16
+#define VIRTIO_9P_NUMTHR	4
+#define VIRTIO_9P_TAG_MAX	32
+#define VIRTIO_9P_MSIZE		(512 * 1024)
+#define VIRTIO_9P_MIN_MSIZE	4096
+#define VIRTIO_9P_MAX_MSIZE	(1024 * 1024)
+#define VIRTIO_9P_FID_HASH	256
+
+/* Capability bits */
+#define VIRTIO_9P_F_MOUNT_TAG	(1 << 0)
+
+#define VIRTIO_9P_S_HOSTCAPS \
+	(VIRTIO_9P_F_MOUNT_TAG | VIRTIO_RING_F_INDIRECT_DESC)
+
+/*
+ * 9P2000.L messages, the reply to a T message is its type plus one
+ */
+#define P9_TLERROR	6
+#define P9_RLERROR	7
+#define P9_TSTATFS	8
+#define P9_TLOPEN	12
+#define P9_TLCREATE	14
+#define P9_TSYMLINK	16
+#define P9_TMKNOD	18
+#define P9_TRENAME	20
+#define P9_TREADLINK	22
+#define P9_TGETATTR	24
+#define P9_TSETATTR	26
+#define P9_TXATTRWALK	30
+#define P9_TXATTRCREATE	32
+#define P9_TREADDIR	40
+#define P9_TFSYNC	50
+#define P9_TLOCK	52
+#define P9_TGETLOCK	54
+#define P9_TLINK	70
+#define P9_TMKDIR	72
+#define P9_TRENAMEAT	74
+#define P9_TUNLINKAT	76
+#define P9_TVERSION	100
+#define P9_TAUTH	102
+#define P9_TATTACH	104
+#define P9_TFLUSH	108
+#define P9_TWALK	110
+#define P9_TREAD	116
+#define P9_TWRITE	118
+#define P9_TCLUNK	120
+#define P9_TREMOVE	122
+
+#define P9_HDR_SIZE	7	/* size[4] type[1] tag[2] */
+#define P9_RW_HDR_SIZE	(P9_HDR_SIZE + 16)	/* fid[4] offset[8] count[4] */
+#define P9_RREAD_HDR_SIZE	(P9_HDR_SIZE + 4)	/* count[4] */
+#define P9_QID_SIZE	13
+#define P9_MAXWELEM	16
+#define P9_NOFID	(~0U)
+
+#define P9_QTDIR	0x80
+#define P9_QTSYMLINK	0x02
+#define P9_QTFILE	0x00
+
+#define P9_GETATTR_BASIC	0x000007ffULL
+
+#define P9_SETATTR_MODE		0x00000001
+#define P9_SETATTR_UID		0x00000002
+#define P9_SETATTR_GID		0x00000004
+#define P9_SETATTR_SIZE		0x00000008
+#define P9_SETATTR_ATIME	0x00000010
+#define P9_SETATTR_MTIME	0x00000020
+#define P9_SETATTR_ATIME_SET	0x00000080
+#define P9_SETATTR_MTIME_SET	0x00000100
+
+#define P9_LOCK_SUCCESS		0
+#define P9_LOCK_TYPE_UNLCK	2
+
+#define P9_DOTL_AT_REMOVEDIR	0x200
+
+/* Tlopen/Tlcreate flags we pass on, they have the Linux values */
+#define P9_OPEN_FLAGS \
+	(O_ACCMODE | O_TRUNC | O_APPEND | O_NONBLOCK | O_DSYNC | \
+	 O_DIRECTORY | O_SYNC)
+
+struct virtio_9p_config {
+	uint16_t tag_len;
+	char tag[VIRTIO_9P_TAG_MAX];
+} __attribute__((packed));
+
+struct virtio_9p_qid {
+	uint8_t type;
+	uint32_t version;
+	uint64_t path;
+};
+
+struct virtio_9p_fid {
+	LIST_ENTRY(virtio_9p_fid) link;
+	uint32_t fid;
+	int refs;
+	int fd;			/* O_PATH descriptor of the file */
+	pthread_mutex_t mtx;	/* protects the fields below */
+	int ofd;		/* from Tlopen/Tlcreate */
+	DIR *dir;		/* Treaddir stream over ofd */
+};
+
+/* A message being built or parsed */
+struct virtio_9p_pdu {
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t off;
+	bool bad;
+};
+
+struct virtio_9p_req {
+	TAILQ_ENTRY(virtio_9p_req) link;
+	uint16_t idx;
+	uint32_t gen;
+	bool queued;
+	bool busy;
+	uint8_t type;
+	uint16_t tag;
+	int nout;		/* device readable iovs, then writable ones */
+	int niov;
+	struct iovec iov[VIRTIO_9P_MAXSEGS];
+};
+
+/* Per worker message buffers */
+struct virtio_9p_worker {
+	struct virtio_9p *vs;
+	struct virtio_9p_req *req;
+	uint8_t *tbuf;
+	uint8_t *rbuf;
+	uint32_t data_len;	/* reply payload written to the guest directly */
+};
+
+struct virtio_9p {
+	struct virtio_base base;
+	struct virtio_vq_info vq;
+	pthread_mutex_t mtx;
+	struct virtio_9p_config cfg;
+	uint32_t gen;		/* bumped on reset, under mtx and req_mtx */
+
+	char *path;
+	int root_fd;
+	dev_t root_dev;
+	ino_t root_ino;
+	bool readonly;
+	uint32_t max_msize;
+	uint32_t msize;		/* negotiated by Tversion */
+
+	pthread_mutex_t fid_mtx;
+	LIST_HEAD(, virtio_9p_fid) fids[VIRTIO_9P_FID_HASH];
+
+	/* worker pool */
+	pthread_mutex_t req_mtx;
+	pthread_cond_t req_cond;
+	pthread_cond_t done_cond;
+	TAILQ_HEAD(, virtio_9p_req) pendq;
+	int nio;		/* workers touching guest buffers */
+	bool closing;
+	int nthreads;
+	pthread_t tids[VIRTIO_9P_MAXTHR];
+	struct virtio_9p_req reqs[VIRTIO_9P_RINGSZ];
+};
+
+static int virtio_9p_debug;
+#define DPRINTF(params) do { if (virtio_9p_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_9p_reset(void *);
+static void virtio_9p_notify(void *, struct virtio_vq_info *);
+static int virtio_9p_cfgread(void *, int, int, uint32_t *);
+static int virtio_9p_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_9p_ops = {
+	"virtio_9p",			/* our name */
+	1,				/* we support 1 virtqueue */
+	sizeof(struct virtio_9p_config), /* config reg size */
+	virtio_9p_reset,		/* reset */
+	virtio_9p_notify,		/* device-wide qnotify */
+	virtio_9p_cfgread,		/* read virtio config */
+	virtio_9p_cfgwrite,		/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+	VIRTIO_9P_S_HOSTCAPS,		/* our capabilities */
+};
+
+/*
+ * Copy between a flat buffer and an iovec, starting at byte off of the
+ * iovec. Returns the bytes copied.
+ */
+static size_t
+p9_iov_copy(struct iovec *iov, int niov, size_t off, void *buf, size_t len,
+	    bool to_iov)
+{
+	size_t done = 0, n;
+	int i;
+
+	for (i = 0; i < niov && done < len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		n = MIN(iov[i].iov_len - off, len - done);
+		if (to_iov)
+			memcpy((char *)iov[i].iov_base + off,
+			       (char *)buf + done, n);
+		else
+			memcpy((char *)buf + done,
+			       (char *)iov[i].iov_base + off, n);
+		done += n;
+		off = 0;
+	}
+	return done;
+}
+
+static size_t
+p9_iov_len(struct iovec *iov, int niov)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/*
+ * Build in out[] the part of iov[] from byte off, at most len bytes long.
+ * Returns the number of entries.
+ */
+static int
+p9_iov_slice(struct iovec *iov, int niov, size_t off, size_t len,
+	     struct iovec *out)
+{
+	int i, n = 0;
+
+	for (i = 0; i < niov && len > 0; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		out[n].iov_base = (char *)iov[i].iov_base + off;
+		out[n].iov_len = MIN(iov[i].iov_len - off, len);
+		len -= out[n].iov_len;
+		off = 0;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Message encoding, little endian like the host. A short message sets bad
+ * and reads as zeroes, the handlers check it once they got all fields.
+ */
+static void
+p9_get(struct virtio_9p_pdu *pdu, void *val, uint32_t len)
+{
+	if (pdu->bad || pdu->size - pdu->off < len) {
+		pdu->bad = true;
+		memset(val, 0, len);
+		return;
+	}
+	memcpy(val, pdu->buf + pdu->off, len);
+	pdu->off += len;
+}
+
+static inline uint8_t
+p9_get8(struct virtio_9p_pdu *pdu)
+{
+	uint8_t v;
+
+	p9_get(pdu, &v, sizeof(v));
+	return v;
+}
+
+static inline uint16_t
+p9_get16(struct virtio_9p_pdu *pdu)
+{
+	uint16_t v;
+
+	p9_get(pdu, &v, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+p9_get32(struct virtio_9p_pdu *pdu)
+{
+	uint32_t v;
+
+	p9_get(pdu, &v, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+p9_get64(struct virtio_9p_pdu *pdu)
+{
+	uint64_t v;
+
+	p9_get(pdu, &v, sizeof(v));
+	return v;
+}
+
+/* Read a string as a C string of at most size - 1 characters */
+static void
+p9_getstr(struct virtio_9p_pdu *pdu, char *str, size_t size)
+{
+	uint16_t len = p9_get16(pdu);
+
+	if (len >= size || memchr(pdu->buf + pdu->off, '\0',
+				  MIN(len, pdu->size - pdu->off))) {
+		pdu->bad = true;
+		len = 0;
+	}
+	p9_get(pdu, str, len);
+	str[pdu->bad ? 0 : len] = '\0';
+}
+
+static void
+p9_put(struct virtio_9p_pdu *pdu, const void *val, uint32_t len)
+{
+	if (pdu->bad || pdu->size - pdu->off < len) {
+		pdu->bad = true;
+		return;
+	}
+	memcpy(pdu->buf + pdu->off, val, len);
+	pdu->off += len;
+}
+
+static inline void
+p9_put8(struct virtio_9p_pdu *pdu, uint8_t v)
+{
+	p9_put(pdu, &v, sizeof(v));
+}
+
+static inline void
+p9_put16(struct virtio_9p_pdu *pdu, uint16_t v)
+{
+	p9_put(pdu, &v, sizeof(v));
+}
+
+static inline void
+p9_put32(struct virtio_9p_pdu *pdu, uint32_t v)
+{
+	p9_put(pdu, &v, sizeof(v));
+}
+
+static inline void
+p9_put64(struct virtio_9p_pdu *pdu, uint64_t v)
+{
+	p9_put(pdu, &v, sizeof(v));
+}
+
+static void
+p9_putstr(struct virtio_9p_pdu *pdu, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (len > UINT16_MAX) {
+		pdu->bad = true;
+		return;
+	}
+	p9_put16(pdu, len);
+	p9_put(pdu, str, len);
+}
+
+static void
+p9_putqid(struct virtio_9p_pdu *pdu, struct virtio_9p_qid *qid)
+{
+	p9_put8(pdu, qid->type);
+	p9_put32(pdu, qid->version);
+	p9_put64(pdu, qid->path);
+}
+
+static void
+p9_stat2qid(struct stat *st, struct virtio_9p_qid *qid)
+{
+	if (S_ISDIR(st->st_mode))
+		qid->type = P9_QTDIR;
+	else if (S_ISLNK(st->st_mode))
+		qid->type = P9_QTSYMLINK;
+	else
+		qid->type = P9_QTFILE;
+	qid->version = 0;
+	qid->path = st->st_ino;
+}
+
+static int
+p9_fstat(int fd, struct stat *st)
+{
+	if (fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+		return errno;
+	return 0;
+}
+
+static int
+p9_qid(int fd, struct virtio_9p_qid *qid)
+{
+	struct stat st;
+	int err;
+
+	err = p9_fstat(fd, &st);
+	if (!err)
+		p9_stat2qid(&st, qid);
+	return err;
+}
+
+/*
+ * Calls that take no O_PATH descriptor reach the file through its
+ * /proc/self/fd entry.
+ */
+static void
+p9_procpath(int fd, char *buf, size_t size)
+{
+	snprintf(buf, size, "/proc/self/fd/%d", fd);
+}
+
+/* A single path component, never leaving the directory */
+static bool
+p9_name_ok(const char *name)
+{
+	return name[0] && strcmp(name, ".") && strcmp(name, "..") &&
+		!strchr(name, '/');
+}
+
+/*
+ * Fid table
+ */
+static struct virtio_9p_fid *
+p9_fid_get(struct virtio_9p *vs, uint32_t fid)
+{
+	struct virtio_9p_fid *f;
+
+	pthread_mutex_lock(&vs->fid_mtx);
+	LIST_FOREACH(f, &vs->fids[fid % VIRTIO_9P_FID_HASH], link) {
+		if (f->fid == fid) {
+			f->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vs->fid_mtx);
+	return f;
+}
+
+static void
+p9_fid_put(struct virtio_9p *vs, struct virtio_9p_fid *f)
+{
+	bool last;
+
+	pthread_mutex_lock(&vs->fid_mtx);
+	last = --f->refs == 0;
+	pthread_mutex_unlock(&vs->fid_mtx);
+	if (!last)
+		return;
+
+	if (f->dir)
+		closedir(f->dir);
+	else if (f->ofd >= 0)
+		close(f->ofd);
+	close(f->fd);
+	pthread_mutex_destroy(&f->mtx);
+	free(f);
+}
+
+/*
+ * Bind fid to the file of the O_PATH descriptor fd, and the open descriptor
+ * ofd if not -1, which the fid owns from now on. A fid in use is only
+ * replaced when replace is set, by a walk to itself or Tlcreate; requests
+ * still using the old file finish with it.
+ */
+static int
+p9_fid_add(struct virtio_9p *vs, uint32_t fid, int fd, int ofd, bool replace)
+{
+	struct virtio_9p_fid *f, *old;
+
+	if (fid == P9_NOFID) {
+		close(fd);
+		if (ofd >= 0)
+			close(ofd);
+		return EBADF;
+	}
+	f = calloc(1, sizeof(*f));
+	if (!f) {
+		close(fd);
+		if (ofd >= 0)
+			close(ofd);
+		return ENOMEM;
+	}
+	f->fid = fid;
+	f->refs = 1;
+	f->fd = fd;
+	f->ofd = ofd;
+	pthread_mutex_init(&f->mtx, NULL);
+
+	pthread_mutex_lock(&vs->fid_mtx);
+	LIST_FOREACH(old, &vs->fids[fid % VIRTIO_9P_FID_HASH], link) {
+		if (old->fid == fid)
+			break;
+	}
+	if (old && !replace) {
+		pthread_mutex_unlock(&vs->fid_mtx);
+		p9_fid_put(vs, f);
+		return EBADF;
+	}
+	if (old)
+		LIST_REMOVE(old, link);
+	LIST_INSERT_HEAD(&vs->fids[fid % VIRTIO_9P_FID_HASH], f, link);
+	pthread_mutex_unlock(&vs->fid_mtx);
+
+	if (old)
+		p9_fid_put(vs, old);
+	return 0;
+}
+
+static int
+p9_fid_clunk(struct virtio_9p *vs, uint32_t fid)
+{
+	struct virtio_9p_fid *f;
+
+	pthread_mutex_lock(&vs->fid_mtx);
+	LIST_FOREACH(f, &vs->fids[fid % VIRTIO_9P_FID_HASH], link) {
+		if (f->fid == fid) {
+			LIST_REMOVE(f, link);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vs->fid_mtx);
+	if (!f)
+		return EBADF;
+	p9_fid_put(vs, f);
+	return 0;
+}
+
+static void
+p9_fid_clunk_all(struct virtio_9p *vs)
+{
+	struct virtio_9p_fid *f;
+	int i;
+
+	for (i = 0; i < VIRTIO_9P_FID_HASH; i++) {
+		pthread_mutex_lock(&vs->fid_mtx);
+		while ((f = LIST_FIRST(&vs->fids[i])) != NULL) {
+			LIST_REMOVE(f, link);
+			pthread_mutex_unlock(&vs->fid_mtx);
+			p9_fid_put(vs, f);
+			pthread_mutex_lock(&vs->fid_mtx);
+		}
+		pthread_mutex_unlock(&vs->fid_mtx);
+	}
+}
+
+/* The descriptor from Tlopen/Tlcreate, -1 if the fid is not open */
+static int
+p9_fid_ofd(struct virtio_9p_fid *f)
+{
+	int fd;
+
+	pthread_mutex_lock(&f->mtx);
+	fd = f->ofd;
+	pthread_mutex_unlock(&f->mtx);
+	return fd;
+}
+
+/*
+ * Request handlers. They parse the rest of the T message from in, put the
+ * reply fields in out and return 0, or return an errno for Rlerror.
+ */
+static int
+p9_version(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	   struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	char version[32];
+	uint32_t msize;
+
+	msize = p9_get32(in);
+	p9_getstr(in, version, sizeof(version));
+	if (in->bad || msize < VIRTIO_9P_MIN_MSIZE)
+		return EINVAL;
+
+	/* A new session, forget the fids of the previous one */
+	p9_fid_clunk_all(vs);
+	vs->msize = MIN(msize, vs->max_msize);
+	p9_put32(out, vs->msize);
+	p9_putstr(out, strncmp(version, "9P2000.L", 8) ? "unknown" :
+		  "9P2000.L");
+	DPRINTF(("virtio_9p: %s, msize %u\n", version, vs->msize));
+	return 0;
+}
+
+static int
+p9_attach(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	  struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_qid qid;
+	char name[256];
+	uint32_t fid;
+	int fd, err;
+
+	fid = p9_get32(in);
+	p9_get32(in);		/* afid, no authentication */
+	p9_getstr(in, name, sizeof(name));	/* uname */
+	p9_getstr(in, name, sizeof(name));	/* aname, one export */
+	if (in->bad)
+		return EINVAL;
+
+	fd = openat(vs->root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+	err = p9_qid(fd, &qid);
+	if (!err)
+		err = p9_fid_add(vs, fid, fd, -1, false);
+	else
+		close(fd);
+	if (err)
+		return err;
+	p9_putqid(out, &qid);
+	return 0;
+}
+
+/*
+ * Open one component below the directory dirfd, ".." of the export root
+ * stays at the root.
+ */
+static int
+p9_walk_one(struct virtio_9p *vs, int dirfd, const char *name, int *fd)
+{
+	struct stat st;
+	int err;
+
+	if (!name[0] || strchr(name, '/'))
+		return ENOENT;
+	if (!strcmp(name, "..")) {
+		err = p9_fstat(dirfd, &st);
+		if (err)
+			return err;
+		if (st.st_dev == vs->root_dev && st.st_ino == vs->root_ino)
+			name = ".";
+	}
+	*fd = openat(dirfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	return *fd < 0 ? errno : 0;
+}
+
+static int
+p9_walk(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_qid qids[P9_MAXWELEM];
+	struct virtio_9p_fid *f;
+	char name[NAME_MAX + 1];
+	uint32_t fid, newfid;
+	uint16_t nwname, i, j;
+	int fd, nfd, err = 0;
+
+	fid = p9_get32(in);
+	newfid = p9_get32(in);
+	nwname = p9_get16(in);
+	if (in->bad || nwname > P9_MAXWELEM)
+		return EINVAL;
+
+	f = p9_fid_get(vs, fid);
+	if (!f)
+		return EBADF;
+	fd = dup(f->fd);
+	p9_fid_put(vs, f);
+	if (fd < 0)
+		return errno;
+
+	for (i = 0; i < nwname; i++) {
+		p9_getstr(in, name, sizeof(name));
+		if (in->bad) {
+			err = EINVAL;
+			break;
+		}
+		nfd = -1;
+		err = p9_walk_one(vs, fd, name, &nfd);
+		if (!err)
+			err = p9_qid(nfd, &qids[i]);
+		if (err) {
+			if (nfd >= 0)
+				close(nfd);
+			break;
+		}
+		close(fd);
+		fd = nfd;
+	}
+
+	/* Only a full walk binds newfid, a partial one just reports */
+	if (i == nwname) {
+		err = p9_fid_add(vs, newfid, fd, -1, newfid == fid);
+		if (err)
+			return err;
+	} else {
+		close(fd);
+		if (i == 0)
+			return err;
+	}
+
+	p9_put16(out, i);
+	for (j = 0; j < i; j++)
+		p9_putqid(out, &qids[j]);
+	return 0;
+}
+
+static int
+p9_clunk(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	 struct virtio_9p_pdu *out)
+{
+	uint32_t fid;
+
+	fid = p9_get32(in);
+	if (in->bad)
+		return EINVAL;
+	return p9_fid_clunk(w->vs, fid);
+}
+
+static int
+p9_remove(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	  struct virtio_9p_pdu *out)
+{
+	uint32_t fid;
+
+	/*
+	 * The fid doesn't tell the directory entry to remove; the guest
+	 * falls back to Tunlinkat. Tremove clunks the fid even if it fails.
+	 */
+	fid = p9_get32(in);
+	if (in->bad)
+		return EINVAL;
+	p9_fid_clunk(w->vs, fid);
+	return EOPNOTSUPP;
+}
+
+static int
+p9_lopen(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	 struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_fid *f;
+	struct virtio_9p_qid qid;
+	struct stat st;
+	char path[32];
+	uint32_t fid, flags;
+	int fd = -1, err;
+
+	fid = p9_get32(in);
+	flags = p9_get32(in) & P9_OPEN_FLAGS;
+	if (in->bad)
+		return EINVAL;
+	if (vs->readonly &&
+	    ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)))
+		return EROFS;
+
+	f = p9_fid_get(vs, fid);
+	if (!f)
+		return EBADF;
+	err = p9_fstat(f->fd, &st);
+	if (err)
+		goto done;
+	if (S_ISLNK(st.st_mode)) {
+		err = ELOOP;
+		goto done;
+	}
+	/* Special files are opened by the guest itself, never through 9p */
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+		err = EPERM;
+		goto done;
+	}
+
+	p9_procpath(f->fd, path, sizeof(path));
+	fd = open(path, flags | O_CLOEXEC);
+	if (fd < 0) {
+		err = errno;
+		goto done;
+	}
+	pthread_mutex_lock(&f->mtx);
+	if (f->ofd < 0) {
+		f->ofd = fd;
+		fd = -1;
+	} else
+		err = EINVAL;
+	pthread_mutex_unlock(&f->mtx);
+	if (fd >= 0)
+		close(fd);
+	if (err)
+		goto done;
+
+	p9_stat2qid(&st, &qid);
+	p9_putqid(out, &qid);
+	p9_put32(out, 0);	/* iounit, up to msize */
+done:
+	p9_fid_put(vs, f);
+	return err;
+}
+
+static int
+p9_lcreate(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	   struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_fid *f;
+	struct virtio_9p_qid qid;
+	struct stat st;
+	char name[NAME_MAX + 1];
+	uint32_t fid, flags, mode;
+	int fd, ofd, err;
+
+	fid = p9_get32(in);
+	p9_getstr(in, name, sizeof(name));
+	flags = p9_get32(in) & (P9_OPEN_FLAGS | O_EXCL);
+	mode = p9_get32(in);
+	p9_get32(in);		/* gid, files belong to the device model */
+	if (in->bad || !p9_name_ok(name))
+		return EINVAL;
+	if (vs->readonly)
+		return EROFS;
+
+	f = p9_fid_get(vs, fid);
+	if (!f)
+		return EBADF;
+	/* O_NONBLOCK until checked, an existing FIFO would block the worker */
+	ofd = openat(f->fd, name,
+		     flags | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC,
+		     mode & 07777);
+	if (ofd < 0) {
+		err = errno;
+		p9_fid_put(vs, f);
+		return err;
+	}
+	fd = -1;
+	err = p9_fstat(ofd, &st);
+	/* Special files are opened by the guest itself, never through 9p */
+	if (!err && !S_ISREG(st.st_mode))
+		err = EPERM;
+	if (!err && !(flags & O_NONBLOCK) &&
+	    fcntl(ofd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+		err = errno;
+	if (!err) {
+		fd = openat(f->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+		err = fd < 0 ? errno : 0;
+	}
+	p9_fid_put(vs, f);
+	if (err) {
+		if (fd >= 0)
+			close(fd);
+		close(ofd);
+		return err;
+	}
+
+	/* The directory fid now stands for the new, open file */
+	err = p9_fid_add(vs, fid, fd, ofd, true);
+	if (err)
+		return err;
+	p9_stat2qid(&st, &qid);
+	p9_putqid(out, &qid);
+	p9_put32(out, 0);
+	return 0;
+}
+
+static int
+p9_read(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_req *req = w->req;
+	struct iovec data[VIRTIO_9P_MAXSEGS];
+	struct virtio_9p_fid *f;
+	uint32_t fid, count;
+	uint64_t offset;
+	ssize_t n;
+	int fd, ndata, err = 0;
+
+	fid = p9_get32(in);
+	offset = p9_get64(in);
+	count = p9_get32(in);
+	if (in->bad)
+		return EINVAL;
+
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+	fd = p9_fid_ofd(f);
+	if (fd < 0) {
+		err = EBADF;
+		goto done;
+	}
+
+	/* Straight into the guest buffers, after the Rread header */
+	count = MIN(count, out->size - P9_RREAD_HDR_SIZE);
+	ndata = p9_iov_slice(req->iov + req->nout, req->niov - req->nout,
+			     P9_RREAD_HDR_SIZE, count, data);
+	do {
+		n = preadv(fd, data, ndata, offset);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		err = errno;
+		goto done;
+	}
+	p9_put32(out, n);
+	w->data_len = n;
+done:
+	p9_fid_put(w->vs, f);
+	return err;
+}
+
+static int
+p9_write(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	 struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_req *req = w->req;
+	struct iovec data[VIRTIO_9P_MAXSEGS];
+	struct virtio_9p_fid *f;
+	uint32_t fid, count;
+	uint64_t offset;
+	ssize_t n;
+	int fd, ndata, err = 0;
+
+	fid = p9_get32(in);
+	offset = p9_get64(in);
+	count = p9_get32(in);
+	if (in->bad || count > p9_iov_len(req->iov, req->nout) -
+	    P9_RW_HDR_SIZE)
+		return EINVAL;
+
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+	fd = p9_fid_ofd(f);
+	if (fd < 0) {
+		err = EBADF;
+		goto done;
+	}
+
+	/* The data follows the Twrite header in the guest buffers */
+	ndata = p9_iov_slice(req->iov, req->nout, P9_RW_HDR_SIZE, count,
+			     data);
+	do {
+		n = pwritev(fd, data, ndata, offset);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		err = errno;
+		goto done;
+	}
+	p9_put32(out, n);
+done:
+	p9_fid_put(w->vs, f);
+	return err;
+}
+
+static int
+p9_getattr(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	   struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_fid *f;
+	struct virtio_9p_qid qid;
+	struct stat st;
+	uint32_t fid;
+	int err;
+
+	fid = p9_get32(in);
+	p9_get64(in);		/* request_mask, we have the basic set */
+	if (in->bad)
+		return EINVAL;
+
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+	err = p9_fstat(f->fd, &st);
+	p9_fid_put(w->vs, f);
+	if (err)
+		return err;
+
+	p9_stat2qid(&st, &qid);
+	p9_put64(out, P9_GETATTR_BASIC);
+	p9_putqid(out, &qid);
+	p9_put32(out, st.st_mode);
+	p9_put32(out, st.st_uid);
+	p9_put32(out, st.st_gid);
+	p9_put64(out, st.st_nlink);
+	p9_put64(out, st.st_rdev);
+	p9_put64(out, st.st_size);
+	p9_put64(out, st.st_blksize);
+	p9_put64(out, st.st_blocks);
+	p9_put64(out, st.st_atim.tv_sec);
+	p9_put64(out, st.st_atim.tv_nsec);
+	p9_put64(out, st.st_mtim.tv_sec);
+	p9_put64(out, st.st_mtim.tv_nsec);
+	p9_put64(out, st.st_ctim.tv_sec);
+	p9_put64(out, st.st_ctim.tv_nsec);
+	p9_put64(out, 0);	/* btime, gen and data_version not valid */
+	p9_put64(out, 0);
+	p9_put64(out, 0);
+	p9_put64(out, 0);
+	return 0;
+}
+
+static int
+p9_setattr(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	   struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_fid *f;
+	struct timespec ts[2];
+	struct stat st;
+	char path[32];
+	uint32_t fid, valid, mode, uid, gid;
+	uint64_t size;
+	int err;
+
+	fid = p9_get32(in);
+	valid = p9_get32(in);
+	mode = p9_get32(in);
+	uid = p9_get32(in);
+	gid = p9_get32(in);
+	size = p9_get64(in);
+	ts[0].tv_sec = p9_get64(in);
+	ts[0].tv_nsec = p9_get64(in);
+	ts[1].tv_sec = p9_get64(in);
+	ts[1].tv_nsec = p9_get64(in);
+	if (in->bad)
+		return EINVAL;
+	if (vs->readonly)
+		return EROFS;
+
+	f = p9_fid_get(vs, fid);
+	if (!f)
+		return EBADF;
+	err = p9_fstat(f->fd, &st);
+	if (err)
+		goto done;
+	p9_procpath(f->fd, path, sizeof(path));
+
+	/* Symlinks have no mode, size or times of their own to set here */
+	if ((valid & (P9_SETATTR_MODE | P9_SETATTR_SIZE)) &&
+	    S_ISLNK(st.st_mode)) {
+		err = EOPNOTSUPP;
+		goto done;
+	}
+	if ((valid & P9_SETATTR_MODE) && chmod(path, mode & 07777) < 0)
+		goto fail;
+	if ((valid & (P9_SETATTR_UID | P9_SETATTR_GID)) &&
+	    fchownat(f->fd, "", (valid & P9_SETATTR_UID) ? uid : -1,
+		     (valid & P9_SETATTR_GID) ? gid : -1,
+		     AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+		goto fail;
+	if ((valid & P9_SETATTR_SIZE) && truncate(path, size) < 0)
+		goto fail;
+	if ((valid & (P9_SETATTR_ATIME | P9_SETATTR_MTIME)) &&
+	    !S_ISLNK(st.st_mode)) {
+		if (!(valid & P9_SETATTR_ATIME))
+			ts[0].tv_nsec = UTIME_OMIT;
+		else if (!(valid & P9_SETATTR_ATIME_SET))
+			ts[0].tv_nsec = UTIME_NOW;
+		if (!(valid & P9_SETATTR_MTIME))
+			ts[1].tv_nsec = UTIME_OMIT;
+		else if (!(valid & P9_SETATTR_MTIME_SET))
+			ts[1].tv_nsec = UTIME_NOW;
+		if (utimensat(AT_FDCWD, path, ts, 0) < 0)
+			goto fail;
+	}
+	goto done;
+
+fail:
+	err = errno;
+done:
+	p9_fid_put(vs, f);
+	return err;
+}
+
+static int
+p9_readdir(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	   struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_fid *f;
+	struct virtio_9p_qid qid;
+	struct dirent *ent;
+	uint32_t fid, count, start, len, limit;
+	uint64_t offset;
+	long pos;
+	int err = 0;
+
+	fid = p9_get32(in);
+	offset = p9_get64(in);
+	count = p9_get32(in);
+	if (in->bad)
+		return EINVAL;
+
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+
+	/* The stream position is per fid, seek to where the guest is */
+	pthread_mutex_lock(&f->mtx);
+	if (!f->dir) {
+		if (f->ofd < 0) {
+			err = EBADF;
+			goto done;
+		}
+		f->dir = fdopendir(f->ofd);
+		if (!f->dir) {
+			err = errno;
+			goto done;
+		}
+	}
+	if (offset == 0)
+		rewinddir(f->dir);
+	else
+		seekdir(f->dir, offset);
+
+	start = out->off;
+	p9_put32(out, 0);
+	limit = out->off + MIN(count, out->size - out->off);
+	for (;;) {
+		pos = telldir(f->dir);
+		errno = 0;
+		ent = readdir(f->dir);
+		if (!ent) {
+			err = errno;
+			break;
+		}
+		len = P9_QID_SIZE + 8 + 1 + 2 + strlen(ent->d_name);
+		if (out->off + len > limit) {
+			seekdir(f->dir, pos);
+			break;
+		}
+		qid.type = ent->d_type == DT_DIR ? P9_QTDIR :
+			ent->d_type == DT_LNK ? P9_QTSYMLINK : P9_QTFILE;
+		qid.version = 0;
+		qid.path = ent->d_ino;
+		p9_putqid(out, &qid);
+		p9_put64(out, ent->d_off);
+		p9_put8(out, ent->d_type);
+		p9_putstr(out, ent->d_name);
+	}
+	len = out->off - start - 4;
+	memcpy(out->buf + start, &len, sizeof(len));
+done:
+	pthread_mutex_unlock(&f->mtx);
+	p9_fid_put(w->vs, f);
+	return err;
+}
+
+static int
+p9_statfs(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	  struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_fid *f;
+	struct statfs st;
+	uint32_t fid;
+	int err = 0;
+
+	fid = p9_get32(in);
+	if (in->bad)
+		return EINVAL;
+
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+	if (fstatfs(f->fd, &st) < 0)
+		err = errno;
+	p9_fid_put(w->vs, f);
+	if (err)
+		return err;
+
+	p9_put32(out, st.f_type);
+	p9_put32(out, st.f_bsize);
+	p9_put64(out, st.f_blocks);
+	p9_put64(out, st.f_bfree);
+	p9_put64(out, st.f_bavail);
+	p9_put64(out, st.f_files);
+	p9_put64(out, st.f_ffree);
+	p9_put(out, &st.f_fsid, sizeof(uint64_t));
+	p9_put32(out, st.f_namelen);
+	return 0;
+}
+
+static int
+p9_fsync(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	 struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_fid *f;
+	uint32_t fid, datasync;
+	int fd, err = 0;
+
+	fid = p9_get32(in);
+	datasync = p9_get32(in);
+	if (in->bad)
+		return EINVAL;
+
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+	fd = p9_fid_ofd(f);
+	if (fd < 0)
+		err = EBADF;
+	else if ((datasync ? fdatasync(fd) : fsync(fd)) < 0)
+		err = errno;
+	p9_fid_put(w->vs, f);
+	return err;
+}
+
+/* The qid of the new entry name below dirfd */
+static int
+p9_qid_at(int dirfd, const char *name, struct virtio_9p_qid *qid)
+{
+	struct stat st;
+
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return errno;
+	p9_stat2qid(&st, qid);
+	return 0;
+}
+
+/*
+ * Tmkdir, Tsymlink and Tmknod: create name in the directory dfid.
+ */
+static int
+p9_mkentry(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	   struct virtio_9p_pdu *out, uint8_t type)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_fid *f;
+	struct virtio_9p_qid qid;
+	char name[NAME_MAX + 1];
+	char *target = NULL;
+	uint32_t dfid, mode = 0, major = 0, minor = 0;
+	int rc, err;
+
+	dfid = p9_get32(in);
+	p9_getstr(in, name, sizeof(name));
+	if (type == P9_TSYMLINK) {
+		target = malloc(PATH_MAX);
+		if (!target)
+			return ENOMEM;
+		p9_getstr(in, target, PATH_MAX);
+	} else {
+		mode = p9_get32(in);
+		if (type == P9_TMKNOD) {
+			major = p9_get32(in);
+			minor = p9_get32(in);
+		}
+	}
+	p9_get32(in);		/* gid */
+	if (in->bad || !p9_name_ok(name)) {
+		err = EINVAL;
+		goto out;
+	}
+	/* No host device nodes in the export */
+	if (type == P9_TMKNOD && (S_ISCHR(mode) || S_ISBLK(mode))) {
+		err = EPERM;
+		goto out;
+	}
+	if (vs->readonly) {
+		err = EROFS;
+		goto out;
+	}
+
+	f = p9_fid_get(vs, dfid);
+	if (!f) {
+		err = EBADF;
+		goto out;
+	}
+	if (type == P9_TMKDIR)
+		rc = mkdirat(f->fd, name, mode & 07777);
+	else if (type == P9_TSYMLINK)
+		rc = symlinkat(target, f->fd, name);
+	else
+		rc = mknodat(f->fd, name, mode, makedev(major, minor));
+	err = rc < 0 ? errno : p9_qid_at(f->fd, name, &qid);
+	p9_fid_put(vs, f);
+	if (!err)
+		p9_putqid(out, &qid);
+out:
+	free(target);
+	return err;
+}
+
+static int
+p9_mkdir(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	 struct virtio_9p_pdu *out)
+{
+	return p9_mkentry(w, in, out, P9_TMKDIR);
+}
+
+static int
+p9_symlink(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	   struct virtio_9p_pdu *out)
+{
+	return p9_mkentry(w, in, out, P9_TSYMLINK);
+}
+
+static int
+p9_mknod(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	 struct virtio_9p_pdu *out)
+{
+	return p9_mkentry(w, in, out, P9_TMKNOD);
+}
+
+static int
+p9_readlink(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	    struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_fid *f;
+	uint32_t fid;
+	ssize_t n;
+	char *target;
+	int err = 0;
+
+	fid = p9_get32(in);
+	if (in->bad)
+		return EINVAL;
+
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+	target = malloc(PATH_MAX);
+	if (!target) {
+		p9_fid_put(w->vs, f);
+		return ENOMEM;
+	}
+	n = readlinkat(f->fd, "", target, PATH_MAX - 1);
+	if (n < 0)
+		err = errno;
+	else {
+		target[n] = '\0';
+		p9_putstr(out, target);
+	}
+	free(target);
+	p9_fid_put(w->vs, f);
+	return err;
+}
+
+static int
+p9_link(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_fid *df, *f;
+	char name[NAME_MAX + 1];
+	char path[32];
+	uint32_t dfid, fid;
+	int err = 0;
+
+	dfid = p9_get32(in);
+	fid = p9_get32(in);
+	p9_getstr(in, name, sizeof(name));
+	if (in->bad || !p9_name_ok(name))
+		return EINVAL;
+	if (vs->readonly)
+		return EROFS;
+
+	df = p9_fid_get(vs, dfid);
+	if (!df)
+		return EBADF;
+	f = p9_fid_get(vs, fid);
+	if (!f) {
+		p9_fid_put(vs, df);
+		return EBADF;
+	}
+	/* AT_EMPTY_PATH would need CAP_DAC_READ_SEARCH */
+	p9_procpath(f->fd, path, sizeof(path));
+	if (linkat(AT_FDCWD, path, df->fd, name, AT_SYMLINK_FOLLOW) < 0)
+		err = errno;
+	p9_fid_put(vs, f);
+	p9_fid_put(vs, df);
+	return err;
+}
+
+static int
+p9_renameat(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	    struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_fid *of, *nf;
+	char oname[NAME_MAX + 1], nname[NAME_MAX + 1];
+	uint32_t ofid, nfid;
+	int err = 0;
+
+	ofid = p9_get32(in);
+	p9_getstr(in, oname, sizeof(oname));
+	nfid = p9_get32(in);
+	p9_getstr(in, nname, sizeof(nname));
+	if (in->bad || !p9_name_ok(oname) || !p9_name_ok(nname))
+		return EINVAL;
+	if (vs->readonly)
+		return EROFS;
+
+	of = p9_fid_get(vs, ofid);
+	if (!of)
+		return EBADF;
+	nf = p9_fid_get(vs, nfid);
+	if (!nf) {
+		p9_fid_put(vs, of);
+		return EBADF;
+	}
+	if (renameat(of->fd, oname, nf->fd, nname) < 0)
+		err = errno;
+	p9_fid_put(vs, nf);
+	p9_fid_put(vs, of);
+	return err;
+}
+
+static int
+p9_unlinkat(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	    struct virtio_9p_pdu *out)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_fid *f;
+	char name[NAME_MAX + 1];
+	uint32_t dfid, flags;
+	int err = 0;
+
+	dfid = p9_get32(in);
+	p9_getstr(in, name, sizeof(name));
+	flags = p9_get32(in);
+	if (in->bad || !p9_name_ok(name))
+		return EINVAL;
+	if (vs->readonly)
+		return EROFS;
+
+	f = p9_fid_get(vs, dfid);
+	if (!f)
+		return EBADF;
+	if (unlinkat(f->fd, name, (flags & P9_DOTL_AT_REMOVEDIR) ?
+		     AT_REMOVEDIR : 0) < 0)
+		err = errno;
+	p9_fid_put(vs, f);
+	return err;
+}
+
+/*
+ * POSIX locks are only kept in the guest: every lock is granted, and no
+ * other host process is reported to hold one.
+ */
+static int
+p9_lock(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_fid *f;
+	uint32_t fid;
+
+	fid = p9_get32(in);
+	if (in->bad)
+		return EINVAL;
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+	p9_fid_put(w->vs, f);
+	p9_put8(out, P9_LOCK_SUCCESS);
+	return 0;
+}
+
+static int
+p9_getlock(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	   struct virtio_9p_pdu *out)
+{
+	struct virtio_9p_fid *f;
+	char client[256];
+	uint64_t start, length;
+	uint32_t fid, proc_id;
+
+	fid = p9_get32(in);
+	p9_get8(in);		/* type */
+	start = p9_get64(in);
+	length = p9_get64(in);
+	proc_id = p9_get32(in);
+	p9_getstr(in, client, sizeof(client));
+	if (in->bad)
+		return EINVAL;
+	f = p9_fid_get(w->vs, fid);
+	if (!f)
+		return EBADF;
+	p9_fid_put(w->vs, f);
+
+	p9_put8(out, P9_LOCK_TYPE_UNLCK);
+	p9_put64(out, start);
+	p9_put64(out, length);
+	p9_put32(out, proc_id);
+	p9_putstr(out, client);
+	return 0;
+}
+
+/* The request to flush has been answered by the time this runs */
+static int
+p9_flush(struct virtio_9p_worker *w, struct virtio_9p_pdu *in,
+	 struct virtio_9p_pdu *out)
+{
+	p9_get16(in);		/* oldtag */
+	return in->bad ? EINVAL : 0;
+}
+
+typedef int (*p9_handler_t)(struct virtio_9p_worker *, struct virtio_9p_pdu *,
+			    struct virtio_9p_pdu *);
+
+/* Messages missing here (auth, xattrs, Trename) get EOPNOTSUPP */
+static p9_handler_t p9_handlers[] = {
+	[P9_TSTATFS]	= p9_statfs,
+	[P9_TLOPEN]	= p9_lopen,
+	[P9_TLCREATE]	= p9_lcreate,
+	[P9_TSYMLINK]	= p9_symlink,
+	[P9_TMKNOD]	= p9_mknod,
+	[P9_TREADLINK]	= p9_readlink,
+	[P9_TGETATTR]	= p9_getattr,
+	[P9_TSETATTR]	= p9_setattr,
+	[P9_TREADDIR]	= p9_readdir,
+	[P9_TFSYNC]	= p9_fsync,
+	[P9_TLOCK]	= p9_lock,
+	[P9_TGETLOCK]	= p9_getlock,
+	[P9_TLINK]	= p9_link,
+	[P9_TMKDIR]	= p9_mkdir,
+	[P9_TRENAMEAT]	= p9_renameat,
+	[P9_TUNLINKAT]	= p9_unlinkat,
+	[P9_TVERSION]	= p9_version,
+	[P9_TATTACH]	= p9_attach,
+	[P9_TFLUSH]	= p9_flush,
+	[P9_TWALK]	= p9_walk,
+	[P9_TREAD]	= p9_read,
+	[P9_TWRITE]	= p9_write,
+	[P9_TCLUNK]	= p9_clunk,
+	[P9_TREMOVE]	= p9_remove,
+};
+
+/*
+ * Handle one request and put the reply in its writable buffers. Returns
+ * the reply length.
+ */
+static uint32_t
+virtio_9p_proc(struct virtio_9p_worker *w, struct virtio_9p_req *req)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_pdu in, out;
+	struct iovec *riov = req->iov + req->nout;
+	int nriov = req->niov - req->nout;
+	size_t tlen, rlen;
+	uint32_t size;
+	uint8_t type;
+	int err;
+
+	tlen = p9_iov_len(req->iov, req->nout);
+	rlen = p9_iov_len(riov, nriov);
+	if (rlen < P9_HDR_SIZE + sizeof(uint32_t)) {
+		WPRINTF(("virtio_9p: no room for the reply\n"));
+		return 0;
+	}
+
+	/* Twrite data is used in place, other messages are copied in */
+	memset(&in, 0, sizeof(in));
+	in.buf = w->tbuf;
+	in.size = p9_iov_copy(req->iov, req->nout, 0, w->tbuf,
+			      req->type == P9_TWRITE ? P9_RW_HDR_SIZE :
+			      vs->max_msize, false);
+	size = p9_get32(&in);
+	p9_get8(&in);
+	p9_get16(&in);
+	if (req->type != P9_TWRITE)
+		in.size = MIN(in.size, size);
+
+	memset(&out, 0, sizeof(out));
+	out.buf = w->rbuf;
+	out.size = MIN(rlen, vs->msize);
+	out.off = P9_HDR_SIZE;
+	w->req = req;
+	w->data_len = 0;
+
+	if (size > tlen || size > vs->max_msize)
+		err = EINVAL;
+	else if (req->type < ARRAY_SIZE(p9_handlers) &&
+		 p9_handlers[req->type])
+		err = p9_handlers[req->type](w, &in, &out);
+	else
+		err = EOPNOTSUPP;
+	if (!err && out.bad)
+		err = EMSGSIZE;
+
+	if (err) {
+		DPRINTF(("virtio_9p: message %u failed: %s\n", req->type,
+			 strerror(err)));
+		memset(&out, 0, sizeof(out));
+		out.buf = w->rbuf;
+		out.size = P9_HDR_SIZE + sizeof(uint32_t);
+		out.off = P9_HDR_SIZE;
+		p9_put32(&out, err);
+		w->data_len = 0;
+		type = P9_RLERROR;
+	} else
+		type = req->type + 1;
+
+	size = out.off + w->data_len;
+	memcpy(out.buf, &size, sizeof(size));
+	out.buf[4] = type;
+	memcpy(out.buf + 5, &req->tag, sizeof(req->tag));
+	p9_iov_copy(riov, nriov, 0, out.buf, out.off, true);
+	return size;
+}
+
+/*
+ * A worker owns the requests it takes off the pending queue and counts in
+ * nio while it reads or writes their buffers. Reset waits for nio to drop
+ * to zero and takes the requests of the old ring back, so guest memory is
+ * never touched once the ring is gone. The io helpers run under req_mtx.
+ */
+static void
+virtio_9p_take(struct virtio_9p *vs, struct virtio_9p_req *req)
+{
+	TAILQ_REMOVE(&vs->pendq, req, link);
+	req->queued = false;
+	req->busy = true;
+	vs->nio++;
+}
+
+static void
+virtio_9p_io_end(struct virtio_9p *vs)
+{
+	if (--vs->nio == 0)
+		pthread_cond_broadcast(&vs->done_cond);
+}
+
+/* Returns -1 if the device was reset meanwhile, the request is gone */
+static int
+virtio_9p_io_begin(struct virtio_9p *vs, uint32_t gen)
+{
+	if (gen != vs->gen)
+		return -1;
+	vs->nio++;
+	return 0;
+}
+
+/*
+ * Run a request taken off the pending queue and return it to the guest,
+ * unless the device was reset meanwhile.
+ */
+static void
+virtio_9p_run(struct virtio_9p_worker *w, struct virtio_9p_req *req)
+{
+	struct virtio_9p *vs = w->vs;
+	uint32_t gen = req->gen;
+	uint16_t idx = req->idx;
+	uint32_t len;
+
+	len = virtio_9p_proc(w, req);
+
+	pthread_mutex_lock(&vs->req_mtx);
+	virtio_9p_io_end(vs);
+	pthread_mutex_unlock(&vs->req_mtx);
+
+	/* Free the slot before the guest may reuse the descriptor */
+	pthread_mutex_lock(&vs->mtx);
+	if (gen == vs->gen) {
+		pthread_mutex_lock(&vs->req_mtx);
+		req->busy = false;
+		pthread_cond_broadcast(&vs->done_cond);
+		pthread_mutex_unlock(&vs->req_mtx);
+		vq_relchain(&vs->vq, idx, len);
+		vq_endchains(&vs->vq, 0);
+	}
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+/*
+ * Rflush must come after the reply to the flushed request: wait for it if
+ * another worker runs it, run it here if it hasn't started yet. Returns -1
+ * if the device was reset meanwhile.
+ */
+static int
+virtio_9p_flush_wait(struct virtio_9p_worker *w, struct virtio_9p_req *req)
+{
+	struct virtio_9p *vs = w->vs;
+	struct virtio_9p_req *old;
+	uint32_t gen = req->gen;
+	uint16_t oldtag;
+	int i, err = 0;
+
+	if (p9_iov_copy(req->iov, req->nout, P9_HDR_SIZE, &oldtag,
+			sizeof(oldtag), false) != sizeof(oldtag))
+		return 0;
+
+	/* Not counted in nio while waiting, the other worker needs mtx */
+	pthread_mutex_lock(&vs->req_mtx);
+	for (;;) {
+		old = NULL;
+		for (i = 0; i < VIRTIO_9P_RINGSZ; i++) {
+			if (&vs->reqs[i] != req && vs->reqs[i].tag == oldtag &&
+			    (vs->reqs[i].queued || vs->reqs[i].busy)) {
+				old = &vs->reqs[i];
+				break;
+			}
+		}
+		if (!old)
+			break;
+		virtio_9p_io_end(vs);
+		if (old->busy) {
+			pthread_cond_wait(&vs->done_cond, &vs->req_mtx);
+		} else {
+			virtio_9p_take(vs, old);
+			pthread_mutex_unlock(&vs->req_mtx);
+			virtio_9p_run(w, old);
+			pthread_mutex_lock(&vs->req_mtx);
+		}
+		err = virtio_9p_io_begin(vs, gen);
+		if (err)
+			break;
+	}
+	pthread_mutex_unlock(&vs->req_mtx);
+	return err;
+}
+
+static void *
+virtio_9p_thr(void *arg)
+{
+	struct virtio_9p *vs = arg;
+	struct virtio_9p_worker w;
+	struct virtio_9p_req *req;
+
+	memset(&w, 0, sizeof(w));
+	w.vs = vs;
+	w.tbuf = malloc(vs->max_msize);
+	w.rbuf = malloc(vs->max_msize);
+	if (!w.tbuf || !w.rbuf) {
+		WPRINTF(("virtio_9p: no memory for a worker\n"));
+		goto out;
+	}
+
+	pthread_mutex_lock(&vs->req_mtx);
+	for (;;) {
+		while (!vs->closing && TAILQ_EMPTY(&vs->pendq))
+			pthread_cond_wait(&vs->req_cond, &vs->req_mtx);
+		if (vs->closing)
+			break;
+		req = TAILQ_FIRST(&vs->pendq);
+		virtio_9p_take(vs, req);
+		pthread_mutex_unlock(&vs->req_mtx);
+
+		if (req->type != P9_TFLUSH || !virtio_9p_flush_wait(&w, req))
+			virtio_9p_run(&w, req);
+		pthread_mutex_lock(&vs->req_mtx);
+	}
+	pthread_mutex_unlock(&vs->req_mtx);
+out:
+	free(w.tbuf);
+	free(w.rbuf);
+	return NULL;
+}
+
+/*
+ * Hand the new requests to the workers. Called with the device mutex held.
+ */
+static void
+virtio_9p_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_9p *vs = vdev;
+	struct virtio_9p_req *req;
+	struct iovec iov[VIRTIO_9P_MAXSEGS];
+	uint16_t flags[VIRTIO_9P_MAXSEGS];
+	uint8_t hdr[P9_HDR_SIZE];
+	bool used = false;
+	uint16_t idx;
+	int i, n, nout;
+	bool inuse;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_9P_MAXSEGS, flags);
+		if (n <= 0) {
+			WPRINTF(("virtio_9p: invalid chain\n"));
+			break;
+		}
+		req = &vs->reqs[idx];
+		pthread_mutex_lock(&vs->req_mtx);
+		inuse = req->queued || req->busy;
+		pthread_mutex_unlock(&vs->req_mtx);
+		if (inuse) {
+			/* Only a broken guest reuses a chain not returned yet */
+			WPRINTF(("virtio_9p: descriptor %u already in use\n",
+				 idx));
+			vq_relchain(vq, idx, 0);
+			used = true;
+			continue;
+		}
+
+		/* The T message, then the buffers for the reply */
+		for (nout = 0; nout < n && nout < VIRTIO_9P_MAXSEGS &&
+		     !(flags[nout] & VRING_DESC_F_WRITE); nout++)
+			;
+		for (i = nout; i < n && i < VIRTIO_9P_MAXSEGS &&
+		     (flags[i] & VRING_DESC_F_WRITE); i++)
+			;
+		if (n > VIRTIO_9P_MAXSEGS || i < n ||
+		    p9_iov_copy(iov, nout, 0, hdr, sizeof(hdr), false) !=
+		    sizeof(hdr)) {
+			WPRINTF(("virtio_9p: malformed request\n"));
+			vq_relchain(vq, idx, 0);
+			used = true;
+			continue;
+		}
+
+		memcpy(req->iov, iov, n * sizeof(struct iovec));
+		req->niov = n;
+		req->nout = nout;
+		req->idx = idx;
+		req->gen = vs->gen;
+		req->type = hdr[4];
+		memcpy(&req->tag, hdr + 5, sizeof(req->tag));
+
+		pthread_mutex_lock(&vs->req_mtx);
+		TAILQ_INSERT_TAIL(&vs->pendq, req, link);
+		req->queued = true;
+		pthread_cond_signal(&vs->req_cond);
+		pthread_mutex_unlock(&vs->req_mtx);
+	}
+	if (used)
+		vq_endchains(vq, 0);
+}
+
+static void
+virtio_9p_reset(void *vdev)
+{
+	struct virtio_9p *vs = vdev;
+	struct virtio_9p_req *req;
+	int i;
+
+	DPRINTF(("virtio_9p: device reset requested\n"));
+
+	/*
+	 * Drop the requests not started yet and wait for the running ones
+	 * to be done with the guest buffers. Their replies are not returned
+	 * to the reset ring, the slots are free for the new one.
+	 */
+	pthread_mutex_lock(&vs->req_mtx);
+	while ((req = TAILQ_FIRST(&vs->pendq)) != NULL) {
+		TAILQ_REMOVE(&vs->pendq, req, link);
+		req->queued = false;
+	}
+	vs->gen++;
+	while (vs->nio)
+		pthread_cond_wait(&vs->done_cond, &vs->req_mtx);
+	for (i = 0; i < VIRTIO_9P_RINGSZ; i++)
+		vs->reqs[i].busy = false;
+	pthread_cond_broadcast(&vs->done_cond);
+	pthread_mutex_unlock(&vs->req_mtx);
+
+	p9_fid_clunk_all(vs);
+	vs->msize = vs->max_msize;
+	virtio_reset_dev(&vs->base);
+}
+
+static int
+virtio_9p_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_9p *vs = vdev;
+	void *ptr;
+
+	/* our caller has already verified offset and size */
+	ptr = (uint8_t *)&vs->cfg + offset;
+	memcpy(retval, ptr, size);
+	return 0;
+}
+
+static int
+virtio_9p_cfgwrite(void *vdev, int offset, int size, uint32_t value)
+{
+	DPRINTF(("virtio_9p: write to readonly reg %d\n", offset));
+	return -1;
+}
+
+static void
+virtio_9p_free(struct virtio_9p *vs)
+{
+	int i;
+
+	pthread_mutex_lock(&vs->req_mtx);
+	vs->closing = true;
+	pthread_cond_broadcast(&vs->req_cond);
+	pthread_mutex_unlock(&vs->req_mtx);
+	for (i = 0; i < vs->nthreads; i++)
+		pthread_join(vs->tids[i], NULL);
+
+	p9_fid_clunk_all(vs);
+	if (vs->root_fd >= 0)
+		close(vs->root_fd);
+	free(vs->path);
+	pthread_cond_destroy(&vs->done_cond);
+	pthread_cond_destroy(&vs->req_cond);
+	pthread_mutex_destroy(&vs->req_mtx);
+	pthread_mutex_destroy(&vs->fid_mtx);
+	pthread_mutex_destroy(&vs->mtx);
+	free(vs);
+}
+
+static int
+virtio_9p_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_9p *vs;
+	pthread_mutexattr_t attr;
+	struct stat st;
+	char *opt, *key, *tag = NULL;
+	char tname[MAXCOMLEN + 1];
+	int i, rc, nthreads = VIRTIO_9P_NUMTHR;
+
+	vs = calloc(1, sizeof(struct virtio_9p));
+	if (!vs) {
+		WPRINTF(("virtio_9p: calloc returns NULL\n"));
+		return -1;
+	}
+	vs->root_fd = -1;
+	vs->max_msize = VIRTIO_9P_MSIZE;
+	for (i = 0; i < VIRTIO_9P_FID_HASH; i++)
+		LIST_INIT(&vs->fids[i]);
+	TAILQ_INIT(&vs->pendq);
+	pthread_mutex_init(&vs->fid_mtx, NULL);
+	pthread_mutex_init(&vs->req_mtx, NULL);
+	pthread_cond_init(&vs->req_cond, NULL);
+	pthread_cond_init(&vs->done_cond, NULL);
+
+	/* Recursive for INTx, where vq_interrupt takes the lock again */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	rc = pthread_mutexattr_settype(&attr, fbsdrun_virtio_msix() ?
+			PTHREAD_MUTEX_DEFAULT : PTHREAD_MUTEX_RECURSIVE);
+	if (rc)
+		DPRINTF(("virtio_9p: mutexattr_settype failed with error %d!\n",
+			 rc));
+	pthread_mutex_init(&vs->mtx, &attr);
+
+	while (opts && (opt = strsep(&opts, ",")) != NULL) {
+		key = strsep(&opt, "=");
+		if (opt && !strcmp(key, "tag"))
+			tag = opt;
+		else if (opt && !strcmp(key, "path")) {
+			free(vs->path);
+			vs->path = strdup(opt);
+		} else if (opt && !strcmp(key, "msize"))
+			vs->max_msize = strtoul(opt, NULL, 0);
+		else if (opt && !strcmp(key, "threads"))
+			nthreads = atoi(opt);
+		else if (!opt && !strcmp(key, "ro"))
+			vs->readonly = true;
+		else {
+			WPRINTF(("virtio_9p: unknown option %s\n", key));
+			goto fail;
+		}
+	}
+	if (!tag || !tag[0] || strlen(tag) > VIRTIO_9P_TAG_MAX) {
+		WPRINTF(("virtio_9p: need a tag=<name> of at most %d chars\n",
+			 VIRTIO_9P_TAG_MAX));
+		goto fail;
+	}
+	if (!vs->path) {
+		WPRINTF(("virtio_9p: need a path=<dir> to export\n"));
+		goto fail;
+	}
+	if (vs->max_msize < VIRTIO_9P_MIN_MSIZE ||
+	    vs->max_msize > VIRTIO_9P_MAX_MSIZE) {
+		WPRINTF(("virtio_9p: msize must be %d to %d\n",
+			 VIRTIO_9P_MIN_MSIZE, VIRTIO_9P_MAX_MSIZE));
+		goto fail;
+	}
+	if (nthreads < 1 || nthreads > VIRTIO_9P_MAXTHR) {
+		WPRINTF(("virtio_9p: threads must be 1 to %d\n",
+			 VIRTIO_9P_MAXTHR));
+		goto fail;
+	}
+	vs->msize = vs->max_msize;
+	vs->cfg.tag_len = strlen(tag);
+	memcpy(vs->cfg.tag, tag, vs->cfg.tag_len);
+
+	vs->root_fd = open(vs->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (vs->root_fd < 0 || fstat(vs->root_fd, &st) < 0) {
+		WPRINTF(("virtio_9p: can't open %s: %s\n", vs->path,
+			 strerror(errno)));
+		goto fail;
+	}
+	vs->root_dev = st.st_dev;
+	vs->root_ino = st.st_ino;
+
+	virtio_linkup(&vs->base, &virtio_9p_ops, vs, dev, &vs->vq);
+	vs->base.mtx = &vs->mtx;
+	vs->vq.qsize = VIRTIO_9P_RINGSZ;
+
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_9P);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_STORAGE);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_STORAGE_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_9P);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&vs->base, fbsdrun_virtio_msix()))
+		goto fail;
+	virtio_set_io_bar(&vs->base, 0);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&vs->tids[i], NULL, virtio_9p_thr, vs)) {
+			WPRINTF(("virtio_9p: thread create failed\n"));
+			goto fail;
+		}
+		vs->nthreads++;
+		if (snprintf(tname, sizeof(tname), "9p-%d:%d-%d", dev->slot,
+			     dev->func, i) < sizeof(tname))
+			pthread_setname_np(vs->tids[i], tname);
+	}
+
+	DPRINTF(("virtio_9p: exporting %s as %s%s, msize %u\n", vs->path,
+		 tag, vs->readonly ? " read-only" : "", vs->max_msize));
+	return 0;
+
+fail:
+	dev->arg = NULL;
+	virtio_9p_free(vs);
+	return -1;
+}
+
+static void
+virtio_9p_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_9p *vs = dev->arg;
+
+	if (!vs)
+		return;
+	DPRINTF(("virtio_9p: deinit\n"));
+	dev->arg = NULL;
+	virtio_9p_free(vs);
+}
+
+struct pci_vdev_ops pci_ops_virtio_9p = {
+	.class_name	= "virtio-9p",
+	.vdev_init	= virtio_9p_init,
+	.vdev_deinit	= virtio_9p_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_9p);
@@ -44,9 +44,11 @@
 #include <openssl/md5.h>
 
 #include "dm.h"
+#include "vmmapi.h"
 #include "pci_core.h"
 #include "virtio.h"
 #include "block_if.h"
+#include "handover.h"
 
 #define VIRTIO_BLK_RINGSZ	64
 
@@ -132,6 +134,8 @@ struct virtio_blk {
 	struct virtio_vq_info vq;
 	struct virtio_blk_config cfg;
 	struct blockif_ctxt *bc;
+	char *opts;		/* backend still to come, see restore */
+	int inflight;		/* requests handed to the blockif */
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
 	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
 };
@@ -182,6 +186,7 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * We wrote 1 byte (our status) to host.
 	 */
 	pthread_mutex_lock(&blk->mtx);
+	blk->inflight--;
 	vq_relchain(&blk->vq, io->idx, 1);
 	vq_endchains(&blk->vq, 0);
 	pthread_mutex_unlock(&blk->mtx);
@@ -242,6 +247,7 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		iolen += iov[i].iov_len;
 	}
 	io->req.resid = iolen;
+	blk->inflight++;
 
 	DPRINTF(("virtio-block: %s op, %zd bytes, %d segs, offset %ld\n\r",
 		 writeop ? "write" : "read/ident", iolen, i - 1,
@@ -282,8 +288,12 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 		virtio_blk_proc(blk, vq);
 }
 
+/*
+ * Open the backing file and set up the device state. This runs in
+ * parallel with the other devices' backends, see vdev_prepare.
+ */
 static int
-virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+virtio_blk_prepare(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	char bident[16];
 	struct blockif_ctxt *bctxt;
@@ -292,31 +302,43 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	struct virtio_blk *blk;
 	off_t size;
 	int i, sectsz, sts, sto;
-	pthread_mutexattr_t attr;
-	int rc;
 
 	if (opts == NULL) {
 		printf("virtio-block: backing device required\n");
 		return -1;
 	}
 
+	blk = calloc(1, sizeof(struct virtio_blk));
+	if (!blk) {
+		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		return -1;
+	}
+
+	/*
+	 * An adopted VM keeps using the backing file of the old DM, which
+	 * still holds its range lock; the fd comes with the handover.
+	 */
+	if (ctx->adopted) {
+		blk->opts = strdup(opts);
+		if (!blk->opts) {
+			free(blk);
+			return -1;
+		}
+	}
+
 	/*
 	 * The supplied backing file has to exist
 	 */
 	snprintf(bident, sizeof(bident), "%d:%d", dev->slot, dev->func);
-	bctxt = blockif_open(opts, bident);
-	if (bctxt == NULL) {
+	if (ctx->adopted)
+		bctxt = NULL;
+	else if (dev->lazy)
+		bctxt = blockif_open_lazy(opts, bident);
+	else
+		bctxt = blockif_open(opts, bident);
+	if (bctxt == NULL && !ctx->adopted) {
 		perror("Could not open backing file");
-		return -1;
-	}
-
-	size = blockif_size(bctxt);
-	sectsz = blockif_sectsz(bctxt);
-	blockif_psectsz(bctxt, &sts, &sto);
-
-	blk = calloc(1, sizeof(struct virtio_blk));
-	if (!blk) {
-		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		free(blk);
 		return -1;
 	}
 
@@ -330,27 +352,6 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		io->idx = i;
 	}
 
-	/* init mutex attribute properly to avoid deadlock */
-	rc = pthread_mutexattr_init(&attr);
-	if (rc)
-		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
-	rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	if (rc)
-		DPRINTF(("virtio_blk: mutexattr_settype failed with "
-					"error %d!\n", rc));
-
-	rc = pthread_mutex_init(&blk->mtx, &attr);
-	if (rc)
-		DPRINTF(("virtio_blk: pthread_mutex_init failed with "
-					"error %d!\n", rc));
-
-	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq);
-	blk->base.mtx = &blk->mtx;
-
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
-
 	/*
 	 * Create an identifier for the backing file. Use parts of the
 	 * md5 sum of the filename
@@ -361,6 +362,16 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	sprintf(blk->ident, "ACRN--%02X%02X-%02X%02X-%02X%02X",
 	    digest[0], digest[1], digest[2], digest[3], digest[4], digest[5]);
 
+	dev->arg = blk;
+
+	/* the config space of an adopted device is restored as well */
+	if (bctxt == NULL)
+		return 0;
+
+	size = blockif_size(bctxt);
+	sectsz = blockif_sectsz(bctxt);
+	blockif_psectsz(bctxt, &sts, &sto);
+
 	/* setup virtio block config space */
 	blk->cfg.capacity = size / DEV_BSIZE; /* 512-byte units */
 	blk->cfg.size_max = 0;	/* not negotiated */
@@ -377,6 +388,37 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk->cfg.topology.opt_io_size = 0;
 	blk->cfg.writeback = 0;
 
+	return 0;
+}
+
+static int
+virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_blk *blk = dev->arg;
+	pthread_mutexattr_t attr;
+	int rc;
+
+	/* init mutex attribute properly to avoid deadlock */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (rc)
+		DPRINTF(("virtio_blk: mutexattr_settype failed with "
+					"error %d!\n", rc));
+
+	rc = pthread_mutex_init(&blk->mtx, &attr);
+	if (rc)
+		DPRINTF(("virtio_blk: pthread_mutex_init failed with "
+					"error %d!\n", rc));
+
+	/* init virtio struct and virtqueues */
+	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq);
+	blk->base.mtx = &blk->mtx;
+
+	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
+	/* blk->vq.vq_notify = we have no per-queue notify */
+
 	/*
 	 * Should we move some of this into virtio.c?  Could
 	 * have the device, class, and subdev_0 as fields in
@@ -388,15 +430,22 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BLOCK);
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
-	if (virtio_interrupt_init(&blk->base, fbsdrun_virtio_msix())) {
-		blockif_close(blk->bc);
-		free(blk);
+	/* the backend is released by virtio_blk_deinit */
+	if (virtio_interrupt_init(&blk->base, fbsdrun_virtio_msix()))
 		return -1;
-	}
+
 	virtio_set_io_bar(&blk->base, 0);
 	return 0;
 }
 
+static int
+virtio_blk_activate(struct vmctx *ctx, struct pci_vdev *dev)
+{
+	struct virtio_blk *blk = dev->arg;
+
+	return blockif_start(blk->bc);
+}
+
 static void
 virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -407,11 +456,63 @@ virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_blk: deinit\n"));
 		blk = (struct virtio_blk *) dev->arg;
 		bctxt = blk->bc;
-		blockif_close(bctxt);
+		if (bctxt)
+			blockif_close(bctxt);
+		free(blk->opts);
 		free(blk);
 	}
 }
 
+/*
+ * The guest is paused, so once the requests already handed to the
+ * blockif are done the ring and the backing file are quiescent.
+ */
+static int
+virtio_blk_save(struct vmctx *ctx, struct pci_vdev *dev,
+		struct handover_buf *hb)
+{
+	struct virtio_blk *blk = dev->arg;
+
+	pthread_mutex_lock(&blk->mtx);
+	while (blk->inflight) {
+		pthread_mutex_unlock(&blk->mtx);
+		usleep(10000);
+		pthread_mutex_lock(&blk->mtx);
+	}
+	pthread_mutex_unlock(&blk->mtx);
+
+	if (handover_put(hb, &blk->cfg, sizeof(blk->cfg)) < 0 ||
+	    handover_put_fd(hb, blockif_fd(blk->bc)) < 0)
+		return -1;
+
+	return virtio_save(&blk->base, hb);
+}
+
+static int
+virtio_blk_restore(struct vmctx *ctx, struct pci_vdev *dev,
+		   struct handover_buf *hb)
+{
+	struct virtio_blk *blk = dev->arg;
+	char bident[16];
+	int fd;
+
+	if (handover_get(hb, &blk->cfg, sizeof(blk->cfg)) < 0)
+		return -1;
+
+	fd = handover_get_fd(hb);
+	if (fd < 0)
+		return -1;
+
+	snprintf(bident, sizeof(bident), "%d:%d", dev->slot, dev->func);
+	blk->bc = blockif_open_fd(blk->opts, bident, fd);
+	if (blk->bc == NULL)
+		return -1;
+	if (!dev->lazy)
+		blockif_start(blk->bc);
+
+	return virtio_restore(&blk->base, hb);
+}
+
 static int
 virtio_blk_cfgwrite(void *vdev, int offset, int size, uint32_t value)
 {
@@ -433,9 +534,13 @@ virtio_blk_cfgread(void *vdev, int offset, int size, uint32_t *retval)
 
 struct pci_vdev_ops pci_ops_virtio_blk = {
 	.class_name	= "virtio-blk",
+	.vdev_prepare	= virtio_blk_prepare,
 	.vdev_init	= virtio_blk_init,
+	.vdev_activate	= virtio_blk_activate,
 	.vdev_deinit	= virtio_blk_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_save	= virtio_blk_save,
+	.vdev_restore	= virtio_blk_restore
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_blk);
@@ -123,6 +123,7 @@ struct virtio_heci {
 	pthread_mutex_t			mutex;
 	struct mei_enumerate_me_clients	me_clients_map;
 	volatile bool			deiniting;
+	bool				started;	/* tx/rx threads */
 	volatile bool			resetting;
 	volatile bool			pending_reset;
 
@@ -1215,8 +1216,10 @@ virtio_heci_stop(struct virtio_heci *vheci)
 
 	virtio_heci_virtual_fw_reset(vheci);
 
-	pthread_join(vheci->rx_thread, NULL);
-	pthread_join(vheci->tx_thread, NULL);
+	if (vheci->started) {
+		pthread_join(vheci->rx_thread, NULL);
+		pthread_join(vheci->tx_thread, NULL);
+	}
 
 	pthread_mutex_destroy(&vheci->rx_mutex);
 	pthread_mutex_destroy(&vheci->tx_mutex);
@@ -1275,11 +1278,34 @@ virtio_heci_cfgwrite(void *vsc, int offset, int size, uint32_t val)
 	return 0;
 }
 
+/*
+ * Spawn the tx/rx threads and start the heci backend, which opens
+ * the native HECI device for the HBM client.
+ */
+static int
+virtio_heci_run(struct virtio_heci *vheci)
+{
+	struct pci_vdev *dev = vheci->base.dev;
+	char tname[MAXCOMLEN + 1];
+
+	pthread_create(&vheci->tx_thread, NULL,
+		virtio_heci_tx_thread, (void *)vheci);
+	snprintf(tname, sizeof(tname), "vheci-%d:%d tx", dev->slot, dev->func);
+	pthread_setname_np(vheci->tx_thread, tname);
+
+	pthread_create(&vheci->rx_thread, NULL,
+			virtio_heci_rx_thread, (void *)vheci);
+	snprintf(tname, sizeof(tname), "vheci-%d:%d rx", dev->slot, dev->func);
+	pthread_setname_np(vheci->rx_thread, tname);
+	vheci->started = true;
+
+	return virtio_heci_start(vheci);
+}
+
 static int
 virtio_heci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_heci *vheci;
-	char tname[MAXCOMLEN + 1];
 	pthread_mutexattr_t attr;
 	int i, rc;
 
@@ -1345,24 +1371,16 @@ virtio_heci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	virtio_set_io_bar(&vheci->base, 0);
 
 	/*
-	 * tx stuff, thread, mutex, cond
+	 * tx stuff, mutex, cond
 	 */
 	pthread_mutex_init(&vheci->tx_mutex, &attr);
 	pthread_cond_init(&vheci->tx_cond, NULL);
-	pthread_create(&vheci->tx_thread, NULL,
-		virtio_heci_tx_thread, (void *)vheci);
-	snprintf(tname, sizeof(tname), "vheci-%d:%d tx", dev->slot, dev->func);
-	pthread_setname_np(vheci->tx_thread, tname);
 
 	/*
 	 * rx stuff
 	 */
 	pthread_mutex_init(&vheci->rx_mutex, &attr);
 	pthread_cond_init(&vheci->rx_cond, NULL);
-	pthread_create(&vheci->rx_thread, NULL,
-			virtio_heci_rx_thread, (void *)vheci);
-	snprintf(tname, sizeof(tname), "vheci-%d:%d rx", dev->slot, dev->func);
-	pthread_setname_np(vheci->rx_thread, tname);
 
 	/*
 	 * init clients
@@ -1373,9 +1391,10 @@ virtio_heci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	LIST_INIT(&vheci->active_clients);
 
 	/*
-	 * start heci backend
+	 * start heci threads and backend, a lazy device waits for
+	 * the guest driver
 	 */
-	if (virtio_heci_start(vheci) < 0)
+	if (!dev->lazy && virtio_heci_run(vheci) < 0)
 		goto start_fail;
 
 	return 0;
@@ -1389,6 +1408,12 @@ fail:
 	return -1;
 }
 
+static int
+virtio_heci_activate(struct vmctx *ctx, struct pci_vdev *dev)
+{
+	return virtio_heci_run((struct virtio_heci *)dev->arg);
+}
+
 static void
 virtio_heci_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -1403,6 +1428,7 @@ virtio_heci_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 struct pci_vdev_ops pci_ops_vheci = {
 	.class_name	= "virtio-heci",
 	.vdev_init	= virtio_heci_init,
+	.vdev_activate	= virtio_heci_activate,
 	.vdev_barwrite	= virtio_pci_write,
 	.vdev_barread	= virtio_pci_read,
 	.vdev_deinit    = virtio_heci_deinit
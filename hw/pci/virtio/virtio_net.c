@@ -50,9 +50,11 @@
 
 #include "types.h"
 #include "dm.h"
+#include "vmmapi.h"
 #include "pci_core.h"
 #include "mevent.h"
 #include "virtio.h"
+#include "handover.h"
 #include "netmap_user.h"
 #include <net/if.h>
 #include <linux/if_tun.h>
@@ -138,6 +140,7 @@ struct virtio_net {
 
 	int		tapfd;
 	struct nm_desc	*nmd;
+	char		*backend;	/* not yet opened, see vdev_activate */
 
 	int		rx_ready;
 
@@ -153,6 +156,7 @@ struct virtio_net {
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
 	pthread_t	tx_tid;
+	int		tx_started;
 	pthread_mutex_t	tx_mtx;
 	pthread_cond_t	tx_cond;
 	int		tx_in_progress;
@@ -269,7 +273,8 @@ virtio_net_tx_stop(struct virtio_net *net)
 
 	pthread_cond_broadcast(&net->tx_cond);
 
-	pthread_join(net->tx_tid, &jval);
+	if (net->tx_started)
+		pthread_join(net->tx_tid, &jval);
 }
 
 /*
@@ -889,19 +894,53 @@ virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
 	}
 }
 
+static void
+virtio_net_backend_setup(struct virtio_net *net, char *devname)
+{
+	if (strncmp(devname, "vale", 4) == 0)
+		virtio_net_netmap_setup(net, devname);
+	if (strncmp(devname, "tap", 3) == 0 ||
+	    strncmp(devname, "vmnet", 5) == 0)
+		virtio_net_tap_setup(net, devname);
+}
+
+/*
+ * Spawn TX processing thread.
+ * As of now, only one thread for TX desc processing is
+ * spawned.
+ */
+static void
+virtio_net_tx_start(struct virtio_net *net)
+{
+	char tname[MAXCOMLEN + 1];
+	struct pci_vdev *dev = net->base.dev;
+
+	if (pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
+			   (void *)net) != 0) {
+		WPRINTF(("vtnet: tx thread create failed\n"));
+		return;
+	}
+	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
+		 dev->func);
+	pthread_setname_np(net->tx_tid, tname);
+	net->tx_started = 1;
+}
+
+/*
+ * Open the backend and work out the MAC address. This runs in parallel
+ * with the other devices' backends, see vdev_prepare; the rx callback
+ * cannot fire before the event loop runs, after vdev_init.
+ */
 static int
-virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+virtio_net_prepare(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	MD5_CTX mdctx;
 	unsigned char digest[16];
 	char nstr[80];
-	char tname[MAXCOMLEN + 1];
 	struct virtio_net *net;
 	char *devname;
 	char *vtopts;
 	int mac_provided;
-	pthread_mutexattr_t attr;
-	int rc;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -909,32 +948,6 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 
-	/* init mutex attribute properly to avoid deadlock */
-	rc = pthread_mutexattr_init(&attr);
-	if (rc)
-		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
-	rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	if (rc)
-		DPRINTF(("virtio_net: mutexattr_settype failed with "
-			"error %d!\n", rc));
-
-	rc = pthread_mutex_init(&net->mtx, &attr);
-	if (rc)
-		DPRINTF(("virtio_net: pthread_mutex_init failed with "
-			"error %d!\n", rc));
-
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues);
-	net->base.mtx = &net->mtx;
-
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
-
 	/*
 	 * Attempt to open the tap device and read the MAC address
 	 * if specified
@@ -948,6 +961,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		devname = vtopts = strdup(opts);
 		if (!devname) {
 			WPRINTF(("virtio_net: strdup returns NULL\n"));
+			free(net);
 			return -1;
 		}
 
@@ -957,18 +971,19 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			err = virtio_net_parsemac(vtopts, net->config.mac);
 			if (err != 0) {
 				free(devname);
+				free(net);
 				return err;
 			}
 			mac_provided = 1;
 		}
 
-		if (strncmp(devname, "vale", 4) == 0)
-			virtio_net_netmap_setup(net, devname);
-		if (strncmp(devname, "tap", 3) == 0 ||
-		    strncmp(devname, "vmnet", 5) == 0)
-			virtio_net_tap_setup(net, devname);
-
-		free(devname);
+		/* an adopted VM gets the old DM's tap fd, see restore */
+		if (dev->lazy || ctx->adopted)
+			net->backend = devname;
+		else {
+			virtio_net_backend_setup(net, devname);
+			free(devname);
+		}
 	}
 
 	/*
@@ -991,6 +1006,50 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		net->config.mac[5] = digest[2];
 	}
 
+	/*
+	 * Link is up if we managed to open tap device or vale port.
+	 * A lazy device reports link up until it tries.
+	 */
+	net->config.status = (opts == NULL || net->backend != NULL ||
+			      net->tapfd >= 0 || net->nmd != NULL);
+
+	dev->arg = net;
+	return 0;
+}
+
+static int
+virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_net *net = dev->arg;
+	pthread_mutexattr_t attr;
+	int rc;
+
+	/* init mutex attribute properly to avoid deadlock */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (rc)
+		DPRINTF(("virtio_net: mutexattr_settype failed with "
+			"error %d!\n", rc));
+
+	rc = pthread_mutex_init(&net->mtx, &attr);
+	if (rc)
+		DPRINTF(("virtio_net: pthread_mutex_init failed with "
+			"error %d!\n", rc));
+
+	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues);
+	net->base.mtx = &net->mtx;
+
+	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
+	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
+	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
+	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
+#ifdef notyet
+	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
+	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
+#endif
+
 	/* initialize config space */
 	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_NET);
 	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
@@ -998,16 +1057,9 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_NET);
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
-	/* Link is up if we managed to open tap device or vale port. */
-	net->config.status = (opts == NULL || net->tapfd >= 0 ||
-			      net->nmd != NULL);
-
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
-	if (virtio_interrupt_init(&net->base, fbsdrun_virtio_msix())) {
-		if (net)
-			free(net);
+	if (virtio_interrupt_init(&net->base, fbsdrun_virtio_msix()))
 		return -1;
-	}
 
 	/* use BAR 0 to map config regs in IO space */
 	virtio_set_io_bar(&net->base, 0);
@@ -1020,23 +1072,32 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	net->rx_in_progress = 0;
 	pthread_mutex_init(&net->rx_mtx, NULL);
 
-	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
-	 */
+	/* Initialize tx semaphore, the TX thread waits for a lazy device */
 	net->tx_in_progress = 0;
 	pthread_mutex_init(&net->tx_mtx, NULL);
 	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	if (!dev->lazy)
+		virtio_net_tx_start(net);
 
 	return 0;
 }
 
+static int
+virtio_net_activate(struct vmctx *ctx, struct pci_vdev *dev)
+{
+	struct virtio_net *net = dev->arg;
+
+	if (net->backend) {
+		virtio_net_backend_setup(net, net->backend);
+		free(net->backend);
+		net->backend = NULL;
+		net->config.status = (net->tapfd >= 0 || net->nmd != NULL);
+	}
+	virtio_net_tx_start(net);
+
+	return (net->config.status && net->tx_started) ? 0 : -1;
+}
+
 static int
 virtio_net_cfgwrite(void *vdev, int offset, int size, uint32_t value)
 {
@@ -1083,6 +1144,82 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 	}
 }
 
+/*
+ * The tap fd goes to the new DM with the rest of the state, the old DM
+ * closing its copy does not take the interface down. A netmap port is
+ * bound to the process and cannot be passed on.
+ */
+static int
+virtio_net_save(struct vmctx *ctx, struct pci_vdev *dev,
+		struct handover_buf *hb)
+{
+	struct virtio_net *net = dev->arg;
+	int err;
+
+	if (net->nmd != NULL) {
+		WPRINTF(("vtnet: netmap backend cannot be handed over\n"));
+		return -1;
+	}
+
+	virtio_net_txwait(net);
+
+	err = handover_put(hb, &net->features, sizeof(net->features));
+	err |= handover_put(hb, &net->config, sizeof(net->config));
+	err |= handover_put(hb, &net->rx_ready, sizeof(net->rx_ready));
+	err |= handover_put(hb, &net->rx_merge, sizeof(net->rx_merge));
+	err |= handover_put(hb, &net->rx_vhdrlen, sizeof(net->rx_vhdrlen));
+	err |= handover_put(hb, &net->tapfd, sizeof(net->tapfd));
+	if (net->tapfd >= 0)
+		err |= handover_put_fd(hb, net->tapfd);
+	if (err)
+		return -1;
+
+	return virtio_save(&net->base, hb);
+}
+
+static int
+virtio_net_restore(struct vmctx *ctx, struct pci_vdev *dev,
+		   struct handover_buf *hb)
+{
+	struct virtio_net *net = dev->arg;
+	int tapfd, err;
+
+	err = handover_get(hb, &net->features, sizeof(net->features));
+	err |= handover_get(hb, &net->config, sizeof(net->config));
+	err |= handover_get(hb, &net->rx_ready, sizeof(net->rx_ready));
+	err |= handover_get(hb, &net->rx_merge, sizeof(net->rx_merge));
+	err |= handover_get(hb, &net->rx_vhdrlen, sizeof(net->rx_vhdrlen));
+	err |= handover_get(hb, &tapfd, sizeof(tapfd));
+	if (err)
+		return -1;
+
+	if (tapfd >= 0) {
+		/* shares the old file description, so it is non-blocking */
+		tapfd = handover_get_fd(hb);
+		if (tapfd < 0)
+			return -1;
+
+		net->mevp = mevent_add(tapfd, EVF_READ,
+				       virtio_net_rx_callback, net);
+		if (net->mevp == NULL) {
+			close(tapfd);
+			return -1;
+		}
+		net->tapfd = tapfd;
+		net->virtio_net_rx = virtio_net_tap_rx;
+		net->virtio_net_tx = virtio_net_tap_tx;
+		free(net->backend);
+		net->backend = NULL;
+	} else if (!dev->lazy && net->backend) {
+		/* the old DM had no backend open, try again */
+		virtio_net_backend_setup(net, net->backend);
+		free(net->backend);
+		net->backend = NULL;
+	}
+
+	return virtio_restore(&net->base, hb);
+}
+
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -1102,6 +1239,7 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		if (net->mevp != NULL)
 			mevent_delete(net->mevp);
 
+		free(net->backend);
 		free(net);
 
 		DPRINTF(("%s: done\n", __func__));
@@ -1111,9 +1249,13 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 struct pci_vdev_ops pci_ops_virtio_net = {
 	.class_name	= "virtio-net",
+	.vdev_prepare	= virtio_net_prepare,
 	.vdev_init	= virtio_net_init,
+	.vdev_activate	= virtio_net_activate,
 	.vdev_deinit	= virtio_net_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_save	= virtio_net_save,
+	.vdev_restore	= virtio_net_restore
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_net);
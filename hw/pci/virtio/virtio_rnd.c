@@ -49,6 +49,7 @@
 #include "virtio.h"
 #include "virtio_kernel.h"
 #include "vmmapi.h"			/* for vmctx */
+#include "handover.h"
 
 #define VIRTIO_RND_RINGSZ	64
 
@@ -335,6 +336,13 @@ virtio_rnd_notify(void *base, struct virtio_vq_info *vq)
 	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
 }
 
+static void
+virtio_rnd_k_handover_name(struct pci_vdev *dev, char *name, size_t len)
+{
+	snprintf(name, len, "vbs-k-rnd-%d:%d.%d",
+		 dev->bus, dev->slot, dev->func);
+}
+
 static int
 virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -346,6 +354,7 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	int rc;
 	char *opt;
 	char *vbs_k_opt = NULL;
+	char name[HANDOVER_NAME_LEN];
 	enum VBS_K_STATUS kstat = VIRTIO_DEV_INITIAL;
 
 	while ((opt = strsep(&opts, ",")) != NULL) {
@@ -413,6 +422,9 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			rnd->vbs_k.status = VIRTIO_DEV_INIT_FAILED;
 		} else {
 			rnd->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+			/* the in-kernel ring state cannot be handed over */
+			virtio_rnd_k_handover_name(dev, name, sizeof(name));
+			handover_register(name, NULL, NULL, NULL);
 		}
 	}
 	if (rnd->vbs_k.status == VIRTIO_DEV_INITIAL ||
@@ -446,10 +458,29 @@ virtio_rnd_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	return 0;
 }
 
+static int
+virtio_rnd_save(struct vmctx *ctx, struct pci_vdev *dev,
+		struct handover_buf *hb)
+{
+	struct virtio_rnd *rnd = dev->arg;
+
+	return virtio_save(&rnd->base, hb);
+}
+
+static int
+virtio_rnd_restore(struct vmctx *ctx, struct pci_vdev *dev,
+		   struct handover_buf *hb)
+{
+	struct virtio_rnd *rnd = dev->arg;
+
+	return virtio_restore(&rnd->base, hb);
+}
+
 static void
 virtio_rnd_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_rnd *rnd;
+	char name[HANDOVER_NAME_LEN];
 
 	rnd = dev->arg;
 	if (rnd == NULL) {
@@ -457,6 +488,9 @@ virtio_rnd_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return;
 	}
 
+	virtio_rnd_k_handover_name(dev, name, sizeof(name));
+	handover_unregister(name);
+
 	if (rnd->vbs_k.status == VIRTIO_DEV_STARTED) {
 		DPRINTF(("%s: deinit virtio_rnd_k!\n", __func__));
 		virtio_rnd_kernel_stop(rnd);
@@ -477,6 +511,8 @@ struct pci_vdev_ops pci_ops_virtio_rnd = {
 	.vdev_init	= virtio_rnd_init,
 	.vdev_deinit	= virtio_rnd_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_save	= virtio_rnd_save,
+	.vdev_restore	= virtio_rnd_restore
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_rnd);
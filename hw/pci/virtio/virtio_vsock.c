@@ -0,0 +1,1246 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * virtio vsock device emulation.
+ *
+ * Stream sockets between the guest and host processes, without any network
+ * configuration in the guest. The host side of every vsock port is a unix
+ * socket, following the convention of firecracker:
+ *
+ *	-s <slot>,virtio-vsock,cid=<guest cid>,uds=<path>
+ *
+ * - a guest connecting to host (cid 2) port P is connected to the unix
+ *   socket "<path>_P", which a host service listens on;
+ * - a host process connects to the unix socket <path>, writes
+ *   "CONNECT <port>\n" and reads "OK <host port>\n" once the guest
+ *   accepted the connection on <port>. Both sides then talk directly.
+ *
+ * All connections are multiplexed on the rx and tx queues. Each side tells
+ * the other how much it can buffer (buf_alloc) and how much it has consumed
+ * (fwd_cnt), and never sends more than the other side has room for. Guest
+ * data the host socket can not take yet is buffered up to the buf_alloc we
+ * advertise, so a slow host reader never stalls the tx queue.
+ *
+ * The tx queue is processed in the vcpu thread of the notification; host
+ * sockets are served by the "vsock" thread with its own epoll set. Both run
+ * under the device mutex and feed the rx queue from vsock_rx_flush().
+ */
+
+#include <sys/cdefs.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+
+#define VIRTIO_VSOCK_RINGSZ	256
+#define VIRTIO_VSOCK_EVT_RINGSZ	16
+#define VIRTIO_VSOCK_MAXSEGS	32
+
+#define VSOCK_RXQ		0
+#define VSOCK_TXQ		1
+#define VSOCK_EVTQ		2
+#define VSOCK_MAXQ		3
+
+#define VSOCK_HOST_CID		2
+#define VSOCK_MIN_GUEST_CID	3
+
+#define VSOCK_BUF_ALLOC		(256 * 1024)	/* guest data we buffer */
+#define VSOCK_MAX_PKT		(64 * 1024)	/* largest payload */
+#define VSOCK_HASH_SIZE		64
+#define VSOCK_MAX_RST		64
+#define VSOCK_LOCAL_PORT_BASE	(1U << 30)	/* host initiated ports */
+#define VSOCK_LINE_MAX		32
+
+#define VIRTIO_VSOCK_TYPE_STREAM	1
+
+enum virtio_vsock_op {
+	VIRTIO_VSOCK_OP_INVALID		= 0,
+	VIRTIO_VSOCK_OP_REQUEST		= 1,
+	VIRTIO_VSOCK_OP_RESPONSE	= 2,
+	VIRTIO_VSOCK_OP_RST		= 3,
+	VIRTIO_VSOCK_OP_SHUTDOWN	= 4,
+	VIRTIO_VSOCK_OP_RW		= 5,
+	VIRTIO_VSOCK_OP_CREDIT_UPDATE	= 6,
+	VIRTIO_VSOCK_OP_CREDIT_REQUEST	= 7,
+};
+
+#define VIRTIO_VSOCK_SHUTDOWN_RCV	1
+#define VIRTIO_VSOCK_SHUTDOWN_SEND	2
+
+struct virtio_vsock_hdr {
+	uint64_t src_cid;
+	uint64_t dst_cid;
+	uint32_t src_port;
+	uint32_t dst_port;
+	uint32_t len;
+	uint16_t type;
+	uint16_t op;
+	uint32_t flags;
+	uint32_t buf_alloc;
+	uint32_t fwd_cnt;
+} __attribute__((packed));
+
+struct virtio_vsock_config {
+	uint64_t guest_cid;
+} __attribute__((packed));
+
+enum vsock_conn_state {
+	VSOCK_CONN_HANDSHAKE,	/* host peer has to send CONNECT <port> */
+	VSOCK_CONN_CONNECTING,	/* REQUEST sent, guest has to respond */
+	VSOCK_CONN_ESTABLISHED,
+};
+
+struct virtio_vsock;
+
+struct vsock_conn {
+	LIST_ENTRY(vsock_conn) link;	/* hash bucket or handshakes */
+	TAILQ_ENTRY(vsock_conn) rx_link;
+	bool on_rxq;
+	bool dead;
+	struct virtio_vsock *vs;
+	int fd;
+	enum vsock_conn_state state;
+
+	uint32_t local_port;		/* host side */
+	uint32_t peer_port;		/* guest side */
+	uint32_t pending;		/* control ops to send, 1 << op */
+	uint32_t shutdown_flags;
+
+	bool readable;			/* host socket may have data */
+	bool host_eof;
+	bool peer_shut_send;		/* guest sends no more data */
+	bool peer_shut_rcv;		/* guest takes no more data */
+	bool credit_requested;
+
+	/* host to guest */
+	uint32_t peer_buf_alloc;
+	uint32_t peer_fwd_cnt;
+	uint32_t tx_cnt;
+
+	/* guest to host */
+	uint32_t rx_cnt;
+	uint32_t fwd_cnt;
+	uint32_t fwd_sent;		/* fwd_cnt the guest knows about */
+	char *buf;
+	uint32_t buf_head;
+	uint32_t buf_len;
+
+	char line[VSOCK_LINE_MAX];
+	int line_len;
+};
+
+struct vsock_rst {
+	uint32_t src_port;
+	uint32_t dst_port;
+};
+
+struct virtio_vsock {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VSOCK_MAXQ];
+	pthread_mutex_t mtx;
+	struct virtio_vsock_config cfg;
+
+	char *uds_path;
+	int listen_fd;
+	int epfd;
+	int stop_fd;
+	pthread_t tid;
+	bool started;
+
+	LIST_HEAD(, vsock_conn) conns[VSOCK_HASH_SIZE];
+	LIST_HEAD(, vsock_conn) handshakes;
+	LIST_HEAD(, vsock_conn) dead;
+	TAILQ_HEAD(, vsock_conn) rxq;
+	uint32_t next_port;
+
+	/* resets for packets that match no connection */
+	struct vsock_rst rst[VSOCK_MAX_RST];
+	int nrst;
+};
+
+static int virtio_vsock_debug;
+#define DPRINTF(params) do { if (virtio_vsock_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_vsock_reset(void *);
+static void virtio_vsock_notify(void *, struct virtio_vq_info *);
+static int virtio_vsock_cfgread(void *, int, int, uint32_t *);
+static int virtio_vsock_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_vsock_ops = {
+	"virtio_vsock",			/* our name */
+	VSOCK_MAXQ,			/* we support 3 virtqueues */
+	sizeof(struct virtio_vsock_config), /* config reg size */
+	virtio_vsock_reset,		/* reset */
+	virtio_vsock_notify,		/* device-wide qnotify */
+	virtio_vsock_cfgread,		/* read virtio config */
+	virtio_vsock_cfgwrite,		/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+	VIRTIO_F_VERSION_1,		/* our capabilities */
+};
+
+/*
+ * Copy between a flat buffer and an iovec, starting at byte off of the
+ * iovec. Returns the bytes copied.
+ */
+static size_t
+vsock_iov_copy(struct iovec *iov, int niov, size_t off, void *buf,
+	       size_t len, bool to_iov)
+{
+	size_t done = 0, n;
+	int i;
+
+	for (i = 0; i < niov && done < len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		n = MIN(iov[i].iov_len - off, len - done);
+		if (to_iov)
+			memcpy((char *)iov[i].iov_base + off,
+			       (char *)buf + done, n);
+		else
+			memcpy((char *)buf + done,
+			       (char *)iov[i].iov_base + off, n);
+		done += n;
+		off = 0;
+	}
+	return done;
+}
+
+static size_t
+vsock_iov_len(struct iovec *iov, int niov)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/*
+ * Build in out[] the part of iov[] from byte off, at most len bytes long.
+ * Returns the number of entries.
+ */
+static int
+vsock_iov_slice(struct iovec *iov, int niov, size_t off, size_t len,
+		struct iovec *out)
+{
+	int i, n = 0;
+
+	for (i = 0; i < niov && len > 0; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		out[n].iov_base = (char *)iov[i].iov_base + off;
+		out[n].iov_len = MIN(iov[i].iov_len - off, len);
+		len -= out[n].iov_len;
+		off = 0;
+		n++;
+	}
+	return n;
+}
+
+static inline int
+vsock_hash(uint32_t local_port, uint32_t peer_port)
+{
+	return (local_port * 31 + peer_port) & (VSOCK_HASH_SIZE - 1);
+}
+
+static struct vsock_conn *
+vsock_conn_find(struct virtio_vsock *vs, uint32_t local_port,
+		uint32_t peer_port)
+{
+	struct vsock_conn *conn;
+
+	LIST_FOREACH(conn, &vs->conns[vsock_hash(local_port, peer_port)],
+		     link)
+		if (conn->local_port == local_port &&
+		    conn->peer_port == peer_port)
+			return conn;
+	return NULL;
+}
+
+static void
+vsock_conn_hash(struct vsock_conn *conn)
+{
+	struct virtio_vsock *vs = conn->vs;
+
+	LIST_INSERT_HEAD(&vs->conns[vsock_hash(conn->local_port,
+					       conn->peer_port)],
+			 conn, link);
+}
+
+static struct vsock_conn *
+vsock_conn_new(struct virtio_vsock *vs, int fd, enum vsock_conn_state state)
+{
+	struct vsock_conn *conn;
+	struct epoll_event ev;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+	conn->vs = vs;
+	conn->fd = fd;
+	conn->state = state;
+
+	/* Edge triggered, readable/buf_len track what is left to do */
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(vs->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		WPRINTF(("vsock: epoll_ctl failed: %s\n", strerror(errno)));
+		free(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+/*
+ * Close a connection. The vsock thread may still hold an event for it,
+ * so it is only freed once that thread is done with its event batch.
+ */
+static void
+vsock_conn_kill(struct vsock_conn *conn)
+{
+	struct virtio_vsock *vs = conn->vs;
+
+	if (conn->dead)
+		return;
+	DPRINTF(("vsock: close %u <-> %u\n", conn->local_port,
+		 conn->peer_port));
+	conn->dead = true;
+	LIST_REMOVE(conn, link);
+	if (conn->on_rxq) {
+		TAILQ_REMOVE(&vs->rxq, conn, rx_link);
+		conn->on_rxq = false;
+	}
+	epoll_ctl(vs->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn->buf);
+	conn->buf = NULL;
+	LIST_INSERT_HEAD(&vs->dead, conn, link);
+}
+
+static void
+vsock_free_dead(struct virtio_vsock *vs)
+{
+	struct vsock_conn *conn;
+
+	while ((conn = LIST_FIRST(&vs->dead)) != NULL) {
+		LIST_REMOVE(conn, link);
+		free(conn);
+	}
+}
+
+static void
+vsock_kill_all(struct virtio_vsock *vs)
+{
+	int i;
+
+	for (i = 0; i < VSOCK_HASH_SIZE; i++)
+		while (!LIST_EMPTY(&vs->conns[i]))
+			vsock_conn_kill(LIST_FIRST(&vs->conns[i]));
+	while (!LIST_EMPTY(&vs->handshakes))
+		vsock_conn_kill(LIST_FIRST(&vs->handshakes));
+	vs->nrst = 0;
+}
+
+static void
+vsock_send_rst(struct virtio_vsock *vs, uint32_t src_port, uint32_t dst_port)
+{
+	/* The guest times out the connection if this one is lost */
+	if (vs->nrst == VSOCK_MAX_RST)
+		return;
+	vs->rst[vs->nrst].src_port = src_port;
+	vs->rst[vs->nrst].dst_port = dst_port;
+	vs->nrst++;
+}
+
+/*
+ * Reset the connection towards the guest and close it.
+ */
+static void
+vsock_conn_reset(struct vsock_conn *conn)
+{
+	vsock_send_rst(conn->vs, conn->local_port, conn->peer_port);
+	vsock_conn_kill(conn);
+}
+
+static void
+vsock_rx_schedule(struct vsock_conn *conn)
+{
+	if (conn->on_rxq || conn->dead)
+		return;
+	TAILQ_INSERT_TAIL(&conn->vs->rxq, conn, rx_link);
+	conn->on_rxq = true;
+}
+
+static inline uint32_t
+vsock_peer_credit(struct vsock_conn *conn)
+{
+	uint32_t used = conn->tx_cnt - conn->peer_fwd_cnt;
+
+	return used < conn->peer_buf_alloc ? conn->peer_buf_alloc - used : 0;
+}
+
+static inline bool
+vsock_conn_can_send(struct vsock_conn *conn)
+{
+	return conn->state == VSOCK_CONN_ESTABLISHED && conn->readable &&
+		!conn->host_eof && !conn->peer_shut_rcv;
+}
+
+/*
+ * Tell the guest about the room freed in our buffer once it may run
+ * short of credit.
+ */
+static void
+vsock_credit_check(struct vsock_conn *conn)
+{
+	uint32_t free_view;
+
+	free_view = VSOCK_BUF_ALLOC - (conn->rx_cnt - conn->fwd_sent);
+	if (free_view < VSOCK_BUF_ALLOC / 2 &&
+	    conn->fwd_cnt != conn->fwd_sent) {
+		conn->pending |= 1 << VIRTIO_VSOCK_OP_CREDIT_UPDATE;
+		vsock_rx_schedule(conn);
+	}
+}
+
+static void
+vsock_hdr_init(struct virtio_vsock *vs, struct virtio_vsock_hdr *hdr,
+	       uint32_t src_port, uint32_t dst_port, uint16_t op)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->src_cid = VSOCK_HOST_CID;
+	hdr->dst_cid = vs->cfg.guest_cid;
+	hdr->src_port = src_port;
+	hdr->dst_port = dst_port;
+	hdr->type = VIRTIO_VSOCK_TYPE_STREAM;
+	hdr->op = op;
+	hdr->buf_alloc = VSOCK_BUF_ALLOC;
+}
+
+/*
+ * Fill one rx chain with the next packet of the connection: a pending
+ * control packet first, else data read from the host socket straight into
+ * the guest buffers. Returns the bytes put in the chain, 0 if the
+ * connection has nothing to send.
+ */
+static size_t
+vsock_conn_rx(struct vsock_conn *conn, struct iovec *iov, int niov)
+{
+	struct virtio_vsock_hdr hdr;
+	struct iovec data[VIRTIO_VSOCK_MAXSEGS];
+	size_t room, len;
+	ssize_t n;
+	int op, ndata;
+
+	room = vsock_iov_len(iov, niov);
+
+	if (conn->pending) {
+		op = ffs(conn->pending) - 1;
+		conn->pending &= ~(1 << op);
+		vsock_hdr_init(conn->vs, &hdr, conn->local_port,
+			       conn->peer_port, op);
+		if (op == VIRTIO_VSOCK_OP_SHUTDOWN)
+			hdr.flags = conn->shutdown_flags;
+	} else {
+		if (!vsock_conn_can_send(conn))
+			return 0;
+		/* Room for the header only, the chain can't carry data */
+		if (room <= sizeof(hdr))
+			return 0;
+		len = MIN(MIN(room - sizeof(hdr), vsock_peer_credit(conn)),
+			  VSOCK_MAX_PKT);
+		if (len == 0) {
+			/* Ask once, the guest answers with its credit */
+			if (!conn->credit_requested) {
+				conn->credit_requested = true;
+				conn->pending |=
+					1 << VIRTIO_VSOCK_OP_CREDIT_REQUEST;
+				return vsock_conn_rx(conn, iov, niov);
+			}
+			return 0;
+		}
+
+		ndata = vsock_iov_slice(iov, niov, sizeof(hdr), len, data);
+		n = readv(conn->fd, data, ndata);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR) {
+				conn->readable = false;
+				return 0;
+			}
+			n = 0;
+		}
+		if (n == 0) {
+			/*
+			 * The host sends no more, the guest closes the
+			 * connection once it is done.
+			 */
+			conn->host_eof = true;
+			conn->readable = false;
+			conn->shutdown_flags = VIRTIO_VSOCK_SHUTDOWN_SEND;
+			conn->pending |= 1 << VIRTIO_VSOCK_OP_SHUTDOWN;
+			return vsock_conn_rx(conn, iov, niov);
+		}
+
+		vsock_hdr_init(conn->vs, &hdr, conn->local_port,
+			       conn->peer_port, VIRTIO_VSOCK_OP_RW);
+		hdr.len = n;
+		conn->tx_cnt += n;
+	}
+
+	hdr.fwd_cnt = conn->fwd_cnt;
+	conn->fwd_sent = conn->fwd_cnt;
+	vsock_iov_copy(iov, niov, 0, &hdr, sizeof(hdr), true);
+	return sizeof(hdr) + hdr.len;
+}
+
+static inline bool
+vsock_conn_busy(struct vsock_conn *conn)
+{
+	return conn->pending || (vsock_conn_can_send(conn) &&
+				 vsock_peer_credit(conn));
+}
+
+/*
+ * Move packets for the guest into the rx queue, round robin between the
+ * connections with something to send. A connection that put nothing in
+ * a chain is not tried again before the next flush.
+ */
+static void
+vsock_rx_flush(struct virtio_vsock *vs)
+{
+	struct virtio_vq_info *vq = &vs->queues[VSOCK_RXQ];
+	struct iovec iov[VIRTIO_VSOCK_MAXSEGS];
+	struct virtio_vsock_hdr hdr;
+	struct vsock_conn *conn;
+	TAILQ_HEAD(, vsock_conn) idle = TAILQ_HEAD_INITIALIZER(idle);
+	bool used = false;
+	size_t len, room;
+	uint16_t idx;
+	int n;
+
+	if (!vq_ring_ready(vq))
+		return;
+
+	while (vq_has_descs(vq) && (vs->nrst || !TAILQ_EMPTY(&vs->rxq))) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_VSOCK_MAXSEGS, NULL);
+		if (n <= 0) {
+			WPRINTF(("vsock: invalid rx chain\n"));
+			break;
+		}
+		room = vsock_iov_len(iov, n);
+		if (room < sizeof(hdr)) {
+			WPRINTF(("vsock: rx buffer too small\n"));
+			vq_relchain(vq, idx, 0);
+			used = true;
+			continue;
+		}
+
+		if (vs->nrst) {
+			vs->nrst--;
+			vsock_hdr_init(vs, &hdr, vs->rst[vs->nrst].src_port,
+				       vs->rst[vs->nrst].dst_port,
+				       VIRTIO_VSOCK_OP_RST);
+			len = vsock_iov_copy(iov, n, 0, &hdr, sizeof(hdr),
+					     true);
+			vq_relchain(vq, idx, len);
+			used = true;
+			continue;
+		}
+
+		conn = TAILQ_FIRST(&vs->rxq);
+		if (room == sizeof(hdr) && !conn->pending) {
+			/* No room for data, don't let it block the queue */
+			WPRINTF(("vsock: rx buffer too small\n"));
+			vq_relchain(vq, idx, 0);
+			used = true;
+			continue;
+		}
+		len = vsock_conn_rx(conn, iov, n);
+
+		TAILQ_REMOVE(&vs->rxq, conn, rx_link);
+		conn->on_rxq = false;
+
+		if (len == 0) {
+			/* on_rxq keeps vsock_rx_schedule() off it until then */
+			if (vsock_conn_busy(conn)) {
+				TAILQ_INSERT_TAIL(&idle, conn, rx_link);
+				conn->on_rxq = true;
+			}
+			vq_retchain(vq);
+			continue;
+		}
+		if (vsock_conn_busy(conn))
+			vsock_rx_schedule(conn);
+		vq_relchain(vq, idx, len);
+		used = true;
+	}
+	TAILQ_CONCAT(&vs->rxq, &idle, rx_link);
+
+	if (used)
+		vq_endchains(vq, 0);
+}
+
+/* Host peers may close at any time, which must not raise SIGPIPE */
+static ssize_t
+vsock_sendv(int fd, struct iovec *iov, int niov)
+{
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/*
+ * Write guest data to the host socket, buffering what it can't take now.
+ */
+static int
+vsock_conn_write(struct vsock_conn *conn, struct iovec *iov, int niov,
+		 uint32_t len)
+{
+	struct iovec data[VIRTIO_VSOCK_MAXSEGS];
+	ssize_t n = 0;
+	int ndata;
+
+	if (len > VSOCK_BUF_ALLOC - (conn->rx_cnt - conn->fwd_cnt)) {
+		WPRINTF(("vsock: guest port %u overran its credit\n",
+			 conn->peer_port));
+		return -1;
+	}
+	ndata = vsock_iov_slice(iov, niov, sizeof(struct virtio_vsock_hdr),
+				len, data);
+
+	if (conn->buf_len == 0) {
+		n = vsock_sendv(conn->fd, data, ndata);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR)
+				return -1;
+			n = 0;
+		}
+	}
+
+	if (n < len) {
+		if (!conn->buf) {
+			conn->buf = malloc(VSOCK_BUF_ALLOC);
+			if (!conn->buf)
+				return -1;
+		}
+		if (conn->buf_head + conn->buf_len + len - n >
+		    VSOCK_BUF_ALLOC) {
+			memmove(conn->buf, conn->buf + conn->buf_head,
+				conn->buf_len);
+			conn->buf_head = 0;
+		}
+		vsock_iov_copy(iov, niov, sizeof(struct virtio_vsock_hdr) + n,
+			       conn->buf + conn->buf_head + conn->buf_len,
+			       len - n, false);
+		conn->buf_len += len - n;
+	}
+
+	conn->rx_cnt += len;
+	conn->fwd_cnt += n;
+	vsock_credit_check(conn);
+	return 0;
+}
+
+/*
+ * The host socket is writable again, flush what the guest sent.
+ */
+static int
+vsock_conn_drain(struct vsock_conn *conn)
+{
+	ssize_t n;
+
+	while (conn->buf_len) {
+		n = send(conn->fd, conn->buf + conn->buf_head,
+			 conn->buf_len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		conn->buf_head += n;
+		conn->buf_len -= n;
+		conn->fwd_cnt += n;
+	}
+	if (conn->buf_len == 0) {
+		conn->buf_head = 0;
+		if (conn->peer_shut_send)
+			shutdown(conn->fd, SHUT_WR);
+	}
+	vsock_credit_check(conn);
+	return 0;
+}
+
+/*
+ * Guest connects to a host port: connect to the unix socket of that port.
+ */
+static void
+vsock_connect(struct virtio_vsock *vs, struct virtio_vsock_hdr *hdr)
+{
+	struct sockaddr_un addr;
+	struct vsock_conn *conn;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u",
+		     vs->uds_path, hdr->dst_port) >= sizeof(addr.sun_path))
+		goto reset;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto reset;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		DPRINTF(("vsock: connect %s failed: %s\n", addr.sun_path,
+			 strerror(errno)));
+		close(fd);
+		goto reset;
+	}
+
+	conn = vsock_conn_new(vs, fd, VSOCK_CONN_ESTABLISHED);
+	if (!conn) {
+		close(fd);
+		goto reset;
+	}
+	conn->local_port = hdr->dst_port;
+	conn->peer_port = hdr->src_port;
+	conn->peer_buf_alloc = hdr->buf_alloc;
+	conn->peer_fwd_cnt = hdr->fwd_cnt;
+	conn->pending = 1 << VIRTIO_VSOCK_OP_RESPONSE;
+	vsock_conn_hash(conn);
+	vsock_rx_schedule(conn);
+	DPRINTF(("vsock: guest port %u connected to %s\n", hdr->src_port,
+		 addr.sun_path));
+	return;
+
+reset:
+	vsock_send_rst(vs, hdr->dst_port, hdr->src_port);
+}
+
+static void
+vsock_handle_pkt(struct virtio_vsock *vs, struct virtio_vsock_hdr *hdr,
+		 struct iovec *iov, int niov)
+{
+	struct vsock_conn *conn;
+	char line[VSOCK_LINE_MAX];
+	int len;
+
+	if (hdr->src_cid != vs->cfg.guest_cid ||
+	    hdr->dst_cid != VSOCK_HOST_CID ||
+	    hdr->type != VIRTIO_VSOCK_TYPE_STREAM) {
+		if (hdr->op != VIRTIO_VSOCK_OP_RST)
+			vsock_send_rst(vs, hdr->dst_port, hdr->src_port);
+		return;
+	}
+
+	conn = vsock_conn_find(vs, hdr->dst_port, hdr->src_port);
+	if (!conn) {
+		if (hdr->op == VIRTIO_VSOCK_OP_REQUEST)
+			vsock_connect(vs, hdr);
+		else if (hdr->op != VIRTIO_VSOCK_OP_RST)
+			vsock_send_rst(vs, hdr->dst_port, hdr->src_port);
+		return;
+	}
+
+	/* Every packet carries the guest view of its buffer */
+	conn->peer_buf_alloc = hdr->buf_alloc;
+	conn->peer_fwd_cnt = hdr->fwd_cnt;
+	if (vsock_peer_credit(conn))
+		conn->credit_requested = false;
+
+	switch (hdr->op) {
+	case VIRTIO_VSOCK_OP_RESPONSE:
+		if (conn->state != VSOCK_CONN_CONNECTING) {
+			vsock_conn_reset(conn);
+			return;
+		}
+		conn->state = VSOCK_CONN_ESTABLISHED;
+		len = snprintf(line, sizeof(line), "OK %u\n",
+			       conn->local_port);
+		if (send(conn->fd, line, len, MSG_NOSIGNAL) != len) {
+			vsock_conn_reset(conn);
+			return;
+		}
+		break;
+	case VIRTIO_VSOCK_OP_RW:
+		if (conn->state != VSOCK_CONN_ESTABLISHED ||
+		    conn->peer_shut_send ||
+		    vsock_conn_write(conn, iov, niov, hdr->len) < 0) {
+			vsock_conn_reset(conn);
+			return;
+		}
+		break;
+	case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+		break;
+	case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+		conn->pending |= 1 << VIRTIO_VSOCK_OP_CREDIT_UPDATE;
+		break;
+	case VIRTIO_VSOCK_OP_SHUTDOWN:
+		if ((hdr->flags & VIRTIO_VSOCK_SHUTDOWN_RCV) &&
+		    (hdr->flags & VIRTIO_VSOCK_SHUTDOWN_SEND)) {
+			/* The guest closed, it waits for our reset */
+			vsock_conn_reset(conn);
+			return;
+		}
+		if (hdr->flags & VIRTIO_VSOCK_SHUTDOWN_RCV)
+			conn->peer_shut_rcv = true;
+		if (hdr->flags & VIRTIO_VSOCK_SHUTDOWN_SEND) {
+			conn->peer_shut_send = true;
+			if (conn->buf_len == 0)
+				shutdown(conn->fd, SHUT_WR);
+		}
+		break;
+	case VIRTIO_VSOCK_OP_RST:
+		vsock_conn_kill(conn);
+		return;
+	default:
+		vsock_conn_reset(conn);
+		return;
+	}
+
+	if (vsock_conn_busy(conn))
+		vsock_rx_schedule(conn);
+}
+
+static void
+vsock_tx_proc(struct virtio_vsock *vs, struct virtio_vq_info *vq)
+{
+	struct iovec iov[VIRTIO_VSOCK_MAXSEGS];
+	struct virtio_vsock_hdr hdr;
+	size_t len;
+	uint16_t idx;
+	int n;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_VSOCK_MAXSEGS, NULL);
+		if (n <= 0) {
+			WPRINTF(("vsock: invalid tx chain\n"));
+			break;
+		}
+
+		len = vsock_iov_copy(iov, n, 0, &hdr, sizeof(hdr), false);
+		if (len != sizeof(hdr) ||
+		    vsock_iov_len(iov, n) - sizeof(hdr) < hdr.len)
+			WPRINTF(("vsock: short tx packet\n"));
+		else if (hdr.len > VSOCK_MAX_PKT)
+			WPRINTF(("vsock: oversized tx packet\n"));
+		else
+			vsock_handle_pkt(vs, &hdr, iov, n);
+
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_vsock_notify(void *base, struct virtio_vq_info *vq)
+{
+	struct virtio_vsock *vs = base;
+
+	/* Called with the device mutex held */
+	switch (vq->num) {
+	case VSOCK_TXQ:
+		vsock_tx_proc(vs, vq);
+		break;
+	case VSOCK_RXQ:
+		/* New buffers, resume the connections waiting for them */
+		break;
+	default:
+		/* Event buffers are kept for a transport reset */
+		return;
+	}
+	vsock_rx_flush(vs);
+}
+
+/*
+ * A host process connected to the vsock socket, it has to tell which guest
+ * port it wants.
+ */
+static void
+vsock_accept(struct virtio_vsock *vs)
+{
+	struct vsock_conn *conn;
+	int fd;
+
+	for (;;) {
+		fd = accept4(vs->listen_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		conn = vsock_conn_new(vs, fd, VSOCK_CONN_HANDSHAKE);
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		LIST_INSERT_HEAD(&vs->handshakes, conn, link);
+	}
+}
+
+static void
+vsock_handshake(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	unsigned long port;
+	char *end;
+	ssize_t n;
+
+	for (;;) {
+		n = read(conn->fd, conn->line + conn->line_len, 1);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0 || conn->line_len == VSOCK_LINE_MAX - 1)
+			goto fail;
+		if (conn->line[conn->line_len] == '\n')
+			break;
+		conn->line_len++;
+	}
+	conn->line[conn->line_len] = '\0';
+
+	if (strncmp(conn->line, "CONNECT ", 8) != 0)
+		goto fail;
+	port = strtoul(conn->line + 8, &end, 10);
+	if (end == conn->line + 8 || (*end && *end != '\r') ||
+	    port > UINT32_MAX)
+		goto fail;
+
+	/* Find a free host port for the connection */
+	do {
+		conn->local_port = vs->next_port++;
+		if (vs->next_port == 0)
+			vs->next_port = VSOCK_LOCAL_PORT_BASE;
+	} while (vsock_conn_find(vs, conn->local_port, port));
+
+	LIST_REMOVE(conn, link);
+	conn->peer_port = port;
+	conn->state = VSOCK_CONN_CONNECTING;
+	conn->pending = 1 << VIRTIO_VSOCK_OP_REQUEST;
+	vsock_conn_hash(conn);
+	vsock_rx_schedule(conn);
+	DPRINTF(("vsock: host connects to guest port %lu\n", port));
+	return;
+
+fail:
+	vsock_conn_kill(conn);
+}
+
+static void *
+vsock_thread(void *arg)
+{
+	struct virtio_vsock *vs = arg;
+	struct epoll_event evs[32];
+	struct vsock_conn *conn;
+	bool stop = false;
+	int i, n;
+
+	while (!stop) {
+		n = epoll_wait(vs->epfd, evs, 32, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			WPRINTF(("vsock: epoll_wait failed: %s\n",
+				 strerror(errno)));
+			break;
+		}
+
+		pthread_mutex_lock(&vs->mtx);
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.ptr == &vs->stop_fd) {
+				stop = true;
+				continue;
+			}
+			if (evs[i].data.ptr == vs) {
+				vsock_accept(vs);
+				continue;
+			}
+
+			conn = evs[i].data.ptr;
+			if (conn->dead)
+				continue;
+			if (conn->state == VSOCK_CONN_HANDSHAKE) {
+				if (evs[i].events & (EPOLLIN | EPOLLRDHUP |
+						     EPOLLHUP | EPOLLERR))
+					vsock_handshake(vs, conn);
+				continue;
+			}
+			if ((evs[i].events & (EPOLLOUT | EPOLLERR)) &&
+			    vsock_conn_drain(conn) < 0) {
+				vsock_conn_reset(conn);
+				continue;
+			}
+			if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+				conn->readable = true;
+			if (vsock_conn_busy(conn))
+				vsock_rx_schedule(conn);
+		}
+		vsock_rx_flush(vs);
+		vsock_free_dead(vs);
+		pthread_mutex_unlock(&vs->mtx);
+	}
+	return NULL;
+}
+
+static int
+virtio_vsock_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_vsock *vs = vdev;
+
+	if (offset + size > sizeof(vs->cfg))
+		return -1;
+	*retval = 0;
+	memcpy(retval, (char *)&vs->cfg + offset, size);
+	return 0;
+}
+
+static int
+virtio_vsock_cfgwrite(void *vdev, int offset, int size, uint32_t value)
+{
+	DPRINTF(("vsock: write to read-only config reg %d\n", offset));
+	return 0;
+}
+
+static void
+virtio_vsock_reset(void *base)
+{
+	struct virtio_vsock *vs = base;
+
+	DPRINTF(("vsock: device reset requested\n"));
+	vsock_kill_all(vs);
+	virtio_reset_dev(&vs->base);
+}
+
+static int
+vsock_listen(struct virtio_vsock *vs)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(vs->uds_path) >= sizeof(addr.sun_path)) {
+		WPRINTF(("vsock: uds path %s too long\n", vs->uds_path));
+		return -1;
+	}
+	strncpy(addr.sun_path, vs->uds_path, sizeof(addr.sun_path) - 1);
+
+	vs->listen_fd = socket(AF_UNIX,
+			       SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (vs->listen_fd < 0)
+		return -1;
+	unlink(vs->uds_path);
+	if (bind(vs->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(vs->listen_fd, SOMAXCONN) < 0) {
+		WPRINTF(("vsock: listen on %s failed: %s\n", vs->uds_path,
+			 strerror(errno)));
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = vs;
+	if (epoll_ctl(vs->epfd, EPOLL_CTL_ADD, vs->listen_fd, &ev) < 0)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &vs->stop_fd;
+	return epoll_ctl(vs->epfd, EPOLL_CTL_ADD, vs->stop_fd, &ev);
+}
+
+static void
+virtio_vsock_free(struct virtio_vsock *vs)
+{
+	uint64_t one = 1;
+
+	if (vs->started) {
+		if (write(vs->stop_fd, &one, sizeof(one)) != sizeof(one))
+			WPRINTF(("vsock: failed to stop the thread\n"));
+		pthread_join(vs->tid, NULL);
+	}
+	vsock_kill_all(vs);
+	vsock_free_dead(vs);
+	if (vs->listen_fd >= 0) {
+		close(vs->listen_fd);
+		unlink(vs->uds_path);
+	}
+	if (vs->stop_fd >= 0)
+		close(vs->stop_fd);
+	if (vs->epfd >= 0)
+		close(vs->epfd);
+	free(vs->uds_path);
+	pthread_mutex_destroy(&vs->mtx);
+	free(vs);
+}
+
+static int
+virtio_vsock_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock *vs;
+	pthread_mutexattr_t attr;
+	char *opt, *key;
+	char tname[MAXCOMLEN + 1];
+	int i, rc;
+
+	vs = calloc(1, sizeof(struct virtio_vsock));
+	if (!vs) {
+		WPRINTF(("vsock: calloc returns NULL\n"));
+		return -1;
+	}
+	vs->listen_fd = -1;
+	vs->stop_fd = -1;
+	vs->next_port = VSOCK_LOCAL_PORT_BASE;
+	for (i = 0; i < VSOCK_HASH_SIZE; i++)
+		LIST_INIT(&vs->conns[i]);
+	LIST_INIT(&vs->handshakes);
+	LIST_INIT(&vs->dead);
+	TAILQ_INIT(&vs->rxq);
+
+	/* Recursive for INTx, where vq_interrupt takes the lock again */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		DPRINTF(("mutexattr init failed with erro %d!\n", rc));
+	rc = pthread_mutexattr_settype(&attr, fbsdrun_virtio_msix() ?
+			PTHREAD_MUTEX_DEFAULT : PTHREAD_MUTEX_RECURSIVE);
+	if (rc)
+		DPRINTF(("vsock: mutexattr_settype failed with error %d!\n",
+			 rc));
+	pthread_mutex_init(&vs->mtx, &attr);
+
+	vs->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	while (opts && (opt = strsep(&opts, ",")) != NULL) {
+		key = strsep(&opt, "=");
+		if (opt && !strcmp(key, "cid"))
+			vs->cfg.guest_cid = strtoull(opt, NULL, 0);
+		else if (opt && !strcmp(key, "uds")) {
+			free(vs->uds_path);
+			vs->uds_path = strdup(opt);
+		} else {
+			WPRINTF(("vsock: unknown option %s\n", key));
+			goto fail;
+		}
+	}
+	if (vs->cfg.guest_cid < VSOCK_MIN_GUEST_CID ||
+	    vs->cfg.guest_cid > UINT32_MAX) {
+		WPRINTF(("vsock: need a guest cid=<n>, %d or above\n",
+			 VSOCK_MIN_GUEST_CID));
+		goto fail;
+	}
+	if (!vs->uds_path) {
+		WPRINTF(("vsock: need a uds=<path> for the host sockets\n"));
+		goto fail;
+	}
+
+	vs->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (vs->epfd < 0 || vs->stop_fd < 0 || vsock_listen(vs) < 0)
+		goto fail;
+
+	virtio_linkup(&vs->base, &virtio_vsock_ops, vs, dev, vs->queues);
+	vs->base.mtx = &vs->mtx;
+	vs->queues[VSOCK_RXQ].qsize = VIRTIO_VSOCK_RINGSZ;
+	vs->queues[VSOCK_TXQ].qsize = VIRTIO_VSOCK_RINGSZ;
+	vs->queues[VSOCK_EVTQ].qsize = VIRTIO_VSOCK_EVT_RINGSZ;
+
+	/* virtio-vsock is a virtio 1.0 only device */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_VSOCK);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_REVID, 1);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_SIMPLECOMM);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_SIMPLECOMM_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_VSOCK);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&vs->base, fbsdrun_virtio_msix()))
+		goto fail;
+	if (virtio_set_modern_bar(&vs->base, false))
+		goto fail;
+
+	if (pthread_create(&vs->tid, NULL, vsock_thread, vs) != 0) {
+		WPRINTF(("vsock: thread create failed\n"));
+		goto fail;
+	}
+	snprintf(tname, sizeof(tname), "vsock-%d:%d", dev->slot, dev->func);
+	pthread_setname_np(vs->tid, tname);
+	vs->started = true;
+
+	DPRINTF(("vsock: guest cid %lu, host sockets %s\n",
+		 vs->cfg.guest_cid, vs->uds_path));
+	return 0;
+
+fail:
+	dev->arg = NULL;
+	virtio_vsock_free(vs);
+	return -1;
+}
+
+static void
+virtio_vsock_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock *vs = dev->arg;
+
+	if (!vs)
+		return;
+	dev->arg = NULL;
+	virtio_vsock_free(vs);
+}
+
+struct pci_vdev_ops pci_ops_virtio_vsock = {
+	.class_name	= "virtio-vsock",
+	.vdev_init	= virtio_vsock_init,
+	.vdev_deinit	= virtio_vsock_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_vsock);
@@ -47,6 +47,7 @@
 #include "ps2mouse.h"
 #include "vmm.h"
 #include "vmmapi.h"
+#include "handover.h"
 
 static void
 atkbdc_assert_kbd_intr(struct atkbdc_base *base)
@@ -456,6 +457,9 @@ atkbdc_init(struct vmctx *ctx)
 
 	base->ps2kbd = ps2kbd_init(base);
 	base->ps2mouse = ps2mouse_init(base);
+
+	/* the controller and ps2 device state is not handed over yet */
+	handover_register("atkbdc", NULL, NULL, NULL);
 }
 
 void
@@ -464,6 +468,7 @@ atkbdc_deinit(struct vmctx *ctx)
 	struct inout_port iop;
 	struct atkbdc_base *base = ctx->atkbdc_base;
 
+	handover_unregister("atkbdc");
 	ps2kbd_deinit(base);
 	base->ps2kbd = NULL;
 	ps2mouse_deinit(base);
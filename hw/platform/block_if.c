@@ -41,12 +41,15 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include <sysexits.h>
 #include <unistd.h>
 
 #include "dm.h"
 #include "mevent.h"
 #include "block_if.h"
+#include "metrics.h"
+#include "tracepoint.h"
 #include "ahci.h"
 
 /*
@@ -112,6 +115,15 @@ struct blockif_ctxt {
 	int			psectsz;
 	int			psectoff;
 	int			closing;
+	int			started;
+	char			ident[16];
+
+	/* runtime metrics, labeled with ident */
+	struct metric		*m_ops[BOP_DELETE + 1];
+	struct metric		*m_bytes[BOP_WRITE + 1];
+	struct metric		*m_errors;
+	struct metric		*m_latency;	/* us spent in blockif_proc */
+	struct metric		*m_inflight;
 	pthread_t		btid[BLOCKIF_NUMTHR];
 	pthread_mutex_t		mtx;
 	pthread_cond_t		cond;
@@ -176,6 +188,7 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	else
 		be->status = BST_BLOCK;
 	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	TRACEPOINT(TP_BLOCKIF_ENQUEUE, (uintptr_t)breq, op);
 	return (be->status == BST_PEND);
 }
 
@@ -195,6 +208,7 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 	be->status = BST_BUSY;
 	be->tid = t;
 	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	TRACEPOINT(TP_BLOCKIF_DEQUEUE, (uintptr_t)be->req, be->op);
 	*bep = be;
 	return 1;
 }
@@ -216,6 +230,7 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 	be->status = BST_FREE;
 	be->req = NULL;
 	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
+	metric_gauge_add(bc->m_inflight, -1);
 }
 
 static void
@@ -223,13 +238,16 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 {
 	struct blockif_req *br;
 	off_t arg[2];
-	ssize_t clen, len, off, boff, voff;
+	ssize_t clen, len, off, boff, voff, resid;
+	struct timespec start, end;
 	int i, err;
 
 	br = be->req;
 	if (br->iovcnt <= 1)
 		buf = NULL;
 	err = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	resid = br->resid;
 	switch (be->op) {
 	case BOP_READ:
 		if (buf == NULL) {
@@ -337,6 +355,16 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 
 	be->status = BST_DONE;
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	metric_observe(bc->m_latency, (end.tv_sec - start.tv_sec) * 1000000 +
+		       (end.tv_nsec - start.tv_nsec) / 1000);
+	metric_inc(bc->m_ops[be->op]);
+	if (be->op <= BOP_WRITE)
+		metric_add(bc->m_bytes[be->op], resid - br->resid);
+	if (err)
+		metric_inc(bc->m_errors);
+
+	TRACEPOINT(TP_BLOCKIF_COMPLETE, (uintptr_t)br, err);
 	(*br->callback)(br, err);
 }
 
@@ -457,17 +485,114 @@ sub_file_unlock(struct blockif_ctxt *bc)
 }
 
 
+static void
+blockif_metrics_init(struct blockif_ctxt *bc)
+{
+	static const char * const opname[] = {
+		[BOP_READ] = "read",
+		[BOP_WRITE] = "write",
+		[BOP_FLUSH] = "flush",
+		[BOP_DELETE] = "delete",
+	};
+	int i;
+
+	for (i = 0; i <= BOP_DELETE; i++)
+		bc->m_ops[i] = metric_register(METRIC_COUNTER,
+			"acrn_blockif_requests_total",
+			"dev=\"%s\",op=\"%s\"", bc->ident, opname[i]);
+	for (i = 0; i <= BOP_WRITE; i++)
+		bc->m_bytes[i] = metric_register(METRIC_COUNTER,
+			"acrn_blockif_bytes_total",
+			"dev=\"%s\",op=\"%s\"", bc->ident, opname[i]);
+	bc->m_errors = metric_register(METRIC_COUNTER,
+		"acrn_blockif_errors_total", "dev=\"%s\"", bc->ident);
+	bc->m_latency = metric_register(METRIC_HISTOGRAM,
+		"acrn_blockif_service_us", "dev=\"%s\"", bc->ident);
+	bc->m_inflight = metric_register(METRIC_GAUGE,
+		"acrn_blockif_inflight", "dev=\"%s\"", bc->ident);
+}
+
+static void
+blockif_metrics_deinit(struct blockif_ctxt *bc)
+{
+	int i;
+
+	for (i = 0; i <= BOP_DELETE; i++)
+		metric_unregister(bc->m_ops[i]);
+	for (i = 0; i <= BOP_WRITE; i++)
+		metric_unregister(bc->m_bytes[i]);
+	metric_unregister(bc->m_errors);
+	metric_unregister(bc->m_latency);
+	metric_unregister(bc->m_inflight);
+}
+
+/*
+ * Start the block i/o threads of a context opened with
+ * blockif_open_lazy(). Requests issued before that start them too.
+ */
+int
+blockif_start(struct blockif_ctxt *bc)
+{
+	char tname[MAXCOMLEN + 1];
+	int i, err;
+
+	assert(bc->magic == BLOCKIF_SIG);
+
+	err = 0;
+	pthread_mutex_lock(&bc->mtx);
+	for (i = bc->started; i < BLOCKIF_NUMTHR; i++) {
+		err = pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
+		if (err) {
+			fprintf(stderr, "blockif: thread create failed %d\n",
+				err);
+			break;
+		}
+		if (snprintf(tname, sizeof(tname), "blk-%s-%d", bc->ident, i)
+				< sizeof(tname))
+			pthread_setname_np(bc->btid[i], tname);
+	}
+	bc->started = i;
+	pthread_mutex_unlock(&bc->mtx);
+
+	return err;
+}
+
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
 {
-	char tname[MAXCOMLEN + 1];
+	struct blockif_ctxt *bc;
+
+	bc = blockif_open_lazy(optstr, ident);
+	if (bc)
+		blockif_start(bc);
+	return bc;
+}
+
+/*
+ * Open the backing file like blockif_open() but leave the block i/o
+ * threads to blockif_start() or the first request.
+ */
+struct blockif_ctxt *
+blockif_open_lazy(const char *optstr, const char *ident)
+{
+	return blockif_open_fd(optstr, ident, -1);
+}
+
+/*
+ * Like blockif_open_lazy() on a backing file which is open already, e.g.
+ * one handed over by another DM. The pathname in optstr is not opened
+ * again, the context takes 'fd' over, also if it fails.
+ */
+struct blockif_ctxt *
+blockif_open_fd(const char *optstr, const char *ident, int fd)
+{
 	/* char name[MAXPATHLEN]; */
 	char *nopt, *xopts, *cp;
 	struct blockif_ctxt *bc;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
-	int extra, fd, i, sectsz;
+	int extra, i, sectsz;
 	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
 	long sz;
 	long long b;
@@ -477,7 +602,6 @@ blockif_open(const char *optstr, const char *ident)
 
 	pthread_once(&blockif_once, blockif_init);
 
-	fd = -1;
 	ssopt = 0;
 	nocache = 0;
 	sync = 0;
@@ -526,7 +650,10 @@ blockif_open(const char *optstr, const char *ident)
 	if (sync)
 		extra |= O_SYNC;
 
-	fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
+	if (fd >= 0)
+		ro = (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY;
+	else
+		fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
 	if (fd < 0 && !ro) {
 		/* Attempt a r/w fail with a r/o open */
 		fd = open(nopt, O_RDONLY | extra);
@@ -661,11 +788,8 @@ blockif_open(const char *optstr, const char *ident)
 		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
 	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
-		pthread_setname_np(bc->btid[i], tname);
-	}
+	snprintf(bc->ident, sizeof(bc->ident), "%s", ident);
+	blockif_metrics_init(bc);
 
 	return bc;
 err:
@@ -680,6 +804,12 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 {
 	int err;
 
+	if (bc->started < BLOCKIF_NUMTHR) {
+		err = blockif_start(bc);
+		if (err)
+			return err;
+	}
+
 	err = 0;
 
 	pthread_mutex_lock(&bc->mtx);
@@ -690,6 +820,7 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 */
 		if (blockif_enqueue(bc, breq, op))
 			pthread_cond_signal(&bc->cond);
+		metric_gauge_add(bc->m_inflight, 1);
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -809,6 +940,14 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return -EBUSY;
 }
 
+/* The backing file, for passing it on to another DM */
+int
+blockif_fd(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	return bc->fd;
+}
+
 int
 blockif_close(struct blockif_ctxt *bc)
 {
@@ -825,7 +964,7 @@ blockif_close(struct blockif_ctxt *bc)
 	bc->closing = 1;
 	pthread_mutex_unlock(&bc->mtx);
 	pthread_cond_broadcast(&bc->cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
+	for (i = 0; i < bc->started; i++)
 		pthread_join(bc->btid[i], &jval);
 
 	/* XXX Cancel queued i/o's ??? */
@@ -833,6 +972,7 @@ blockif_close(struct blockif_ctxt *bc)
 	/*
 	 * Release resources
 	 */
+	blockif_metrics_deinit(bc);
 	bc->magic = 0;
 	close(bc->fd);
 	free(bc);
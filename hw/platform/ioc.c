@@ -86,9 +86,11 @@
 #include <types.h>
 
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 
 #include "ioc.h"
+#include "handover.h"
 
 /* For debugging log to a file */
 static int ioc_debug;
@@ -642,63 +644,136 @@ ioc_ch_deinit(void)
 }
 
 /*
- * Called to put a cbc_request to a specific queue
+ * Put a cbc_request on a ring, only called by the producer of the ring.
+ * The rings hold all requests so this cannot overflow.
  */
 static void
-cbc_request_enqueue(struct ioc_dev *ioc, struct cbc_request *req,
-		enum cbc_queue_type qtype, bool to_head)
+cbc_req_ring_put(struct cbc_req_ring *ring, struct cbc_request *req)
+{
+	uint32_t tail = ring->tail;
+
+	assert(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) <
+			CBC_REQ_RING_SIZE);
+	ring->reqs[tail & (CBC_REQ_RING_SIZE - 1)] = req;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Get a cbc_request from a ring, only called by the consumer of the ring.
+ */
+static struct cbc_request *
+cbc_req_ring_get(struct cbc_req_ring *ring)
+{
+	struct cbc_request *req;
+	uint32_t head = ring->head;
+
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	req = ring->reqs[head & (CBC_REQ_RING_SIZE - 1)];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return req;
+}
+
+/*
+ * Put a cbc_request on a rx/tx queue and wake up the consumer if it is
+ * idle. Requests from the other worker thread go to the urgent ring.
+ */
+static void
+cbc_queue_put(struct cbc_queue *q, struct cbc_request *req, bool urgent)
 {
-	pthread_cond_t *cond;
-	pthread_mutex_t *mtx;
-	struct cbc_qhead *qhead;
+	uint64_t kick = 1;
+
+	cbc_req_ring_put(urgent ? &q->urgent : &q->ring, req);
 
+	/*
+	 * Pairs with the idle store in cbc_queue_get(): either the consumer
+	 * sees the request on its recheck or we see it idle.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&q->idle, 0, __ATOMIC_SEQ_CST) &&
+			write(q->efd, &kick, sizeof(kick)) < 0)
+		DPRINTF("ioc queue kick error:%s\r\n", strerror(errno));
+}
+
+static struct cbc_request *
+cbc_queue_poll(struct cbc_queue *q)
+{
+	struct cbc_request *req;
+
+	req = cbc_req_ring_get(&q->urgent);
 	if (!req)
-		return;
+		req = cbc_req_ring_get(&q->ring);
+	return req;
+}
 
-	if (qtype == CBC_QUEUE_T_RX) {
-		cond = &ioc->rx_cond;
-		mtx = &ioc->rx_mtx;
-		qhead = &ioc->rx_qhead;
-	} else if (qtype == CBC_QUEUE_T_TX) {
-		cond = &ioc->tx_cond;
-		mtx = &ioc->tx_mtx;
-		qhead = &ioc->tx_qhead;
-	} else {
-		cond = NULL;
-		mtx = &ioc->free_mtx;
-		qhead = &ioc->free_qhead;
+/*
+ * Wait for a cbc_request on a rx/tx queue, returns NULL when the IOC
+ * mediator is closing.
+ */
+static struct cbc_request *
+cbc_queue_get(struct ioc_dev *ioc, struct cbc_queue *q)
+{
+	struct cbc_request *req;
+	uint64_t cnt;
+
+	for (;;) {
+		if (ioc->closing)
+			return NULL;
+		req = cbc_queue_poll(q);
+		if (req)
+			return req;
+
+		__atomic_store_n(&q->idle, 1, __ATOMIC_SEQ_CST);
+		req = cbc_queue_poll(q);
+		if (req) {
+			__atomic_store_n(&q->idle, 0, __ATOMIC_RELAXED);
+			return req;
+		}
+		if (read(q->efd, &cnt, sizeof(cnt)) < 0 && errno != EINTR) {
+			DPRINTF("ioc queue wait error:%s\r\n",
+					strerror(errno));
+			return NULL;
+		}
 	}
+}
+
+/*
+ * Called by the core thread to put a cbc_request to a specific queue.
+ */
+static void
+cbc_request_enqueue(struct ioc_dev *ioc, struct cbc_request *req,
+		enum cbc_queue_type qtype)
+{
+	if (!req)
+		return;
 
-	pthread_mutex_lock(mtx);
-	if (to_head)
-		SIMPLEQ_INSERT_HEAD(qhead, req, me_queue);
+	if (qtype == CBC_QUEUE_T_RX)
+		cbc_queue_put(&ioc->rx_queue, req, false);
+	else if (qtype == CBC_QUEUE_T_TX)
+		cbc_queue_put(&ioc->tx_queue, req, false);
 	else
-		SIMPLEQ_INSERT_TAIL(qhead, req, me_queue);
-	if (cond != NULL)
-		pthread_cond_signal(cond);
-	pthread_mutex_unlock(mtx);
+		ioc->free_reqs[ioc->free_num++] = req;
 }
 
 /*
- * Called to get a cbc_request from a specific queue,
- * due to rx and tx threads have implemented getting a cbc_request from
- * related queue and only core thread needs to dequque, so only supports
- * dequeue from the free queue.
+ * Called by the core thread to get a free cbc_request, the requests freed
+ * by rx and tx threads are collected once the local ones run out.
  */
 static struct cbc_request*
 cbc_request_dequeue(struct ioc_dev *ioc, enum cbc_queue_type qtype)
 {
-	struct cbc_request *free = NULL;
+	struct cbc_request *req;
 
-	if (qtype == CBC_QUEUE_T_FREE) {
-		pthread_mutex_lock(&ioc->free_mtx);
-		if (!SIMPLEQ_EMPTY(&ioc->free_qhead)) {
-			free = SIMPLEQ_FIRST(&ioc->free_qhead);
-			SIMPLEQ_REMOVE_HEAD(&ioc->free_qhead, me_queue);
-		}
-		pthread_mutex_unlock(&ioc->free_mtx);
+	if (qtype != CBC_QUEUE_T_FREE)
+		return NULL;
+
+	if (ioc->free_num == 0) {
+		while ((req = cbc_req_ring_get(&ioc->rx_free)) != NULL)
+			ioc->free_reqs[ioc->free_num++] = req;
+		while ((req = cbc_req_ring_get(&ioc->tx_free)) != NULL)
+			ioc->free_reqs[ioc->free_num++] = req;
 	}
-	return free;
+	return ioc->free_num > 0 ? ioc->free_reqs[--ioc->free_num] : NULL;
 }
 
 /*
@@ -724,7 +799,7 @@ ioc_build_request(struct ioc_dev *ioc, int32_t link_len, int32_t srv_len)
 	}
 	req->srv_len = srv_len;
 	req->link_len = link_len;
-	cbc_request_enqueue(ioc, req, CBC_QUEUE_T_RX, false);
+	cbc_request_enqueue(ioc, req, CBC_QUEUE_T_RX);
 }
 
 /*
@@ -769,7 +844,7 @@ ioc_process_tx(struct ioc_dev *ioc, enum ioc_ch_id id)
 	 */
 	count = ioc_ch_recv(id, req->buf + CBC_SRV_POS, CBC_MAX_SERVICE_SIZE);
 	if (count <= 0) {
-		cbc_request_enqueue(ioc, req, CBC_QUEUE_T_FREE, false);
+		cbc_request_enqueue(ioc, req, CBC_QUEUE_T_FREE);
 		DPRINTF("ioc channel=%d,recv error\r\n", id);
 		return -1;
 	}
@@ -790,7 +865,7 @@ ioc_process_tx(struct ioc_dev *ioc, enum ioc_ch_id id)
 #else
 	req->id = id;
 #endif
-	cbc_request_enqueue(ioc, req, CBC_QUEUE_T_TX, false);
+	cbc_request_enqueue(ioc, req, CBC_QUEUE_T_TX);
 	return 0;
 }
 
@@ -875,26 +950,15 @@ ioc_rx_thread(void *arg)
 	struct ioc_dev *ioc = (struct ioc_dev *) arg;
 	struct cbc_request *req = NULL;
 	struct cbc_pkt packet;
-	int err;
 
 	memset(&packet, 0, sizeof(packet));
 	packet.cfg = &ioc->rx_config;
 	packet.boot_reason = ioc_boot_reason;
 	for (;;) {
-		pthread_mutex_lock(&ioc->rx_mtx);
-		while (SIMPLEQ_EMPTY(&ioc->rx_qhead)) {
-			err = pthread_cond_wait(&ioc->rx_cond, &ioc->rx_mtx);
-			assert(err == 0);
-			if (ioc->closing)
-				goto exit;
-		}
-		if (ioc->closing)
-			goto exit;
-
 		/* Get a cbc request from the queue head */
-		req = SIMPLEQ_FIRST(&ioc->rx_qhead);
-		SIMPLEQ_REMOVE_HEAD(&ioc->rx_qhead, me_queue);
-		pthread_mutex_unlock(&ioc->rx_mtx);
+		req = cbc_queue_get(ioc, &ioc->rx_queue);
+		if (!req)
+			break;
 		packet.req = req;
 
 		/*
@@ -908,12 +972,10 @@ ioc_rx_thread(void *arg)
 
 		/* Route the cbc_request */
 		if (packet.qtype == CBC_QUEUE_T_TX)
-			cbc_request_enqueue(ioc, req, CBC_QUEUE_T_TX, true);
+			cbc_queue_put(&ioc->tx_queue, req, true);
 		else
-			cbc_request_enqueue(ioc, req, CBC_QUEUE_T_FREE, false);
+			cbc_req_ring_put(&ioc->rx_free, req);
 	}
-exit:
-	pthread_mutex_unlock(&ioc->rx_mtx);
 	return NULL;
 }
 
@@ -927,26 +989,15 @@ ioc_tx_thread(void *arg)
 	struct ioc_dev *ioc = (struct ioc_dev *) arg;
 	struct cbc_request *req = NULL;
 	struct cbc_pkt packet;
-	int err;
 
 	memset(&packet, 0, sizeof(packet));
 	packet.cfg = &ioc->tx_config;
 	packet.boot_reason = ioc_boot_reason;
 	for (;;) {
-		pthread_mutex_lock(&ioc->tx_mtx);
-		while (SIMPLEQ_EMPTY(&ioc->tx_qhead)) {
-			err =  pthread_cond_wait(&ioc->tx_cond, &ioc->tx_mtx);
-			assert(err == 0);
-			if (ioc->closing)
-				goto exit;
-		}
-		if (ioc->closing)
-			goto exit;
-
 		/* Get a cbc request from the queue head */
-		req = SIMPLEQ_FIRST(&ioc->tx_qhead);
-		SIMPLEQ_REMOVE_HEAD(&ioc->tx_qhead, me_queue);
-		pthread_mutex_unlock(&ioc->tx_mtx);
+		req = cbc_queue_get(ioc, &ioc->tx_queue);
+		if (!req)
+			break;
 		packet.req = req;
 
 		/*
@@ -960,15 +1011,22 @@ ioc_tx_thread(void *arg)
 
 		/* Route the cbc_request */
 		if (packet.qtype == CBC_QUEUE_T_RX)
-			cbc_request_enqueue(ioc, req, CBC_QUEUE_T_RX, true);
+			cbc_queue_put(&ioc->rx_queue, req, true);
 		else
-			cbc_request_enqueue(ioc, req, CBC_QUEUE_T_FREE, false);
+			cbc_req_ring_put(&ioc->tx_free, req);
 	}
-exit:
-	pthread_mutex_unlock(&ioc->tx_mtx);
 	return NULL;
 }
 
+static void
+ioc_wakeup_worker(struct cbc_queue *q)
+{
+	uint64_t kick = 1;
+
+	if (write(q->efd, &kick, sizeof(kick)) < 0)
+		DPRINTF("ioc worker wakeup error:%s\r\n", strerror(errno));
+}
+
 /*
  * Stop all threads(core/rx/tx)
  */
@@ -982,24 +1040,11 @@ ioc_kill_workers(struct ioc_dev *ioc)
 	ioc->epfd = IOC_INIT_FD;
 	pthread_join(ioc->tid, NULL);
 
-	/* Stop IOC rx thread */
-	pthread_mutex_lock(&ioc->rx_mtx);
-	pthread_cond_signal(&ioc->rx_cond);
-	pthread_mutex_unlock(&ioc->rx_mtx);
+	/* Stop IOC rx and tx threads, they see closing once woken up */
+	ioc_wakeup_worker(&ioc->rx_queue);
 	pthread_join(ioc->rx_tid, NULL);
-
-	/* Stop IOC tx thread */
-	pthread_mutex_lock(&ioc->tx_mtx);
-	pthread_cond_signal(&ioc->tx_cond);
-	pthread_mutex_unlock(&ioc->tx_mtx);
+	ioc_wakeup_worker(&ioc->tx_queue);
 	pthread_join(ioc->tx_tid, NULL);
-
-	/* Release the cond and mutex */
-	pthread_mutex_destroy(&ioc->rx_mtx);
-	pthread_cond_destroy(&ioc->rx_cond);
-	pthread_mutex_destroy(&ioc->tx_mtx);
-	pthread_cond_destroy(&ioc->tx_cond);
-	pthread_mutex_destroy(&ioc->free_mtx);
 }
 
 static int
@@ -1088,10 +1133,11 @@ ioc_init(void)
 	 * Put all buffered CBC requests on the free queue, the free queue is
 	 * used to be a cbc_request buffer.
 	 */
-	SIMPLEQ_INIT(&ioc->free_qhead);
-	pthread_mutex_init(&ioc->free_mtx, NULL);
 	for (i = 0; i < IOC_MAX_REQUESTS; i++)
-		SIMPLEQ_INSERT_TAIL(&ioc->free_qhead, ioc->pool + i, me_queue);
+		ioc->free_reqs[i] = ioc->pool + i;
+	ioc->free_num = IOC_MAX_REQUESTS;
+	ioc->rx_queue.efd = IOC_INIT_FD;
+	ioc->tx_queue.efd = IOC_INIT_FD;
 
 	/*
 	 * Initialize native CBC cdev and virtual UART.
@@ -1116,9 +1162,6 @@ ioc_init(void)
 	/* Setup IOC rx members */
 	snprintf(ioc->rx_name, sizeof(ioc->rx_name), "ioc_rx");
 	ioc->ioc_dev_rx = cbc_rx_handler;
-	pthread_cond_init(&ioc->rx_cond, NULL);
-	pthread_mutex_init(&ioc->rx_mtx, NULL);
-	SIMPLEQ_INIT(&ioc->rx_qhead);
 	ioc->rx_config.cbc_sig_num = ARRAY_SIZE(cbc_rx_signal_table);
 	ioc->rx_config.cbc_grp_num = ARRAY_SIZE(cbc_rx_group_table);
 	ioc->rx_config.wlist_sig_num = ARRAY_SIZE(wlist_rx_signal_table);
@@ -1131,9 +1174,6 @@ ioc_init(void)
 	/* Setup IOC tx members */
 	snprintf(ioc->tx_name, sizeof(ioc->tx_name), "ioc_tx");
 	ioc->ioc_dev_tx = cbc_tx_handler;
-	pthread_cond_init(&ioc->tx_cond, NULL);
-	pthread_mutex_init(&ioc->tx_mtx, NULL);
-	SIMPLEQ_INIT(&ioc->tx_qhead);
 	ioc->tx_config.cbc_sig_num = ARRAY_SIZE(cbc_tx_signal_table);
 	ioc->tx_config.cbc_grp_num = ARRAY_SIZE(cbc_tx_group_table);
 	ioc->tx_config.wlist_sig_num = ARRAY_SIZE(wlist_tx_signal_table);
@@ -1143,6 +1183,17 @@ ioc_init(void)
 	ioc->tx_config.wlist_sig_tbl = wlist_tx_signal_table;
 	ioc->tx_config.wlist_grp_tbl = wlist_tx_group_table;
 
+	/* Index the signal and group tables for the per-frame lookups */
+	if (cbc_index_init(&ioc->rx_config) != 0 ||
+			cbc_index_init(&ioc->tx_config) != 0)
+		goto queue_err;
+
+	/* Wakeups of the rx and tx threads when their queues were empty */
+	ioc->rx_queue.efd = eventfd(0, EFD_CLOEXEC);
+	ioc->tx_queue.efd = eventfd(0, EFD_CLOEXEC);
+	if (ioc->rx_queue.efd < 0 || ioc->tx_queue.efd < 0)
+		goto queue_err;
+
 	/*
 	 * Three threads are created for IOC work flow.
 	 * Rx thread is responsible for writing data to native CBC cdevs.
@@ -1161,16 +1212,21 @@ ioc_init(void)
 			(void *)ioc) < 0)
 		goto work_err;
 
+	/* the CBC channels and queued requests cannot be handed over */
+	handover_register("ioc", NULL, NULL, NULL);
+
 	return ioc;
 work_err:
-	pthread_mutex_destroy(&ioc->rx_mtx);
-	pthread_cond_destroy(&ioc->rx_cond);
-	pthread_mutex_destroy(&ioc->tx_mtx);
-	pthread_cond_destroy(&ioc->tx_cond);
 	ioc_kill_workers(ioc);
+queue_err:
+	cbc_index_deinit(&ioc->rx_config);
+	cbc_index_deinit(&ioc->tx_config);
+	if (ioc->rx_queue.efd >= 0)
+		close(ioc->rx_queue.efd);
+	if (ioc->tx_queue.efd >= 0)
+		close(ioc->tx_queue.efd);
 chl_err:
 	ioc_ch_deinit();
-	pthread_mutex_destroy(&ioc->free_mtx);
 	close(ioc->epfd);
 alloc_err:
 	free(ioc->evts);
@@ -1192,8 +1248,13 @@ ioc_deinit(struct ioc_dev *ioc)
 		DPRINTF("%s", "ioc deinit parameter is NULL\r\n");
 		return;
 	}
+	handover_unregister("ioc");
 	ioc_kill_workers(ioc);
 	ioc_ch_deinit();
+	cbc_index_deinit(&ioc->rx_config);
+	cbc_index_deinit(&ioc->tx_config);
+	close(ioc->rx_queue.efd);
+	close(ioc->tx_queue.efd);
 	close(ioc->epfd);
 	free(ioc->evts);
 	free(ioc->pool);
@@ -33,6 +33,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
 #include "ioc.h"
@@ -240,130 +242,183 @@ cbc_unpack_link(struct ioc_dev *ioc)
 	}
 }
 
-/*
- * Find a CBC signal from CBC signal table.
- */
-static inline struct cbc_signal *
-cbc_find_signal(uint16_t id, struct cbc_signal *table, size_t size)
+static inline uint32_t
+cbc_index_hash(uint16_t id, uint32_t bits)
 {
-	int i;
-
-	for (i = 0; i < size; i++) {
-		if (id == table[i].id)
-			return &table[i];
-	}
-	return NULL;
+	return ((uint32_t)id * 2654435761U) >> (32 - bits);
 }
 
 /*
- * Find a CBC signal group from CBC signal group table.
+ * Find the index entry of a signal or group id, the index is never more
+ * than half full so the probing always ends at an unused slot.
  */
-static inline struct cbc_group *
-cbc_find_signal_group(uint16_t id, struct cbc_group *table, size_t size)
+static struct cbc_index_entry *
+cbc_index_find(struct cbc_index *idx, uint16_t id)
 {
-	int i;
+	struct cbc_index_entry *e;
+	uint32_t i, mask;
+
+	if (!idx->tbl)
+		return NULL;
+	mask = (1U << idx->bits) - 1;
+	for (i = cbc_index_hash(id, idx->bits); ; i = (i + 1) & mask) {
+		e = &idx->tbl[i];
+		if (!e->used)
+			return NULL;
+		if (e->id == id)
+			return e;
+	}
+}
 
-	for (i = 0; i < size; i++) {
-		if (id == table[i].id)
-			return &table[i];
+static struct cbc_index_entry *
+cbc_index_add(struct cbc_index *idx, uint16_t id, void *node)
+{
+	struct cbc_index_entry *e;
+	uint32_t i, mask;
+
+	mask = (1U << idx->bits) - 1;
+	for (i = cbc_index_hash(id, idx->bits); ; i = (i + 1) & mask) {
+		e = &idx->tbl[i];
+		/* Keep the first one of duplicated ids like a table scan */
+		if (e->used && e->id == id)
+			return e;
+		if (!e->used)
+			break;
 	}
-	return NULL;
+	e->id = id;
+	e->used = 1;
+	e->node = node;
+	return e;
 }
 
-/*
- * Signal length unit is bit in signal definition not byte,
- * if the length is 3 bits then return 1 byte,
- * if the length is 10 bits then return 2 bytes.
- */
 static int
-cbc_get_signal_len(uint16_t id, struct cbc_signal *table, size_t size)
+cbc_index_alloc(struct cbc_index *idx, size_t num)
 {
-	struct cbc_signal *p;
-
-	p = cbc_find_signal(id, table, size);
-	return (p == NULL ? 0 : (p->len + 7)/8);
+	idx->bits = 4;
+	while ((1U << idx->bits) < num * 2)
+		idx->bits++;
+	idx->tbl = calloc(1U << idx->bits, sizeof(struct cbc_index_entry));
+	return idx->tbl ? 0 : -1;
 }
 
 /*
- * Set signal flag to inactive.
+ * Index the signal and group tables of a CBC configuration and mark the
+ * whitelisted ids, so that a signal is looked up, sized and verified with
+ * one probe.
  */
-static void
-cbc_disable_signal(uint16_t id, struct cbc_signal *table, size_t size)
+int
+cbc_index_init(struct cbc_config *cfg)
 {
-	struct cbc_signal *p;
+	struct cbc_index_entry *e;
+	int i;
+
+	if (cbc_index_alloc(&cfg->sig_idx, cfg->cbc_sig_num) ||
+			cbc_index_alloc(&cfg->grp_idx, cfg->cbc_grp_num)) {
+		cbc_index_deinit(cfg);
+		return -1;
+	}
 
-	p = cbc_find_signal(id, table, size);
-	if (p)
-		p->flag = CBC_INACTIVE;
+	for (i = 0; i < cfg->cbc_sig_num; i++)
+		cbc_index_add(&cfg->sig_idx, cfg->cbc_sig_tbl[i].id,
+				&cfg->cbc_sig_tbl[i]);
+	for (i = 0; i < cfg->cbc_grp_num; i++)
+		cbc_index_add(&cfg->grp_idx, cfg->cbc_grp_tbl[i].id,
+				&cfg->cbc_grp_tbl[i]);
+
+	for (i = 0; i < cfg->wlist_sig_num; i++) {
+		e = cbc_index_find(&cfg->sig_idx, cfg->wlist_sig_tbl[i].id);
+		if (e)
+			e->wlisted = 1;
+	}
+	for (i = 0; i < cfg->wlist_grp_num; i++) {
+		e = cbc_index_find(&cfg->grp_idx, cfg->wlist_grp_tbl[i].id);
+		if (e)
+			e->wlisted = 1;
+	}
+	return 0;
+}
+
+void
+cbc_index_deinit(struct cbc_config *cfg)
+{
+	free(cfg->sig_idx.tbl);
+	cfg->sig_idx.tbl = NULL;
+	free(cfg->grp_idx.tbl);
+	cfg->grp_idx.tbl = NULL;
 }
 
 /*
- * Set signal group flag to inactive.
+ * Look up a signal for forwarding. Signal length unit is bit in signal
+ * definition not byte, if the length is 3 bits then the length is 1 byte,
+ * if the length is 10 bits then it is 2 bytes, an unknown signal has no
+ * data. Returns 0 if the signal is whitelisted and active.
  */
-static void
-cbc_disable_signal_group(uint16_t id, struct cbc_group *table, size_t size)
+static int
+cbc_lookup_signal(struct cbc_config *cfg, uint16_t id, int *len)
 {
-	struct cbc_group *p;
+	struct cbc_index_entry *e;
+	struct cbc_signal *sig;
 
-	p = cbc_find_signal_group(id, table, size);
-	if (p)
-		p->flag = CBC_INACTIVE;
+	e = cbc_index_find(&cfg->sig_idx, id);
+	if (!e) {
+		*len = 0;
+		return -1;
+	}
+	sig = e->node;
+	*len = (sig->len + 7) / 8;
+	if (!e->wlisted || sig->flag == CBC_INACTIVE)
+		return -1;
+	return 0;
 }
 
 /*
- * Search one cbc_signal with signal id in the whitelist table.
+ * Set signal flag to inactive.
  */
-static struct cbc_signal *
-wlist_find_signal(uint16_t id, struct wlist_signal *list, size_t size)
+static void
+cbc_disable_signal(struct cbc_config *cfg, uint16_t id)
 {
-	int i;
+	struct cbc_index_entry *e;
 
-	for (i = 0; i < size; i++) {
-		if (id == list[i].id)
-			return list[i].sig;
-	}
-	return NULL;
+	e = cbc_index_find(&cfg->sig_idx, id);
+	if (e)
+		((struct cbc_signal *)e->node)->flag = CBC_INACTIVE;
 }
 
 /*
- * Search one cbc_group with group id in the whitelist table.
+ * Set signal group flag to inactive.
  */
-static struct
-cbc_group *wlist_find_group(uint16_t id, struct wlist_group *list, size_t size)
+static void
+cbc_disable_signal_group(struct cbc_config *cfg, uint16_t id)
 {
-	int i;
+	struct cbc_index_entry *e;
 
-	for (i = 0; i < size; i++) {
-		if (id == list[i].id)
-			return list[i].grp;
-	}
-	return NULL;
+	e = cbc_index_find(&cfg->grp_idx, id);
+	if (e)
+		((struct cbc_group *)e->node)->flag = CBC_INACTIVE;
 }
 
 /*
  * Whitelist verification for a signal.
  */
 static int
-wlist_verify_signal(uint16_t id, struct wlist_signal *list, size_t size)
+wlist_verify_signal(struct cbc_config *cfg, uint16_t id)
 {
-	struct cbc_signal *sig;
+	int len;
 
-	sig = wlist_find_signal(id, list, size);
-	if (!sig || sig->flag == CBC_INACTIVE)
-		return -1;
-	return 0;
+	return cbc_lookup_signal(cfg, id, &len);
 }
 
 /*
  * Whiltelist verification for a signal group.
  */
 static int
-wlist_verify_group(uint16_t id, struct wlist_group *list, size_t size)
+wlist_verify_group(struct cbc_config *cfg, uint16_t id)
 {
-	struct cbc_group *grp;
+	struct cbc_index_entry *e;
 
-	grp = wlist_find_group(id, list, size);
-	if (!grp || grp->flag == CBC_INACTIVE)
+	e = cbc_index_find(&cfg->grp_idx, id);
+	if (!e || !e->wlisted ||
+			((struct cbc_group *)e->node)->flag == CBC_INACTIVE)
 		return -1;
 	return 0;
 }
@@ -397,11 +452,9 @@ cbc_set_invalidation(struct cbc_pkt *pkt, int type)
 	for (i = 0; i < num; i++) {
 		id = payload[i * 2 + 2] | payload[i * 2 + 3] << 8;
 		if (type == CBC_INVAL_T_SIGNAL)
-			cbc_disable_signal(id, pkt->cfg->cbc_sig_tbl,
-					pkt->cfg->cbc_sig_num);
+			cbc_disable_signal(pkt->cfg, id);
 		else if (type == CBC_INVAL_T_GROUP)
-			cbc_disable_signal_group(id, pkt->cfg->cbc_grp_tbl,
-					pkt->cfg->cbc_grp_num);
+			cbc_disable_signal_group(pkt->cfg, id);
 		else
 			DPRINTF("%s", "ioc invalidation is not defined\r\n");
 	}
@@ -410,35 +463,35 @@ cbc_set_invalidation(struct cbc_pkt *pkt, int type)
 /*
  * CBC multi-signal data process.
  * Forwarding signal should be in whitelist, otherwise abandon the signal.
+ * Permitted signals are compacted in place in the same pass.
  */
 static void
 cbc_forward_signals(struct cbc_pkt *pkt)
 {
-	int i, j;
+	int i;
 	int offset = 1;
 	uint8_t *payload = pkt->req->buf + CBC_PAYLOAD_POS;
 	uint8_t num = 0;
 	uint16_t id;
 	int signal_len;
 	int valids = 1;
+	bool permitted;
 
 	for (i = 0; i < payload[0]; i++) {
 		id = payload[offset] | payload[offset + 1] << 8;
 
-		/* The length includes two bytes of signal ID occupation */
-		signal_len = cbc_get_signal_len(id, pkt->cfg->cbc_sig_tbl,
-				pkt->cfg->cbc_sig_num) + 2;
-
 		/* Whitelist verification */
-		if (wlist_verify_signal(id, pkt->cfg->wlist_sig_tbl,
-					pkt->cfg->wlist_sig_num) == 0) {
+		permitted = cbc_lookup_signal(pkt->cfg, id, &signal_len) == 0;
+
+		/* The length includes two bytes of signal ID occupation */
+		signal_len += 2;
 
+		if (permitted) {
 			num++;
-			if (valids < offset) {
-				for (j = 0; j < signal_len; j++, valids++)
-					payload[valids] = payload[offset + j];
-			} else
-				valids += signal_len;
+			if (valids < offset)
+				memmove(payload + valids, payload + offset,
+						signal_len);
+			valids += signal_len;
 		}
 		offset += signal_len;
 
@@ -720,8 +773,7 @@ cbc_process_signal(struct cbc_pkt *pkt)
 	/* Bidirectional command */
 	case CBC_SD_SINGLE_SIGNAL:
 		id = payload[0] | payload[1] << 8;
-		if (wlist_verify_signal(id, pkt->cfg->wlist_sig_tbl,
-					pkt->cfg->wlist_sig_num) == 0)
+		if (wlist_verify_signal(pkt->cfg, id) == 0)
 			cbc_send_pkt(pkt);
 		break;
 	/* Bidirectional command */
@@ -731,15 +783,13 @@ cbc_process_signal(struct cbc_pkt *pkt)
 	/* Bidirectional command */
 	case CBC_SD_GROUP_SIGNAL:
 		id = payload[0] | payload[1] << 8;
-		if (wlist_verify_group(id, pkt->cfg->wlist_grp_tbl,
-					pkt->cfg->wlist_grp_num) == 0)
+		if (wlist_verify_group(pkt->cfg, id) == 0)
 			cbc_send_pkt(pkt);
 		break;
 	/* Bidirectional command */
 	case CBC_SD_INVAL_SSIG:
 		id = payload[0] | payload[1] << 8;
-		cbc_disable_signal(id, pkt->cfg->cbc_sig_tbl,
-				pkt->cfg->cbc_sig_num);
+		cbc_disable_signal(pkt->cfg, id);
 		break;
 	/* Bidirectional command */
 	case CBC_SD_INVAL_MSIG:
@@ -748,8 +798,7 @@ cbc_process_signal(struct cbc_pkt *pkt)
 	/* Bidirectional command */
 	case CBC_SD_INVAL_SGRP:
 		id = payload[0] | payload[1] << 8;
-		cbc_disable_signal_group(id, pkt->cfg->cbc_grp_tbl,
-				pkt->cfg->cbc_grp_num);
+		cbc_disable_signal_group(pkt->cfg, id);
 		break;
 	/* Bidirectional command */
 	case CBC_SD_INVAL_MGRP:
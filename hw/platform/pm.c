@@ -40,6 +40,7 @@
 #include "mevent.h"
 #include "irq.h"
 #include "lpc.h"
+#include "handover.h"
 
 static pthread_mutex_t pm_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct mevent *power_button;
@@ -299,6 +300,48 @@ smi_cmd_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 INOUT_PORT(smi_cmd, SMI_CMD, IOPORT_F_OUT, smi_cmd_handler);
 SYSRES_IO(SMI_CMD, 1);
 
+/*
+ * The level of the SCI line lives in the hypervisor and survives the
+ * handover, only our view of it is restored.
+ */
+static int
+pm_save(void *arg, struct handover_buf *hb)
+{
+	int err;
+
+	pthread_mutex_lock(&pm_lock);
+	err = handover_put(hb, &pm1_enable, sizeof(pm1_enable));
+	err |= handover_put(hb, &pm1_status, sizeof(pm1_status));
+	err |= handover_put(hb, &pm1_control, sizeof(pm1_control));
+	err |= handover_put(hb, &sci_active, sizeof(sci_active));
+	pthread_mutex_unlock(&pm_lock);
+
+	return err ? -1 : 0;
+}
+
+static int
+pm_restore(void *arg, struct handover_buf *hb)
+{
+	struct vmctx *ctx = arg;
+	int err;
+
+	pthread_mutex_lock(&pm_lock);
+	err = handover_get(hb, &pm1_enable, sizeof(pm1_enable));
+	err |= handover_get(hb, &pm1_status, sizeof(pm1_status));
+	err |= handover_get(hb, &pm1_control, sizeof(pm1_control));
+	err |= handover_get(hb, &sci_active, sizeof(sci_active));
+
+	/* ACPI was enabled, so SIGTERM is the power button again */
+	if (!err && (pm1_control & PM1_SCI_EN) && power_button == NULL) {
+		power_button = mevent_add(SIGTERM, EVF_SIGNAL,
+		    power_button_handler, ctx);
+		old_power_handler = signal(SIGTERM, SIG_IGN);
+	}
+	pthread_mutex_unlock(&pm_lock);
+
+	return err ? -1 : 0;
+}
+
 void
 sci_init(struct vmctx *ctx)
 {
@@ -307,4 +350,12 @@ sci_init(struct vmctx *ctx)
 	 * in the PIRQ router.
 	 */
 	pci_irq_use(SCI_INT);
+
+	handover_register("pm", pm_save, pm_restore, ctx);
+}
+
+void
+sci_deinit(void)
+{
+	handover_unregister("pm");
 }
@@ -42,6 +42,7 @@
 #include "inout.h"
 #include "mc146818rtc.h"
 #include "rtc.h"
+#include "handover.h"
 
 /* #define DEBUG_RTC */
 #ifdef DEBUG_RTC
@@ -76,6 +77,8 @@ struct vrtc {
 	pthread_mutex_t	mtx;
 	timer_t		periodic_timer_id;  /*periodic timer id*/
 	timer_t		update_timer_id;    /*update timer id*/
+	time_t		period;             /* periodic timer armed, ns */
+	time_t		update_deadline;    /* update timer armed, secs */
 	u_int		addr;               /* RTC register to read or write */
 	time_t		base_uptime;
 	time_t		base_rtctime;
@@ -322,7 +325,7 @@ rtcset(struct rtcdev *rtc, int val)
 }
 
 static time_t
-vrtc_freq(struct vrtc *vrtc)
+vrtc_period(struct vrtc *vrtc)
 {
 	int ratesel;
 
@@ -346,20 +349,13 @@ vrtc_freq(struct vrtc *vrtc)
 	};
 
 	/*
-	 * If both periodic and alarm interrupts are enabled then use the
-	 * periodic frequency to drive the callout. The minimum periodic
-	 * frequency (2 Hz) is higher than the alarm frequency (1 Hz) so
-	 * piggyback the alarm on top of it. The same argument applies to
-	 * the update interrupt.
+	 * The periodic timer only drives the periodic interrupt, update
+	 * and alarm interrupts have a timer of their own.
 	 */
 	if (pintr_enabled(vrtc) && divider_enabled(vrtc->rtcdev.reg_a)) {
 		ratesel = vrtc->rtcdev.reg_a & 0xf;
 		return pf[ratesel];
-	} else if (aintr_enabled(vrtc) && update_enabled(vrtc))
-		return SBT_1S;
-	else if (uintr_enabled(vrtc) && update_enabled(vrtc))
-		return SBT_1S;
-	else
+	} else
 		return 0;
 }
 
@@ -383,13 +379,43 @@ rtcget(struct rtcdev *rtc, int val, int *retval)
 	return 0;
 }
 
+static uint8_t
+rtchour(struct rtcdev *rtc, int hour)
+{
+	uint8_t val;
+
+	if (rtc->reg_b & RTCSB_24HR)
+		return rtcset(rtc, hour);
+
+	/*
+	 * Convert to the 12-hour format.
+	 */
+	switch (hour) {
+	case 0:			/* 12 AM */
+	case 12:		/* 12 PM */
+		val = rtcset(rtc, 12);
+		break;
+	default:
+		/*
+		 * The remaining 'hour' values are interpreted as:
+		 * [1  - 11] ->  1 - 11 AM
+		 * [13 - 23] ->  1 - 11 PM
+		 */
+		val = rtcset(rtc, hour % 12);
+		break;
+	}
+
+	if (hour >= 12)
+		val |= 0x80;	    /* set MSB to indicate PM */
+	return val;
+}
+
 static void
 secs_to_rtc(time_t rtctime, struct vrtc *vrtc, int force_update)
 {
 	struct clktime ct;
 	struct timespec ts;
 	struct rtcdev *rtc;
-	int hour;
 
 	if (rtctime < 0) {
 		assert(rtctime == VRTC_BROKEN_TIME);
@@ -419,34 +445,7 @@ secs_to_rtc(time_t rtctime, struct vrtc *vrtc, int force_update)
 	rtc = &vrtc->rtcdev;
 	rtc->sec = rtcset(rtc, ct.sec);
 	rtc->min = rtcset(rtc, ct.min);
-
-	if (rtc->reg_b & RTCSB_24HR) {
-		hour = ct.hour;
-	} else {
-		/*
-		 * Convert to the 12-hour format.
-		 */
-		switch (ct.hour) {
-		case 0:			/* 12 AM */
-		case 12:		/* 12 PM */
-			hour = 12;
-			break;
-		default:
-			/*
-			 * The remaining 'ct.hour' values are interpreted as:
-			 * [1  - 11] ->  1 - 11 AM
-			 * [13 - 23] ->  1 - 11 PM
-			 */
-			hour = ct.hour % 12;
-			break;
-		}
-	}
-
-	rtc->hour = rtcset(rtc, hour);
-
-	if ((rtc->reg_b & RTCSB_24HR) == 0 && ct.hour >= 12)
-		rtc->hour |= 0x80;	    /* set MSB to indicate PM */
-
+	rtc->hour = rtchour(rtc, ct.hour);
 	rtc->day_of_week = rtcset(rtc, ct.dow + 1);
 	rtc->day_of_month = rtcset(rtc, ct.day);
 	rtc->month = rtcset(rtc, ct.mon);
@@ -566,28 +565,103 @@ fail:
 	return VRTC_BROKEN_TIME;
 }
 
+static inline bool
+alarm_match(uint8_t alarm, uint8_t val)
+{
+	/* the two MSBs set make an alarm field match any value */
+	return alarm >= 0xC0 || alarm == val;
+}
+
+/*
+ * Decode an alarm field to the value it matches: -1 for any value, the
+ * value in [0, limit), or -2 if no value of the field ever matches.
+ */
+static int
+alarm_value(struct rtcdev *rtc, uint8_t alarm, int limit, bool hour)
+{
+	int v;
+
+	if (alarm >= 0xC0)
+		return -1;
+
+	for (v = 0; v < limit; v++)
+		if (alarm == (hour ? rtchour(rtc, v) : rtcset(rtc, v)))
+			return v;
+	return -2;
+}
+
+/* first value from 'from' on that matches 'want', or -1 if none */
+static inline int
+alarm_next(int want, int from, int limit)
+{
+	if (want == -1)
+		return from < limit ? from : -1;
+	return want >= from ? want : -1;
+}
+
+/*
+ * Return the first second after 'rtctime' at which the alarm fields
+ * match the date/time fields, or VRTC_BROKEN_TIME if they never do.
+ * The fields are compared in the current register format, like the
+ * guest programmed them.
+ */
+static time_t
+vrtc_next_alarm(struct vrtc *vrtc, time_t rtctime)
+{
+	struct rtcdev *rtc = &vrtc->rtcdev;
+	int ah, am, as, h0, m0, s0, h, m, s;
+	time_t day, tod;
+
+	if (rtctime < 0)
+		return VRTC_BROKEN_TIME;
+
+	ah = alarm_value(rtc, rtc->alarm_hour, 24, true);
+	am = alarm_value(rtc, rtc->alarm_min, 60, false);
+	as = alarm_value(rtc, rtc->alarm_sec, 60, false);
+	if (ah == -2 || am == -2 || as == -2)
+		return VRTC_BROKEN_TIME;
+
+	day = rtctime - rtctime % SECDAY;
+	tod = rtctime % SECDAY + 1;
+	if (tod == SECDAY) {
+		day += SECDAY;
+		tod = 0;
+	}
+
+	/* later today, else the first match of tomorrow */
+	h0 = tod / 3600;
+	m0 = tod / 60 % 60;
+	s0 = tod % 60;
+	h = alarm_next(ah, h0, 24);
+	for (; h >= 0; h = alarm_next(ah, h + 1, 24)) {
+		m = alarm_next(am, h == h0 ? m0 : 0, 60);
+		for (; m >= 0; m = alarm_next(am, m + 1, 60)) {
+			s = alarm_next(as, h == h0 && m == m0 ? s0 : 0, 60);
+			if (s >= 0)
+				return day + h * 3600 + m * 60 + s;
+		}
+	}
+
+	h = alarm_next(ah, 0, 24);
+	m = alarm_next(am, 0, 60);
+	s = alarm_next(as, 0, 60);
+	return day + SECDAY + h * 3600 + m * 60 + s;
+}
+
 static timer_t
-vrtc_create_timer(struct vrtc *vrtc, time_t sec, time_t nsec, void (*cb)())
+vrtc_create_timer(struct vrtc *vrtc, void (*cb)())
 {
 	timer_t timerid;
 	struct sigevent sigevt;
-	struct itimerspec ts;
 
 	memset(&sigevt, 0, sizeof(struct sigevent));
-	memset(&ts, 0, sizeof(struct itimerspec));
 
 	sigevt.sigev_value.sival_ptr = vrtc;
 	sigevt.sigev_notify = SIGEV_THREAD;
 	sigevt.sigev_notify_function = cb;
 
+	/* created disarmed, vrtc_arm_timers() starts it when needed */
 	assert(timer_create(CLOCK_REALTIME, &sigevt, &timerid) == 0);
-	/*setting the interval time*/
-	ts.it_interval.tv_sec = sec;
-	ts.it_interval.tv_nsec = nsec;
-	/*set the delay time it will be started when timer_setting*/
-	ts.it_value.tv_sec = sec;
-	ts.it_value.tv_nsec = nsec;
-	assert(timer_settime(timerid, 0, &ts, NULL) == 0);
 
 	return timerid;
 }
@@ -602,14 +676,9 @@ static int
 vrtc_time_update(struct vrtc *vrtc, time_t newtime, time_t newbase)
 {
 	struct rtcdev *rtc;
-	time_t oldtime;
-	uint8_t alarm_sec, alarm_min, alarm_hour;
+	time_t oldtime, alarm;
 
 	rtc = &vrtc->rtcdev;
-	alarm_sec = rtc->alarm_sec;
-	alarm_min = rtc->alarm_min;
-	alarm_hour = rtc->alarm_hour;
-
 	oldtime = vrtc->base_rtctime;
 	RTC_DEBUG("Updating RTC secs from %#lx to %#lx\n",
 			oldtime, newtime);
@@ -639,34 +708,18 @@ vrtc_time_update(struct vrtc *vrtc, time_t newtime, time_t newbase)
 		return -1;
 	}
 
-	do {
-		/*
-		 * If the alarm interrupt is enabled and 'oldtime' is valid
-		 * then visit all the seconds between 'oldtime' and 'newtime'
-		 * to check for the alarm condition.
-		 *
-		 * Otherwise move the RTC time forward directly to 'newtime'.
-		 */
-		if (aintr_enabled(vrtc) && oldtime != VRTC_BROKEN_TIME)
-			vrtc->base_rtctime++;
-		else
-			vrtc->base_rtctime = newtime;
-
-		if (aintr_enabled(vrtc)) {
-			/*
-			 * Update the RTC date/time fields before checking
-			 * if the alarm conditions are satisfied.
-			 */
-			secs_to_rtc(vrtc->base_rtctime, vrtc, 0);
-
-			if ((alarm_sec >= 0xC0 || alarm_sec == rtc->sec) &&
-				(alarm_min >= 0xC0 || alarm_min == rtc->min) &&
-					(alarm_hour >= 0xC0 ||
-					 alarm_hour == rtc->hour)) {
-				vrtc_set_reg_c(vrtc, rtc->reg_c | RTCIR_ALARM);
-			}
-		}
-	} while (vrtc->base_rtctime != newtime);
+	/*
+	 * If the alarm interrupt is enabled then check whether an alarm
+	 * second passed between 'oldtime' and 'newtime', or whether
+	 * 'newtime' matches when 'oldtime' is not valid.
+	 */
+	if (aintr_enabled(vrtc)) {
+		alarm = vrtc_next_alarm(vrtc, oldtime != VRTC_BROKEN_TIME ?
+					oldtime : newtime - 1);
+		if (alarm != VRTC_BROKEN_TIME && alarm <= newtime)
+			vrtc_set_reg_c(vrtc, rtc->reg_c | RTCIR_ALARM);
+	}
+	vrtc->base_rtctime = newtime;
 
 	if (uintr_enabled(vrtc))
 		vrtc_set_reg_c(vrtc, rtc->reg_c | RTCIR_UPDATE);
@@ -674,6 +727,51 @@ vrtc_time_update(struct vrtc *vrtc, time_t newtime, time_t newbase)
 	return 0;
 }
 
+/*
+ * The date/time registers are computed from the base time when the
+ * guest reads them, so the timers only run for the interrupts the guest
+ * enabled: the periodic timer at the rate of reg_a while PIE is set,
+ * and the update timer for the next second while UIE is set or for the
+ * next alarm second while only AIE is set. A guest that masks all of
+ * them costs no host wakeups.
+ */
+static void
+vrtc_arm_timers(struct vrtc *vrtc)
+{
+	struct itimerspec ts;
+	time_t period, deadline, curtime, basetime, alarm;
+
+	period = vrtc_period(vrtc);
+	if (period != vrtc->period) {
+		memset(&ts, 0, sizeof(ts));
+		ts.it_value.tv_nsec = period;
+		ts.it_interval.tv_nsec = period;
+		assert(timer_settime(vrtc->periodic_timer_id, 0, &ts,
+				     NULL) == 0);
+		vrtc->period = period;
+	}
+
+	deadline = 0;
+	if (update_enabled(vrtc) &&
+	    (uintr_enabled(vrtc) || aintr_enabled(vrtc))) {
+		curtime = vrtc_curtime(vrtc, &basetime);
+		if (uintr_enabled(vrtc)) {
+			deadline = basetime + 1;
+		} else {
+			alarm = vrtc_next_alarm(vrtc, curtime);
+			if (alarm != VRTC_BROKEN_TIME)
+				deadline = basetime + (alarm - curtime);
+		}
+	}
+	if (deadline != vrtc->update_deadline) {
+		memset(&ts, 0, sizeof(ts));
+		ts.it_value.tv_sec = deadline;
+		assert(timer_settime(vrtc->update_timer_id, TIMER_ABSTIME,
+				     &ts, NULL) == 0);
+		vrtc->update_deadline = deadline;
+	}
+}
+
 static void
 vrtc_periodic_timer(void *arg)
 {
@@ -700,6 +798,9 @@ vrtc_update_timer(void *arg)
 		vrtc_time_update(vrtc, curtime, basetime);
 	}
 
+	/* the timer is one-shot, arm it for the next deadline */
+	vrtc->update_deadline = 0;
+	vrtc_arm_timers(vrtc);
 	pthread_mutex_unlock(&vrtc->mtx);
 }
 
@@ -748,14 +849,13 @@ static int
 vrtc_set_reg_b(struct vrtc *vrtc, uint8_t newval)
 {
 	struct rtcdev *rtc;
-	time_t oldfreq, newfreq, basetime;
+	time_t basetime;
 	time_t curtime, rtctime;
 	int error;
 	uint8_t oldval, changed;
 
 	rtc = &vrtc->rtcdev;
 	oldval = rtc->reg_b;
-	oldfreq = vrtc_freq(vrtc);
 
 	rtc->reg_b = newval;
 	changed = oldval ^ newval;
@@ -800,27 +900,6 @@ vrtc_set_reg_b(struct vrtc *vrtc, uint8_t newval)
 	if (changed & RTCSB_ALL_INTRS)
 		vrtc_set_reg_c(vrtc, vrtc->rtcdev.reg_c);
 
-	/*
-	 * Change the callout frequency if it has changed.
-	 */
-	newfreq = vrtc_freq(vrtc);
-
-	if (pintr_enabled(vrtc) && newfreq != oldfreq) {
-		/*stop the previous timer*/
-		if (vrtc->periodic_timer_id > 0) {
-			assert(timer_delete(vrtc->periodic_timer_id) == 0);
-			vrtc->periodic_timer_id = 0;
-		}
-
-		/*create the new periodic timer*/
-		vrtc->periodic_timer_id =
-		    vrtc_create_timer(vrtc, 0, newfreq, vrtc_periodic_timer);
-		assert(vrtc->periodic_timer_id > 0);
-
-	} else {
-		/*Nothing to do*/
-	}
-
 	/*
 	 * The side effect of bits that control the RTC date/time format
 	 * is handled lazily when those fields are actually read.
@@ -831,12 +910,10 @@ vrtc_set_reg_b(struct vrtc *vrtc, uint8_t newval)
 static void
 vrtc_set_reg_a(struct vrtc *vrtc, uint8_t newval)
 {
-	time_t oldfreq, newfreq;
 	uint8_t oldval, changed;
 
 	newval &= ~RTCSA_TUP;
 	oldval = vrtc->rtcdev.reg_a;
-	oldfreq = vrtc_freq(vrtc);
 
 	if (divider_enabled(oldval) && !divider_enabled(newval)) {
 		RTC_DEBUG("RTC divider held in reset at %#lx/%#lx",
@@ -861,26 +938,6 @@ vrtc_set_reg_a(struct vrtc *vrtc, uint8_t newval)
 		RTC_DEBUG("RTC reg_a changed from %#x to %#x",
 				oldval, newval);
 	}
-
-	/*
-	 * Side effect of changes to rate select and divider enable bits.
-	 */
-	newfreq = vrtc_freq(vrtc);
-
-	if (pintr_enabled(vrtc) && newfreq != oldfreq) {
-		/*stop the previous timer*/
-		if (vrtc->periodic_timer_id > 0) {
-			assert(timer_delete(vrtc->periodic_timer_id) == 0);
-			vrtc->periodic_timer_id = 0;
-		}
-
-		/*create the new periodic timer*/
-		vrtc->periodic_timer_id =
-		     vrtc_create_timer(vrtc, 0, newfreq, vrtc_periodic_timer);
-		assert(vrtc->periodic_timer_id > 0);
-	} else {
-		/*Nothing to do*/
-	}
 }
 
 int
@@ -1046,6 +1103,12 @@ vrtc_data_handler(struct vmctx *ctx, int vcpu, int in, int port,
 			if (curtime == VRTC_BROKEN_TIME && rtc_flag_broken_time)
 				error = -1;
 		}
+
+		/*
+		 * Side effect of changes to the interrupt enables, rate
+		 * select, alarm and date/time fields.
+		 */
+		vrtc_arm_timers(vrtc);
 	}
 
 	pthread_mutex_unlock(&vrtc->mtx);
@@ -1060,6 +1123,7 @@ vrtc_set_time(struct vrtc *vrtc, time_t secs)
 
 	pthread_mutex_lock(&vrtc->mtx);
 	error = vrtc_time_update(vrtc, secs, time(NULL));
+	vrtc_arm_timers(vrtc);
 	pthread_mutex_unlock(&vrtc->mtx);
 
 	if (error)
@@ -1092,8 +1156,50 @@ vrtc_reset(struct vrtc *vrtc)
 	rtc = &vrtc->rtcdev;
 	vrtc_set_reg_b(vrtc, rtc->reg_b & ~(RTCSB_ALL_INTRS | RTCSB_SQWE));
 	vrtc_set_reg_c(vrtc, 0);
+	vrtc_arm_timers(vrtc);
+
+	pthread_mutex_unlock(&vrtc->mtx);
+}
+
+/*
+ * The time base is the host's wall clock, which the new DM shares, so
+ * the registers and the base times carry over as they are. The timers
+ * are armed again from them.
+ */
+static int
+vrtc_save(void *arg, struct handover_buf *hb)
+{
+	struct vrtc *vrtc = arg;
+	int err;
 
+	pthread_mutex_lock(&vrtc->mtx);
+	err = handover_put(hb, &vrtc->addr, sizeof(vrtc->addr));
+	err |= handover_put(hb, &vrtc->base_uptime, sizeof(vrtc->base_uptime));
+	err |= handover_put(hb, &vrtc->base_rtctime,
+			sizeof(vrtc->base_rtctime));
+	err |= handover_put(hb, &vrtc->rtcdev, sizeof(vrtc->rtcdev));
 	pthread_mutex_unlock(&vrtc->mtx);
+
+	return err ? -1 : 0;
+}
+
+static int
+vrtc_restore(void *arg, struct handover_buf *hb)
+{
+	struct vrtc *vrtc = arg;
+	int err;
+
+	pthread_mutex_lock(&vrtc->mtx);
+	err = handover_get(hb, &vrtc->addr, sizeof(vrtc->addr));
+	err |= handover_get(hb, &vrtc->base_uptime, sizeof(vrtc->base_uptime));
+	err |= handover_get(hb, &vrtc->base_rtctime,
+			sizeof(vrtc->base_rtctime));
+	err |= handover_get(hb, &vrtc->rtcdev, sizeof(vrtc->rtcdev));
+	if (!err)
+		vrtc_arm_timers(vrtc);
+	pthread_mutex_unlock(&vrtc->mtx);
+
+	return err ? -1 : 0;
 }
 
 struct vrtc *
@@ -1111,10 +1217,10 @@ vrtc_init(struct vmctx *ctx, int local_time)
 
 	pthread_mutex_init(&vrtc->mtx, NULL);
 
-	/*create update interrupt timer(1s)*/
+	vrtc->periodic_timer_id =
+		vrtc_create_timer(vrtc, vrtc_periodic_timer);
 	vrtc->update_timer_id =
-		vrtc_create_timer(vrtc, 1, 0, vrtc_update_timer);
-	assert(vrtc->update_timer_id > 0);
+		vrtc_create_timer(vrtc, vrtc_update_timer);
 
 	memset(&rtc_addr, 0, sizeof(struct inout_port));
 	memset(&rtc_data, 0, sizeof(struct inout_port));
@@ -1158,6 +1264,8 @@ vrtc_init(struct vmctx *ctx, int local_time)
 	secs_to_rtc(curtime, vrtc, 0);
 	pthread_mutex_unlock(&vrtc->mtx);
 
+	handover_register("rtc", vrtc_save, vrtc_restore, vrtc);
+
 	return vrtc;
 }
 
@@ -1167,6 +1275,8 @@ vrtc_deinit(struct vmctx *ctx)
 	struct vrtc *vrtc = ctx->vrtc;
 	struct inout_port iop;
 
+	handover_unregister("rtc");
+
 	memset(&iop, 0, sizeof(struct inout_port));
 	iop.name = "rtc";
 	iop.port = IO_RTC;
@@ -1179,6 +1289,7 @@ vrtc_deinit(struct vmctx *ctx)
 	iop.size = 1;
 	unregister_inout(&iop);
 
+	vrtc_delete_timer(vrtc->periodic_timer_id);
 	vrtc_delete_timer(vrtc->update_timer_id);
 	free(vrtc);
 	ctx->vrtc = NULL;
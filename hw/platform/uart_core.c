@@ -39,12 +39,14 @@
 #include <string.h>
 #include <pthread.h>
 #include <sysexits.h>
+#include <sys/timerfd.h>
 
 #include "types.h"
 #include "mevent.h"
 #include "uart_core.h"
 #include "ns16550.h"
 #include "dm.h"
+#include "handover.h"
 
 #define	COM1_BASE	0x3F8
 #define COM1_IRQ	4
@@ -67,6 +69,15 @@
 
 #define	FIFOSZ	256
 
+/*
+ * Guest output leaves the tx fifo for txbuf, which is written to the
+ * backend in one go once TXBUF_FLUSH bytes are in, or TX_FLUSH_MS
+ * after the first byte, rather than one write() per byte.
+ */
+#define	TXBUFSZ		4096
+#define	TXBUF_FLUSH	1024
+#define	TX_FLUSH_MS	5
+
 static struct termios tio_stdio_orig;
 
 static struct {
@@ -111,8 +122,17 @@ struct uart_vdev {
 	struct fifo rxfifo;
 	struct mevent *mev;
 
+	struct fifo txfifo;
+	uint8_t	txbuf[TXBUFSZ];	/* transmitted, not written to tty yet */
+	int	txlen;
+	int	txtimer_fd;
+	bool	txtimer_armed;
+	struct mevent *txmev;
+
 	struct ttyfd tty;
 	bool	thre_int_pending;	/* THRE interrupt pending */
+	bool	intr_asserted;		/* intr pin state we set last */
+	uint8_t	intr_reason;		/* reason it was set for */
 
 	void	*arg;
 	uart_intr_func_t intr_assert;
@@ -120,6 +140,7 @@ struct uart_vdev {
 };
 
 static void uart_drain(int fd, enum ev_type ev, void *arg);
+static void uart_tx_flush(int fd, enum ev_type ev, void *arg);
 
 static void
 ttyclose(void)
@@ -144,24 +165,15 @@ ttyopen(struct ttyfd *tf)
 }
 
 static int
-ttyread(struct ttyfd *tf)
+ttyread(struct ttyfd *tf, uint8_t *buf, int len)
 {
-	unsigned char rb;
-
-	if (read(tf->fd, &rb, 1) > 0)
-		return rb;
-
-	return -1;
+	return read(tf->fd, buf, len);
 }
 
 static int
-ttywrite(struct ttyfd *tf, unsigned char wb)
+ttywrite(struct ttyfd *tf, const uint8_t *buf, int len)
 {
-
-	if (write(tf->fd, &wb, 1) > 0)
-		return 1;
-
-	return -1;
+	return write(tf->fd, buf, len);
 }
 
 static void
@@ -263,6 +275,98 @@ rxfifo_numchars(struct uart_vdev *uart)
 	return fifo->num;
 }
 
+static void
+uart_txtimer_arm(struct uart_vdev *uart)
+{
+	struct itimerspec its;
+
+	if (uart->txtimer_armed || uart->txtimer_fd < 0)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = TX_FLUSH_MS * 1000000;
+	if (timerfd_settime(uart->txtimer_fd, 0, &its, NULL) == 0)
+		uart->txtimer_armed = true;
+}
+
+/*
+ * Write out what txbuf holds, as much as the backend takes now. The
+ * rest stays for the next flush.
+ */
+static void
+uart_txbuf_flush(struct uart_vdev *uart)
+{
+	int n;
+
+	if (uart->txlen == 0 || !uart->tty.opened)
+		return;
+
+	n = ttywrite(&uart->tty, uart->txbuf, uart->txlen);
+	if (n <= 0)
+		return;
+
+	uart->txlen -= n;
+	memmove(uart->txbuf, uart->txbuf + n, uart->txlen);
+}
+
+static void
+txfifo_reset(struct uart_vdev *uart, int size)
+{
+	struct fifo *fifo = &uart->txfifo;
+
+	bzero(fifo, sizeof(struct fifo));
+	fifo->size = size;
+}
+
+static int
+txfifo_putchar(struct uart_vdev *uart, uint8_t ch)
+{
+	struct fifo *fifo = &uart->txfifo;
+
+	if (fifo->num == fifo->size)
+		return -1;
+
+	fifo->buf[fifo->windex] = ch;
+	fifo->windex = (fifo->windex + 1) % fifo->size;
+	fifo->num++;
+	return 0;
+}
+
+/*
+ * Move the tx fifo out to txbuf, as if the transmitter had sent it all,
+ * and raise THRE for the now empty fifo. While the backend does not take
+ * txbuf, what does not fit stays in the fifo and THRE is held back, so
+ * the guest waits rather than losing output. Without a backend, output
+ * is thrown away.
+ */
+static void
+txfifo_transmit(struct uart_vdev *uart)
+{
+	struct fifo *fifo = &uart->txfifo;
+
+	if (fifo->num == 0)
+		return;
+
+	while (fifo->num > 0) {
+		if (uart->tty.opened) {
+			if (uart->txlen == TXBUFSZ)
+				uart_txbuf_flush(uart);
+			if (uart->txlen == TXBUFSZ)
+				break;
+			uart->txbuf[uart->txlen++] = fifo->buf[fifo->rindex];
+		}
+		fifo->rindex = (fifo->rindex + 1) % fifo->size;
+		fifo->num--;
+	}
+	if (fifo->num == 0)
+		uart->thre_int_pending = true;
+
+	if (uart->txlen >= TXBUF_FLUSH || uart->txtimer_fd < 0)
+		uart_txbuf_flush(uart);
+	if (uart->txlen > 0 || fifo->num > 0)
+		uart_txtimer_arm(uart);
+}
+
 static void
 uart_opentty(struct uart_vdev *uart)
 {
@@ -272,11 +376,36 @@ uart_opentty(struct uart_vdev *uart)
 			uart_drain, uart);
 		assert(uart->mev != NULL);
 	}
+
+	/* without the timer, output is written once the fifo is sent */
+	uart->txtimer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (uart->txtimer_fd >= 0) {
+		uart->txmev = mevent_add(uart->txtimer_fd, EVF_READ,
+					 uart_tx_flush, uart);
+		if (uart->txmev == NULL) {
+			close(uart->txtimer_fd);
+			uart->txtimer_fd = -1;
+		}
+	}
 }
 
 static void
 uart_closetty(struct uart_vdev *uart)
 {
+	pthread_mutex_lock(&uart->mtx);
+	txfifo_transmit(uart);
+	uart_txbuf_flush(uart);
+	uart->txlen = 0;
+	pthread_mutex_unlock(&uart->mtx);
+
+	if (uart->txmev) {
+		mevent_delete_close(uart->txmev);
+		uart->txmev = NULL;
+		uart->txtimer_fd = -1;
+		uart->txtimer_armed = false;
+	}
+
 	if (uart->tty.fd != STDIN_FILENO)
 		mevent_delete_close(uart->mev);
 	else
@@ -352,6 +481,7 @@ uart_reset(struct uart_vdev *uart)
 	uart->msr = modem_status(uart->mcr);
 
 	rxfifo_reset(uart, 1);	/* no fifo until enabled by software */
+	txfifo_reset(uart, 1);
 }
 
 /*
@@ -365,17 +495,27 @@ uart_toggle_intr(struct uart_vdev *uart)
 
 	intr_reason = uart_intr_reason(uart);
 
-	if (intr_reason == IIR_NOPEND)
-		(*uart->intr_deassert)(uart->arg);
-	else
+	/*
+	 * Only tell the pin about changes, the LPC uart pulses its irq
+	 * on each assert and that is a hypercall per guest access.
+	 */
+	if (intr_reason == IIR_NOPEND) {
+		if (uart->intr_asserted)
+			(*uart->intr_deassert)(uart->arg);
+		uart->intr_asserted = false;
+	} else if (!uart->intr_asserted || intr_reason != uart->intr_reason) {
 		(*uart->intr_assert)(uart->arg);
+		uart->intr_asserted = true;
+	}
+	uart->intr_reason = intr_reason;
 }
 
 static void
 uart_drain(int fd, enum ev_type ev, void *arg)
 {
 	struct uart_vdev *uart;
-	int ch;
+	uint8_t buf[FIFOSZ];
+	int i, n, room;
 
 	uart = arg;
 
@@ -390,10 +530,17 @@ uart_drain(int fd, enum ev_type ev, void *arg)
 	pthread_mutex_lock(&uart->mtx);
 
 	if ((uart->mcr & MCR_LOOPBACK) != 0) {
-		(void) ttyread(&uart->tty);
+		(void) ttyread(&uart->tty, buf, 1);
 	} else {
-		while ((ch = ttyread(&uart->tty)) != -1)
-			rxfifo_putchar(uart, ch);
+		/* take as much as the fifo has room for in each read */
+		do {
+			room = uart->rxfifo.size - rxfifo_numchars(uart);
+			if (room == 0)
+				break;
+			n = ttyread(&uart->tty, buf, room);
+			for (i = 0; i < n; i++)
+				rxfifo_putchar(uart, buf[i]);
+		} while (n == room);
 
 		uart_toggle_intr(uart);
 	}
@@ -401,6 +548,27 @@ uart_drain(int fd, enum ev_type ev, void *arg)
 	pthread_mutex_unlock(&uart->mtx);
 }
 
+/* flush timer: send what the guest left in the fifo, write out txbuf */
+static void
+uart_tx_flush(int fd, enum ev_type ev, void *arg)
+{
+	struct uart_vdev *uart = arg;
+	uint64_t expired;
+
+	/* nothing to read if the timer was re-armed meanwhile */
+	if (read(fd, &expired, sizeof(expired)) != sizeof(expired))
+		return;
+
+	pthread_mutex_lock(&uart->mtx);
+	uart->txtimer_armed = false;
+	txfifo_transmit(uart);
+	uart_txbuf_flush(uart);
+	if (uart->txlen > 0 || uart->txfifo.num > 0)
+		uart_txtimer_arm(uart);
+	uart_toggle_intr(uart);
+	pthread_mutex_unlock(&uart->mtx);
+}
+
 void
 uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 {
@@ -429,10 +597,23 @@ uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 		if (uart->mcr & MCR_LOOPBACK) {
 			if (rxfifo_putchar(uart, value) != 0)
 				uart->lsr |= LSR_OE;
-		} else if (uart->tty.opened) {
-			ttywrite(&uart->tty, value);
-		} /* else drop on floor */
-		uart->thre_int_pending = true;
+			uart->thre_int_pending = true;
+			break;
+		}
+
+		/*
+		 * A full fifo is sent right away, a partial one when the
+		 * guest looks at LSR or IIR, or by the flush timer.
+		 */
+		if (txfifo_putchar(uart, value) != 0) {
+			txfifo_transmit(uart);
+			txfifo_putchar(uart, value);
+		}
+		if (uart->txfifo.num == uart->txfifo.size ||
+		    uart->txtimer_fd < 0)
+			txfifo_transmit(uart);
+		else
+			uart_txtimer_arm(uart);
 		break;
 	case REG_IER:
 		/*
@@ -449,6 +630,8 @@ uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 		if ((uart->fcr & FCR_ENABLE) ^ (value & FCR_ENABLE)) {
 			fifosz = (value & FCR_ENABLE) ? FIFOSZ : 1;
 			rxfifo_reset(uart, fifosz);
+			txfifo_transmit(uart);
+			txfifo_reset(uart, fifosz);
 		}
 
 		/*
@@ -460,6 +643,10 @@ uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 		} else {
 			if ((value & FCR_RCV_RST) != 0)
 				rxfifo_reset(uart, FIFOSZ);
+			if ((value & FCR_XMT_RST) != 0) {
+				txfifo_reset(uart, FIFOSZ);
+				uart->thre_int_pending = true;
+			}
 
 			uart->fcr = value &
 				(FCR_ENABLE | FCR_DMA | FCR_RX_MASK);
@@ -549,6 +736,9 @@ uart_read(struct uart_vdev *uart, int offset)
 	case REG_IIR:
 		iir = (uart->fcr & FCR_ENABLE) ? IIR_FIFO_MASK : 0;
 
+		/* the guest is waiting for THRE maybe, send the fifo */
+		txfifo_transmit(uart);
+
 		intr_reason = uart_intr_reason(uart);
 
 		/*
@@ -568,8 +758,12 @@ uart_read(struct uart_vdev *uart, int offset)
 		reg = uart->mcr;
 		break;
 	case REG_LSR:
-		/* Transmitter is always ready for more data */
-		uart->lsr |= LSR_TEMT | LSR_THRE;
+		/* Transmitter sends all at once when polled */
+		txfifo_transmit(uart);
+		if (uart->txfifo.num == 0)
+			uart->lsr |= LSR_TEMT | LSR_THRE;
+		else
+			uart->lsr &= ~(LSR_TEMT | LSR_THRE);
 
 		/* Check for new receive data */
 		if (rxfifo_numchars(uart) > 0)
@@ -639,6 +833,7 @@ uart_init(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 
 	pthread_mutex_init(&uart->mtx, NULL);
 
+	uart->txtimer_fd = -1;
 	uart_reset(uart);
 
 	return uart;
@@ -720,3 +915,58 @@ uart_release_backend(struct uart_vdev *uart, const char *opts)
 	uart->tty.fd = 0;
 	uart->tty.opened = false;
 }
+
+/* Guest visible register file and pending rx data, for live handover */
+int
+uart_save(struct uart_vdev *uart, struct handover_buf *hb)
+{
+	int err;
+
+	pthread_mutex_lock(&uart->mtx);
+	err = handover_put(hb, &uart->data, sizeof(uart->data));
+	err |= handover_put(hb, &uart->ier, sizeof(uart->ier));
+	err |= handover_put(hb, &uart->lcr, sizeof(uart->lcr));
+	err |= handover_put(hb, &uart->mcr, sizeof(uart->mcr));
+	err |= handover_put(hb, &uart->lsr, sizeof(uart->lsr));
+	err |= handover_put(hb, &uart->msr, sizeof(uart->msr));
+	err |= handover_put(hb, &uart->fcr, sizeof(uart->fcr));
+	err |= handover_put(hb, &uart->scr, sizeof(uart->scr));
+	err |= handover_put(hb, &uart->dll, sizeof(uart->dll));
+	err |= handover_put(hb, &uart->dlh, sizeof(uart->dlh));
+	err |= handover_put(hb, &uart->rxfifo, sizeof(uart->rxfifo));
+	err |= handover_put(hb, &uart->thre_int_pending,
+			sizeof(uart->thre_int_pending));
+	err |= handover_put(hb, &uart->txfifo, sizeof(uart->txfifo));
+	/* the new acrn-dm starts with the output written out */
+	uart_txbuf_flush(uart);
+	pthread_mutex_unlock(&uart->mtx);
+
+	return err ? -1 : 0;
+}
+
+int
+uart_restore(struct uart_vdev *uart, struct handover_buf *hb)
+{
+	int err;
+
+	pthread_mutex_lock(&uart->mtx);
+	err = handover_get(hb, &uart->data, sizeof(uart->data));
+	err |= handover_get(hb, &uart->ier, sizeof(uart->ier));
+	err |= handover_get(hb, &uart->lcr, sizeof(uart->lcr));
+	err |= handover_get(hb, &uart->mcr, sizeof(uart->mcr));
+	err |= handover_get(hb, &uart->lsr, sizeof(uart->lsr));
+	err |= handover_get(hb, &uart->msr, sizeof(uart->msr));
+	err |= handover_get(hb, &uart->fcr, sizeof(uart->fcr));
+	err |= handover_get(hb, &uart->scr, sizeof(uart->scr));
+	err |= handover_get(hb, &uart->dll, sizeof(uart->dll));
+	err |= handover_get(hb, &uart->dlh, sizeof(uart->dlh));
+	err |= handover_get(hb, &uart->rxfifo, sizeof(uart->rxfifo));
+	err |= handover_get(hb, &uart->thre_int_pending,
+			sizeof(uart->thre_int_pending));
+	err |= handover_get(hb, &uart->txfifo, sizeof(uart->txfifo));
+	if (err == 0)
+		uart_toggle_intr(uart);
+	pthread_mutex_unlock(&uart->mtx);
+
+	return err ? -1 : 0;
+}
@@ -52,6 +52,10 @@ struct blockif_req {
 
 struct blockif_ctxt;
 struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
+struct blockif_ctxt *blockif_open_lazy(const char *optstr, const char *ident);
+struct blockif_ctxt *blockif_open_fd(const char *optstr, const char *ident,
+				     int fd);
+int	blockif_start(struct blockif_ctxt *bc);
 off_t	blockif_size(struct blockif_ctxt *bc);
 void	blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h,
 		    uint8_t *s);
@@ -65,6 +69,7 @@ int	blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq);
 int	blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq);
+int	blockif_fd(struct blockif_ctxt *bc);
 int	blockif_close(struct blockif_ctxt *bc);
 
 #endif /* _BLOCK_IF_H_ */
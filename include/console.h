@@ -44,6 +44,13 @@ struct gfx_ctx_image *console_get_image(void);
 void	console_fb_register(fb_render_func_t render_cb, void *arg);
 void	console_refresh(void);
 
+/*
+ * The display device calls console_fb_dirty() once it changed the
+ * image; console users only look at the image again after it did.
+ */
+void	console_fb_dirty(void);
+unsigned long console_fb_seq(void);
+
 void	console_kbd_register(kbd_event_func_t event_cb, void *arg, int pri);
 void	console_kbd_unregister(void);
 void	console_key_event(int down, uint32_t keysym);
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * DM live handover.
+ *
+ * A running acrn-dm started with "--enable_handover" can hand its VM
+ * over to a freshly started acrn-dm binary without rebooting the guest.
+ * The new process is started with the same command line plus
+ * "--handover"; it connects to the handover socket of the running DM,
+ * which then pauses the VM, serializes the device state and passes it,
+ * together with the VHM device fd and any backend fds, over the socket
+ * with SCM_RIGHTS. Without "--enable_handover" there is no socket and
+ * no handover. The new process adopts
+ * the VM and resumes it. If the transfer fails before the new process
+ * has acknowledged it, the running DM resumes the VM itself.
+ *
+ * Components that carry state take part by registering a section. A
+ * section registered without a save callback marks a component which
+ * cannot be handed over; the running DM refuses the handover and keeps
+ * the VM running in that case. Every component with guest visible state
+ * has to register one or the other, a new DM would silently start it
+ * from scratch otherwise.
+ */
+
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HANDOVER_NAME_LEN	32
+#define HANDOVER_MAX_FDS	64
+
+struct vmctx;
+
+struct handover_buf {
+	uint8_t	*data;
+	size_t	len;		/* bytes used */
+	size_t	size;		/* bytes allocated */
+	size_t	pos;		/* read position */
+	int	*fds;		/* fd table shared by all sections */
+	int	*nfds;
+};
+
+typedef int (*handover_save_t)(void *arg, struct handover_buf *hb);
+typedef int (*handover_restore_t)(void *arg, struct handover_buf *hb);
+
+int	handover_register(const char *name, handover_save_t save,
+			  handover_restore_t restore, void *arg);
+void	handover_unregister(const char *name);
+
+int	handover_put(struct handover_buf *hb, const void *data, size_t len);
+int	handover_put_fd(struct handover_buf *hb, int fd);
+int	handover_get(struct handover_buf *hb, void *data, size_t len);
+int	handover_get_fd(struct handover_buf *hb);
+
+/* running DM side */
+int	handover_init(struct vmctx *ctx);
+void	handover_deinit(void);
+int	handover_send(struct vmctx *ctx);
+
+/* new DM side */
+void	handover_set_incoming(void);
+bool	handover_incoming(void);
+struct vmctx *handover_receive(const char *name, size_t *memsize);
+int	handover_restore(void);
+
+#endif
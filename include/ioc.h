@@ -129,6 +129,12 @@
  */
 #define IOC_MAX_REQUESTS	200
 
+/*
+ * Slots of a CBC request ring, a power of two that holds all requests so
+ * that putting a request never fails.
+ */
+#define CBC_REQ_RING_SIZE	256
+
 /*
  * Maximum epoll events.
  */
@@ -609,6 +615,23 @@ struct wlist_group {
 	struct cbc_group *grp;
 };
 
+/*
+ * Index over the 16-bit ids of a signal or group table, built once at init
+ * so the per-frame lookups do not scan the tables. Open addressing with
+ * linear probing, at most half of the slots are used.
+ */
+struct cbc_index_entry {
+	uint16_t id;
+	uint8_t used;
+	uint8_t wlisted;	/* Id is on the whitelist as well */
+	void *node;		/* struct cbc_signal or struct cbc_group */
+};
+
+struct cbc_index {
+	uint32_t bits;
+	struct cbc_index_entry *tbl;
+};
+
 /*
  * CBC ring is used to buffer bytes before build one complete CBC frame.
  */
@@ -630,6 +653,8 @@ struct cbc_config {
 	struct cbc_group *cbc_grp_tbl;		/* CBC groups table */
 	struct wlist_signal *wlist_sig_tbl;	/* Whitelist signals table */
 	struct wlist_group *wlist_grp_tbl;	/* Whitelist groups table */
+	struct cbc_index sig_idx;		/* Signals by id */
+	struct cbc_index grp_idx;		/* Groups by id */
 };
 
 /*
@@ -651,8 +676,6 @@ struct cbc_request {
 	enum ioc_ch_id id;		/* Channel id number */
 	enum cbc_request_type rtype;	/* Request types */
 	uint8_t buf[CBC_MAX_FRAME_SIZE];
-
-	SIMPLEQ_ENTRY(cbc_request) me_queue;
 };
 
 /*
@@ -669,9 +692,28 @@ struct cbc_pkt {
 };
 
 /*
- * CBC simple queue head definition.
+ * Single producer single consumer ring of cbc_requests between two IOC
+ * threads. Only the producer writes tail and only the consumer writes
+ * head, so neither side takes a lock.
  */
-SIMPLEQ_HEAD(cbc_qhead, cbc_request);
+struct cbc_req_ring {
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	struct cbc_request *reqs[CBC_REQ_RING_SIZE];
+};
+
+/*
+ * Work queue of the rx or tx thread. Requests from the core thread come
+ * through ring, requests routed by the other worker come through urgent
+ * and are served first. A producer writes the eventfd only when the
+ * consumer went idle waiting for it.
+ */
+struct cbc_queue {
+	struct cbc_req_ring ring;	/* From the core thread */
+	struct cbc_req_ring urgent;	/* From the other worker thread */
+	int efd;			/* Wakes up the idle consumer */
+	int idle;			/* Consumer waits on efd */
+};
 
 /*
  * IOC device structure.
@@ -687,23 +729,23 @@ struct ioc_dev {
 	struct cbc_request *pool;	/* CBC requests pool */
 	struct cbc_ring ring;		/* Ring buffer */
 	pthread_t tid;			/* Core thread id */
-	struct cbc_qhead free_qhead;	/* Free queue head */
-	pthread_mutex_t free_mtx;	/* Free queue mutex */
+
+	/* Free requests, only the core thread takes them */
+	struct cbc_request *free_reqs[IOC_MAX_REQUESTS];
+	int free_num;
 
 	char rx_name[16];		/* Rx thread name */
-	struct cbc_qhead rx_qhead;	/* Rx queue head */
+	struct cbc_queue rx_queue;	/* Rx queue */
+	struct cbc_req_ring rx_free;	/* Requests freed by rx thread */
 	struct cbc_config rx_config;	/* Rx configuration */
 	pthread_t rx_tid;
-	pthread_cond_t rx_cond;
-	pthread_mutex_t rx_mtx;
 	void (*ioc_dev_rx)(struct cbc_pkt *pkt);
 
 	char tx_name[16];		/* Tx thread name */
-	struct cbc_qhead tx_qhead;	/* Tx queue head */
+	struct cbc_queue tx_queue;	/* Tx queue */
+	struct cbc_req_ring tx_free;	/* Requests freed by tx thread */
 	struct cbc_config tx_config;	/* Tx configuration */
 	pthread_t tx_tid;
-	pthread_cond_t tx_cond;
-	pthread_mutex_t tx_mtx;
 	void (*ioc_dev_tx)(struct cbc_pkt *pkt);
 };
 
@@ -736,6 +778,10 @@ void wlist_init_signal(struct cbc_signal *cbc_tbl, size_t cbc_size,
 void wlist_init_group(struct cbc_group *cbc_tbl, size_t cbc_size,
 		struct wlist_group *wlist_tbl, size_t wlist_size);
 
+/* Signal and group index of a CBC configuration */
+int cbc_index_init(struct cbc_config *cfg);
+void cbc_index_deinit(struct cbc_config *cfg);
+
 /* Set CBC log file */
 void cbc_set_log_file(FILE *f);
 #endif
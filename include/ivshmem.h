@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Inter-VM shared memory (ivshmem) server protocol.
+ *
+ * Peers connect to the server over a unix stream socket. Every message is
+ * a little-endian int64, optionally with one file descriptor attached as
+ * SCM_RIGHTS. On connection the server sends, in order:
+ *
+ *	IVSHMEM_PROTOCOL_VERSION		no fd
+ *	peer id of the new client		no fd
+ *	-1					shared memory fd
+ *
+ * followed by one message per doorbell vector of every peer, the new
+ * client included: the peer id with the eventfd of that vector attached.
+ * The vectors of a peer are sent in order, so the n-th fd received for an
+ * id is its vector n. When a peer goes away, the server sends its id
+ * without fd to the others.
+ *
+ * This is the protocol of the QEMU ivshmem-server, so either server can
+ * be used.
+ */
+
+#ifndef _IVSHMEM_H_
+#define _IVSHMEM_H_
+
+#define IVSHMEM_PROTOCOL_VERSION	0
+#define IVSHMEM_MAX_PEERS		65536
+#define IVSHMEM_MAX_VECTORS		64
+#define IVSHMEM_DEFAULT_SOCKET		"/tmp/ivshmem_socket"
+
+#endif
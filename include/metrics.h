@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Runtime metrics of acrn-dm.
+ *
+ * Devices register named counters, gauges and histograms once at init
+ * and update them from any thread. Counters and histograms are split
+ * into per-thread shards on separate cache lines and updated with
+ * relaxed atomics, so the hot paths never share a line or take a lock.
+ * All metrics are dumped in one pass over the monitor socket, as text
+ * (REQ_METRICS) or in binary (REQ_METRICS_BIN, see monitor_msg.h).
+ *
+ * A NULL metric is accepted by all update functions, so a failed
+ * registration only loses the metric.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define METRIC_NAME_LEN		48
+#define METRIC_LABELS_LEN	48
+#define METRIC_SHARDS		8
+#define METRIC_HIST_BUCKETS	24	/* bucket i counts values < 2^i */
+
+enum metric_type {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM
+};
+
+struct metric_shard {
+	uint64_t	count;		/* counter value, histogram samples */
+	uint64_t	sum;		/* histogram only from here on */
+	uint64_t	bucket[METRIC_HIST_BUCKETS];
+};
+
+struct metric {
+	char		name[METRIC_NAME_LEN];
+	char		labels[METRIC_LABELS_LEN];	/* k="v",... */
+	enum metric_type type;
+	int64_t		gauge;
+	size_t		stride;		/* bytes between shards */
+	void		*shards;
+	TAILQ_ENTRY(metric) list;
+};
+
+extern __thread unsigned int metric_tid;
+unsigned int metric_tid_init(void);
+
+struct metric *metric_register(enum metric_type type, const char *name,
+			       const char *labels_fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+void	metric_unregister(struct metric *m);
+int	metrics_monitor_init(void);
+
+static inline struct metric_shard *
+metric_shard(struct metric *m)
+{
+	unsigned int tid = metric_tid;
+
+	if (tid == 0)
+		tid = metric_tid_init();
+	return (struct metric_shard *)((char *)m->shards +
+			(tid % METRIC_SHARDS) * m->stride);
+}
+
+static inline void
+metric_add(struct metric *m, uint64_t val)
+{
+	if (m)
+		__atomic_fetch_add(&metric_shard(m)->count, val,
+				   __ATOMIC_RELAXED);
+}
+
+static inline void
+metric_inc(struct metric *m)
+{
+	metric_add(m, 1);
+}
+
+static inline void
+metric_set(struct metric *m, int64_t val)
+{
+	if (m)
+		__atomic_store_n(&m->gauge, val, __ATOMIC_RELAXED);
+}
+
+static inline void
+metric_gauge_add(struct metric *m, int64_t val)
+{
+	if (m)
+		__atomic_fetch_add(&m->gauge, val, __ATOMIC_RELAXED);
+}
+
+static inline void
+metric_observe(struct metric *m, uint64_t val)
+{
+	struct metric_shard *s;
+	int b;
+
+	if (!m)
+		return;
+
+	b = val ? 64 - __builtin_clzll(val) : 0;
+	if (b >= METRIC_HIST_BUCKETS)
+		b = METRIC_HIST_BUCKETS - 1;
+
+	s = metric_shard(m);
+	__atomic_fetch_add(&s->bucket[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->sum, val, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+}
+
+#endif
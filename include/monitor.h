@@ -56,7 +56,7 @@ int monitor_broadcast(struct vmm_msg *msg);
 
 /* msg_sender will be seen/modify by msg handler */
 struct msg_sender {
-	int fd;			/* msg handler can replay to this fd */
+	int fd;			/* non-blocking, reply with monitor_send() */
 	char name[CLIENT_NAME_LEN];	/* client have a chance to name itsself */
 	int broadcast;
 };
@@ -69,12 +69,38 @@ struct msg_sender {
  * @msg: msg->msgid must be set, for which handler will be add.
  * @callback: when a received message match msg->msgid, callback will be envoked.
  *   And these data are pass in to help developer: (a)msg, the received message, from
- *   socket. (b)sender, tell you who send this message, anything wite to sender->fd
- *   will be able to read out by client socket. Developer should only write valid
- *   vmm_msg. (c)priv, that is what you pass to monitor_add_msg_handler();
+ *   socket. (b)sender, tell you who send this message, pass it to monitor_send()
+ *   to reply. (c)priv, that is what you pass to monitor_add_msg_handler();
+ *   Handlers run on the monitor thread and should not block.
  * @priv, callback will see this value.
 */
 
+/**
+ * monitor_send()
+ * Queue a vmm_msg for the client that sent a request. It never blocks, the
+ * message is dropped and -1 returned if the client does not keep up.
+ * @arguements:
+ * @sender: the sender passed to the msg handler
+ * @msg: any valid vmm_msg data structure, copied before returning
+ */
+
+int monitor_send(struct msg_sender *sender, struct vmm_msg *msg);
+
+/**
+ * monitor_send_chunks()
+ * Reply with data split over as many struct vmm_msg_metrics chunks as
+ * needed, the client concatenates them until the last one.
+ * @arguements:
+ * @sender: the sender passed to the msg handler
+ * @msgid: msgid of the replies
+ * @data, @len: what to send, an empty reply is a single last chunk
+ * Returns -1 if the reply did not fit in the queue of the client, which
+ * then gets a last chunk marked VMM_CHUNK_DROPPED instead.
+ */
+
+int monitor_send_chunks(struct msg_sender *sender, unsigned int msgid,
+			const char *data, size_t len);
+
 int monitor_register_handler(struct vmm_msg *msg,
 			     void (*callback) (struct vmm_msg * msg,
 					       struct msg_sender * sender,
@@ -57,6 +57,11 @@ enum msgid {
 
 	MSG_STR,
 	MSG_HANDSHAKE,		/* handshake */
+	REQ_TIMELINE,		/* startup timeline of ACRN-DM, JSON in chunks */
+	REQ_SUBSCRIBE,		/* replay a request periodically */
+	REQ_METRICS,		/* runtime metrics, text exposition format */
+	REQ_METRICS_BIN,	/* runtime metrics, binary records */
+	REQ_TRACE,		/* control and drain DM tracepoints */
 
 	MSGID_MAX
 };
@@ -104,4 +109,78 @@ struct vmm_msg_handshake {
 	/*   message to such client */
 };
 
+/* REQ_SUBSCRIBE: acrn-dm handles request msgid for the sender every
+ * interval_ms milliseconds, and the sender reads the replies as if it
+ * had sent the request itself. interval_ms 0 cancels. The reply to the
+ * subscription itself is a MSG_STR.
+ */
+struct vmm_msg_subscribe {
+	struct vmm_msg vmsg;
+	unsigned int msgid;	/* request to replay, e.g. REQ_TIMELINE */
+	unsigned int interval_ms;
+};
+
+/* REQ_METRICS and REQ_METRICS_BIN replies: the dump is split over as
+ * many messages as needed, the client concatenates data until last.
+ * last is VMM_CHUNK_DROPPED if the reply did not fit in the queue of
+ * the client, the data received is then to be thrown away.
+ */
+#define VMM_CHUNK_DROPPED	2
+
+struct vmm_msg_metrics {
+	struct vmm_msg vmsg;
+	unsigned int seq;	/* chunk number, from 0 */
+	unsigned int last;	/* set on the final chunk */
+	char data[0];
+};
+
+/* REQ_TRACE: op TRACE_OP_ENABLE enables the tracepoints listed, "all"
+ * or names separated by ',', and disables the others; an empty list
+ * disables all. The reply tells the tracepoints enabled. TRACE_OP_DRAIN
+ * replies with the records taken since the last drain, merged in TSC
+ * order. The first line is
+ *   # tsc_hz <hz> lost <records> more <0|1>
+ * then one line per record:
+ *   <tsc> <ns since tracing was enabled> <tid> <tracepoint> <arg0> <arg1>
+ * A drain carries TRACE_DRAIN_MAX records at most, drain again while
+ * "more" is 1. TRACE_OP_FLIGHT asks acrntrace, running as a flight
+ * recorder, to dump its rings; tracepoints[] holds the reason, if any.
+ * Replies are text in struct vmm_msg_metrics chunks.
+ */
+#define TRACE_OP_ENABLE		0
+#define TRACE_OP_DRAIN		1
+#define TRACE_OP_FLIGHT		2
+#define TRACE_DRAIN_MAX		2048
+
+struct vmm_msg_trace {
+	struct vmm_msg vmsg;
+	unsigned int op;
+	char tracepoints[64];	/* or the reason of TRACE_OP_FLIGHT */
+};
+
+/* binary dump: a header and then records back to back, native order */
+#define METRICS_BIN_MAGIC	0x544d4341	/* "ACMT" */
+#define METRICS_BIN_VERSION	1
+
+struct metrics_bin_hdr {
+	unsigned int magic;
+	unsigned short version;
+	unsigned short nhist_buckets;	/* bucket i counts values < 2^i */
+	unsigned int nrecords;
+	unsigned int reserved;
+	unsigned long long timestamp_ns;	/* CLOCK_MONOTONIC */
+};
+
+struct metrics_bin_record {
+	unsigned short size;	/* whole record, a multiple of 8 */
+	unsigned char type;	/* 0 counter, 1 gauge, 2 histogram */
+	unsigned char nvalues;
+	unsigned short name_len;
+	unsigned short labels_len;	/* k="v",... */
+	/* char name[name_len], labels[labels_len], zero padded to 8,
+	 * then unsigned long long values[nvalues]: the counter, the gauge
+	 * (signed) or histogram count, sum and buckets.
+	 */
+};
+
 #endif
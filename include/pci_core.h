@@ -40,14 +40,34 @@
 struct vmctx;
 struct pci_vdev;
 struct memory_region;
+struct handover_buf;
+struct metric;
 
 struct pci_vdev_ops {
 	char	*class_name;		/* Name of device class */
 
+	/*
+	 * optional backend setup ahead of vdev_init, e.g. opening the
+	 * backing image. It runs in parallel with the vdev_prepare of
+	 * other devices, so it may only touch the device's own state and
+	 * must not modify opts. vdev_deinit must cope with a prepared
+	 * device whose vdev_init failed or never ran.
+	 */
+	int	(*vdev_prepare)(struct vmctx *, struct pci_vdev *,
+				char *opts);
+
 	/* instance creation */
 	int	(*vdev_init)(struct vmctx *, struct pci_vdev *,
 			     char *opts);
 
+	/*
+	 * deferred backend setup for a device configured with the "lazy"
+	 * slot flag, see pci_emul_activate(). vdev_init sees dev->lazy
+	 * set and only builds what the guest can see before enabling the
+	 * device (config space, BARs, device config registers).
+	 */
+	int	(*vdev_activate)(struct vmctx *, struct pci_vdev *);
+
 	/* instance deinit */
 	void	(*vdev_deinit)(struct vmctx *, struct pci_vdev *,
 			char *opts);
@@ -73,6 +93,15 @@ struct pci_vdev_ops {
 	uint64_t  (*vdev_barread)(struct vmctx *ctx, int vcpu,
 				struct pci_vdev *pi, int baridx,
 				uint64_t offset, int size);
+
+	/*
+	 * live handover: a device type providing vdev_restore can be
+	 * handed over to a new DM, vdev_save is optional.
+	 */
+	int	(*vdev_save)(struct vmctx *ctx, struct pci_vdev *dev,
+			     struct handover_buf *hb);
+	int	(*vdev_restore)(struct vmctx *ctx, struct pci_vdev *dev,
+				struct handover_buf *hb);
 };
 
 /*
@@ -111,6 +140,13 @@ struct msix_table_entry {
 #define MAX_MSIX_TABLE_ENTRIES	2048
 #define	PBA_SIZE(msgnum)	(roundup2((msgnum), 64) / 8)
 
+/* when a lazy device gets its backend, see vdev_activate */
+enum pci_lazy {
+	PCI_LAZY_NONE,		/* backend is set up */
+	PCI_LAZY_ENABLE,	/* on I/O or memory decode enable */
+	PCI_LAZY_DRIVER_OK	/* on virtio DRIVER_OK */
+};
+
 enum lintr_stat {
 	IDLE,
 	ASSERTED,
@@ -125,6 +161,7 @@ struct pci_vdev {
 	int	bar_getsize;
 	int	prevcap;
 	int	capend;
+	enum pci_lazy	lazy;
 
 	struct {
 		int8_t	pin;
@@ -157,6 +194,9 @@ struct pci_vdev {
 
 	void	*arg;		/* devemu-private data */
 
+	struct metric	*m_access;	/* BAR reads and writes */
+	struct metric	*m_intr;	/* MSI/MSI-X/INTx raised */
+
 	uint8_t	cfgdata[PCI_REGMAX + 1];
 	struct pcibar bar[PCI_BARMAX + 1];
 };
@@ -225,6 +265,7 @@ void	msicap_cfgwrite(struct pci_vdev *pi, int capoff, int offset,
 void	msixcap_cfgwrite(struct pci_vdev *pi, int capoff, int offset,
 			 int bytes, uint32_t val);
 void	pci_callback(void);
+void	pci_emul_activate(struct pci_vdev *dev);
 int	pci_emul_alloc_bar(struct pci_vdev *pdi, int idx,
 			   enum pcibar_type type, uint64_t size);
 int	pci_emul_alloc_pbar(struct pci_vdev *pdi, int idx,
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Startup timeline of acrn-dm.
+ *
+ * Phases of the VM start are bracketed with timeline_begin() and
+ * timeline_end(), which record CLOCK_MONOTONIC timestamps relative to
+ * the start of the DM. The result can be written out as JSON with
+ * --timeline <file> and queried over the monitor socket (REQ_TIMELINE).
+ * The table is cleared when the VM is rebooted.
+ */
+
+#ifndef _TIMELINE_H_
+#define _TIMELINE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define TIMELINE_MAX_EVENTS	256
+#define TIMELINE_NAME_LEN	48
+
+void	timeline_init(void);
+void	timeline_reset(void);
+int	timeline_begin(const char *fmt, ...);
+void	timeline_end(int id);
+int	timeline_dump(FILE *fp);
+int	timeline_write(const char *path);
+int	timeline_monitor_init(void);
+
+#endif
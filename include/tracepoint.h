@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Static tracepoints of acrn-dm.
+ *
+ * TRACEPOINT() sits in the hot paths and, when enabled, writes a fixed
+ * size record stamped with the TSC into a ring owned by the calling
+ * thread, so recording takes no lock and shares no cache line. A
+ * disabled tracepoint costs one load and a not-taken branch.
+ *
+ * Rings keep the latest TP_RING_SIZE records of their thread. A drain
+ * copies what was recorded since the last drain out of every ring and
+ * merges it into one timeline by TSC, which is synchronized across
+ * cores on the platforms acrn-dm runs on. Tracepoints are enabled with
+ * --trace at start or over the monitor socket (REQ_TRACE).
+ */
+
+#ifndef _TRACEPOINT_H_
+#define _TRACEPOINT_H_
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+enum tracepoint_id {
+	TP_VMEXIT,		/* ioreq dispatch: exitcode, vcpu */
+	TP_VQ_NOTIFY,		/* guest kicked a vq: virtio_base, queue */
+	TP_VQ_ENDCHAINS,	/* used ring published: virtio_base,
+				 * queue | interrupt sent << 16 */
+	TP_BLOCKIF_ENQUEUE,	/* request queued: blockif_req, op */
+	TP_BLOCKIF_DEQUEUE,	/* request picked by a worker: req, op */
+	TP_BLOCKIF_COMPLETE,	/* request done: blockif_req, error */
+	TP_INTR_MSI,		/* MSI injected: address, data */
+	TP_INTR_LINE,		/* line interrupt: ioapic irq,
+				 * 0 deassert, 1 assert, 2 pulse */
+	TP_MEVENT,		/* mevent callback: fd, ev_type */
+	TRACEPOINT_MAX
+};
+
+#define TP_RING_SIZE	4096	/* records, a power of 2 */
+
+struct tp_record {
+	uint64_t	tsc;
+	uint16_t	id;
+	uint16_t	reserved;
+	uint32_t	tid;
+	uint64_t	arg[2];
+};
+
+struct tp_ring {
+	uint64_t	head;		/* records written, owner only */
+	uint64_t	drained;	/* records drained, drainer only */
+	uint32_t	tid;
+	LIST_ENTRY(tp_ring) list;
+	struct tp_record rec[TP_RING_SIZE] __attribute__((aligned(64)));
+};
+
+extern uint32_t tracepoint_mask;
+extern __thread struct tp_ring *tp_ring;
+
+struct tp_ring *tp_ring_init(void);
+int	tracepoint_parse(const char *list, uint32_t *mask);
+void	tracepoint_enable(uint32_t mask);
+int	tracepoint_monitor_init(void);
+
+static inline void
+tracepoint_record(enum tracepoint_id id, uint64_t arg0, uint64_t arg1)
+{
+	struct tp_ring *r = tp_ring;
+	struct tp_record *rec;
+	uint64_t head;
+
+	if (!r && !(r = tp_ring_init()))
+		return;
+
+	head = r->head;
+	rec = &r->rec[head & (TP_RING_SIZE - 1)];
+	rec->tsc = __builtin_ia32_rdtsc();
+	rec->id = id;
+	rec->tid = r->tid;
+	rec->arg[0] = arg0;
+	rec->arg[1] = arg1;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACEPOINT(id, arg0, arg1)					\
+	do {								\
+		if (__builtin_expect(__atomic_load_n(&tracepoint_mask,	\
+				__ATOMIC_RELAXED) & (1U << (id)), 0))	\
+			tracepoint_record(id, (uint64_t)(arg0),		\
+					  (uint64_t)(arg1));		\
+	} while (0)
+
+#endif
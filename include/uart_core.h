@@ -33,6 +33,7 @@
 #define	UART_IO_BAR_SIZE	8
 
 struct uart_vdev;
+struct handover_buf;
 
 typedef void (*uart_intr_func_t)(void *arg);
 struct uart_vdev *uart_init(uart_intr_func_t intr_assert,
@@ -45,4 +46,6 @@ uint8_t	uart_read(struct uart_vdev *uart, int offset);
 void	uart_write(struct uart_vdev *uart, int offset, uint8_t value);
 int	uart_set_backend(struct uart_vdev *uart, const char *opt);
 void	uart_release_backend(struct uart_vdev *uart, const char *opts);
+int	uart_save(struct uart_vdev *uart, struct handover_buf *hb);
+int	uart_restore(struct uart_vdev *uart, struct handover_buf *hb);
 #endif
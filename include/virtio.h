@@ -215,6 +215,7 @@ struct vring_used {
 #define	VIRTIO_TYPE_RPMSG	7
 #define	VIRTIO_TYPE_SCSI	8
 #define	VIRTIO_TYPE_9P		9
+#define	VIRTIO_TYPE_VSOCK	19
 
 /*
  * ACRN virtio device types
@@ -238,6 +239,8 @@ struct vring_used {
 #define	VIRTIO_DEV_BLOCK	0x1001
 #define	VIRTIO_DEV_CONSOLE	0x1003
 #define	VIRTIO_DEV_RANDOM	0x1005
+#define	VIRTIO_DEV_9P		0x1009
+#define	VIRTIO_DEV_VSOCK	0x1053	/* modern only, 0x1040 + type */
 
 /*
  * ACRN virtio device IDs
@@ -872,6 +875,34 @@ void virtio_dev_error(struct virtio_base *base);
  */
 int virtio_set_modern_bar(struct virtio_base *base, bool use_notify_pio);
 
+struct handover_buf;
+
+/**
+ * @brief Save the transport state of a virtio device for live handover.
+ *
+ * Saves the negotiated features, status and the position of every
+ * virtqueue so that a new DM can carry on with the rings as they are.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param hb Pointer to the handover section buffer.
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_save(struct virtio_base *base, struct handover_buf *hb);
+
+/**
+ * @brief Restore the transport state saved by virtio_save.
+ *
+ * Rings which were set up by the guest are mapped again from their
+ * guest physical address.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param hb Pointer to the handover section buffer.
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_restore(struct virtio_base *base, struct handover_buf *hb);
+
 /**
  * @}
  */
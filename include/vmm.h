@@ -61,6 +61,7 @@ enum vm_suspend_how {
 	VM_SUSPEND_POWEROFF,
 	VM_SUSPEND_HALT,
 	VM_SUSPEND_TRIPLEFAULT,
+	VM_SUSPEND_HANDOVER,
 	VM_SUSPEND_LAST
 };
 
@@ -55,6 +55,7 @@ struct vmctx {
 	int     ioreq_client;
 	uint32_t lowmem_limit;
 	int     memflags;
+	int     adopted;	/* VM handed over by a previous DM */
 	size_t  lowmem;
 	size_t  highmem;
 	char    *mmap_lowmem;
@@ -112,6 +113,7 @@ void	*vm_create_devmem(struct vmctx *ctx, int segid, const char *name,
 int	vm_create(const char *name);
 int	vm_get_device_fd(struct vmctx *ctx);
 struct	vmctx *vm_open(const char *name);
+struct	vmctx *vm_adopt(const char *name, int fd, int vmid);
 void	vm_close(struct vmctx *ctx);
 void	vm_pause(struct vmctx *ctx);
 int	vm_set_shared_io_page(struct vmctx *ctx, uint64_t page_vma);
@@ -125,6 +127,8 @@ void	vm_destroy(struct vmctx *ctx);
 int	vm_parse_memsize(const char *optarg, size_t *memsize);
 int	vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	uint64_t vma, int prot);
+int	vm_unmap_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+	uint64_t vma, int prot);
 int	vm_setup_memory(struct vmctx *ctx, size_t len, enum vm_mmap_style s);
 void	vm_unsetup_memory(struct vmctx *ctx);
 bool	check_hugetlb_support(void);
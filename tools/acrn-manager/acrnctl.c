@@ -34,14 +34,23 @@
  * Author: Tao Yuhong <yuhong.tao@intel.com>
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <time.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include "monitor_msg.h"
 
 #define ACRNCTL_OPT_ROOT	"/opt/acrn/conf"
@@ -69,18 +78,12 @@ static int shell_cmd(const char *cmd, char *outbuf, int len)
 	return ret;
 }
 
-static void process_msg(struct vmm_msg *msg)
+static double monotonic_now(void)
 {
-	if (msg->len < sizeof(*msg))
-		return;
+	struct timespec ts;
 
-	switch(msg->msgid) {
-	case MSG_STR:
-		printf("%s\n", msg->payload);
-		break;
-	default:
-		printf("Unknown msgid(%d) received\n", msg->msgid);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 /* vm states data and helper functions */
@@ -121,7 +124,7 @@ static struct vmm_struct *vmm_list_add(char *name)
 		return NULL;
 	}
 
-	strcpy(s->name, name);
+	snprintf(s->name, sizeof(s->name), "%s", name);
 	LIST_INSERT_HEAD(&vmm_head, s, list);
 
 	return s;
@@ -137,49 +140,190 @@ static struct vmm_struct *vmm_find(char *name)
 	return NULL;
 }
 
-static void vmm_update(void)
+static void vmm_list_free(void)
 {
-	char cmd[128] = { };
-	char cmd_out[256] = { };
-	char *vmname;
-	char *pvmname = NULL;
 	struct vmm_struct *s;
 
-	snprintf(cmd, sizeof(cmd),
-		 "find %s/add/ -name \"*.sh\" | "
-		 "sed \"s/\\/opt\\/acrn\\/conf\\/add\\///g\" | "
-		 "sed \"s/.sh//g\"", ACRNCTL_OPT_ROOT);
-	shell_cmd(cmd, cmd_out, sizeof(cmd_out));
+	while ((s = LIST_FIRST(&vmm_head))) {
+		LIST_REMOVE(s, list);
+		free(s);
+	}
+}
+
+/* Strip suffix from entry, return 0 if entry had it and fits in a name */
+static int strip_suffix(char *name, size_t len, const char *entry,
+			const char *suffix)
+{
+	size_t n = strlen(entry), m = strlen(suffix);
+
+	if (n <= m || n - m >= len || strcmp(entry + n - m, suffix))
+		return -1;
+
+	memcpy(name, entry, n - m);
+	name[n - m] = 0;
+	return 0;
+}
+
+#define MONITOR_SOCK_SUFFIX	"-monitor.socket"
+#define PROBE_TIMEOUT_MS	500
+
+/* Connect to the monitor of vmname without blocking, -1 if nobody listens */
+static int monitor_connect(const char *vmname)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s%s",
+		 ACRN_DM_SOCK_ROOT, vmname, MONITOR_SOCK_SUFFIX);
+
+	/* a full backlog (EAGAIN) still means an acrn-dm is listening */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    && errno != EINPROGRESS && errno != EAGAIN) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
 
-	vmname = strtok_r(cmd_out, "\n", &pvmname);
-	while (vmname) {
-		s = vmm_list_add(vmname);
-		if (!s)
+/* Names of the monitor sockets under ACRN_DM_SOCK_ROOT, NULL terminated */
+static char **monitor_list(int *count)
+{
+	char name[128], **names = NULL, **tmp;
+	struct dirent *e;
+	DIR *dir;
+	int n = 0;
+
+	*count = 0;
+	dir = opendir(ACRN_DM_SOCK_ROOT);
+	if (!dir)
+		return NULL;
+
+	while ((e = readdir(dir))) {
+		if (strip_suffix(name, sizeof(name), e->d_name,
+				 MONITOR_SOCK_SUFFIX))
+			continue;
+		tmp = realloc(names, (n + 2) * sizeof(*names));
+		if (!tmp)
+			break;
+		names = tmp;
+		names[n] = strdup(name);
+		if (!names[n])
+			break;
+		names[++n] = NULL;
+	}
+	closedir(dir);
+
+	*count = n;
+	return names;
+}
+
+static void monitor_list_free(char **names)
+{
+	char **p;
+
+	for (p = names; p && *p; p++)
+		free(*p);
+	free(names);
+}
+
+/*
+ * Probe all monitor sockets at once: a socket file left behind by a
+ * crashed acrn-dm refuses the connection, so it does not count as
+ * started. Returns how many acrn-dm answered; alive[i] tells which.
+ */
+static int monitor_probe(char **names, int n, int *alive)
+{
+	struct pollfd *pfd;
+	int i, err, found = 0;
+	socklen_t len;
+
+	pfd = calloc(n, sizeof(*pfd));
+	if (!pfd)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		pfd[i].fd = monitor_connect(names[i]);
+		pfd[i].events = POLLOUT;
+	}
+
+	/* unix sockets connect at once, unless the backlog is full */
+	if (poll(pfd, n, PROBE_TIMEOUT_MS) < 0)
+		for (i = 0; i < n; i++)
+			pfd[i].revents = 0;
+
+	for (i = 0; i < n; i++) {
+		alive[i] = 0;
+		if (pfd[i].fd < 0)
 			continue;
-		s->state = VM_CREATED;
-		vmname = strtok_r(NULL, "\n", &pvmname);
+		err = 0;
+		len = sizeof(err);
+		if ((pfd[i].revents & POLLOUT) && !(pfd[i].revents & POLLERR)
+		    && !getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len)
+		    && !err) {
+			alive[i] = 1;
+			found++;
+		}
+		close(pfd[i].fd);
+	}
+
+	free(pfd);
+	return found;
+}
+
+static void vmm_update(void)
+{
+	char name[128], **names;
+	struct vmm_struct *s;
+	struct dirent *e;
+	int i, n, *alive;
+	DIR *dir;
+
+	vmm_list_free();
+
+	dir = opendir(ACRNCTL_OPT_ROOT "/add");
+	if (dir) {
+		while ((e = readdir(dir))) {
+			if (strip_suffix(name, sizeof(name), e->d_name, ".sh"))
+				continue;
+			s = vmm_list_add(name);
+			if (s)
+				s->state = VM_CREATED;
+		}
+		closedir(dir);
 	}
 
-	pvmname = NULL;
+	names = monitor_list(&n);
+	if (!n)
+		goto out;
 
-	snprintf(cmd, sizeof(cmd),
-		 "find %s/ -name \"*.socket\" | "
-		 "sed \"s/\\/run\\/acrn\\///g\" | "
-		 "sed \"s/-monitor.socket//g\"", ACRN_DM_SOCK_ROOT);
-	shell_cmd(cmd, cmd_out, sizeof(cmd_out));
+	alive = calloc(n, sizeof(*alive));
+	if (!alive)
+		goto out;
 
-	vmname = strtok_r(cmd_out, "\n", &pvmname);
-	while (vmname) {
-		s = vmm_find(vmname);
+	monitor_probe(names, n, alive);
+	for (i = 0; i < n; i++) {
+		if (!alive[i])
+			continue;
+		s = vmm_find(names[i]);
 		if (s)
 			s->state = VM_STARTED;
 		else {
-			s = vmm_list_add(vmname);
+			s = vmm_list_add(names[i]);
 			if (s)
 				s->state = VM_UNTRACKED;
 		}
-		vmname = strtok_r(NULL, "\n", &pvmname);
 	}
+	free(alive);
+
+ out:
+	monitor_list_free(names);
 }
 
 /* There are acrnctl cmds */
@@ -481,121 +625,487 @@ static int acrnctl_do_add(int argc, char *argv[])
 	return ret;
 }
 
-/* command: stop */
-static void acrnctl_stop_help(void)
+/* bulk start/stop: run one job per VM, several at a time */
+#define BULK_TICK_MS		50
+#define BULK_TIMEOUT		30	/* seconds */
+#define MAX_DEPS		16
+
+enum job_state {
+	JOB_PENDING = 0,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+};
+
+struct vm_job {
+	struct vmm_struct *vm;
+	enum job_state state;
+	pid_t pid;			/* launch script, start only */
+	int fd;				/* monitor connection */
+	int sent;			/* request written to the monitor */
+	double begin, end;
+	int deps[MAX_DEPS];		/* batch indices to wait for */
+	int ndeps;
+	char why[128];			/* reason of JOB_FAILED */
+	char in[VMM_MSG_MAX_LEN];
+	size_t in_len;
+};
+
+struct bulk_ops {
+	const char *verb;		/* "started", "stopped" */
+	/* 1 when job i may begin, 0 to wait, -1 to give up */
+	int (*ready)(struct vm_job *jobs, int n, int i);
+	int (*begin)(struct vm_job *job);
+	/* make progress on the events of job->fd */
+	void (*step)(struct vm_job *job, short revents);
+};
+
+static void job_fail(struct vm_job *job, const char *fmt, ...)
 {
-	printf("acrnctl stop [vmname0] [vmname1] ...\n"
-	       "\t run \"acrnctl list\" to get running VMs\n");
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(job->why, sizeof(job->why), fmt, ap);
+	va_end(ap);
+	job->state = JOB_FAILED;
 }
 
-static int send_stop_msg(char *vmname)
+static void job_disconnect(struct vm_job *job)
 {
-	int fd, ret;
-	struct sockaddr_un addr;
-	struct vmm_msg msg;
-	struct timeval timeout;
-	fd_set rfd, wfd;
-	char buf[128];
+	if (job->fd >= 0)
+		close(job->fd);
+	job->fd = -1;
+	job->sent = 0;
+	job->in_len = 0;
+}
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (fd < 0) {
-		printf("%s %d\n", __FUNCTION__, __LINE__);
-		ret = -1;
-		goto sock_err;
+static int job_send(struct vm_job *job, unsigned int msgid)
+{
+	struct vmm_msg_handshake msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.vmsg.magic = VMM_MSG_MAGIC;
+	msg.vmsg.msgid = msgid;
+	msg.vmsg.len = sizeof(msg.vmsg);
+	if (msgid == MSG_HANDSHAKE) {
+		msg.vmsg.len = sizeof(msg);
+		snprintf(msg.name, sizeof(msg.name), "acrnctl");
 	}
 
-	addr.sun_family = AF_UNIX;
-	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s-monitor.socket",
-		 ACRN_DM_SOCK_ROOT, vmname);
+	if (write(job->fd, &msg, msg.vmsg.len) != msg.vmsg.len)
+		return -1;
+	job->sent = 1;
+	return 0;
+}
+
+/* Read what the monitor sent, -1 once it hung up */
+static int job_recv(struct vm_job *job)
+{
+	ssize_t len;
+
+	len = read(job->fd, job->in + job->in_len,
+		   sizeof(job->in) - job->in_len - 1);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (len <= 0)
+		return -1;
+	job->in_len += len;
+	job->in[job->in_len] = 0;
+	return 0;
+}
 
-	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-	if (ret < 0) {
-		printf("%s %d\n", __FUNCTION__, __LINE__);
-		goto connect_err;
+/* The first whole message in job->in, or NULL */
+static struct vmm_msg *job_msg(struct vm_job *job)
+{
+	struct vmm_msg *msg = (void *)job->in;
+
+	if (job->in_len < sizeof(*msg))
+		return NULL;
+	if (msg->magic != VMM_MSG_MAGIC || msg->len < sizeof(*msg)
+	    || msg->len > VMM_MSG_MAX_LEN) {
+		job->in_len = 0;
+		return NULL;
 	}
+	return job->in_len >= msg->len ? msg : NULL;
+}
 
-	msg.magic = VMM_MSG_MAGIC;
-	msg.msgid = REQ_STOP;
-	msg.len = sizeof(msg);
+static void job_consume(struct vm_job *job)
+{
+	size_t len = ((struct vmm_msg *)job->in)->len;
 
-	timeout.tv_sec = 1;	/* wait 1 second for read/write socket */
-	timeout.tv_usec = 0;
-	FD_ZERO(&rfd);
-	FD_ZERO(&wfd);
-	FD_SET(fd, &rfd);
-	FD_SET(fd, &wfd);
+	job->in_len -= len;
+	memmove(job->in, job->in + len, job->in_len);
+}
 
-	select(fd + 1, NULL, &wfd, NULL, &timeout);
+static int bulk_run(struct vm_job *jobs, int n, int max_jobs, int timeout,
+		    struct bulk_ops *ops)
+{
+	struct pollfd *pfd;
+	int i, r, running, left, progress, failed = 0;
+	double now;
 
-	if (!FD_ISSET(fd, &wfd)) {
-		printf("%s %d\n", __FUNCTION__, __LINE__);
-		goto cant_write;
+	pfd = calloc(n, sizeof(*pfd));
+	if (!pfd) {
+		perror("alloc for bulk");
+		return -1;
 	}
 
-	ret = write(fd, &msg, sizeof(msg));
+	do {
+		now = monotonic_now();
+		running = 0;
+		for (i = 0; i < n; i++)
+			if (jobs[i].state == JOB_RUNNING)
+				running++;
+
+		/* jobs begin in command line order as slots free up */
+		progress = 0;
+		for (i = 0; i < n && running < max_jobs; i++) {
+			if (jobs[i].state != JOB_PENDING)
+				continue;
+			r = ops->ready(jobs, n, i);
+			if (!r)
+				continue;
+			jobs[i].begin = now;
+			if (r > 0 && !ops->begin(&jobs[i])) {
+				jobs[i].state = JOB_RUNNING;
+				running++;
+			}
+			progress = 1;
+		}
+
+		/* nothing runs and nothing can begin: circular dependencies */
+		if (!running && !progress)
+			for (i = 0; i < n; i++)
+				if (jobs[i].state == JOB_PENDING)
+					job_fail(&jobs[i], "circular dependency");
+
+		for (i = 0; i < n; i++) {
+			pfd[i].fd = -1;
+			pfd[i].revents = 0;
+			if (jobs[i].state != JOB_RUNNING)
+				continue;
+			if (now - jobs[i].begin > timeout) {
+				job_fail(&jobs[i], "timed out");
+				continue;
+			}
+			pfd[i].fd = jobs[i].fd;
+			pfd[i].events = jobs[i].sent ? POLLIN : POLLOUT;
+		}
 
-	/* wait response */
-	select(fd + 1, &rfd, NULL, NULL, &timeout);
+		if (running && poll(pfd, n, BULK_TICK_MS) < 0 && errno != EINTR)
+			for (i = 0; i < n; i++)
+				pfd[i].revents = 0;
+
+		left = 0;
+		now = monotonic_now();
+		for (i = 0; i < n; i++) {
+			if (jobs[i].state == JOB_RUNNING)
+				ops->step(&jobs[i], pfd[i].revents);
+			if (jobs[i].state == JOB_PENDING
+			    || jobs[i].state == JOB_RUNNING) {
+				left++;
+				continue;
+			}
+			if (jobs[i].end)
+				continue;
+
+			/* report each VM as soon as it is through */
+			jobs[i].end = now;
+			job_disconnect(&jobs[i]);
+			if (jobs[i].state == JOB_DONE)
+				printf("%s %s in %.3fs\n", jobs[i].vm->name,
+				       ops->verb, jobs[i].end - jobs[i].begin);
+			else {
+				printf("%s not %s: %s\n", jobs[i].vm->name,
+				       ops->verb, jobs[i].why);
+				failed++;
+			}
+			fflush(stdout);
+		}
+	} while (left);
 
-	if (FD_ISSET(fd, &rfd)) {
-		memset(buf, 0, sizeof(buf));
-		ret = read(fd, buf, sizeof(buf));
-		if (ret <= sizeof(buf))
-			process_msg((void*)&buf);
+	free(pfd);
+	return failed ? -1 : 0;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	const struct vmm_struct *const *x = a, *const *y = b;
+
+	return strcmp((*x)->name, (*y)->name);
+}
+
+/*
+ * Resolve names and glob patterns to VMs for a command, in command line
+ * order and each VM once. A pattern skips VMs in the wrong state; a name
+ * in the wrong state is reported. ok() tells if a state fits.
+ */
+static struct vmm_struct **vm_select(int argc, char *argv[],
+				     int (*ok)(unsigned long state),
+				     const char *cmd, int *count)
+{
+	struct vmm_struct **sel, *s;
+	int i, k, n = 0, nvm = 0, first;
+
+	LIST_FOREACH(s, &vmm_head, list)
+		nvm++;
+	sel = calloc(nvm + 1, sizeof(*sel));
+	if (!sel) {
+		perror("alloc for select");
+		*count = 0;
+		return NULL;
+	}
+
+	for (i = 0; i < argc; i++) {
+		first = n;
+		LIST_FOREACH(s, &vmm_head, list) {
+			if (fnmatch(argv[i], s->name, 0))
+				continue;
+			if (!ok(s->state)) {
+				if (!strpbrk(argv[i], "*?["))
+					printf("can't %s %s(%s)\n", cmd,
+					       s->name, state_str[s->state]);
+				continue;
+			}
+			for (k = 0; k < n; k++)
+				if (sel[k] == s)
+					break;
+			if (k == n)
+				sel[n++] = s;
+		}
+		if (first == n && !strpbrk(argv[i], "*?[") && !vmm_find(argv[i]))
+			printf("can't find %s\n", argv[i]);
+		/* make what one pattern matched come out sorted */
+		qsort(&sel[first], n - first, sizeof(*sel), name_cmp);
 	}
 
- cant_write:
- connect_err:
+	*count = n;
+	return sel;
+}
+
+/*
+ * Read ACRNCTL_OPT_ROOT/add/<vm>.<suffix>, a missing file reads empty.
+ * <vm>.args holds the launch script args, <vm>.deps the dependency
+ * hints: VMs, separated by blanks, that start before and stop after <vm>.
+ */
+static int vm_read_conf(const char *vmname, const char *suffix, char *buf,
+			size_t len)
+{
+	char path[256];
+	int fd, n;
+
+	buf[0] = 0;
+	snprintf(path, sizeof(path), "%s/add/%s.%s", ACRNCTL_OPT_ROOT,
+		 vmname, suffix);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, len - 1);
 	close(fd);
- sock_err:
-	return ret;
+	if (n < 0)
+		return -1;
+	buf[n] = 0;
+	return 0;
 }
 
-static int acrnctl_do_stop(int argc, char *argv[])
+static struct vm_job *bulk_jobs(struct vmm_struct **sel, int n,
+				int missing_ok)
 {
-	struct vmm_struct *s;
-	int i;
+	struct vm_job *jobs;
+	struct vmm_struct *d;
+	char deps[1024], *p, *save;
+	int i, j;
+
+	jobs = calloc(n, sizeof(*jobs));
+	if (!jobs) {
+		perror("alloc for jobs");
+		return NULL;
+	}
 
-	if (argc < 2) {
-		acrnctl_stop_help();
+	for (i = 0; i < n; i++) {
+		jobs[i].vm = sel[i];
+		jobs[i].fd = -1;
+		vm_read_conf(sel[i]->name, "deps", deps, sizeof(deps));
+		save = NULL;
+		for (p = strtok_r(deps, " \t\n", &save); p;
+		     p = strtok_r(NULL, " \t\n", &save)) {
+			for (j = 0; j < n; j++)
+				if (!strcmp(sel[j]->name, p))
+					break;
+			if (j < n && j != i && jobs[i].ndeps < MAX_DEPS) {
+				jobs[i].deps[jobs[i].ndeps++] = j;
+				continue;
+			}
+			if (j < n || missing_ok)
+				continue;
+			/* a dependency outside the batch has to be up */
+			d = vmm_find(p);
+			if (!d || (d->state != VM_STARTED
+				   && d->state != VM_UNTRACKED)) {
+				job_fail(&jobs[i], "needs %s, which is not running",
+					 p);
+				break;
+			}
+		}
+	}
+
+	return jobs;
+}
+
+static int bulk_getopt(int argc, char *argv[], int *max_jobs, int *timeout)
+{
+	int opt;
+
+	*max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (*max_jobs < 1)
+		*max_jobs = 1;
+	*timeout = BULK_TIMEOUT;
+
+	while ((opt = getopt(argc, argv, "j:t:")) != -1) {
+		switch (opt) {
+		case 'j':
+			*max_jobs = atoi(optarg);
+			break;
+		case 't':
+			*timeout = atoi(optarg);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (*max_jobs < 1 || *timeout < 1 || optind >= argc)
+		return -1;
+	return 0;
+}
+
+/* command: stop */
+static void acrnctl_stop_help(void)
+{
+	printf("acrnctl stop [-j jobs] [-t seconds] [vmname|pattern] ...\n"
+	       "\t run \"acrnctl list\" to get running VMs\n"
+	       "\t stops up to -j VMs at once (default: one per CPU), a VM\n"
+	       "\t after those listing it in their .deps file, and waits\n"
+	       "\t -t seconds (default %d) for each acrn-dm to exit\n",
+	       BULK_TIMEOUT);
+}
+
+static int stop_ok(unsigned long state)
+{
+	return state != VM_CREATED;
+}
+
+/* a VM stops once every VM of the batch needing it is down */
+static int stop_ready(struct vm_job *jobs, int n, int i)
+{
+	int j, k;
+
+	for (j = 0; j < n; j++)
+		for (k = 0; k < jobs[j].ndeps; k++) {
+			if (jobs[j].deps[k] != i)
+				continue;
+			if (jobs[j].state == JOB_FAILED) {
+				job_fail(&jobs[i], "%s is still running",
+					 jobs[j].vm->name);
+				return -1;
+			}
+			if (jobs[j].state != JOB_DONE)
+				return 0;
+		}
+	return 1;
+}
+
+static int stop_begin(struct vm_job *job)
+{
+	job->fd = monitor_connect(job->vm->name);
+	if (job->fd < 0) {
+		job_fail(job, "can't reach its acrn-dm");
 		return -1;
 	}
+	return 0;
+}
 
-	if (!strcmp("help", argv[1])) {
+/* send REQ_STOP, then wait for acrn-dm to hang up on exit */
+static void stop_step(struct vm_job *job, short revents)
+{
+	struct vmm_msg *msg;
+	int r;
+
+	if (!revents)
+		return;
+
+	if (!job->sent) {
+		if ((revents & (POLLERR | POLLHUP)) || job_send(job, REQ_STOP))
+			job_fail(job, "can't send stop request");
+		return;
+	}
+
+	r = job_recv(job);
+	while ((msg = job_msg(job))) {
+		if (msg->msgid == MSG_STR)
+			printf("%s: %s\n", job->vm->name, msg->payload);
+		job_consume(job);
+	}
+	if (r < 0)
+		job->state = JOB_DONE;
+}
+
+static struct bulk_ops stop_ops = {
+	.verb = "stopped",
+	.ready = stop_ready,
+	.begin = stop_begin,
+	.step = stop_step,
+};
+
+static int acrnctl_do_stop(int argc, char *argv[])
+{
+	struct vmm_struct **sel;
+	struct vm_job *jobs;
+	int n, max_jobs, timeout, ret = -1;
+
+	if (argc == 2 && !strcmp("help", argv[1])) {
 		acrnctl_stop_help();
 		return 0;
 	}
 
-	vmm_update();
-	for (i = 1; i < argc; i++) {
-		s = vmm_find(argv[i]);
-		if (!s) {
-			printf("can't find %s\n", argv[i]);
-			continue;
-		}
-		if (s->state == VM_CREATED) {
-			printf("%s is already (%s)\n", argv[i],
-			       state_str[s->state]);
-			continue;
-		}
-		send_stop_msg(argv[i]);
+	if (bulk_getopt(argc, argv, &max_jobs, &timeout)) {
+		acrnctl_stop_help();
+		return -1;
 	}
 
-	return 0;
+	vmm_update();
+	sel = vm_select(argc - optind, &argv[optind], stop_ok, "stop", &n);
+	if (!n)
+		goto out;
+
+	jobs = bulk_jobs(sel, n, 1);
+	if (jobs)
+		ret = bulk_run(jobs, n, max_jobs, timeout, &stop_ops);
+	free(jobs);
+
+ out:
+	free(sel);
+	return ret;
 }
 
 /* command: delete */
 static void acrnctl_del_help(void)
 {
-	printf("acrnctl del [vmname0] [vmname1] ...\n"
+	printf("acrnctl del [vmname|pattern] ...\n"
 	       "\t run \"acrnctl list\" get VM names\n");
 }
 
+static int del_ok(unsigned long state)
+{
+	return state == VM_CREATED;
+}
+
 static int acrnctl_do_del(int argc, char *argv[])
 {
-	struct vmm_struct *s;
-	int i;
-	char cmd[128];
+	static const char *suffix[] = { "sh", "args", "deps" };
+	struct vmm_struct **sel;
+	char path[256];
+	int i, k, n;
 
 	if (argc < 2) {
 		acrnctl_del_help();
@@ -609,24 +1119,15 @@ static int acrnctl_do_del(int argc, char *argv[])
 	}
 
 	vmm_update();
-	for (i = 1; i < argc; i++) {
-		s = vmm_find(argv[i]);
-		if (!s) {
-			printf("can't find %s\n", argv[i]);
-			continue;
+	sel = vm_select(argc - 1, &argv[1], del_ok, "delete", &n);
+	for (i = 0; i < n; i++)
+		for (k = 0; k < sizeof(suffix) / sizeof(suffix[0]); k++) {
+			snprintf(path, sizeof(path), "%s/add/%s.%s",
+				 ACRNCTL_OPT_ROOT, sel[i]->name, suffix[k]);
+			if (unlink(path) && errno != ENOENT)
+				perror(path);
 		}
-		if (s->state != VM_CREATED) {
-			printf("can't delete %s(%s)\n", argv[i],
-			       state_str[s->state]);
-			continue;
-		}
-		snprintf(cmd, sizeof(cmd), "rm -f %s/add/%s.sh",
-			 ACRNCTL_OPT_ROOT, argv[i]);
-		system(cmd);
-		snprintf(cmd, sizeof(cmd), "rm -f %s/add/%s.args",
-			 ACRNCTL_OPT_ROOT, argv[i]);
-		system(cmd);
-	}
+	free(sel);
 
 	return 0;
 }
@@ -634,46 +1135,659 @@ static int acrnctl_do_del(int argc, char *argv[])
 /* command: start */
 static void acrnctl_start_help(void)
 {
-	printf("acrnctl start [vmname]\n"
+	printf("acrnctl start [-j jobs] [-t seconds] [vmname|pattern] ...\n"
 	       "\t run \"acrnctl list\" get VM names\n"
-	       "\t each time user can only start one VM\n");
+	       "\t starts up to -j VMs at once (default: one per CPU), a VM\n"
+	       "\t after those in its %s/add/<vmname>.deps file, and\n"
+	       "\t waits -t seconds (default %d) for each acrn-dm to answer\n"
+	       "\t on its monitor socket; output goes to %s/<vmname>.log\n",
+	       ACRNCTL_OPT_ROOT, BULK_TIMEOUT, ACRN_DM_SOCK_ROOT);
 }
 
-static int acrnctl_do_start(int argc, char *argv[])
+static int start_ok(unsigned long state)
 {
-	struct vmm_struct *s;
-	char cmd[128];
+	return state == VM_CREATED;
+}
 
-	if (argc != 2) {
-		acrnctl_start_help();
+static int start_ready(struct vm_job *jobs, int n, int i)
+{
+	int k;
+	struct vm_job *d;
+
+	for (k = 0; k < jobs[i].ndeps; k++) {
+		d = &jobs[jobs[i].deps[k]];
+		if (d->state == JOB_FAILED) {
+			job_fail(&jobs[i], "needs %s, which failed",
+				 d->vm->name);
+			return -1;
+		}
+		if (d->state != JOB_DONE)
+			return 0;
+	}
+	return 1;
+}
+
+/* run the launch script detached, with its saved args */
+static int start_begin(struct vm_job *job)
+{
+	char path[256], log[256], args[1024], *argv[MAX_WORD + 3];
+	char *p, *save = NULL;
+	int fd, n = 0;
+	pid_t pid;
+
+	if (vm_read_conf(job->vm->name, "args", args, sizeof(args))) {
+		job_fail(job, "can't read its args: %s", strerror(errno));
 		return -1;
 	}
 
-	if (!strcmp("help", argv[1])) {
+	snprintf(path, sizeof(path), "%s/add/%s.sh", ACRNCTL_OPT_ROOT,
+		 job->vm->name);
+	argv[n++] = "bash";
+	argv[n++] = path;
+	for (p = strtok_r(args, " \t\n", &save); p && n < MAX_WORD + 2;
+	     p = strtok_r(NULL, " \t\n", &save))
+		argv[n++] = p;
+	argv[n] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		job_fail(job, "fork: %s", strerror(errno));
+		return -1;
+	}
+
+	if (!pid) {
+		/* outlive acrnctl and its terminal */
+		setsid();
+		fd = open("/dev/null", O_RDONLY);
+		if (fd >= 0)
+			dup2(fd, STDIN_FILENO);
+		snprintf(log, sizeof(log), "%s/%s.log", ACRN_DM_SOCK_ROOT,
+			 job->vm->name);
+		fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execv("/bin/bash", argv);
+		_exit(127);
+	}
+
+	job->pid = pid;
+	return 0;
+}
+
+/* a VM is up once its acrn-dm answers the monitor handshake */
+static void start_step(struct vm_job *job, short revents)
+{
+	int status;
+
+	if (job->pid > 0 && waitpid(job->pid, &status, WNOHANG) == job->pid) {
+		job->pid = 0;
+		job_fail(job, "launch script exited (%d), see %s/%s.log",
+			 WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+			 ACRN_DM_SOCK_ROOT, job->vm->name);
+		return;
+	}
+
+	if (job->fd < 0) {
+		/* refused until acrn-dm listens, retried every tick */
+		job->fd = monitor_connect(job->vm->name);
+		return;
+	}
+
+	if (!job->sent) {
+		if (!(revents & POLLOUT))
+			return;
+		if ((revents & (POLLERR | POLLHUP))
+		    || job_send(job, MSG_HANDSHAKE))
+			job_disconnect(job);
+		return;
+	}
+
+	if (!revents)
+		return;
+	if (job_recv(job))
+		job_disconnect(job);
+	else if (job_msg(job))
+		job->state = JOB_DONE;
+}
+
+static struct bulk_ops start_ops = {
+	.verb = "started",
+	.ready = start_ready,
+	.begin = start_begin,
+	.step = start_step,
+};
+
+static int acrnctl_do_start(int argc, char *argv[])
+{
+	struct vmm_struct **sel;
+	struct vm_job *jobs;
+	int n, max_jobs, timeout, ret = -1;
+
+	if (argc == 2 && !strcmp("help", argv[1])) {
 		acrnctl_start_help();
 		return 0;
 	}
 
+	if (bulk_getopt(argc, argv, &max_jobs, &timeout)) {
+		acrnctl_start_help();
+		return -1;
+	}
+
 	vmm_update();
-	s = vmm_find(argv[1]);
-	if (!s) {
-		printf("can't find %s\n", argv[1]);
+	sel = vm_select(argc - optind, &argv[optind], start_ok, "start", &n);
+	if (!n)
+		goto out;
+
+	mkdir(ACRN_DM_SOCK_ROOT, 0755);
+	jobs = bulk_jobs(sel, n, 0);
+	if (jobs)
+		ret = bulk_run(jobs, n, max_jobs, timeout, &start_ops);
+	free(jobs);
+
+ out:
+	free(sel);
+	return ret;
+}
+
+/* command: top */
+static void acrnctl_top_help(void)
+{
+	printf("acrnctl top [-d seconds] [-n iterations]\n"
+	       "\tshow VM exits, block I/O and acrn-dm CPU usage of all\n"
+	       "\trunning VMs, refreshed every -d seconds (default 1)\n");
+}
+
+struct top_sample {
+	int valid;
+	double time;			/* seconds, CLOCK_MONOTONIC */
+	unsigned long long exits;
+	unsigned long long rd_bytes;
+	unsigned long long wr_bytes;
+	unsigned long long irqs;
+	unsigned long long cpu_ticks;	/* utime + stime of acrn-dm */
+};
+
+struct top_vm {
+	char name[128];
+	int fd;
+	pid_t pid;
+	char in[2 * VMM_MSG_MAX_LEN];	/* partial monitor messages */
+	size_t in_len;
+	char *dump;			/* metrics chunks of the current dump */
+	size_t dump_len;
+	struct top_sample prev, cur;
+};
+
+/* utime + stime of pid, from /proc/<pid>/stat */
+static unsigned long long top_cpu_ticks(pid_t pid)
+{
+	unsigned long long utime, stime;
+	char path[64], buf[512], *p;
+	int fd, len;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = 0;
+
+	/* comm may contain spaces, fields restart after its ')' */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+			 " %llu %llu", &utime, &stime) != 2)
+		return 0;
+	return utime + stime;
+}
+
+/* Sum the metrics top shows out of one binary metrics dump */
+static int top_parse_dump(struct top_vm *vm)
+{
+	struct metrics_bin_hdr *hdr = (void *)vm->dump;
+	struct metrics_bin_record *rec;
+	struct top_sample *t = &vm->cur;
+	unsigned long long val;
+	const char *name, *labels;
+	size_t off, head;
+	unsigned int i;
+
+	if (vm->dump_len < sizeof(*hdr) || hdr->magic != METRICS_BIN_MAGIC
+	    || hdr->version != METRICS_BIN_VERSION)
 		return -1;
+
+	vm->prev = vm->cur;
+	memset(t, 0, sizeof(*t));
+	t->time = monotonic_now();
+
+	off = sizeof(*hdr);
+	for (i = 0; i < hdr->nrecords; i++, off += rec->size) {
+		rec = (void *)(vm->dump + off);
+		if (off + sizeof(*rec) > vm->dump_len || rec->size < sizeof(*rec)
+		    || off + rec->size > vm->dump_len)
+			return -1;
+		if (!rec->nvalues)
+			continue;
+
+		name = (const char *)(rec + 1);
+		labels = name + rec->name_len;
+		head = (sizeof(*rec) + rec->name_len + rec->labels_len + 7) & ~7UL;
+		if (head + sizeof(val) > rec->size)
+			return -1;
+		memcpy(&val, (char *)rec + head, sizeof(val));
+
+#define IS(s)	(rec->name_len == strlen(s) && !strncmp(name, s, rec->name_len))
+		if (IS("acrn_vmexits_total"))
+			t->exits += val;
+		else if (IS("acrn_pci_interrupts_total"))
+			t->irqs += val;
+		else if (IS("acrn_blockif_bytes_total")) {
+			if (memmem(labels, rec->labels_len, "op=\"read\"", 9))
+				t->rd_bytes += val;
+			else if (memmem(labels, rec->labels_len,
+					"op=\"write\"", 10))
+				t->wr_bytes += val;
+		}
+#undef IS
 	}
 
-	if (s->state != VM_CREATED) {
-		printf("can't start %s(%s)\n", argv[1], state_str[s->state]);
+	t->cpu_ticks = top_cpu_ticks(vm->pid);
+	t->valid = 1;
+	return 0;
+}
+
+/* Collect metrics chunks out of the monitor messages read so far */
+static int top_process(struct top_vm *vm)
+{
+	struct vmm_msg_metrics *m;
+	struct vmm_msg *msg;
+	size_t off = 0, n;
+	char *tmp;
+
+	while (vm->in_len - off >= sizeof(*msg)) {
+		msg = (void *)(vm->in + off);
+		if (msg->magic != VMM_MSG_MAGIC || msg->len < sizeof(*msg)
+		    || msg->len > VMM_MSG_MAX_LEN)
+			return -1;
+		if (vm->in_len - off < msg->len)
+			break;
+		off += msg->len;
+
+		if (msg->msgid != REQ_METRICS_BIN || msg->len < sizeof(*m))
+			continue;
+		m = (void *)msg;
+		if (!m->seq)
+			vm->dump_len = 0;
+		n = msg->len - sizeof(*m);
+		tmp = realloc(vm->dump, vm->dump_len + n);
+		if (!tmp)
+			return -1;
+		vm->dump = tmp;
+		memcpy(vm->dump + vm->dump_len, m->data, n);
+		vm->dump_len += n;
+		if (m->last == VMM_CHUNK_DROPPED)
+			vm->dump_len = 0;
+		else if (m->last)
+			top_parse_dump(vm);
+	}
+
+	memmove(vm->in, vm->in + off, vm->in_len - off);
+	vm->in_len -= off;
+	return 0;
+}
+
+/* Ask acrn-dm to push a binary metrics dump every interval_ms */
+static int top_subscribe(struct top_vm *vm, unsigned int interval_ms)
+{
+	struct vmm_msg_subscribe sub;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct pollfd pfd = {.fd = vm->fd, .events = POLLOUT};
+
+	if (poll(&pfd, 1, PROBE_TIMEOUT_MS) != 1 || !(pfd.revents & POLLOUT))
 		return -1;
+
+	/* the peer is acrn-dm itself, that is whose CPU time we show */
+	if (!getsockopt(vm->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		vm->pid = cred.pid;
+
+	memset(&sub, 0, sizeof(sub));
+	sub.vmsg.magic = VMM_MSG_MAGIC;
+	sub.vmsg.msgid = REQ_SUBSCRIBE;
+	sub.vmsg.len = sizeof(sub);
+	sub.msgid = REQ_METRICS_BIN;
+	sub.interval_ms = interval_ms;
+
+	if (write(vm->fd, &sub, sizeof(sub)) != sizeof(sub))
+		return -1;
+	return 0;
+}
+
+static void top_show(struct top_vm *vms, int n)
+{
+	static long hz;
+	struct top_sample *a, *b;
+	double dt;
+	int i;
+
+	if (!hz)
+		hz = sysconf(_SC_CLK_TCK);
+
+	printf("\033[H\033[2J");
+	printf("%-24s %12s %10s %10s %10s %8s\n", "VM", "EXITS/s",
+	       "READ KB/s", "WRITE KB/s", "IRQ/s", "DM CPU%");
+	for (i = 0; i < n; i++) {
+		a = &vms[i].prev;
+		b = &vms[i].cur;
+		if (vms[i].fd < 0) {
+			printf("%-24s %12s\n", vms[i].name, "(exited)");
+			continue;
+		}
+		if (!a->valid || !b->valid || b->time <= a->time) {
+			printf("%-24s %12s\n", vms[i].name, "-");
+			continue;
+		}
+		dt = b->time - a->time;
+		printf("%-24s %12.0f %10.1f %10.1f %10.0f %8.1f\n",
+		       vms[i].name,
+		       (b->exits - a->exits) / dt,
+		       (b->rd_bytes - a->rd_bytes) / dt / 1024,
+		       (b->wr_bytes - a->wr_bytes) / dt / 1024,
+		       (b->irqs - a->irqs) / dt,
+		       (b->cpu_ticks - a->cpu_ticks) * 100.0 / hz / dt);
 	}
+	fflush(stdout);
+}
 
-	snprintf(cmd, sizeof(cmd), "bash %s/add/%s.sh $(cat %s/add/%s.args)",
-		 ACRNCTL_OPT_ROOT, argv[1], ACRNCTL_OPT_ROOT, argv[1]);
+static int acrnctl_do_top(int argc, char *argv[])
+{
+	struct top_vm *vms = NULL;
+	struct pollfd *pfd = NULL;
+	char **names;
+	double interval = 1, next;
+	int i, n, live, opt, ret = -1, iter = -1, timeout;
+	ssize_t len;
+
+	if (argc == 2 && !strcmp("help", argv[1])) {
+		acrnctl_top_help();
+		return 0;
+	}
 
-	system(cmd);
+	while ((opt = getopt(argc, argv, "d:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			interval = atof(optarg);
+			break;
+		case 'n':
+			iter = atoi(optarg);
+			break;
+		default:
+			acrnctl_top_help();
+			return -1;
+		}
+	}
+	if (interval < 0.1 || !iter) {
+		acrnctl_top_help();
+		return -1;
+	}
+
+	names = monitor_list(&n);
+	if (!n) {
+		printf("There are no running VMs\n");
+		goto out;
+	}
+
+	vms = calloc(n, sizeof(*vms));
+	pfd = calloc(n, sizeof(*pfd));
+	if (!vms || !pfd) {
+		perror("alloc for top");
+		goto out;
+	}
+
+	/* connect to every acrn-dm at once, then let them push the data */
+	for (i = 0; i < n; i++) {
+		snprintf(vms[i].name, sizeof(vms[i].name), "%s", names[i]);
+		vms[i].fd = monitor_connect(names[i]);
+	}
+	for (i = 0, live = 0; i < n; i++) {
+		/* stale sockets of dead acrn-dm are left out */
+		if (vms[i].fd < 0)
+			continue;
+		if (top_subscribe(&vms[i], interval * 1000)) {
+			close(vms[i].fd);
+			continue;
+		}
+		if (live != i)
+			memcpy(&vms[live], &vms[i], sizeof(vms[i]));
+		pfd[live].fd = vms[live].fd;
+		pfd[live].events = POLLIN;
+		live++;
+	}
+	n = live;
+	if (!n) {
+		printf("There are no running VMs\n");
+		goto out;
+	}
+
+	next = monotonic_now() + interval;
+	while (iter) {
+		timeout = (next - monotonic_now()) * 1000;
+		if (timeout <= 0) {
+			top_show(vms, n);
+			if (iter > 0)
+				iter--;
+			next += interval;
+			continue;
+		}
+
+		if (poll(pfd, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			goto out;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+			len = read(vms[i].fd, vms[i].in + vms[i].in_len,
+				   sizeof(vms[i].in) - vms[i].in_len);
+			if (len < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (len <= 0 || (vms[i].in_len += len,
+					 top_process(&vms[i]))) {
+				/* acrn-dm went away */
+				close(vms[i].fd);
+				vms[i].fd = pfd[i].fd = -1;
+			}
+		}
+	}
+	ret = 0;
+
+ out:
+	for (i = 0; vms && i < n; i++) {
+		if (vms[i].fd >= 0)
+			close(vms[i].fd);
+		free(vms[i].dump);
+	}
+	free(vms);
+	free(pfd);
+	monitor_list_free(names);
+	return ret;
+}
+
+static void acrnctl_trace_help(void)
+{
+	printf("acrnctl trace VM_NAME on [tracepoints]\n"
+	       "acrnctl trace VM_NAME off\n"
+	       "acrnctl trace VM_NAME dump\n"
+	       "acrnctl trace VM_NAME flight [reason]\n"
+	       "\tenable all or the tracepoints listed, separated by ',',\n"
+	       "\tin acrn-dm, disable them, or print what they recorded\n"
+	       "\tsince the last dump, in time order; or have acrn-dm\n"
+	       "\task acrntrace -f to dump its flight recorder\n");
+}
+
+#define TRACE_TIMEOUT_MS	2000
+
+/* Read one whole monitor message into buf, -1 on failure or timeout */
+static int trace_read_msg(int fd, struct vmm_msg *buf)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	size_t len = 0, want = sizeof(*buf);
+	ssize_t ret;
+
+	while (len < want) {
+		if (poll(&pfd, 1, TRACE_TIMEOUT_MS) != 1)
+			return -1;
+		ret = read(fd, (char *)buf + len, want - len);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (ret <= 0)
+			return -1;
+		len += ret;
+		if (len == sizeof(*buf)) {
+			if (buf->magic != VMM_MSG_MAGIC || buf->len < want
+			    || buf->len > VMM_MSG_MAX_LEN)
+				return -1;
+			want = buf->len;
+		}
+	}
 
 	return 0;
 }
 
+/* Send req, and gather its chunked reply into *out, NUL terminated */
+static int trace_request(int fd, struct vmm_msg_trace *req, char **out)
+{
+	struct vmm_msg_metrics *m;
+	size_t len = 0, n;
+	char *tmp;
+
+	req->vmsg.magic = VMM_MSG_MAGIC;
+	req->vmsg.msgid = REQ_TRACE;
+	req->vmsg.len = sizeof(*req);
+	if (write(fd, req, sizeof(*req)) != sizeof(*req))
+		return -1;
+
+	m = malloc(VMM_MSG_MAX_LEN);
+	if (!m)
+		return -1;
+
+	*out = NULL;
+	do {
+		if (trace_read_msg(fd, &m->vmsg))
+			goto err;
+		if (m->vmsg.msgid != REQ_TRACE || m->vmsg.len < sizeof(*m)) {
+			m->last = 0;
+			continue;
+		}
+		n = m->vmsg.len - sizeof(*m);
+		tmp = realloc(*out, len + n + 1);
+		if (!tmp)
+			goto err;
+		*out = tmp;
+		memcpy(*out + len, m->data, n);
+		len += n;
+		(*out)[len] = 0;
+	} while (!m->last);
+
+	if (m->last == VMM_CHUNK_DROPPED) {
+		fprintf(stderr, "trace reply dropped, acrn-dm queue full\n");
+		goto err;
+	}
+
+	free(m);
+	return *out ? 0 : -1;
+
+ err:
+	free(m);
+	free(*out);
+	*out = NULL;
+	return -1;
+}
+
+static int acrnctl_do_trace(int argc, char *argv[])
+{
+	struct pollfd pfd;
+	struct vmm_msg_trace req;
+	unsigned long lost, total = 0;
+	char *reply, *body;
+	int fd, more, ret = -1;
+
+	if (argc < 3 || (strcmp(argv[2], "on") && strcmp(argv[2], "off")
+			 && strcmp(argv[2], "dump") && strcmp(argv[2], "flight"))
+	    || argc > 4 || (argc == 4 && strcmp(argv[2], "on")
+			    && strcmp(argv[2], "flight"))) {
+		acrnctl_trace_help();
+		return argc == 2 && !strcmp(argv[1], "help") ? 0 : -1;
+	}
+
+	fd = monitor_connect(argv[1]);
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	if (fd < 0 || poll(&pfd, 1, PROBE_TIMEOUT_MS) != 1
+	    || !(pfd.revents & POLLOUT)) {
+		printf("%s is not running\n", argv[1]);
+		goto out;
+	}
+
+	memset(&req, 0, sizeof(req));
+	if (strcmp(argv[2], "dump")) {
+		req.op = TRACE_OP_ENABLE;
+		if (!strcmp(argv[2], "on"))
+			snprintf(req.tracepoints, sizeof(req.tracepoints),
+				 "%s", argc == 4 ? argv[3] : "all");
+		else if (!strcmp(argv[2], "flight")) {
+			req.op = TRACE_OP_FLIGHT;
+			if (argc == 4)
+				snprintf(req.tracepoints,
+					 sizeof(req.tracepoints), "%s",
+					 argv[3]);
+		}
+		if (trace_request(fd, &req, &reply))
+			goto fail;
+		printf("%s", reply);
+		free(reply);
+		ret = 0;
+		goto out;
+	}
+
+	/* a dump is drained in rounds, until acrn-dm has no more */
+	req.op = TRACE_OP_DRAIN;
+	do {
+		if (trace_request(fd, &req, &reply))
+			goto fail;
+		more = 0;
+		lost = 0;
+		body = strchr(reply, '\n');
+		if (sscanf(reply, "# tsc_hz %*u lost %lu more %d",
+			   &lost, &more) != 2 || !body) {
+			free(reply);
+			goto fail;
+		}
+		total += lost;
+		fputs(body + 1, stdout);
+		free(reply);
+	} while (more);
+
+	if (total)
+		fprintf(stderr, "%lu records lost, dump more often\n", total);
+	ret = 0;
+	goto out;
+
+ fail:
+	printf("%s: no answer to the trace request\n", argv[1]);
+ out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
 #define ACMD(CMD,FUNC)	\
 {.cmd = CMD, .func = FUNC,}
 
@@ -686,6 +1800,8 @@ struct acrnctl_cmd {
 	ACMD("stop", acrnctl_do_stop),
 	ACMD("del", acrnctl_do_del),
 	ACMD("add", acrnctl_do_add),
+	ACMD("top", acrnctl_do_top),
+	ACMD("trace", acrnctl_do_trace),
 };
 
 #define NCMD	(sizeof(acmds)/sizeof(struct acrnctl_cmd))
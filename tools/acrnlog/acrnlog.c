@@ -38,9 +38,13 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <dirent.h>
+#include <sys/queue.h>
+#include <zlib.h>
 
 #define LOG_ELEMENT_SIZE        80
 #define LOG_MSG_SIZE		480
+#define LOG_READ_ELEMENTS	64	/* sbuf elements asked per read() */
 #define PCPU_NUM		4
 
 /* num of physical cpu, not the cpu num seen on SOS */
@@ -67,6 +71,10 @@ struct hvlog_dev {
 	int latched;		/* 1 if an sbuf element latched */
 	char entry_latch[LOG_ELEMENT_SIZE];	/* latch for an sbuf element */
 	struct hvlog_msg latched_msg;	/* latch for parsed msg */
+
+	/* elements read ahead, consumed from pos */
+	char rbuf[LOG_ELEMENT_SIZE * LOG_READ_ELEMENTS];
+	size_t rlen, rpos;
 };
 
 static int shell_cmd(const char *cmd, char *outbuf, int len)
@@ -118,6 +126,78 @@ static int get_cpu_num(void)
 	return ret;
 }
 
+/*
+ * Copy the next sbuf element of dev to entry, 0 if there is none yet.
+ * Elements are read ahead as many as the driver hands out at once.
+ */
+static size_t hvlog_read_entry(struct hvlog_dev *dev, char *entry)
+{
+	ssize_t ret;
+
+	if (dev->rlen - dev->rpos < LOG_ELEMENT_SIZE) {
+		/* keep a partial element, if any, and refill behind it */
+		dev->rlen -= dev->rpos;
+		memmove(dev->rbuf, dev->rbuf + dev->rpos, dev->rlen);
+		dev->rpos = 0;
+
+		ret = read(dev->fd, dev->rbuf + dev->rlen,
+			   sizeof(dev->rbuf) - dev->rlen);
+		if (ret > 0)
+			dev->rlen += ret;
+		if (dev->rlen < LOG_ELEMENT_SIZE)
+			return 0;
+	}
+
+	memcpy(entry, dev->rbuf + dev->rpos, LOG_ELEMENT_SIZE);
+	dev->rpos += LOG_ELEMENT_SIZE;
+
+	return LOG_ELEMENT_SIZE;
+}
+
+/* parse number at *s, then expect the literal sep behind it */
+static int parse_field(const char **s, const char *sep, __u64 *val)
+{
+	const char *p = *s;
+	size_t len = strlen(sep);
+	__u64 v = 0;
+
+	if (*p < '0' || *p > '9')
+		return -1;
+	while (*p >= '0' && *p <= '9')
+		v = v * 10 + (*p++ - '0');
+
+	if (strncmp(p, sep, len))
+		return -1;
+
+	*val = v;
+	*s = p + len;
+	return 0;
+}
+
+/*
+ * Parse a message head "[<usec>us][cpu=<cpu>][sev=<sev>][seq=<seq>]",
+ * 0 if entry starts one.
+ */
+static int hvlog_parse_head(const char *entry, struct hvlog_msg *msg)
+{
+	__u64 usec, cpu, sev, seq;
+
+	if (*entry++ != '[')
+		return -1;
+
+	if (parse_field(&entry, "us][cpu=", &usec)
+	    || parse_field(&entry, "][sev=", &cpu)
+	    || parse_field(&entry, "][seq=", &sev)
+	    || parse_field(&entry, "]", &seq))
+		return -1;
+
+	msg->usec = usec;
+	msg->cpu = cpu;
+	msg->sev = sev;
+	msg->seq = seq;
+	return 0;
+}
+
 /*
  * The function read a complete msg from acrnlog dev.
  * read one more sbuf entry if read an entry doesn't end with '\0'
@@ -146,18 +226,12 @@ struct hvlog_msg *hvlog_read_dev(struct hvlog_dev *dev)
 			msg_num++;
 			memcpy(msg[0], msg[1], sizeof(struct hvlog_msg));
 		} else {
-			ret =
-			    read(dev->fd, &msg[0]->raw[msg[0]->len],
-				 LOG_ELEMENT_SIZE);
+			ret = hvlog_read_entry(dev, &msg[0]->raw[msg[0]->len]);
 			if (!ret)
 				break;
 			/* do we read a new meaasge? */
-			ret =
-			    sscanf(&msg[0]->raw[msg[0]->len],
-				   "[%lluus][cpu=%d][sev=%d][seq=%llu]:",
-				   &msg[msg_num]->usec, &msg[msg_num]->cpu,
-				   &msg[msg_num]->sev, &msg[msg_num]->seq);
-			if (ret == 4) {
+			if (!hvlog_parse_head(&msg[0]->raw[msg[0]->len],
+					      msg[msg_num])) {
 				msg_num++;
 				/* if we read another new msg, latch it */
 				/* to process next time */
@@ -178,7 +252,7 @@ struct hvlog_msg *hvlog_read_dev(struct hvlog_dev *dev)
 			continue;
 		}
 
-		len = strlen(&msg[0]->raw[msg[0]->len]);
+		len = strnlen(&msg[0]->raw[msg[0]->len], LOG_ELEMENT_SIZE);
 		msg[0]->len += len;
 	} while (len == LOG_ELEMENT_SIZE &&
 		 msg[0]->len < LOG_MSG_SIZE - LOG_ELEMENT_SIZE);
@@ -246,69 +320,197 @@ static struct hvlog_data {
 } *cur, *last;
 
 /*
- * read the earliest msg from each dev, to hvlog_data[].msg
- * hvlog_data[] will be used for reordering
+ * Devices holding a msg are kept in a min-heap on msg seq, so picking
+ * the next msg of the merged log costs log(num_dev) and only the device
+ * it came from needs to be read again. The hypervisor numbers msgs of
+ * all pcpus from one counter, so a msg following the last one taken is
+ * the next in order; otherwise a dry device may hold the missing one,
+ * and all dry devices are polled again before picking.
  */
-static int hvlog_dev_read_msg(struct hvlog_data *data, int num_dev)
+
+struct hvlog_merge {
+	struct hvlog_data *data;
+	int num_dev;
+	int *heap;		/* index of data[] */
+	int heap_len;
+	int taken;		/* data[] a msg was taken from, -1 if none */
+	int seq_valid;		/* a msg was taken, last_seq is valid */
+	__u64 last_seq;
+};
+
+static struct hvlog_merge cur_merge, last_merge;
+
+static inline __u64 merge_seq(struct hvlog_merge *m, int i)
 {
-	int i, new_read;
+	return m->data[m->heap[i]].msg->seq;
+}
 
-	new_read = 0;
-	for (i = 0; i < num_dev; i++) {
-		if (data[i].msg)
-			continue;
-		if (!data[i].dev)
-			continue;
+static void merge_swap(struct hvlog_merge *m, int i, int j)
+{
+	int tmp = m->heap[i];
 
-		data[i].msg = hvlog_read_dev(data[i].dev);
-		if (data[i].msg)
-			new_read++;
+	m->heap[i] = m->heap[j];
+	m->heap[j] = tmp;
+}
+
+static void merge_push(struct hvlog_merge *m, int index)
+{
+	int i, parent;
+
+	i = m->heap_len++;
+	m->heap[i] = index;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (merge_seq(m, parent) <= merge_seq(m, i))
+			break;
+		merge_swap(m, i, parent);
+		i = parent;
 	}
+}
+
+static int merge_pop(struct hvlog_merge *m)
+{
+	int i, child, index;
 
-	return new_read;
+	index = m->heap[0];
+	m->heap[0] = m->heap[--m->heap_len];
+
+	i = 0;
+	while ((child = 2 * i + 1) < m->heap_len) {
+		if (child + 1 < m->heap_len &&
+		    merge_seq(m, child + 1) < merge_seq(m, child))
+			child++;
+		if (merge_seq(m, i) <= merge_seq(m, child))
+			break;
+		merge_swap(m, i, child);
+		i = child;
+	}
+
+	return index;
 }
 
-static struct hvlog_msg *get_min_seq_msg(struct hvlog_data *data, int num_dev)
+static int merge_init(struct hvlog_merge *m, struct hvlog_data *data,
+		      int num_dev)
 {
-	int i, index_min = -1;
-	__u64 min_seq = 0;
-	struct hvlog_msg *msg;
+	m->heap = calloc(num_dev, sizeof(int));
+	if (!m->heap)
+		return -1;
 
-	for (i = 0; i < num_dev; i++) {
-		if (!data[i].msg)
-			continue;
+	m->data = data;
+	m->num_dev = num_dev;
+	m->heap_len = 0;
+	m->taken = -1;
+	m->seq_valid = 0;
 
-		if (index_min == -1) {
-			index_min = i;
-			min_seq = data[i].msg->seq;
-			continue;
-		}
+	return 0;
+}
 
-		if (data[i].msg->seq > min_seq)
-			continue;
-		index_min = i;
-		min_seq = data[i].msg->seq;
+static void merge_deinit(struct hvlog_merge *m)
+{
+	free(m->heap);
+	m->heap = NULL;
+}
+
+/* read a msg from data[i], and put it in heap if any */
+static void merge_fill(struct hvlog_merge *m, int i)
+{
+	struct hvlog_data *data = &m->data[i];
+
+	if (data->msg || !data->dev)
+		return;
+
+	data->msg = hvlog_read_dev(data->dev);
+	if (data->msg)
+		merge_push(m, i);
+}
+
+/*
+ * return the msg with min seq among all devs, it's valid until the next
+ * call, as the dev it comes from reuses the buffer
+ */
+static struct hvlog_msg *merge_next(struct hvlog_merge *m)
+{
+	struct hvlog_msg *msg;
+	int i;
+
+	if (m->taken >= 0) {
+		merge_fill(m, m->taken);
+		m->taken = -1;
 	}
 
-	if (index_min == -1)
+	if (!m->heap_len || !m->seq_valid ||
+	    merge_seq(m, 0) != m->last_seq + 1)
+		for (i = 0; i < m->num_dev; i++)
+			merge_fill(m, i);
+
+	if (!m->heap_len)
 		return NULL;
 
-	msg = data[index_min].msg;
-	data[index_min].msg = NULL;
+	i = merge_pop(m);
+	msg = m->data[i].msg;
+	m->data[i].msg = NULL;
+	m->taken = i;
+	m->last_seq = msg->seq;
+	m->seq_valid = 1;
 
 	return msg;
 }
 
 /* this is for log file */
 #define LOG_FILE_SIZE	(1024*1024)
-#define LOG_FILE_NUM 	4
+#define LOG_FILE_NUM 	32
 static size_t hvlog_log_size = LOG_FILE_SIZE;
 static unsigned short hvlog_log_num = LOG_FILE_NUM;
 
+#define LOG_WBUF_SIZE	(64*1024)
+#define LOG_NAME_LEN	64
+
+/*
+ * Rotated segments are compressed to <segment>.gz by zip_thread, and
+ * described by <segment>.idx:
+ *   <file> <first seq> <last seq> <first usec> <last usec>
+ *   <seq> <usec> <log offset> <file offset>
+ *   ...
+ * One checkpoint line every LOG_CKPT_SIZE of log. The deflate stream is
+ * fully flushed at each checkpoint, so a reader can start a raw inflate
+ * at the file offset, without going through the segment from its head.
+ * Segments failed to be compressed are indexed as they are, where both
+ * offsets are the same.
+ */
+#define LOG_CKPT_SIZE	(64*1024)
+#define LOG_IDX_SUFFIX	".idx"
+#define LOG_GZ_SUFFIX	".gz"
+
+struct hvlog_ckpt {
+	__u64 seq;
+	__u64 usec;
+	size_t off;		/* in the segment */
+	size_t zoff;		/* in the compressed segment */
+};
+
+struct hvlog_seg {
+	char name[LOG_NAME_LEN];
+	__u64 seq[2];		/* first and last */
+	__u64 usec[2];
+	size_t size;
+
+	struct hvlog_ckpt *ckpt;
+	int ckpt_num;
+	int ckpt_max;
+
+	TAILQ_ENTRY(hvlog_seg) list;
+};
+
 struct hvlog_file {
 	const char *path;
 	int fd;
 
+	/* msgs are gathered here, and written out when full or idle */
+	char *wbuf;
+	size_t wlen;
+
+	struct hvlog_seg *seg;	/* the one being written */
+
 	size_t left_space;
 	unsigned short index;
 	unsigned short num;
@@ -330,88 +532,680 @@ static struct hvlog_file last_log = {
 	.num = LOG_FILE_NUM
 };
 
+/* segments waiting for zip_thread */
+static TAILQ_HEAD(, hvlog_seg) zip_queue = TAILQ_HEAD_INITIALIZER(zip_queue);
+static pthread_mutex_t zip_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zip_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t zip_thread;
+static int zip_quit;
+static struct hvlog_seg *zip_cur;	/* the one being compressed */
+static int zip_cur_drop;		/* unlink zip_cur once done */
+
+static void free_seg(struct hvlog_seg *seg)
+{
+	free(seg->ckpt);
+	free(seg);
+}
+
+static int write_index(struct hvlog_seg *seg, const char *file, int zipped)
+{
+	char name[LOG_NAME_LEN + 8], tmp[LOG_NAME_LEN + 16];
+	const char *base;
+	FILE *fp;
+	int i;
+
+	snprintf(name, sizeof(name), "%s%s", seg->name, LOG_IDX_SUFFIX);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		perror(tmp);
+		return -1;
+	}
+
+	base = strrchr(file, '/');
+	base = base ? base + 1 : file;
+	fprintf(fp, "%s %llu %llu %llu %llu\n", base, seg->seq[0],
+		seg->seq[1], seg->usec[0], seg->usec[1]);
+	for (i = 0; i < seg->ckpt_num; i++)
+		fprintf(fp, "%llu %llu %zu %zu\n", seg->ckpt[i].seq,
+			seg->ckpt[i].usec, seg->ckpt[i].off,
+			zipped ? seg->ckpt[i].zoff : seg->ckpt[i].off);
+
+	if (fclose(fp)) {
+		perror(tmp);
+		unlink(tmp);
+		return -1;
+	}
+
+	/* readers never see a partial index */
+	return rename(tmp, name);
+}
+
+/* compress seg to seg.gz, with a full flush at each checkpoint */
+static int zip_seg(struct hvlog_seg *seg, const char *zname)
+{
+	static char buf[LOG_CKPT_SIZE];
+	size_t off, len;
+	gzFile gz;
+	ssize_t ret;
+	int fd, i;
+
+	fd = open(seg->name, O_RDONLY);
+	if (fd < 0) {
+		perror(seg->name);
+		return -1;
+	}
+
+	gz = gzopen(zname, "wb");
+	if (!gz) {
+		perror(zname);
+		close(fd);
+		return -1;
+	}
+
+	off = 0;
+	i = 0;
+	while (1) {
+		while (i < seg->ckpt_num && seg->ckpt[i].off <= off) {
+			if (gzflush(gz, Z_FULL_FLUSH) != Z_OK)
+				goto zip_err;
+			seg->ckpt[i++].zoff = gzoffset(gz);
+		}
+
+		len = sizeof(buf);
+		if (i < seg->ckpt_num && seg->ckpt[i].off - off < len)
+			len = seg->ckpt[i].off - off;
+
+		ret = read(fd, buf, len);
+		if (ret < 0)
+			goto zip_err;
+		if (!ret)
+			break;
+		if (gzwrite(gz, buf, ret) != ret)
+			goto zip_err;
+		off += ret;
+	}
+
+	close(fd);
+	if (gzclose(gz) != Z_OK) {
+		unlink(zname);
+		return -1;
+	}
+
+	return 0;
+
+ zip_err:
+	printf("%s: failed to compress\n", seg->name);
+	close(fd);
+	gzclose(gz);
+	unlink(zname);
+	return -1;
+}
+
+static void unlink_seg_files(const char *name)
+{
+	char file_name[LOG_NAME_LEN + 8];
+
+	unlink(name);
+	snprintf(file_name, sizeof(file_name), "%s%s", name, LOG_GZ_SUFFIX);
+	unlink(file_name);
+	snprintf(file_name, sizeof(file_name), "%s%s", name, LOG_IDX_SUFFIX);
+	unlink(file_name);
+}
+
+static void *zip_func(void *arg)
+{
+	char zname[LOG_NAME_LEN + 8];
+	struct hvlog_seg *seg;
+
+	pthread_mutex_lock(&zip_mtx);
+	while (1) {
+		seg = TAILQ_FIRST(&zip_queue);
+		if (!seg) {
+			if (zip_quit)
+				break;
+			pthread_cond_wait(&zip_cond, &zip_mtx);
+			continue;
+		}
+		TAILQ_REMOVE(&zip_queue, seg, list);
+		zip_cur = seg;
+		zip_cur_drop = 0;
+		pthread_mutex_unlock(&zip_mtx);
+
+		snprintf(zname, sizeof(zname), "%s%s", seg->name,
+			 LOG_GZ_SUFFIX);
+		if (!zip_seg(seg, zname)) {
+			if (!write_index(seg, zname, 1))
+				unlink(seg->name);
+			else
+				unlink(zname);
+		} else {
+			/* keep it as it is, still indexed */
+			write_index(seg, seg->name, 0);
+		}
+
+		pthread_mutex_lock(&zip_mtx);
+		if (zip_cur_drop)
+			unlink_seg_files(seg->name);
+		zip_cur = NULL;
+		free_seg(seg);
+	}
+	pthread_mutex_unlock(&zip_mtx);
+
+	return NULL;
+}
+
+static void zip_queue_seg(struct hvlog_seg *seg)
+{
+	if (!zip_thread) {
+		write_index(seg, seg->name, 0);
+		free_seg(seg);
+		return;
+	}
+
+	pthread_mutex_lock(&zip_mtx);
+	TAILQ_INSERT_TAIL(&zip_queue, seg, list);
+	pthread_cond_signal(&zip_cond);
+	pthread_mutex_unlock(&zip_mtx);
+}
+
+static void zip_init(void)
+{
+	if (pthread_create(&zip_thread, NULL, zip_func, NULL)) {
+		printf("%s %d\n", __FUNCTION__, __LINE__);
+		zip_thread = 0;
+	}
+}
+
+/* compress what's queued, and stop zip_thread */
+static void zip_deinit(void)
+{
+	if (!zip_thread)
+		return;
+
+	pthread_mutex_lock(&zip_mtx);
+	zip_quit = 1;
+	pthread_cond_signal(&zip_cond);
+	pthread_mutex_unlock(&zip_mtx);
+
+	pthread_join(zip_thread, NULL);
+	zip_thread = 0;
+}
+
+static void flush_log_file(struct hvlog_file *log)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < log->wlen) {
+		ret = write(log->fd, log->wbuf + off, log->wlen - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(log->path);
+			break;
+		}
+		off += ret;
+	}
+
+	log->wlen = 0;
+}
+
+/* flush and close current segment, and hand it over to be compressed */
+static void close_log_file(struct hvlog_file *log)
+{
+	if (log->fd < 0)
+		return;
+
+	flush_log_file(log);
+	close(log->fd);
+	log->fd = -1;
+
+	if (log->seg) {
+		zip_queue_seg(log->seg);
+		log->seg = NULL;
+	}
+}
+
+/*
+ * Drop a segment, and its compressed file and index. One still queued is
+ * taken off zip_queue, one being compressed is unlinked by zip_thread
+ * when done, else it would leave its .gz and .idx behind.
+ */
+static void unlink_seg(const char *name)
+{
+	struct hvlog_seg *seg;
+
+	pthread_mutex_lock(&zip_mtx);
+	TAILQ_FOREACH(seg, &zip_queue, list) {
+		if (!strcmp(seg->name, name)) {
+			TAILQ_REMOVE(&zip_queue, seg, list);
+			free_seg(seg);
+			break;
+		}
+	}
+	if (zip_cur && !strcmp(zip_cur->name, name)) {
+		zip_cur_drop = 1;
+		pthread_mutex_unlock(&zip_mtx);
+		return;
+	}
+	pthread_mutex_unlock(&zip_mtx);
+
+	unlink_seg_files(name);
+}
+
 static int new_log_file(struct hvlog_file *log)
 {
-	char file_name[32] = { };
-	char cmd[64] = { };
+	char file_name[LOG_NAME_LEN] = { };
 
 	if (log->fd >= 0) {
 		if (!hvlog_log_size)
 			return 0;
-		close(log->fd);
-		log->fd = -1;
+		close_log_file(log);
 	}
 
 	snprintf(file_name, sizeof(file_name), "%s.%hu", log->path,
-		 log->index + 1);
-	snprintf(cmd, sizeof(cmd), "rm -f %s", file_name);
-	system(cmd);
+		 (unsigned short)(log->index + 1));
+
+	log->seg = calloc(1, sizeof(struct hvlog_seg));
+	if (!log->seg) {
+		printf("%s %d\n", __FUNCTION__, __LINE__);
+		return -1;
+	}
+	strncpy(log->seg->name, file_name, sizeof(log->seg->name) - 1);
 
 	log->fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
 	if (log->fd < 0) {
 		perror(file_name);
+		free_seg(log->seg);
+		log->seg = NULL;
 		return -1;
 	}
 
 	log->left_space = hvlog_log_size;
 	log->index++;
-	snprintf(cmd, sizeof(cmd), "rm -f %s.%hu", log->path,
-		 log->index - hvlog_log_num);
-	system(cmd);
+
+	/* drop the oldest one, to keep hvlog_log_num files at most */
+	snprintf(file_name, sizeof(file_name), "%s.%hu", log->path,
+		 (unsigned short)(log->index - hvlog_log_num));
+	unlink_seg(file_name);
 
 	return 0;
 }
 
-size_t write_log_file(struct hvlog_file * log, const char *buf, size_t len)
+/* account msg to current segment, adding a checkpoint if it's time to */
+static void index_log_msg(struct hvlog_seg *seg, struct hvlog_msg *msg)
 {
-	int ret;
+	struct hvlog_ckpt *ckpt;
+
+	if (!seg->size) {
+		seg->seq[0] = msg->seq;
+		seg->usec[0] = msg->usec;
+	}
+	seg->seq[1] = msg->seq;
+	seg->usec[1] = msg->usec;
+
+	if (seg->ckpt_num &&
+	    seg->size - seg->ckpt[seg->ckpt_num - 1].off < LOG_CKPT_SIZE)
+		goto out;
+
+	if (seg->ckpt_num == seg->ckpt_max) {
+		ckpt = realloc(seg->ckpt, (seg->ckpt_max + 16) *
+			       sizeof(struct hvlog_ckpt));
+		if (!ckpt)
+			goto out;
+		seg->ckpt = ckpt;
+		seg->ckpt_max += 16;
+	}
+
+	ckpt = &seg->ckpt[seg->ckpt_num++];
+	ckpt->seq = msg->seq;
+	ckpt->usec = msg->usec;
+	ckpt->off = seg->size;
+
+ out:
+	seg->size += msg->len;
+}
+
+size_t write_log_file(struct hvlog_file *log, struct hvlog_msg *msg)
+{
+	size_t len = msg->len;
 
 	if (len >= log->left_space)
 		if (new_log_file(log))
 			return 0;
 
-	ret = write(log->fd, buf, len);
-	log->left_space -= ret;
+	if (!log->wbuf) {
+		log->wbuf = malloc(LOG_WBUF_SIZE);
+		if (!log->wbuf) {
+			printf("%s %d\n", __FUNCTION__, __LINE__);
+			return 0;
+		}
+	}
 
-	return ret;
+	if (log->wlen + len > LOG_WBUF_SIZE)
+		flush_log_file(log);
+
+	if (log->seg)
+		index_log_msg(log->seg, msg);
+
+	memcpy(log->wbuf + log->wlen, msg->raw, len);
+	log->wlen += len;
+	log->left_space -= len;
+
+	return len;
 }
 
+/* poll interval of cur log, backing off while the devices are dry */
+#define LOG_POLL_MIN	1000		/* us */
+#define LOG_POLL_MAX	500000		/* us */
+
 static void *cur_read_func(void *arg)
 {
 	struct hvlog_msg *msg;
+	useconds_t interval = LOG_POLL_MIN;
 
 	while (1) {
-		hvlog_dev_read_msg(cur, pcpu_num);
-		msg = get_min_seq_msg(cur, pcpu_num);
+		msg = merge_next(&cur_merge);
 		if (!msg) {
-			usleep(500000);
+			flush_log_file(&cur_log);
+			usleep(interval);
+			interval *= 2;
+			if (interval > LOG_POLL_MAX)
+				interval = LOG_POLL_MAX;
 			continue;
 		}
 
-		write_log_file(&cur_log, msg->raw, msg->len);
+		interval = LOG_POLL_MIN;
+		write_log_file(&cur_log, msg);
 	}
 
 	return NULL;
 }
 
+/*
+ * for -q, print the log from hvlog_query_usec[0] to [1], going through
+ * segments and checkpoints covering the window only
+ */
+static struct hvlog_file *hvlog_query;
+static __u64 hvlog_query_usec[2];
+
+struct query_seg {
+	char name[LOG_NAME_LEN];
+	int zipped;
+	int indexed;
+	unsigned long num;	/* to order segments not indexed yet */
+	__u64 seq[2];
+	__u64 usec[2];
+	struct hvlog_ckpt *ckpt;
+	int ckpt_num;
+};
+
+struct query_out {
+	char line[LOG_MSG_SIZE + 2];
+	size_t len;
+	int in;			/* last msg head within the window */
+};
+
+static void query_line(struct query_out *out)
+{
+	struct hvlog_msg head;
+
+	out->line[out->len] = 0;
+	/* lines without a head belong to the msg before */
+	if (!hvlog_parse_head(out->line, &head))
+		out->in = head.usec >= hvlog_query_usec[0] &&
+			  head.usec <= hvlog_query_usec[1];
+	if (out->in)
+		fputs(out->line, stdout);
+	out->len = 0;
+}
+
+static void query_feed(struct query_out *out, const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		out->line[out->len++] = buf[i];
+		if (buf[i] == '\n' || out->len == sizeof(out->line) - 1)
+			query_line(out);
+	}
+}
+
+static int query_load_index(struct query_seg *seg, const char *idx)
+{
+	struct hvlog_ckpt ckpt, *p;
+	char file[LOG_NAME_LEN];
+	FILE *fp;
+	int ret;
+
+	fp = fopen(idx, "r");
+	if (!fp) {
+		perror(idx);
+		return -1;
+	}
+
+	ret = fscanf(fp, "%63s %llu %llu %llu %llu", file, &seg->seq[0],
+		     &seg->seq[1], &seg->usec[0], &seg->usec[1]);
+	if (ret != 5) {
+		fclose(fp);
+		return -1;
+	}
+
+	while (fscanf(fp, "%llu %llu %zu %zu", &ckpt.seq, &ckpt.usec,
+		      &ckpt.off, &ckpt.zoff) == 4) {
+		p = realloc(seg->ckpt, (seg->ckpt_num + 1) * sizeof(*p));
+		if (!p)
+			break;
+		seg->ckpt = p;
+		seg->ckpt[seg->ckpt_num++] = ckpt;
+	}
+	fclose(fp);
+
+	if (snprintf(seg->name, sizeof(seg->name), "/tmp/acrnlog/%s",
+		     file) >= (int)sizeof(seg->name)) {
+		free(seg->ckpt);
+		return -1;
+	}
+	seg->zipped = strlen(file) > strlen(LOG_GZ_SUFFIX) &&
+		!strcmp(file + strlen(file) - strlen(LOG_GZ_SUFFIX),
+			LOG_GZ_SUFFIX);
+	seg->indexed = 1;
+
+	return 0;
+}
+
+static int query_seg_cmp(const void *a, const void *b)
+{
+	const struct query_seg *x = a, *y = b;
+
+	if (x->indexed != y->indexed)
+		return y->indexed - x->indexed;
+	if (x->indexed)
+		return x->seq[0] < y->seq[0] ? -1 : x->seq[0] > y->seq[0];
+	return x->num < y->num ? -1 : x->num > y->num;
+}
+
+/* go through seg from file offset start, until log offset end */
+static void query_read_seg(struct query_seg *seg, struct query_out *out,
+			   size_t off, size_t start, size_t end)
+{
+	static char in[LOG_CKPT_SIZE], buf[LOG_CKPT_SIZE];
+	z_stream zs;
+	ssize_t ret;
+	size_t len;
+	int fd, zret;
+
+	fd = open(seg->name, O_RDONLY);
+	if (fd < 0) {
+		perror(seg->name);
+		return;
+	}
+
+	if (lseek(fd, start, SEEK_SET) < 0)
+		goto out;
+
+	if (!seg->zipped) {
+		while (off < end && (ret = read(fd, buf, sizeof(buf))) > 0) {
+			len = ret < end - off ? ret : end - off;
+			query_feed(out, buf, len);
+			off += len;
+		}
+		goto out;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+		goto out;
+
+	zret = Z_OK;
+	while (off < end && zret == Z_OK) {
+		ret = read(fd, in, sizeof(in));
+		if (ret <= 0)
+			break;
+		zs.next_in = (Bytef *)in;
+		zs.avail_in = ret;
+
+		do {
+			zs.next_out = (Bytef *)buf;
+			zs.avail_out = sizeof(buf);
+			zret = inflate(&zs, Z_NO_FLUSH);
+			if (zret != Z_OK && zret != Z_STREAM_END)
+				break;
+			len = sizeof(buf) - zs.avail_out;
+			if (len > end - off)
+				len = end - off;
+			query_feed(out, buf, len);
+			off += len;
+		} while (zs.avail_in && zret == Z_OK && off < end);
+	}
+	inflateEnd(&zs);
+
+ out:
+	close(fd);
+}
+
+static void query_seg(struct query_seg *seg, struct query_out *out)
+{
+	size_t off = 0, start = 0, end = ~0UL;
+	int i;
+
+	if (seg->indexed) {
+		if (seg->usec[1] < hvlog_query_usec[0] ||
+		    seg->usec[0] > hvlog_query_usec[1])
+			return;
+
+		/* gz header isn't part of the deflate stream */
+		if (seg->ckpt_num) {
+			off = seg->ckpt[0].off;
+			start = seg->ckpt[0].zoff;
+		}
+
+		for (i = 1; i < seg->ckpt_num; i++) {
+			if (seg->ckpt[i].usec > hvlog_query_usec[1]) {
+				end = seg->ckpt[i].off;
+				break;
+			}
+			if (seg->ckpt[i].usec <= hvlog_query_usec[0]) {
+				off = seg->ckpt[i].off;
+				start = seg->ckpt[i].zoff;
+			}
+		}
+	}
+
+	query_read_seg(seg, out, off, start, end);
+	if (out->len)
+		query_line(out);
+}
+
+static int query_log(const struct hvlog_file *log)
+{
+	struct query_seg *segs = NULL, *p;
+	struct query_out out = { };
+	const char *base, *suffix;
+	char name[LOG_NAME_LEN + 8];
+	struct dirent *ent;
+	int i, num = 0;
+	size_t len;
+	DIR *dir;
+
+	dir = opendir("/tmp/acrnlog");
+	if (!dir) {
+		perror("/tmp/acrnlog");
+		return -1;
+	}
+
+	base = strrchr(log->path, '/') + 1;
+	len = strlen(base);
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, base, len) || ent->d_name[len] != '.')
+			continue;
+
+		/* not one of ours, it would not fit in a segment name */
+		if (snprintf(name, sizeof(name), "/tmp/acrnlog/%s",
+			     ent->d_name) >= LOG_NAME_LEN)
+			continue;
+
+		p = realloc(segs, (num + 1) * sizeof(*p));
+		if (!p)
+			break;
+		segs = p;
+		p = &segs[num];
+		memset(p, 0, sizeof(*p));
+
+		p->num = strtoul(ent->d_name + len + 1, (char **)&suffix, 10);
+		if (!strcmp(suffix, LOG_IDX_SUFFIX)) {
+			if (!query_load_index(p, name))
+				num++;
+			continue;
+		}
+		if (*suffix)
+			continue;
+
+		/* one being written or waiting to be compressed */
+		strcpy(p->name, name);
+		strcat(name, LOG_IDX_SUFFIX);
+		if (!access(name, F_OK))
+			continue;
+		num++;
+	}
+	closedir(dir);
+
+	qsort(segs, num, sizeof(*segs), query_seg_cmp);
+	for (i = 0; i < num; i++) {
+		query_seg(&segs[i], &out);
+		free(segs[i].ckpt);
+	}
+	free(segs);
+
+	return 0;
+}
+
 /* for user optinal args */
-static const char optString[] = "s:n:h";
+static const char optString[] = "s:n:q:Q:h";
 
 static void display_usage(void)
 {
 	printf("acrnlog - tool to collect ACRN hypervisor log\n"
-	       "[Usage] acrnlog [-s] [size] [-n] [number]\n\n"
+	       "[Usage] acrnlog [-s] [size] [-n] [number]\n"
+	       "        acrnlog -q|-Q from[:to]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
 	       "\t-s: size limitation for each log file, in MB.\n"
 	       "\t    0 means no limitation.\n"
-	       "\t-n: how many files you would like to keep on disk\n"
+	       "\t-n: how many files you would like to keep on disk,\n"
+	       "\t    rotated ones are compressed\n"
+	       "\t-q: print log of current running captured, from\n"
+	       "\t    <from> to <to> in hypervisor time, in us\n"
+	       "\t-Q: the same as -q, for log of last running\n"
 	       "[Output] capatured log files under /tmp/acrnlog/\n");
 }
 
 static int parse_opt(int argc, char *argv[])
 {
 	int opt, ret;
+	char *end;
 
 	while ((opt = getopt(argc, argv, optString)) != -1) {
 		switch (opt) {
@@ -423,6 +1217,18 @@ static int parse_opt(int argc, char *argv[])
 			if (ret > 3)
 				hvlog_log_num = ret;
 			break;
+		case 'q':
+		case 'Q':
+			hvlog_query = opt == 'q' ? &cur_log : &last_log;
+			hvlog_query_usec[0] = strtoull(optarg, &end, 0);
+			hvlog_query_usec[1] = ~0ULL;
+			if (*end == ':')
+				hvlog_query_usec[1] = strtoull(end + 1, &end, 0);
+			if (*end || hvlog_query_usec[1] < hvlog_query_usec[0]) {
+				printf("invalid window: %s\n", optarg);
+				return -EINVAL;
+			}
+			break;
 		case 'h':
 			display_usage();
 			return -EINVAL;
@@ -447,6 +1253,9 @@ int main(int argc, char *argv[])
 	if (parse_opt(argc, argv))
 		return -1;
 
+	if (hvlog_query)
+		return query_log(hvlog_query);
+
 	system("rm -rf /tmp/acrnlog");
 	ret = system("mkdir -p /tmp/acrnlog");
 	if (ret) {
@@ -490,6 +1299,14 @@ int main(int argc, char *argv[])
 
 	printf("open cur:%d last:%d\n", num_cur, num_last);
 
+	zip_init();
+
+	if (merge_init(&cur_merge, cur, pcpu_num)
+	    || (last && merge_init(&last_merge, last, pcpu_num))) {
+		printf("Failed to allocate merge heap\n");
+		return -1;
+	}
+
 	/* create thread to read cur log */
 	if (num_cur) {
 		ret = pthread_create(&cur_thread, NULL, cur_read_func, cur);
@@ -501,22 +1318,27 @@ int main(int argc, char *argv[])
 
 	if (num_last && last) {
 		while (1) {
-			hvlog_dev_read_msg(last, pcpu_num);
-			msg = get_min_seq_msg(last, pcpu_num);
+			msg = merge_next(&last_merge);
 			if (!msg)
 				break;
-			write_log_file(&last_log, msg->raw, msg->len);
+			write_log_file(&last_log, msg);
 		}
+		/* last log is complete, compress it all */
+		close_log_file(&last_log);
 	}
 
 	if (cur_thread)
 		pthread_join(cur_thread, NULL);
 
+	zip_deinit();
+
 	for (i = 0; i < pcpu_num; i++) {
 		hvlog_close_dev(cur[i].dev);
 		hvlog_close_dev(last[i].dev);
 	}
 
+	merge_deinit(&cur_merge);
+	merge_deinit(&last_merge);
 	free(cur);
 	if (last)
 		free(last);
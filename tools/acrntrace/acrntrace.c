@@ -28,11 +28,17 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
@@ -44,10 +50,21 @@
 
 /* for opt */
 static uint64_t period = 10000;
-static const char optString[] = "t:hc";
+static const char optString[] = "t:a:s:f:l:hcr";
 static const char dev_name[] = "/dev/acrn_trace";
 
 static uint32_t flags;
+static int hk_cpu = -1;
+static int stats_interval;	/* seconds between summaries, 0 for none */
+static double cpu_freq;
+
+/* flight recorder */
+static uint64_t flight_size;	/* bytes per cpu */
+static uint64_t latency_us;	/* dump on a longer VM exit, 0 for never */
+static uint64_t latency_cycles;
+static int trigger_pipe[2] = {-1, -1};
+static int latency_pending;
+static int flight_sock = -1;
 static char trace_file_dir[TRACE_FILE_DIR_LEN];
 
 static reader_struct *reader;
@@ -56,11 +73,26 @@ static int pcpu_num = 0;
 static void display_usage(void)
 {
 	printf("acrntrace - tool to collect ACRN trace data\n"
-	       "[Usage] acrntrace [-t] [period in msec] [-ch]\n\n"
+	       "[Usage] acrntrace [-t] [period in msec] [-a cpu] [-s sec]\n"
+	       "\t\t [-f MB [-l usec]] [-chr]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
-	       "\t-t: period_in_ms: specify polling interval [1-999]\n"
-	       "\t-c: clear the buffered old data\n");
+	       "\t-t: period_in_ms: specify the longest polling interval\n"
+	       "\t    [1-999], shortened while buffers fill up\n"
+	       "\t-a: run all readers on this housekeeping cpu, instead\n"
+	       "\t    of each on the cpu it traces\n"
+	       "\t-c: clear the buffered old data\n"
+	       "\t-r: write raw binary records to <cpu>%s, to be\n"
+	       "\t    decoded offline by acrntrace_decode\n"
+	       "\t-s: sec: write no trace files, count VM exits and their\n"
+	       "\t    durations instead; print a summary every sec seconds\n"
+	       "\t    (0 for none) and a report at the end\n"
+	       "\t-f: MB: flight recorder, keep the last MB of events per\n"
+	       "\t    cpu in memory and write them out only on SIGUSR1 or\n"
+	       "\t    a datagram to %s\n"
+	       "\t-l: usec: with -f, also write them out after a VM exit\n"
+	       "\t    longer than usec\n",
+	       TRACE_RAW_SUFFIX, FLIGHT_SOCK);
 }
 
 static int parse_opt(int argc, char *argv[])
@@ -78,9 +110,44 @@ static int parse_opt(int argc, char *argv[])
 			period = ret * 1000;
 			pr_dbg("Period is %lu\n", period);
 			break;
+		case 'a':
+			hk_cpu = atoi(optarg);
+			if (hk_cpu < 0 || hk_cpu >= CPU_SETSIZE) {
+				pr_err("'-a' require a cpu number\n");
+				return -EINVAL;
+			}
+			break;
 		case 'c':
 			flags |= FLAG_CLEAR_BUF;
 			break;
+		case 'r':
+			flags |= FLAG_RAW;
+			break;
+		case 's':
+			stats_interval = atoi(optarg);
+			if (stats_interval < 0) {
+				pr_err("'-s' require a positive integer\n");
+				return -EINVAL;
+			}
+			flags |= FLAG_STATS;
+			break;
+		case 'f':
+			ret = atoi(optarg);
+			if (ret <= 0) {
+				pr_err("'-f' require a size in MB\n");
+				return -EINVAL;
+			}
+			flight_size = (uint64_t)ret << 20;
+			flags |= FLAG_FLIGHT;
+			break;
+		case 'l':
+			ret = atoi(optarg);
+			if (ret <= 0) {
+				pr_err("'-l' require a time in usec\n");
+				return -EINVAL;
+			}
+			latency_us = ret;
+			break;
 		case 'h':
 			display_usage();
 			return -EINVAL;
@@ -90,6 +157,16 @@ static int parse_opt(int argc, char *argv[])
 			return -EINVAL;
 		}
 	};
+
+	if (latency_us && !(flags & FLAG_FLIGHT)) {
+		pr_err("'-l' needs '-f'\n");
+		return -EINVAL;
+	}
+	if ((flags & FLAG_FLIGHT) && (flags & FLAG_RAW)) {
+		pr_err("'-f' writes raw data already, drop '-r'\n");
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
@@ -163,11 +240,8 @@ static double get_cpu_freq(void)
 	return freq;
 }
 
-static int create_trace_file_dir(char *dir)
+static void get_time_str(char *time_str)
 {
-	int status;
-	char cmd[CMD_MAX_LEN];
-	char time_str[TIME_STR_LEN];
 	time_t timep;
 	struct tm *p;
 
@@ -176,6 +250,15 @@ static int create_trace_file_dir(char *dir)
 	snprintf(time_str, TIME_STR_LEN, "%d%02d%02d-%02d%02d%02d",
 		 (1900 + p->tm_year), (1 + p->tm_mon), p->tm_mday,
 		 p->tm_hour, p->tm_min, p->tm_sec);
+}
+
+static int create_trace_file_dir(char *dir)
+{
+	int status;
+	char cmd[CMD_MAX_LEN];
+	char time_str[TIME_STR_LEN];
+
+	get_time_str(time_str);
 	pr_info("start tracing at %s\n", time_str);
 
 	snprintf(dir, TRACE_FILE_DIR_LEN, "%s%s", TRACE_FILE_ROOT, time_str);
@@ -192,10 +275,188 @@ static int create_trace_file_dir(char *dir)
 	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
 }
 
+/*
+ * Sleep until the next drain. The interval follows the fill level the
+ * last drain found: halved past half full, doubled back up to period
+ * below an eighth. A grown overrun_cnt means the hypervisor dropped
+ * events, so report it and drain as often as possible.
+ */
+static void reader_sleep(param_t * param, uint32_t used)
+{
+	shared_buf_t *sbuf = param->sbuf;
+	uint32_t overrun;
+
+	overrun = __atomic_load_n(&sbuf->overrun_cnt, __ATOMIC_RELAXED);
+	if (overrun != param->overrun) {
+		pr_err("sbuf[%u] overrun, %u events lost\n", param->cpuid,
+		       overrun - param->overrun);
+		param->lost += overrun - param->overrun;
+		param->overrun = overrun;
+		param->interval = MIN_PERIOD;
+	} else if (used > sbuf->size / 2) {
+		param->interval /= 2;
+		if (param->interval < MIN_PERIOD)
+			param->interval = MIN_PERIOD;
+	} else if (used < sbuf->size / 8) {
+		param->interval *= 2;
+		if (param->interval > period)
+			param->interval = period;
+	}
+
+	usleep(param->interval);
+}
+
+/* write(2) all of buf, retrying on short writes */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Raw mode: no formatting in the reader, each contiguous span of the
+ * sbuf goes to the file with a single write, straight from the mapping.
+ */
+static void reader_raw(param_t * param)
+{
+	uint32_t cpuid = param->cpuid;
+	shared_buf_t *sbuf = param->sbuf;
+	struct trace_raw_hdr hdr;
+	int ret, fd;
+	uint32_t len, used;
+	void *data;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TRACE_RAW_MAGIC;
+	hdr.version = TRACE_RAW_VERSION;
+	hdr.cpuid = cpuid;
+	hdr.ele_size = sizeof(trace_ev_t);
+	hdr.cpu_freq = get_cpu_freq();
+
+	if (sbuf->ele_size != sizeof(trace_ev_t)) {
+		pr_err("sbuf[%u] element size %u unknown\n", cpuid,
+		       sbuf->ele_size);
+		return;
+	}
+
+	fd = fileno(param->trace_filep);
+	ret = write_all(fd, &hdr, sizeof(hdr));
+
+	while (!ret) {
+		used = sbuf_used(sbuf);
+
+		/* up to two spans when the data wraps around */
+		while ((len = sbuf_span(sbuf, &data)) > 0) {
+			ret = write_all(fd, data, len);
+			if (ret)
+				break;
+			sbuf_consume(sbuf, len);
+		}
+
+		if (!ret)
+			reader_sleep(param, used);
+	}
+
+	pr_err("sbuf[%u] write error: %d\n", cpuid, ret);
+}
+
+/* wake the main thread up to dump the flight recorder */
+static void flight_trigger(char why)
+{
+	if (write(trigger_pipe[1], &why, 1) < 0) {
+		pr_dbg("trigger lost, err %d\n", errno);
+	}
+}
+
+/* raise the latency trigger on the first VM exit that took too long */
+static void flight_check_latency(param_t * param, const trace_ev_t *ev,
+				 uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (ev[i].id == TRACE_VM_EXIT) {
+			param->exit_tsc = ev[i].tsc;
+		} else if (ev[i].id == TRACE_VM_ENTER) {
+			if (param->exit_tsc
+			    && ev[i].tsc - param->exit_tsc > latency_cycles
+			    && !__atomic_exchange_n(&latency_pending, 1,
+						    __ATOMIC_RELAXED))
+				flight_trigger('l');
+			param->exit_tsc = 0;
+		}
+	}
+}
+
+/* Flight recorder mode: events only go to the in-memory ring */
+static void reader_flight(param_t * param)
+{
+	shared_buf_t *sbuf = param->sbuf;
+	uint32_t len, used, n;
+	void *data;
+
+	if (sbuf->ele_size != sizeof(trace_ev_t)) {
+		pr_err("sbuf[%u] element size %u unknown\n", param->cpuid,
+		       sbuf->ele_size);
+		return;
+	}
+
+	while (1) {
+		used = sbuf_used(sbuf);
+		while ((len = sbuf_span(sbuf, &data)) > 0) {
+			n = len / sizeof(trace_ev_t);
+			flight_ring_put(param->ring, data, n);
+			if (latency_cycles)
+				flight_check_latency(param, data, n);
+			if (param->agg)
+				vmexit_agg_events(param->agg, data, n);
+			sbuf_consume(sbuf, len);
+		}
+		reader_sleep(param, used);
+	}
+}
+
+/* Stats mode: events are folded into param->agg where they lie */
+static void reader_stats(param_t * param)
+{
+	shared_buf_t *sbuf = param->sbuf;
+	uint32_t len, used;
+	void *data;
+
+	if (sbuf->ele_size != sizeof(trace_ev_t)) {
+		pr_err("sbuf[%u] element size %u unknown\n", param->cpuid,
+		       sbuf->ele_size);
+		return;
+	}
+
+	while (1) {
+		used = sbuf_used(sbuf);
+		while ((len = sbuf_span(sbuf, &data)) > 0) {
+			vmexit_agg_events(param->agg, data,
+					  len / sizeof(trace_ev_t));
+			sbuf_consume(sbuf, len);
+		}
+		reader_sleep(param, used);
+	}
+}
+
 /* function executed in each consumer thread */
 static void reader_fn(param_t * param)
 {
 	int ret;
+	uint32_t used;
 	uint32_t cpuid = param->cpuid;
 	FILE *fp = param->trace_filep;
 	shared_buf_t *sbuf = param->sbuf;
@@ -211,10 +472,33 @@ static void reader_fn(param_t * param)
 	if (flags & FLAG_CLEAR_BUF)
 		sbuf_clear_buffered(sbuf);
 
+	/* have the hypervisor count what it drops, and ignore the count
+	 * from before we started
+	 */
+	sbuf_add_flags(sbuf, OVERRUN_CNT_EN);
+	param->overrun = sbuf->overrun_cnt;
+	param->interval = period;
+
+	if (flags & FLAG_FLIGHT) {
+		reader_flight(param);
+		return;
+	}
+
+	if (flags & FLAG_STATS) {
+		reader_stats(param);
+		return;
+	}
+
+	if (flags & FLAG_RAW) {
+		reader_raw(param);
+		return;
+	}
+
 	/* write cpu freq to the first line of output file */
 	fprintf(fp, "CPU Freq: %f\n", get_cpu_freq());
 
 	while (1) {
+		used = sbuf_used(sbuf);
 		do {
 			ret = sbuf_get(sbuf, (void *)&e);
 			if (ret == 0)
@@ -224,21 +508,18 @@ static void reader_fn(param_t * param)
 				return;
 			}
 
-			fprintf(fp, "%u | %lu | ", cpuid, e.tsc);
-			switch (e.id) {
-				/* defined in trace_event.h     */
-				/* for each ev type             */
-				ALL_CASES;
-			}
+			trace_ev_print(fp, cpuid, &e);
 		} while (ret > 0);
 
-		usleep(period);
+		reader_sleep(param, used);
 	}
 }
 
 static int create_reader(reader_struct * reader, uint32_t cpu)
 {
 	char trace_file_name[TRACE_FILE_NAME_LEN];
+	cpu_set_t mask;
+	int ret;
 
 	snprintf(reader->dev_name, DEV_PATH_LEN, "%s_%u", dev_name, cpu);
 	reader->param.cpuid = cpu;
@@ -263,8 +544,32 @@ static int create_reader(reader_struct * reader, uint32_t cpu)
 	       cpu, reader->param.sbuf->magic, reader->param.sbuf->ele_num,
 	       reader->param.sbuf->ele_size);
 
-	snprintf(trace_file_name, TRACE_FILE_NAME_LEN, "%s/%d", trace_file_dir,
-		 cpu);
+	if (flags & FLAG_FLIGHT) {
+		reader->param.ring = malloc(sizeof(*reader->param.ring));
+		if (!reader->param.ring
+		    || flight_ring_init(reader->param.ring, flight_size)) {
+			pr_err("Failed to allocate %luMB for cpu%d\n",
+			       flight_size >> 20, cpu);
+			free(reader->param.ring);
+			reader->param.ring = NULL;
+			return -3;
+		}
+	}
+
+	if (flags & FLAG_STATS) {
+		reader->param.agg = malloc(sizeof(*reader->param.agg));
+		if (!reader->param.agg) {
+			pr_err("Failed to allocate stats for cpu%d\n", cpu);
+			return -3;
+		}
+		vmexit_agg_init(reader->param.agg, cpu);
+	}
+
+	if (flags & (FLAG_FLIGHT | FLAG_STATS))
+		goto start;
+
+	snprintf(trace_file_name, TRACE_FILE_NAME_LEN, "%s/%d%s", trace_file_dir,
+		 cpu, (flags & FLAG_RAW) ? TRACE_RAW_SUFFIX : "");
 	reader->param.trace_filep = fopen(trace_file_name, "w+");
 	if (!reader->param.trace_filep) {
 		pr_err("Failed to open %s, err %d\n", trace_file_name, errno);
@@ -274,12 +579,21 @@ static int create_reader(reader_struct * reader, uint32_t cpu)
 	pr_info("trace data file %s created for %s\n",
 		trace_file_name, reader->dev_name);
 
+ start:
 	if (pthread_create(&reader->thrd, NULL,
 			   (void *)&reader_fn, &reader->param)) {
 		pr_err("failed to create reader thread, %d\n", cpu);
 		return -4;
 	}
 
+	/* keep the reader off other cpus, tracing goes on without it */
+	CPU_ZERO(&mask);
+	CPU_SET(hk_cpu >= 0 ? hk_cpu : cpu, &mask);
+	ret = pthread_setaffinity_np(reader->thrd, sizeof(mask), &mask);
+	if (ret)
+		pr_err("failed to pin reader of cpu%d to cpu%d, err %d\n",
+		       cpu, hk_cpu >= 0 ? hk_cpu : cpu, ret);
+
 	return 0;
 }
 
@@ -293,6 +607,11 @@ static void destory_reader(reader_struct * reader)
 			reader->thrd = 0;
 	}
 
+	if (reader->param.lost)
+		pr_info("cpu%u: %lu events lost to overruns\n",
+			reader->param.cpuid, reader->param.lost);
+	reader->param.lost = 0;
+
 	if (reader->param.sbuf) {
 		munmap(reader->param.sbuf, MMAP_SIZE);
 		reader->param.sbuf = NULL;
@@ -308,6 +627,226 @@ static void destory_reader(reader_struct * reader)
 		fclose(reader->param.trace_filep);
 		reader->param.trace_filep = NULL;
 	}
+
+	if (reader->param.ring) {
+		flight_ring_free(reader->param.ring);
+		free(reader->param.ring);
+		reader->param.ring = NULL;
+	}
+}
+
+/* write the rings of all cpus out as raw files, into a new dir */
+static void flight_dump(const char *why)
+{
+	static unsigned int seq;
+	char dir[TRACE_FILE_DIR_LEN], name[TRACE_FILE_NAME_LEN + 16];
+	char time_str[TIME_STR_LEN];
+	struct trace_raw_hdr hdr;
+	trace_ev_t *ev;
+	uint64_t n;
+	uint32_t cpu;
+	int fd, ret;
+
+	get_time_str(time_str);
+	snprintf(dir, sizeof(dir), "%s%s-%u", TRACE_FILE_ROOT, time_str, seq++);
+	mkdir(TRACE_FILE_ROOT, 0755);
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		pr_err("Failed to create %s, err %d\n", dir, errno);
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TRACE_RAW_MAGIC;
+	hdr.version = TRACE_RAW_VERSION;
+	hdr.ele_size = sizeof(trace_ev_t);
+	hdr.cpu_freq = cpu_freq;
+
+	foreach_cpu(cpu) {
+		if (!reader[cpu].param.ring)
+			continue;
+		ev = flight_ring_snapshot(reader[cpu].param.ring, &n);
+		if (!ev) {
+			pr_err("Failed to snapshot cpu%u\n", cpu);
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "%s/%u%s", dir, cpu,
+			 TRACE_RAW_SUFFIX);
+		fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			pr_err("Failed to open %s, err %d\n", name, errno);
+			free(ev);
+			continue;
+		}
+
+		hdr.cpuid = cpu;
+		ret = write_all(fd, &hdr, sizeof(hdr));
+		if (!ret)
+			ret = write_all(fd, ev, n * sizeof(*ev));
+		if (ret)
+			pr_err("Failed to write %s, err %d\n", name, ret);
+		close(fd);
+		free(ev);
+	}
+
+	pr_info("%s: flight recorder written to %s\n", why, dir);
+}
+
+static void flight_signal_handler(int sig)
+{
+	flight_trigger('u');
+}
+
+static int flight_init(void)
+{
+	struct sockaddr_un addr;
+
+	if (pipe2(trigger_pipe, O_CLOEXEC | O_NONBLOCK)) {
+		pr_err("Failed to create trigger pipe, err %d\n", errno);
+		return -1;
+	}
+	signal(SIGUSR1, flight_signal_handler);
+
+	latency_cycles = latency_us * cpu_freq;
+
+	/* anyone, a DM as well, may ask for a dump with a datagram */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", FLIGHT_SOCK);
+	mkdir("/run/acrn", 0755);
+	unlink(addr.sun_path);
+	flight_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			     0);
+	if (flight_sock < 0
+	    || bind(flight_sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_err("No trigger socket %s, err %d\n", FLIGHT_SOCK, errno);
+		if (flight_sock >= 0)
+			close(flight_sock);
+		flight_sock = -1;
+	}
+
+	pr_info("flight recorder: %luMB per cpu, kill -USR1 %d to dump\n",
+		flight_size >> 20, getpid());
+	return 0;
+}
+
+static void flight_deinit(void)
+{
+	if (flight_sock >= 0) {
+		close(flight_sock);
+		unlink(FLIGHT_SOCK);
+		flight_sock = -1;
+	}
+}
+
+/* print the VM exit summary (final: report) of the readers with stats */
+static void stats_print(int final)
+{
+	struct vmexit_agg *aggs[pcpu_num];
+	uint32_t cpu;
+	int n = 0;
+
+	foreach_cpu(cpu)
+	    if (reader[cpu].param.agg)
+		aggs[n++] = reader[cpu].param.agg;
+
+	if (final)
+		vmexit_report(stdout, aggs, n, cpu_freq);
+	else
+		vmexit_summary(stdout, aggs, n, cpu_freq);
+}
+
+static void stats_free(void)
+{
+	uint32_t cpu;
+
+	foreach_cpu(cpu) {
+		free(reader[cpu].param.agg);
+		reader[cpu].param.agg = NULL;
+	}
+}
+
+static void flight_handle_triggers(void)
+{
+	static time_t last_latency;
+	char why[96], buf[64];
+	ssize_t len;
+	int i;
+
+	while ((len = read(trigger_pipe[0], buf, sizeof(buf))) > 0)
+		for (i = 0; i < len; i++) {
+			if (buf[i] == 'u') {
+				flight_dump("SIGUSR1");
+				continue;
+			}
+
+			/* let one more drain bring in what came after */
+			if (time(NULL) - last_latency >= FLIGHT_COOLDOWN) {
+				usleep(period);
+				snprintf(why, sizeof(why),
+					 "VM exit over %luus", latency_us);
+				flight_dump(why);
+				last_latency = time(NULL);
+			}
+			__atomic_store_n(&latency_pending, 0,
+					 __ATOMIC_RELAXED);
+		}
+
+	while (flight_sock >= 0
+	       && (len = recv(flight_sock, buf, sizeof(buf) - 1, 0)) >= 0) {
+		buf[len] = 0;
+		buf[strcspn(buf, "\n")] = 0;
+		snprintf(why, sizeof(why), "request \"%s\"", buf);
+		flight_dump(why);
+	}
+}
+
+/*
+ * Wait for 'q', printing a summary every stats_interval and dumping
+ * the flight recorder on its triggers meanwhile.
+ */
+static void wait_quit(void)
+{
+	struct pollfd pfd[3] = {
+		{.fd = STDIN_FILENO, .events = POLLIN},
+		{.fd = trigger_pipe[0], .events = POLLIN},
+		{.fd = flight_sock, .events = POLLIN},
+	};
+	time_t next = time(NULL) + stats_interval;
+	char buf[64];
+	int ret, timeout;
+
+	printf("q <enter> to quit:\n");
+	while (1) {
+		timeout = -1;
+		if ((flags & FLAG_STATS) && stats_interval) {
+			timeout = (next - time(NULL)) * 1000;
+			if (timeout <= 0) {
+				stats_print(0);
+				next += stats_interval;
+				continue;
+			}
+		}
+
+		ret = poll(pfd, 3, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		if (pfd[1].revents || pfd[2].revents)
+			flight_handle_triggers();
+
+		if (!pfd[0].revents)
+			continue;
+		ret = read(STDIN_FILENO, buf, sizeof(buf));
+		if (ret > 0 && memchr(buf, 'q', ret))
+			return;
+		/* no terminal, run until a signal */
+		if (ret <= 0)
+			pfd[0].fd = -1;
+	}
 }
 
 static void handle_on_exit(void)
@@ -322,6 +861,13 @@ static void handle_on_exit(void)
 
 	foreach_cpu(cpu)
 	    destory_reader(&reader[cpu]);
+
+	if (flags & FLAG_STATS) {
+		stats_print(1);
+		stats_free();
+	}
+
+	flight_deinit();
 }
 
 static void signal_exit_handler(int sig)
@@ -346,8 +892,15 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (flags & (FLAG_STATS | FLAG_FLIGHT))
+		cpu_freq = get_cpu_freq();
+
+	if ((flags & FLAG_FLIGHT) && flight_init())
+		exit(EXIT_FAILURE);
+
 	/* create dir for trace file */
-	if (create_trace_file_dir(trace_file_dir)) {
+	if (!(flags & (FLAG_STATS | FLAG_FLIGHT))
+	    && create_trace_file_dir(trace_file_dir)) {
 		pr_err("Failed to create dir for trace files\n");
 		exit(EXIT_FAILURE);
 	}
@@ -365,14 +918,24 @@ int main(int argc, char *argv[])
 	signal(SIGINT, signal_exit_handler);
 
 	/* wait for user input to stop */
-	printf("q <enter> to quit:\n");
-	while (getchar() != 'q')
+	if (flags & (FLAG_STATS | FLAG_FLIGHT))
+		wait_quit();
+	else {
 		printf("q <enter> to quit:\n");
+		while (getchar() != 'q')
+			printf("q <enter> to quit:\n");
+	}
 
  out_free:
 	foreach_cpu(cpu)
 	    destory_reader(&reader[cpu]);
 
+	if (flags & FLAG_STATS) {
+		stats_print(1);
+		stats_free();
+	}
+
+	flight_deinit();
 	free(reader);
 	flags &= ~FLAG_TO_REL;
 
@@ -41,12 +41,13 @@
 #define MMAP_SIZE 		((TRACE_ELEMENT_SIZE * TRACE_ELEMENT_NUM \
 				+ PAGE_SIZE - 1) & PAGE_MASK)
 */
-#define TRACE_FILE_NAME_LEN	36
+#define TRACE_FILE_NAME_LEN	48
 #define TRACE_FILE_DIR_LEN	(TRACE_FILE_NAME_LEN - 2)
 #define TRACE_FILE_ROOT		"/tmp/acrntrace/"
 #define DEV_PATH_LEN		18
 #define TIME_STR_LEN		16
 #define CMD_MAX_LEN		48
+#define MIN_PERIOD		100	/* usec, shortest drain interval */
 
 #define pr_fmt(fmt)             "acrntrace: " fmt
 #define pr_info(fmt, ...)       printf(pr_fmt(fmt), ##__VA_ARGS__)
@@ -62,9 +63,15 @@
  * flags:
  * FLAG_TO_REL   - resources need to be release
  * FLAG_CLEAR_BUF - to clear buffered old data
+ * FLAG_RAW      - to write binary records, see struct trace_raw_hdr
+ * FLAG_STATS    - to aggregate VM exits instead of writing events
+ * FLAG_FLIGHT   - to keep events in memory until a trigger
  */
 #define FLAG_TO_REL		(1UL << 0)
 #define FLAG_CLEAR_BUF		(1UL << 1)
+#define FLAG_RAW		(1UL << 2)
+#define FLAG_STATS		(1UL << 3)
+#define FLAG_FLIGHT		(1UL << 4)
 
 #define foreach_cpu(cpu)                                       \
         for ((cpu) = 0; (cpu) < (pcpu_num); (cpu)++)
@@ -94,12 +101,84 @@ typedef struct {
 	};
 } trace_ev_t;
 
+/*
+ * Raw trace file, <cpu>.raw: this header, then trace_ev_t records as the
+ * hypervisor wrote them. acrntrace_decode turns it into the text format.
+ */
+#define TRACE_RAW_MAGIC		0x57415254	/* "TRAW" */
+#define TRACE_RAW_VERSION	1
+#define TRACE_RAW_SUFFIX	".raw"
+
+struct trace_raw_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cpuid;
+	uint32_t ele_size;	/* sizeof(trace_ev_t) */
+	double cpu_freq;	/* MHz, to convert tsc */
+	uint64_t reserved[4];
+};
+
+void trace_ev_print(FILE *fp, uint32_t cpuid, const trace_ev_t *ev);
+
+/*
+ * Online VM exit statistics of one cpu, from VM_EXIT/VM_ENTER pairs.
+ * Basic exit reasons go up to 64, anything beyond counts as the last.
+ */
+#define VMEXIT_REASON_NUM	66
+#define VMEXIT_HIST_BUCKETS	32	/* bucket i: less than 2^i cycles */
+
+struct vmexit_stat {
+	uint64_t count;
+	uint64_t cycles;
+	uint64_t max;
+	uint64_t hist[VMEXIT_HIST_BUCKETS];
+};
+
+struct vmexit_agg {
+	pthread_mutex_t lock;
+	uint32_t cpuid;
+	uint32_t exit_reason;	/* of the pending VM_EXIT */
+	uint64_t exit_tsc;	/* of the pending VM_EXIT, 0 if none */
+	struct vmexit_stat reason[VMEXIT_REASON_NUM];
+};
+
+void vmexit_agg_init(struct vmexit_agg *agg, uint32_t cpuid);
+void vmexit_agg_events(struct vmexit_agg *agg, const trace_ev_t *ev, int n);
+void vmexit_summary(FILE *fp, struct vmexit_agg **aggs, int n, double freq);
+void vmexit_report(FILE *fp, struct vmexit_agg **aggs, int n, double freq);
+
+/*
+ * Flight recorder: the last events of a cpu, dumped as <cpu>.raw files
+ * on SIGUSR1, a datagram to FLIGHT_SOCK or an over-long VM exit.
+ */
+#define FLIGHT_SOCK		"/run/acrn/acrntrace.socket"
+#define FLIGHT_COOLDOWN		1	/* seconds between latency dumps */
+
+struct flight_ring {
+	pthread_mutex_t lock;
+	trace_ev_t *ev;
+	uint64_t num;		/* capacity, in events */
+	uint64_t written;	/* events ever put, next at written % num */
+};
+
+int flight_ring_init(struct flight_ring *ring, uint64_t bytes);
+void flight_ring_free(struct flight_ring *ring);
+void flight_ring_put(struct flight_ring *ring, const trace_ev_t *ev,
+		     uint64_t n);
+trace_ev_t *flight_ring_snapshot(struct flight_ring *ring, uint64_t *n);
+
 typedef struct {
 	uint32_t cpuid;
 	int exit_flag;
 	FILE *trace_filep;
 	shared_buf_t *sbuf;
 	pthread_mutex_t *sbuf_lock;
+	uint64_t interval;	/* current drain interval, usec */
+	uint32_t overrun;	/* last seen sbuf->overrun_cnt */
+	uint64_t lost;		/* events lost to overruns */
+	struct vmexit_agg *agg;	/* FLAG_STATS only */
+	struct flight_ring *ring;	/* FLAG_FLIGHT only */
+	uint64_t exit_tsc;	/* pending VM_EXIT, for the latency trigger */
 } param_t;
 
 typedef struct {
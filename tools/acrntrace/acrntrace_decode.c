@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * acrntrace_decode: turn the raw per-cpu files of "acrntrace -r" into
+ * the text format of acrntrace, as read by scripts/acrnalyze.py.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "acrntrace.h"
+
+#define DECODE_BATCH	4096	/* records per read */
+#define DECODE_BUF_SIZE	(1 << 20)
+
+static void display_usage(void)
+{
+	printf("acrntrace_decode - decode raw acrntrace data to text\n"
+	       "[Usage] acrntrace_decode [-o output] raw_file ...\n\n"
+	       "[Options]\n"
+	       "\t-h: print this message\n"
+	       "\t-o: output file, '-' for stdout, only with one raw_file;\n"
+	       "\t    by default raw_file without %s, eg. 0.raw -> 0\n",
+	       TRACE_RAW_SUFFIX);
+}
+
+static int decode(const char *ifile, const char *ofile)
+{
+	struct trace_raw_hdr hdr;
+	trace_ev_t *ev;
+	FILE *ifp, *ofp;
+	size_t n, i;
+	int ret = -1;
+
+	ev = malloc(DECODE_BATCH * sizeof(*ev));
+	if (!ev) {
+		pr_err("Failed to allocate decode buffer\n");
+		return -1;
+	}
+
+	ifp = fopen(ifile, "r");
+	if (!ifp) {
+		pr_err("Failed to open %s, err %d\n", ifile, errno);
+		goto open_in;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, ifp) != 1
+	    || hdr.magic != TRACE_RAW_MAGIC
+	    || hdr.version != TRACE_RAW_VERSION
+	    || hdr.ele_size != sizeof(trace_ev_t)) {
+		pr_err("%s is not a raw trace file\n", ifile);
+		goto bad_hdr;
+	}
+
+	ofp = strcmp(ofile, "-") ? fopen(ofile, "w") : stdout;
+	if (!ofp) {
+		pr_err("Failed to open %s, err %d\n", ofile, errno);
+		goto bad_hdr;
+	}
+	setvbuf(ofp, NULL, _IOFBF, DECODE_BUF_SIZE);
+
+	fprintf(ofp, "CPU Freq: %f\n", hdr.cpu_freq);
+	while ((n = fread(ev, sizeof(*ev), DECODE_BATCH, ifp)) > 0)
+		for (i = 0; i < n; i++)
+			trace_ev_print(ofp, hdr.cpuid, &ev[i]);
+
+	ret = 0;
+	if (ferror(ifp)) {
+		pr_err("Failed to read %s\n", ifile);
+		ret = -1;
+	}
+	if (fflush(ofp)) {
+		pr_err("Failed to write %s, err %d\n", ofile, errno);
+		ret = -1;
+	}
+	if (ofp != stdout)
+		fclose(ofp);
+
+ bad_hdr:
+	fclose(ifp);
+ open_in:
+	free(ev);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *ofile = NULL;
+	char name[TRACE_FILE_NAME_LEN * 2];
+	size_t len, slen = strlen(TRACE_RAW_SUFFIX);
+	int opt, i, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "o:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			ofile = optarg;
+			break;
+		case 'h':
+			display_usage();
+			return EXIT_SUCCESS;
+		default:
+			display_usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || (ofile && argc - optind > 1)) {
+		display_usage();
+		return EXIT_FAILURE;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (!ofile) {
+			len = strlen(argv[i]);
+			if (len <= slen || len - slen >= sizeof(name)
+			    || strcmp(argv[i] + len - slen, TRACE_RAW_SUFFIX)) {
+				pr_err("%s: no %s suffix, use -o\n", argv[i],
+				       TRACE_RAW_SUFFIX);
+				ret = EXIT_FAILURE;
+				continue;
+			}
+			memcpy(name, argv[i], len - slen);
+			name[len - slen] = 0;
+		}
+
+		if (decode(argv[i], ofile ? ofile : name))
+			ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Flight recorder ring: the last events of one cpu kept in memory,
+ * the oldest overwritten, to be written out only when something
+ * interesting happened.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "acrntrace.h"
+
+int flight_ring_init(struct flight_ring *ring, uint64_t bytes)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->num = bytes / sizeof(trace_ev_t);
+	if (!ring->num)
+		return -1;
+
+	ring->ev = malloc(ring->num * sizeof(trace_ev_t));
+	if (!ring->ev)
+		return -1;
+
+	pthread_mutex_init(&ring->lock, NULL);
+	return 0;
+}
+
+void flight_ring_free(struct flight_ring *ring)
+{
+	free(ring->ev);
+	ring->ev = NULL;
+}
+
+/* append n events, overwriting the oldest once the ring is full */
+void flight_ring_put(struct flight_ring *ring, const trace_ev_t *ev,
+		     uint64_t n)
+{
+	uint64_t pos, first;
+
+	/* of a burst larger than the ring only its tail survives */
+	if (n > ring->num) {
+		ev += n - ring->num;
+		n = ring->num;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	pos = ring->written % ring->num;
+	first = (n < ring->num - pos) ? n : ring->num - pos;
+	memcpy(&ring->ev[pos], ev, first * sizeof(trace_ev_t));
+	memcpy(ring->ev, ev + first, (n - first) * sizeof(trace_ev_t));
+	ring->written += n;
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Copy of the events in the ring, oldest first, so that it can be
+ * written out while the reader goes on. Free it after use.
+ */
+trace_ev_t *flight_ring_snapshot(struct flight_ring *ring, uint64_t *n)
+{
+	uint64_t pos, first;
+	trace_ev_t *ev;
+
+	ev = malloc(ring->num * sizeof(trace_ev_t));
+	if (!ev)
+		return NULL;
+
+	pthread_mutex_lock(&ring->lock);
+	if (ring->written < ring->num) {
+		*n = ring->written;
+		memcpy(ev, ring->ev, *n * sizeof(trace_ev_t));
+	} else {
+		*n = ring->num;
+		pos = ring->written % ring->num;
+		first = ring->num - pos;
+		memcpy(ev, &ring->ev[pos], first * sizeof(trace_ev_t));
+		memcpy(ev + first, ring->ev, pos * sizeof(trace_ev_t));
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return ev;
+}
@@ -67,6 +67,39 @@ int sbuf_get(shared_buf_t *sbuf, uint8_t *data)
 	return sbuf->ele_size;
 }
 
+/* bytes written and not read yet */
+uint32_t sbuf_used(shared_buf_t *sbuf)
+{
+	uint32_t head = sbuf->head;
+	uint32_t tail = __atomic_load_n(&sbuf->tail, __ATOMIC_ACQUIRE);
+
+	return (tail >= head) ? (tail - head) : (sbuf->size - head + tail);
+}
+
+/*
+ * Contiguous span of unread elements from head, up to tail or the end
+ * of the ring, so that it can be copied out in one go. Returns its
+ * length in bytes, 0 when the buffer is empty. The span stays owned by
+ * the reader until sbuf_consume().
+ */
+uint32_t sbuf_span(shared_buf_t *sbuf, void **data)
+{
+	uint32_t head = sbuf->head;
+	uint32_t tail = __atomic_load_n(&sbuf->tail, __ATOMIC_ACQUIRE);
+
+	*data = (void *)sbuf + SBUF_HEAD_SIZE + head;
+
+	return (tail >= head) ? (tail - head) : (sbuf->size - head);
+}
+
+/* hand len bytes from head back to the writer */
+void sbuf_consume(shared_buf_t *sbuf, uint32_t len)
+{
+	__atomic_store_n(&sbuf->head,
+			 sbuf_next_ptr(sbuf->head, len, sbuf->size),
+			 __ATOMIC_RELEASE);
+}
+
 int sbuf_clear_buffered(shared_buf_t *sbuf)
 {
 	if (sbuf == NULL)
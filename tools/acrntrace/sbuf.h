@@ -90,5 +90,8 @@ static inline void sbuf_add_flags(shared_buf_t *sbuf, uint64_t flags)
 }
 
 int sbuf_get(shared_buf_t *sbuf, uint8_t *data);
+uint32_t sbuf_used(shared_buf_t *sbuf);
+uint32_t sbuf_span(shared_buf_t *sbuf, void **data);
+void sbuf_consume(shared_buf_t *sbuf, uint32_t len);
 int sbuf_clear_buffered(shared_buf_t *sbuf);
 #endif /* SHARED_BUF_H */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Streaming VM exit statistics: each reader folds the events of its cpu
+ * into counts and duration histograms per exit reason as it drains the
+ * sbuf, so that no event has to be written out. The duration of an exit
+ * is the tsc distance from VM_EXIT to the following VM_ENTER.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "acrntrace.h"
+#include "trace_event.h"
+
+/* names as in the text trace and scripts/vmexit_analyze.py */
+static const char *const reason_name[VMEXIT_REASON_NUM] = {
+	[0] = "EXCEPTION_OR_NMI",
+	[1] = "EXTERNAL_INTERRUPT",
+	[2] = "TRIPLE_FAULT",
+	[3] = "INIT_SIGNAL",
+	[4] = "STARTUP_IPI",
+	[5] = "IO_SMI",
+	[6] = "OTHER_SMI",
+	[7] = "INTERRUPT_WINDOW",
+	[8] = "NMI_WINDOW",
+	[9] = "TASK_SWITCH",
+	[10] = "CPUID",
+	[11] = "GETSEC",
+	[12] = "HLT",
+	[13] = "INVD",
+	[14] = "INVLPG",
+	[15] = "RDPMC",
+	[16] = "RDTSC",
+	[17] = "RSM",
+	[18] = "VMCALL",
+	[19] = "VMCLEAR",
+	[20] = "VMLAUNCH",
+	[21] = "VMPTRLD",
+	[22] = "VMPTRST",
+	[23] = "VMREAD",
+	[24] = "VMRESUME",
+	[25] = "VMWRITE",
+	[26] = "VMXOFF",
+	[27] = "VMXON",
+	[28] = "CR_ACCESS",
+	[29] = "DR_ACCESS",
+	[30] = "IO_INSTRUCTION",
+	[31] = "RDMSR",
+	[32] = "WRMSR",
+	[33] = "ENTRY_FAILURE_INVALID_GUEST_STATE",
+	[34] = "ENTRY_FAILURE_MSR_LOADING",
+	[36] = "MWAIT",
+	[37] = "MONITOR_TRAP",
+	[39] = "MONITOR",
+	[40] = "PAUSE",
+	[41] = "ENTRY_FAILURE_MACHINE_CHECK",
+	[43] = "TPR_BELOW_THRESHOLD",
+	[44] = "APICV_ACCESS",
+	[45] = "APICV_VIRT_EOI",
+	[46] = "GDTR_IDTR_ACCESS",
+	[47] = "LDTR_TR_ACCESS",
+	[48] = "EPT_VIOLATION",
+	[49] = "EPT_MISCONFIGURATION",
+	[50] = "INVEPT",
+	[51] = "RDTSCP",
+	[52] = "VMX_PREEMPTION_TIMER",
+	[53] = "INVVPID",
+	[54] = "WBINVD",
+	[55] = "XSETBV",
+	[56] = "APICV_WRITE",
+	[57] = "RDRAND",
+	[58] = "INVPCID",
+	[59] = "VMFUNC",
+	[60] = "ENCLS",
+	[61] = "RDSEED",
+	[62] = "PAGE_MODIFICATION_LOG_FULL",
+	[63] = "XSAVES",
+	[64] = "XRSTORS",
+	[65] = "OTHER",
+};
+
+void vmexit_agg_init(struct vmexit_agg *agg, uint32_t cpuid)
+{
+	memset(agg, 0, sizeof(*agg));
+	pthread_mutex_init(&agg->lock, NULL);
+	agg->cpuid = cpuid;
+}
+
+static void vmexit_stat_add(struct vmexit_stat *st, uint64_t cycles)
+{
+	int b = 0;
+
+	while (b < VMEXIT_HIST_BUCKETS - 1 && cycles >= (1UL << b))
+		b++;
+
+	st->count++;
+	st->cycles += cycles;
+	st->hist[b]++;
+	if (cycles > st->max)
+		st->max = cycles;
+}
+
+/* fold n events, in the order the cpu logged them, into agg */
+void vmexit_agg_events(struct vmexit_agg *agg, const trace_ev_t *ev, int n)
+{
+	uint64_t reason;
+	int i;
+
+	pthread_mutex_lock(&agg->lock);
+	for (i = 0; i < n; i++) {
+		switch (ev[i].id) {
+		case TRACE_VM_EXIT:
+			/* a VM_ENTER lost on the way drops its exit */
+			reason = ev[i].e & 0xffff;
+			agg->exit_reason = (reason < VMEXIT_REASON_NUM - 1) ?
+				reason : VMEXIT_REASON_NUM - 1;
+			agg->exit_tsc = ev[i].tsc;
+			break;
+		case TRACE_VM_ENTER:
+			if (agg->exit_tsc && ev[i].tsc >= agg->exit_tsc)
+				vmexit_stat_add(&agg->reason[agg->exit_reason],
+						ev[i].tsc - agg->exit_tsc);
+			agg->exit_tsc = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&agg->lock);
+}
+
+/* upper bound in cycles of the p-th fraction of st's exits */
+static uint64_t vmexit_percentile(const struct vmexit_stat *st, double p)
+{
+	uint64_t seen = 0, want = st->count * p;
+	int b;
+
+	for (b = 0; b < VMEXIT_HIST_BUCKETS - 1; b++) {
+		seen += st->hist[b];
+		if (seen > want)
+			break;
+	}
+	return ((1UL << b) < st->max) ? (1UL << b) : st->max;
+}
+
+static void vmexit_print_head(FILE *fp)
+{
+	fprintf(fp, "%-4s %-34s %12s %10s %10s %10s %10s\n", "CPU",
+		"EXIT REASON", "COUNT", "AVG(us)", "P50(us)", "P99(us)",
+		"MAX(us)");
+}
+
+static void vmexit_print(FILE *fp, const char *cpu, int reason,
+			 const struct vmexit_stat *st, double freq)
+{
+	char name[16];
+	const char *rn = reason_name[reason];
+
+	if (!rn) {
+		snprintf(name, sizeof(name), "0x%x", reason);
+		rn = name;
+	}
+
+	/* freq is in MHz, so cycles / freq gives us */
+	fprintf(fp, "%-4s %-34s %12lu %10.2f %10.2f %10.2f %10.2f\n", cpu, rn,
+		st->count, st->cycles / freq / st->count,
+		vmexit_percentile(st, 0.5) / freq,
+		vmexit_percentile(st, 0.99) / freq, st->max / freq);
+}
+
+static void vmexit_stat_merge(struct vmexit_stat *to,
+			      const struct vmexit_stat *from)
+{
+	int b;
+
+	to->count += from->count;
+	to->cycles += from->cycles;
+	for (b = 0; b < VMEXIT_HIST_BUCKETS; b++)
+		to->hist[b] += from->hist[b];
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+/* what the exits of all cpus added up to since the last call */
+void vmexit_summary(FILE *fp, struct vmexit_agg **aggs, int n, double freq)
+{
+	static struct vmexit_stat prev[VMEXIT_REASON_NUM];
+	static struct timespec last;
+	struct vmexit_stat now[VMEXIT_REASON_NUM], d;
+	struct timespec ts;
+	double secs;
+	int i, r, b;
+
+	memset(now, 0, sizeof(now));
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&aggs[i]->lock);
+		for (r = 0; r < VMEXIT_REASON_NUM; r++)
+			vmexit_stat_merge(&now[r], &aggs[i]->reason[r]);
+		pthread_mutex_unlock(&aggs[i]->lock);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	secs = last.tv_sec ? (ts.tv_sec - last.tv_sec)
+		+ (ts.tv_nsec - last.tv_nsec) / 1e9 : 0;
+	last = ts;
+
+	if (secs > 0)
+		fprintf(fp, "\nVM exits of the last %.1fs:\n", secs);
+	else
+		fprintf(fp, "\nVM exits so far:\n");
+	vmexit_print_head(fp);
+
+	for (r = 0; r < VMEXIT_REASON_NUM; r++) {
+		d = now[r];
+		d.count -= prev[r].count;
+		d.cycles -= prev[r].cycles;
+		for (b = 0; b < VMEXIT_HIST_BUCKETS; b++)
+			d.hist[b] -= prev[r].hist[b];
+		/* no way to take the max of an interval, keep the overall */
+		if (d.count)
+			vmexit_print(fp, "all", r, &d, freq);
+	}
+	memcpy(prev, now, sizeof(prev));
+	fflush(fp);
+}
+
+/* the final report, per cpu and over all of them */
+void vmexit_report(FILE *fp, struct vmexit_agg **aggs, int n, double freq)
+{
+	struct vmexit_stat all[VMEXIT_REASON_NUM];
+	char cpu[8];
+	int i, r;
+
+	memset(all, 0, sizeof(all));
+	fprintf(fp, "\nVM exit report, cpu freq %.2fMHz:\n", freq);
+	vmexit_print_head(fp);
+
+	for (i = 0; i < n; i++) {
+		snprintf(cpu, sizeof(cpu), "%u", aggs[i]->cpuid);
+		pthread_mutex_lock(&aggs[i]->lock);
+		for (r = 0; r < VMEXIT_REASON_NUM; r++) {
+			if (!aggs[i]->reason[r].count)
+				continue;
+			vmexit_print(fp, cpu, r, &aggs[i]->reason[r], freq);
+			vmexit_stat_merge(&all[r], &aggs[i]->reason[r]);
+		}
+		pthread_mutex_unlock(&aggs[i]->lock);
+	}
+
+	for (r = 0; r < VMEXIT_REASON_NUM; r++)
+		if (all[r].count)
+			vmexit_print(fp, "all", r, &all[r], freq);
+	fflush(fp);
+}
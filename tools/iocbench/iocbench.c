@@ -0,0 +1,848 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * IOC mediator benchmark.
+ *
+ * Links the mediator (hw/platform/ioc.c and ioc_cbc.c) into a standalone
+ * process and replaces the CBC character devices with local stand-ins, so
+ * the mediator can be loaded with synthetic CBC traffic without an IOC:
+ *
+ *	  uos side                     mediator                 native side
+ *	vUART pty slave <--> pty master  ioc  seqpacket <--> /dev/cbc-* stand-in
+ *
+ * The virtual UART is the pty the mediator creates itself. The native cdevs
+ * deliver one service frame per read(), which a pty can not preserve, so
+ * each of them is a SOCK_SEQPACKET socket pair handed out by the open()
+ * wrapper below (link with -Wl,--wrap=open,--wrap=stat).
+ *
+ * Every frame carries its sequence number, which the receiver uses to match
+ * it with its send time, to detect drops, and to compute latencies. Frames
+ * keep their order within a channel only, so each channel has its own queue
+ * of in-flight frames.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "ioc.h"
+
+#define BENCH_NATIVE_PREFIX	"/dev/cbc-"
+#define BENCH_PENDING_SIZE	(1 << 16)	/* in-flight frames, power of 2 */
+#define BENCH_IDLE_TIMEOUT	1000		/* ms without output to stop */
+
+enum bench_kind {
+	BENCH_RAW,		/* raw0 channel frame */
+	BENCH_SINGLE,		/* single signal update, 16-bit tag */
+	BENCH_MULTI,		/* multi signal update with a filtered signal */
+	BENCH_KIND_MAX
+};
+
+static const char *bench_kind_names[BENCH_KIND_MAX] = {
+	"raw", "single", "multi"
+};
+
+/*
+ * Native cdevs backed by the benchmark, others fail to open like on a
+ * platform without them.
+ */
+static struct bench_native {
+	const char *path;
+	int id;
+	int fd;		/* benchmark side */
+} bench_natives[] = {
+	{IOC_NP_LF,	IOC_NATIVE_LFCC,	-1},
+	{IOC_NP_SIG,	IOC_NATIVE_SIGNAL,	-1},
+	{IOC_NP_RAW0,	IOC_NATIVE_RAW0,	-1},
+};
+
+struct bench_frame {
+	uint32_t tag;
+	uint32_t mask;
+	uint64_t ts;
+};
+
+enum bench_chan {
+	BENCH_CHAN_RAW,		/* raw0 */
+	BENCH_CHAN_SIGNAL,	/* signals */
+	BENCH_CHAN_MAX
+};
+
+static struct bench_pending {
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	struct bench_frame frames[BENCH_PENDING_SIZE];
+} pending[BENCH_CHAN_MAX];
+
+static bool bench_tx = true;		/* native to uos, else uos to native */
+static unsigned long bench_rate;	/* frames/s, 0 for closed loop */
+static unsigned long bench_count = 100000;
+static unsigned long bench_window = 16;
+static unsigned int bench_size = 16;	/* raw service frame size */
+static unsigned int bench_mix[BENCH_KIND_MAX] = {1, 1, 1};
+static bool bench_ramp;
+static bool bench_verbose;
+static FILE *out;		/* report, the mediator logs to stdout */
+
+static bool bench_active;
+static int uos_fd = -1;
+static uint8_t uos_seq;
+static volatile sig_atomic_t bench_stop;
+
+static uint32_t bench_done;		/* frames matched or lost */
+static uint64_t *latencies;
+static unsigned long received, lost, backlogged;
+static uint64_t last_rx;
+
+int __real_open(const char *path, int flags, ...);
+int __real_stat(const char *path, struct stat *st);
+
+int
+__wrap_open(const char *path, int flags, ...)
+{
+	int i, sv[2];
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	if (!bench_active || strncmp(path, BENCH_NATIVE_PREFIX,
+				strlen(BENCH_NATIVE_PREFIX)) != 0)
+		return __real_open(path, flags, mode);
+
+	for (i = 0; i < sizeof(bench_natives)/sizeof(bench_natives[0]); i++) {
+		if (strcmp(path, bench_natives[i].path) != 0)
+			continue;
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+					sv) < 0)
+			return -1;
+		if (flags & O_NONBLOCK)
+			fcntl(sv[0], F_SETFL, O_NONBLOCK);
+		bench_natives[i].fd = sv[1];
+		return sv[0];
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+int
+__wrap_stat(const char *path, struct stat *st)
+{
+	if (bench_active && strcmp(path, IOC_NP_ESIG) == 0) {
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFCHR | 0600;
+		return 0;
+	}
+	return __real_stat(path, st);
+}
+
+static int
+bench_native_fd(int id)
+{
+	int i;
+
+	for (i = 0; i < sizeof(bench_natives)/sizeof(bench_natives[0]); i++)
+		if (bench_natives[i].id == id)
+			return bench_natives[i].fd;
+	return -1;
+}
+
+static inline uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static uint16_t
+get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/*
+ * Pack one service frame into a CBC link frame the way the IOC firmware
+ * does, returns the link frame length.
+ */
+static size_t
+bench_pack_link(uint8_t *buf, int mux, const uint8_t *srv, size_t srv_len)
+{
+	size_t i, len;
+	uint16_t checksum = 0;
+
+	len = srv_len + CBC_ADDR_HDR_SIZE + CBC_LINK_HDR_SIZE;
+	len = (len + CBC_GRANULARITY - 1) & ~(CBC_GRANULARITY - 1);
+	memset(buf, 0xFF, len);
+	uos_seq = (uos_seq + 1) & CBC_SEQ_MASK;
+	buf[CBC_SOF_POS] = CBC_SOF_VALUE;
+	buf[CBC_ELS_POS] = (((srv_len - 1) / CBC_LEN_UNIT) & CBC_LEN_MASK)
+		<< CBC_LEN_OFFSET | uos_seq << CBC_SEQ_OFFSET;
+	buf[CBC_ADDR_POS] = (mux & CBC_MUX_MASK) << CBC_MUX_OFFSET |
+		(CBC_PRIO_MEDIUM & CBC_PRIO_MASK) << CBC_PRIO_OFFSET;
+	memcpy(buf + CBC_SRV_POS, srv, srv_len);
+	for (i = 0; i < len - 1; i++)
+		checksum += 0x100 - buf[i];
+	buf[len - 1] = checksum & 0xFF;
+	return len;
+}
+
+static int
+bench_uos_send(int mux, const uint8_t *srv, size_t srv_len)
+{
+	uint8_t buf[CBC_MAX_FRAME_SIZE];
+	size_t len;
+
+	len = bench_pack_link(buf, mux, srv, srv_len);
+	return write(uos_fd, buf, len) == len ? 0 : -1;
+}
+
+/*
+ * Build the service frame for one benchmark frame, returns its length and
+ * the channel it goes through.
+ */
+static size_t
+bench_build(uint8_t *srv, enum bench_kind kind, uint32_t tag, int *mux)
+{
+	switch (kind) {
+	case BENCH_SINGLE:
+		*mux = IOC_NATIVE_SIGNAL;
+		srv[0] = CBC_SD_SINGLE_SIGNAL;
+		put_le16(srv + 1, CBC_SIG_ID_VSPD);
+		put_le16(srv + 3, tag);
+		return 5;
+	case BENCH_MULTI:
+		/* VSWA is not whitelisted, the mediator has to filter it */
+		*mux = IOC_NATIVE_SIGNAL;
+		srv[0] = CBC_SD_MULTI_SIGNAL;
+		srv[1] = 3;
+		put_le16(srv + 2, CBC_SIG_ID_VSWA);
+		put_le16(srv + 4, 0);
+		put_le16(srv + 6, CBC_SIG_ID_VSPD);
+		put_le16(srv + 8, tag);
+		put_le16(srv + 10, CBC_SIG_ID_VESP);
+		put_le16(srv + 12, tag >> 16);
+		return 14;
+	default:
+		*mux = IOC_NATIVE_RAW0;
+		memset(srv, 0, bench_size);
+		memcpy(srv + 1, &tag, sizeof(tag));
+		return bench_size;
+	}
+}
+
+/*
+ * Extract the tag of a received service frame.
+ */
+static int
+bench_parse(const uint8_t *srv, size_t len, int mux, uint32_t *tag)
+{
+	size_t i;
+	uint16_t id;
+	int found = 0;
+
+	if (mux == IOC_NATIVE_RAW0) {
+		if (len < 1 + sizeof(*tag))
+			return -1;
+		memcpy(tag, srv + 1, sizeof(*tag));
+		return 0;
+	}
+	if (mux != IOC_NATIVE_SIGNAL || len < 5)
+		return -1;
+	if (srv[0] == CBC_SD_SINGLE_SIGNAL &&
+			get_le16(srv + 1) == CBC_SIG_ID_VSPD) {
+		*tag = get_le16(srv + 3);
+		return 0;
+	}
+	if (srv[0] != CBC_SD_MULTI_SIGNAL)
+		return -1;
+	*tag = 0;
+	for (i = 2; i + 4 <= len && i < 2 + srv[1] * 4; i += 4) {
+		id = get_le16(srv + i);
+		if (id == CBC_SIG_ID_VSWA)
+			return -1;
+		if (id == CBC_SIG_ID_VSPD) {
+			*tag |= get_le16(srv + i + 2);
+			found |= 1;
+		} else if (id == CBC_SIG_ID_VESP) {
+			*tag |= (uint32_t)get_le16(srv + i + 2) << 16;
+			found |= 2;
+		}
+	}
+	return found == 3 ? 0 : -1;
+}
+
+/*
+ * Match a received tag against the in-flight frames. Frames are delivered in
+ * order, so everything queued before the match was dropped.
+ */
+static void
+bench_match(struct bench_pending *q, uint32_t tag, uint64_t now)
+{
+	uint32_t head, tail, i;
+	struct bench_frame *f;
+
+	head = q->head;
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	for (i = head; i != tail; i++) {
+		f = &q->frames[i & (BENCH_PENDING_SIZE - 1)];
+		if ((f->tag & f->mask) != (tag & f->mask))
+			continue;
+		lost += i - head;
+		latencies[received++] = now - f->ts;
+		last_rx = now;
+		__atomic_store_n(&q->head, i + 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&bench_done, i + 1 - head,
+				__ATOMIC_RELEASE);
+		return;
+	}
+}
+
+static void
+bench_flush_pending(void)
+{
+	uint32_t head, tail;
+	int i;
+
+	for (i = 0; i < BENCH_CHAN_MAX; i++) {
+		head = pending[i].head;
+		tail = __atomic_load_n(&pending[i].tail, __ATOMIC_ACQUIRE);
+		lost += tail - head;
+		__atomic_store_n(&pending[i].head, tail, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&bench_done, tail - head,
+				__ATOMIC_RELEASE);
+	}
+}
+
+static enum bench_kind
+bench_pick(unsigned long n)
+{
+	unsigned int i, total = 0, slot;
+
+	for (i = 0; i < BENCH_KIND_MAX; i++)
+		total += bench_mix[i];
+	slot = (n * 2654435761U) % total;
+	for (i = 0; i < BENCH_KIND_MAX; i++) {
+		if (slot < bench_mix[i])
+			return i;
+		slot -= bench_mix[i];
+	}
+	return BENCH_RAW;
+}
+
+struct bench_run {
+	unsigned long rate;
+	unsigned long count;
+	uint64_t start;
+	uint64_t end;
+};
+
+static void *
+bench_sender(void *arg)
+{
+	struct bench_run *run = arg;
+	struct bench_pending *q;
+	struct bench_frame *f;
+	struct timespec ts;
+	uint8_t srv[CBC_MAX_SERVICE_SIZE];
+	enum bench_kind kind;
+	unsigned long n;
+	uint64_t due;
+	uint32_t tail;
+	size_t len;
+	int mux, fd;
+
+	run->start = bench_now();
+	for (n = 0; n < run->count && !bench_stop; n++) {
+		if (run->rate) {
+			due = run->start + n * 1000000000ULL / run->rate;
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+		} else {
+			while (n - __atomic_load_n(&bench_done,
+					__ATOMIC_ACQUIRE) >= bench_window &&
+					!bench_stop)
+				sched_yield();
+		}
+
+		kind = bench_tx ? bench_pick(n) : BENCH_RAW;
+		q = &pending[kind == BENCH_RAW ? BENCH_CHAN_RAW :
+			BENCH_CHAN_SIGNAL];
+		tail = q->tail;
+		if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ==
+				BENCH_PENDING_SIZE) {
+			backlogged++;
+			n--;
+			sched_yield();
+			continue;
+		}
+
+		len = bench_build(srv, kind, (uint32_t)n, &mux);
+		f = &q->frames[tail & (BENCH_PENDING_SIZE - 1)];
+		f->tag = n;
+		f->mask = kind == BENCH_SINGLE ? 0xFFFF : 0xFFFFFFFF;
+		f->ts = bench_now();
+		__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+		if (bench_tx) {
+			fd = bench_native_fd(mux);
+			if (write(fd, srv, len) != len)
+				perror("iocbench: native write");
+		} else if (bench_uos_send(mux, srv, len) < 0)
+			perror("iocbench: uart write");
+	}
+	run->end = bench_now();
+	return NULL;
+}
+
+/*
+ * Receive frames until all in-flight frames are matched or the mediator
+ * stays silent for the idle timeout.
+ */
+static void
+bench_receive(pthread_t sender, struct bench_run *run)
+{
+	static uint8_t ring[CBC_MAX_FRAME_SIZE * 64];
+	static size_t fill;
+	uint8_t buf[CBC_MAX_FRAME_SIZE * 16];
+	struct pollfd pfd;
+	size_t off, flen, i;
+	uint16_t checksum;
+	uint32_t tag;
+	ssize_t rc;
+	int mux;
+
+	pfd.fd = bench_tx ? uos_fd : bench_native_fd(IOC_NATIVE_RAW0);
+	pfd.events = POLLIN;
+	for (;;) {
+		rc = poll(&pfd, 1, BENCH_IDLE_TIMEOUT);
+		if (rc == 0) {
+			if (pthread_tryjoin_np(sender, NULL) == 0)
+				break;
+			continue;
+		}
+		if (rc < 0) {
+			if (errno == EINTR && !bench_stop)
+				continue;
+			break;
+		}
+
+		if (!bench_tx) {
+			rc = read(pfd.fd, buf, sizeof(buf));
+			if (rc > 0 && bench_parse(buf, rc, IOC_NATIVE_RAW0,
+						&tag) == 0)
+				bench_match(&pending[BENCH_CHAN_RAW], tag,
+						bench_now());
+			continue;
+		}
+
+		rc = read(pfd.fd, ring + fill, sizeof(ring) - fill);
+		if (rc <= 0)
+			continue;
+		fill += rc;
+
+		/* Unpack the link frames written by the mediator */
+		off = 0;
+		while (fill - off >= CBC_MIN_FRAME_SIZE) {
+			if (ring[off] != CBC_SOF_VALUE) {
+				off++;
+				continue;
+			}
+			flen = (((ring[off + CBC_ELS_POS] >> CBC_LEN_OFFSET) &
+					CBC_LEN_MASK) + 1) * CBC_LEN_UNIT +
+				CBC_LINK_HDR_SIZE + CBC_ADDR_HDR_SIZE;
+			if (fill - off < flen)
+				break;
+			for (i = 0, checksum = 0; i < flen - 1; i++)
+				checksum += 0x100 - ring[off + i];
+			if ((checksum & 0xFF) != ring[off + flen - 1]) {
+				off++;
+				continue;
+			}
+			mux = (ring[off + CBC_ADDR_POS] >> CBC_MUX_OFFSET) &
+				CBC_MUX_MASK;
+			if (bench_parse(ring + off + CBC_SRV_POS,
+					flen - CBC_SRV_POS - CBC_CHKSUM_SIZE,
+					mux, &tag) == 0)
+				bench_match(&pending[mux == IOC_NATIVE_RAW0 ?
+						BENCH_CHAN_RAW :
+						BENCH_CHAN_SIGNAL],
+						tag, bench_now());
+			off += flen;
+		}
+		memmove(ring, ring + off, fill - off);
+		fill -= off;
+	}
+	bench_flush_pending();
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(double p)
+{
+	unsigned long i;
+
+	if (received == 0)
+		return 0;
+	i = (unsigned long)(p / 100 * (received - 1) + 0.5);
+	return latencies[i] / 1000.0;
+}
+
+/*
+ * Run one pass, returns the delivered rate in frames/s.
+ */
+static double
+bench_run(unsigned long rate, unsigned long count, bool quiet)
+{
+	struct bench_run run = {rate, count};
+	pthread_t sender;
+	double secs, delivered;
+
+	received = lost = backlogged = 0;
+	last_rx = 0;
+	bench_done = 0;
+	memset(pending, 0, sizeof(pending));
+
+	if (pthread_create(&sender, NULL, bench_sender, &run) != 0) {
+		perror("iocbench: pthread_create");
+		exit(1);
+	}
+	bench_receive(sender, &run);
+
+	/* Frames still queued in the mediator count against the rate */
+	secs = ((last_rx > run.end ? last_rx : run.end) - run.start) / 1e9;
+	delivered = secs > 0 ? received / secs : 0;
+	qsort(latencies, received, sizeof(latencies[0]), cmp_u64);
+
+	if (quiet)
+		return delivered;
+	if (rate)
+		fprintf(out, "offered %lu frames/s: ", rate);
+	else
+		fprintf(out, "closed loop, window %lu: ", bench_window);
+	fprintf(out, "sent %lu received %lu lost %lu in %.3f s\n", count, received,
+			lost, secs);
+	fprintf(out, "delivered: %.0f frames/s\n", delivered);
+	if (backlogged)
+		fprintf(out, "sender stalled %lu times on %d frames in flight\n",
+				backlogged, BENCH_PENDING_SIZE);
+	fprintf(out, "latency us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+			percentile(50), percentile(90), percentile(99),
+			percentile(99.9), percentile(100));
+	return delivered;
+}
+
+/*
+ * Double the offered rate until the mediator drops frames or falls behind,
+ * then bisect to the highest rate it keeps up with.
+ */
+static void
+bench_ramp_run(void)
+{
+	unsigned long lo = 0, hi, rate = bench_rate ? bench_rate : 1000;
+	unsigned long count;
+	double delivered;
+	bool ok;
+
+	for (;;) {
+		count = rate / 2 > 1000 ? rate / 2 : 1000;
+		count = count < bench_count ? count : bench_count;
+		delivered = bench_run(rate, count, true);
+		ok = lost == 0 && delivered >= rate * 0.95;
+		fprintf(out, "ramp %lu frames/s: delivered %.0f lost %lu p99 %.1f us"
+				" %s\n", rate, delivered, lost, percentile(99),
+				ok ? "ok" : "saturated");
+		if (bench_stop)
+			return;
+		if (!ok)
+			break;
+		lo = rate;
+		rate *= 2;
+	}
+	hi = rate;
+	while (hi - lo > hi / 20 && !bench_stop) {
+		rate = (lo + hi) / 2;
+		count = rate / 2 > 1000 ? rate / 2 : 1000;
+		count = count < bench_count ? count : bench_count;
+		delivered = bench_run(rate, count, true);
+		ok = lost == 0 && delivered >= rate * 0.95;
+		fprintf(out, "ramp %lu frames/s: delivered %.0f lost %lu p99 %.1f us"
+				" %s\n", rate, delivered, lost, percentile(99),
+				ok ? "ok" : "saturated");
+		if (ok)
+			lo = rate;
+		else
+			hi = rate;
+	}
+	fprintf(out, "max sustainable rate: %lu frames/s\n", lo);
+}
+
+static int
+bench_parse_mix(const char *opt)
+{
+	char *s, *tok, *val, *save;
+	unsigned int i;
+
+	memset(bench_mix, 0, sizeof(bench_mix));
+	s = strdup(opt);
+	for (tok = strtok_r(s, ",", &save); tok;
+			tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (!val)
+			goto err;
+		*val++ = '\0';
+		for (i = 0; i < BENCH_KIND_MAX; i++)
+			if (strcmp(tok, bench_kind_names[i]) == 0)
+				break;
+		if (i == BENCH_KIND_MAX)
+			goto err;
+		bench_mix[i] = strtoul(val, NULL, 0);
+	}
+	free(s);
+	for (i = 0; i < BENCH_KIND_MAX; i++)
+		if (bench_mix[i])
+			return 0;
+	return -1;
+err:
+	free(s);
+	return -1;
+}
+
+static void
+bench_sigint(int sig)
+{
+	bench_stop = 1;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(out, "Usage: %s [options]\n"
+		"  -d, --direction tx|rx  tx: native cdevs to uos (default)\n"
+		"                         rx: uos to native raw0 channel\n"
+		"  -r, --rate N           offered frames/s, 0 for closed loop"
+		" (default)\n"
+		"  -w, --window N         frames in flight in closed loop"
+		" (default 16)\n"
+		"  -n, --count N          frames per run (default 100000)\n"
+		"  -m, --mix raw=N,single=N,multi=N\n"
+		"                         tx frame mix weights (default 1:1:1)\n"
+		"  -s, --size N           raw service frame size (default 16)\n"
+		"  -R, --ramp             search the max sustainable rate\n"
+		"  -v, --verbose          show the mediator messages\n"
+		"  -h, --help             show this help\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"direction",	required_argument,	0, 'd'},
+		{"rate",	required_argument,	0, 'r'},
+		{"window",	required_argument,	0, 'w'},
+		{"count",	required_argument,	0, 'n'},
+		{"mix",		required_argument,	0, 'm'},
+		{"size",	required_argument,	0, 's'},
+		{"ramp",	no_argument,		0, 'R'},
+		{"verbose",	no_argument,		0, 'v'},
+		{"help",	no_argument,		0, 'h'},
+		{0, 0, 0, 0}
+	};
+	char uart_path[32], opts[64];
+	struct ioc_dev *ioc;
+	struct termios tio;
+	uint8_t srv[1];
+	int c, i, fd;
+
+	out = stdout;
+	while ((c = getopt_long(argc, argv, "d:r:w:n:m:s:Rvh", long_options,
+					NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			if (strcmp(optarg, "tx") && strcmp(optarg, "rx")) {
+				usage(argv[0]);
+				return 1;
+			}
+			bench_tx = strcmp(optarg, "tx") == 0;
+			break;
+		case 'r':
+			bench_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			bench_window = strtoul(optarg, NULL, 0);
+			if (bench_window == 0 ||
+					bench_window > BENCH_PENDING_SIZE) {
+				fprintf(stderr, "invalid window\n");
+				return 1;
+			}
+			break;
+		case 'n':
+			bench_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (bench_parse_mix(optarg) < 0) {
+				fprintf(stderr, "invalid mix %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			bench_size = strtoul(optarg, NULL, 0);
+			if (bench_size < 8 || bench_size > CBC_MAX_SERVICE_SIZE) {
+				fprintf(stderr, "size must be 8..%d\n",
+						CBC_MAX_SERVICE_SIZE);
+				return 1;
+			}
+			break;
+		case 'R':
+			bench_ramp = true;
+			break;
+		case 'v':
+			bench_verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (bench_count == 0)
+		return 0;
+
+	latencies = calloc(bench_count, sizeof(latencies[0]));
+	if (!latencies) {
+		perror("iocbench");
+		return 1;
+	}
+
+	/*
+	 * The mediator reports every drop on stdout, keep those off the
+	 * report unless asked for.
+	 */
+	if (!bench_verbose) {
+		fd = __real_open("/dev/null", O_WRONLY);
+		out = fdopen(dup(STDOUT_FILENO), "w");
+		if (fd < 0 || !out) {
+			perror("iocbench");
+			return 1;
+		}
+		setvbuf(out, NULL, _IOLBF, 0);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+
+	/* Boot reason 0x20 is the ignition button */
+	snprintf(uart_path, sizeof(uart_path), "/tmp/iocbench.%d", getpid());
+	snprintf(opts, sizeof(opts), "%s,0x20", uart_path);
+	ioc_parse(opts);
+	bench_active = true;
+	ioc = ioc_init();
+	if (!ioc) {
+		fprintf(stderr, "iocbench: ioc init failed\n");
+		return 1;
+	}
+
+	uos_fd = open(uart_path, O_RDWR | O_NOCTTY);
+	if (uos_fd < 0) {
+		perror("iocbench: open virtual uart");
+		ioc_deinit(ioc);
+		unlink(uart_path);
+		return 1;
+	}
+	tcgetattr(uos_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(uos_fd, TCSANOW, &tio);
+
+	signal(SIGINT, bench_sigint);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Let the mediator forward signal frames to the uos */
+	srv[0] = CBC_SD_OPEN_CHANNEL;
+	bench_uos_send(IOC_NATIVE_SIGNAL, srv, sizeof(srv));
+	usleep(100000);
+
+	fprintf(out, "iocbench: %s, ", bench_tx ? "tx native -> uos" :
+			"rx uos -> native");
+	if (bench_tx)
+		for (i = 0; i < BENCH_KIND_MAX; i++)
+			fprintf(out, "%s %u%s", bench_kind_names[i], bench_mix[i],
+					i + 1 < BENCH_KIND_MAX ? ":" : "\n");
+	else
+		fprintf(out, "raw\n");
+
+	if (bench_ramp)
+		bench_ramp_run();
+	else
+		bench_run(bench_rate, bench_count, false);
+
+	close(uos_fd);
+	ioc_deinit(ioc);
+	for (i = 0; i < sizeof(bench_natives)/sizeof(bench_natives[0]); i++)
+		if (bench_natives[i].fd >= 0)
+			close(bench_natives[i].fd);
+	unlink(uart_path);
+	free(latencies);
+	return 0;
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * ivshmem server: hands out the shared memory of the ivshmem devices and
+ * the doorbell eventfds of every peer, see include/ivshmem.h for the
+ * protocol. Doorbells never go through the server, peers write each
+ * other's eventfds directly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ivshmem.h"
+
+#define MAX_CLIENTS	64
+
+struct peer {
+	int sock;
+	int id;
+	int efd[IVSHMEM_MAX_VECTORS];
+};
+
+static struct peer *peers[MAX_CLIENTS];
+static int nvecs = 1;
+static int shm_fd = -1;
+static const char *sock_path = IVSHMEM_DEFAULT_SOCKET;
+static volatile sig_atomic_t stop;
+static bool verbose;
+
+static int
+send_msg(int sock, int64_t val, int fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t len;
+
+	val = htole64(val);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &val;
+	iov.iov_len = sizeof(val);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do {
+		len = sendmsg(sock, &msg, 0);
+	} while (len < 0 && errno == EINTR);
+	return len == sizeof(val) ? 0 : -1;
+}
+
+static int
+send_peer_vectors(int sock, struct peer *peer)
+{
+	int i;
+
+	for (i = 0; i < nvecs; i++)
+		if (send_msg(sock, peer->id, peer->efd[i]) < 0)
+			return -1;
+	return 0;
+}
+
+static void
+free_peer(struct peer *peer)
+{
+	int i;
+
+	for (i = 0; i < nvecs; i++)
+		if (peer->efd[i] >= 0)
+			close(peer->efd[i]);
+	close(peer->sock);
+	free(peer);
+}
+
+static void
+remove_peer(int slot)
+{
+	struct peer *peer = peers[slot];
+	int i;
+
+	if (verbose)
+		printf("peer %d left\n", peer->id);
+	peers[slot] = NULL;
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (peers[i])
+			send_msg(peers[i]->sock, peer->id, -1);
+	free_peer(peer);
+}
+
+static int
+alloc_id(void)
+{
+	int id, i;
+
+	for (id = 0; id < IVSHMEM_MAX_PEERS; id++) {
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (peers[i] && peers[i]->id == id)
+				break;
+		if (i == MAX_CLIENTS)
+			return id;
+	}
+	return -1;
+}
+
+static void
+add_peer(int listen_fd)
+{
+	struct peer *peer;
+	int sock, slot, i;
+
+	sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0)
+		return;
+
+	for (slot = 0; slot < MAX_CLIENTS; slot++)
+		if (!peers[slot])
+			break;
+	peer = calloc(1, sizeof(*peer));
+	if (slot == MAX_CLIENTS || !peer) {
+		fprintf(stderr, "too many peers\n");
+		free(peer);
+		close(sock);
+		return;
+	}
+	peer->sock = sock;
+	peer->id = alloc_id();
+	for (i = 0; i < nvecs; i++)
+		peer->efd[i] = -1;
+	for (i = 0; i < nvecs; i++) {
+		peer->efd[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (peer->efd[i] < 0) {
+			perror("eventfd");
+			goto fail;
+		}
+	}
+
+	if (send_msg(sock, IVSHMEM_PROTOCOL_VERSION, -1) < 0 ||
+			send_msg(sock, peer->id, -1) < 0 ||
+			send_msg(sock, -1, shm_fd) < 0)
+		goto fail;
+
+	/* Tell the new peer about the others, and the others about it */
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (!peers[i])
+			continue;
+		if (send_peer_vectors(sock, peers[i]) < 0)
+			goto fail;
+		send_peer_vectors(peers[i]->sock, peer);
+	}
+	if (send_peer_vectors(sock, peer) < 0)
+		goto fail;
+
+	peers[slot] = peer;
+	if (verbose)
+		printf("peer %d joined\n", peer->id);
+	return;
+
+fail:
+	free_peer(peer);
+}
+
+static int
+open_shm(const char *path, size_t size)
+{
+	int fd;
+
+	if (path)
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	else {
+		fd = memfd_create("ivshmem", MFD_CLOEXEC | MFD_HUGETLB);
+		if (fd < 0) {
+			fprintf(stderr, "no hugetlb memfd (%s), ACRN can't "
+					"map small pages into guests\n",
+					strerror(errno));
+			fd = memfd_create("ivshmem", MFD_CLOEXEC);
+		}
+	}
+	if (fd < 0) {
+		perror(path ? path : "memfd_create");
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+open_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path %s too long\n", path);
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(fd, MAX_CLIENTS) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+parse_size(const char *str, size_t *size)
+{
+	char *end;
+	uint64_t val;
+
+	val = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'g':
+	case 'G':
+		val <<= 10;
+	case 'm':
+	case 'M':
+		val <<= 10;
+	case 'k':
+	case 'K':
+		val <<= 10;
+		end++;
+		break;
+	}
+	if (*end != '\0' || val == 0)
+		return -1;
+	*size = val;
+	return 0;
+}
+
+static void
+sig_stop(int sig)
+{
+	stop = 1;
+}
+
+static void
+usage(const char *prog)
+{
+	printf("Usage: %s [-S socket] [-m size] [-p path] [-n vectors] [-v]\n"
+		"  -S: unix socket to listen on (default %s)\n"
+		"  -m: shared memory size, e.g. 16M (default 4M)\n"
+		"  -p: back the memory by this file, on hugetlbfs\n"
+		"      (default: a hugetlb memfd)\n"
+		"  -n: doorbell vectors per peer (default 1, max %d)\n"
+		"  -v: log peers joining and leaving\n",
+		prog, IVSHMEM_DEFAULT_SOCKET, IVSHMEM_MAX_VECTORS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pollfd pfd[MAX_CLIENTS + 1];
+	int slots[MAX_CLIENTS + 1];
+	const char *shm_path = NULL;
+	size_t size = 4 << 20;
+	char buf[64];
+	int listen_fd, c, i, n;
+
+	while ((c = getopt(argc, argv, "S:m:p:n:vh")) != -1) {
+		switch (c) {
+		case 'S':
+			sock_path = optarg;
+			break;
+		case 'm':
+			if (parse_size(optarg, &size) < 0) {
+				fprintf(stderr, "invalid size %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			shm_path = optarg;
+			break;
+		case 'n':
+			nvecs = atoi(optarg);
+			if (nvecs < 1 || nvecs > IVSHMEM_MAX_VECTORS) {
+				fprintf(stderr, "invalid vectors %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	shm_fd = open_shm(shm_path, size);
+	if (shm_fd < 0)
+		return 1;
+	listen_fd = open_socket(sock_path);
+	if (listen_fd < 0)
+		return 1;
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, sig_stop);
+	signal(SIGTERM, sig_stop);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	while (!stop) {
+		pfd[0].fd = listen_fd;
+		pfd[0].events = POLLIN;
+		for (i = 0, n = 1; i < MAX_CLIENTS; i++) {
+			if (!peers[i])
+				continue;
+			pfd[n].fd = peers[i]->sock;
+			pfd[n].events = POLLIN;
+			slots[n++] = i;
+		}
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		/* Peers never talk, readable means they went away */
+		for (i = 1; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+			if (read(pfd[i].fd, buf, sizeof(buf)) > 0)
+				continue;
+			remove_peer(slots[i]);
+		}
+		if (pfd[0].revents & POLLIN)
+			add_peer(listen_fd);
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (peers[i])
+			free_peer(peers[i]);
+	close(listen_fd);
+	unlink(sock_path);
+	close(shm_fd);
+	return 0;
+}